@@ -39,6 +39,13 @@
 #undef uint8_t
 #undef uint16_t
 #undef uint32_t
+#undef uint64_t
+
+/* Define to 64 to make off_t big enough for files over 2GB.  */
+#undef _FILE_OFFSET_BITS
+
+/* Define to get fseeko() and ftello().  */
+#undef _LARGEFILE_SOURCE
 
 @BOTTOM@
 
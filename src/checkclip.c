@@ -0,0 +1,110 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Check the soft_clip kernel of every kernel set this CPU can run
+ * against tanh() from libm, over the whole range of inputs, and fail
+ * if any result is further off than kernels.h says they can be: a
+ * thousandth of an LSB of 32 bits.  Run by "make check".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <math.h>
+#endif
+
+#include "kernels.h"
+
+/* the most a result may be off by, in LSBs of the full scale given */
+#define MAX_ERROR 0.001
+
+/* the inputs are checked a block at a time */
+#define BLOCK 4096
+
+/*
+ * The ranges swept, as fractions of full scale: all of them, past
+ * where tanh() is 1.0 in a double, then the knee, where the results
+ * change fastest, more finely, and the smallest samples, where they're
+ * nearly the input.
+ */
+static const struct {
+  double lo, hi;
+  long steps;
+} ranges[] = {
+  { -24.0, 24.0, 1L << 22 },
+  { -3.0, 3.0, 1L << 22 },
+  { -1e-6, 1e-6, 1L << 16 },
+};
+
+/*
+ * Sweep the soft_clip kernel of k at full_scale, and return the
+ * largest error, in LSBs
+ */
+static double
+sweep(const struct kernels *k, double full_scale)
+{
+  double u[BLOCK], x[BLOCK], err, max_err = 0;
+  long i, n, step;
+  int r;
+
+  for (r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    for (step = 0; step < ranges[r].steps; step += BLOCK) {
+      n = ranges[r].steps - step < BLOCK ? ranges[r].steps - step : BLOCK;
+      for (i = 0; i < n; i++) {
+	u[i] = ranges[r].lo + (ranges[r].hi - ranges[r].lo)
+	  * (step + i) / (ranges[r].steps - 1);
+	x[i] = u[i] * full_scale;
+      }
+      k->soft_clip(x, n, full_scale);
+      for (i = 0; i < n; i++) {
+	err = fabs(x[i] - full_scale * tanh(u[i]));
+	if (err > max_err)
+	  max_err = err;
+      }
+    }
+  }
+  return max_err;
+}
+
+int
+main(int argc, char *argv[])
+{
+  const struct kernels *k;
+  double full_scale, err;
+  int i, bits, failed = 0;
+
+  for (i = 0; kernel_sets[i]; i++) {
+    k = kernel_sets[i];
+    if (!kernels_supported(k)) {
+      printf("%-8s not supported by this CPU, skipped\n", k->name);
+      continue;
+    }
+    for (bits = 16; bits <= 32; bits += 8) {
+      full_scale = ldexp(1.0, bits - 1) - 1;
+      err = sweep(k, full_scale);
+      printf("%-8s %d bits: max error %.3g LSB%s\n", k->name, bits, err,
+	     err > MAX_ERROR ? ", FAILED" : "");
+      if (err > MAX_ERROR)
+	failed = 1;
+    }
+  }
+
+  return failed;
+}
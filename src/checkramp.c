@@ -0,0 +1,200 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Check that the gain ramp between two segments bends samples the
+ * same way the rest of a segment does.  The first of two segments is
+ * a sweep from full scale down to silence, on the left, and from the
+ * most negative sample up to silence, on the right; it gets a gain
+ * past full scale and ramps down into the second.  Since neither the
+ * samples nor the gain grow along the first segment, neither may its
+ * output, with compression on or off: fail if it ever does.  Run by
+ * "make check".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <string.h>
+#endif
+
+#include "libnormalize.h"
+
+#define RATE 8000
+#define CHANNELS 2
+
+/* the gains of the two segments, and the ramp between them */
+static const double gains[] = { 4.0, 1.0 };
+static const double times[] = { 0.0, 1.0, 1.0, 2.0 };
+#define RAMP 0.2
+
+static void
+put_lendian(unsigned char *buf, unsigned long x, int bytes)
+{
+  int i;
+
+  for (i = 0; i < bytes; i++, x >>= 8)
+    buf[i] = x & 0xFF;
+}
+
+static long
+get_lendian(const unsigned char *buf, int bytes)
+{
+  unsigned long x = 0;
+  int i;
+
+  for (i = bytes - 1; i >= 0; i--)
+    x = (x << 8) | buf[i];
+  /* sign extend */
+  if (x & (1UL << (bytes * 8 - 1)))
+    return -(long)((~x & ((1UL << (bytes * 8 - 1)) - 1)) + 1);
+  return (long)x;
+}
+
+/*
+ * Write a WAV file of two seconds, the first the sweeps, the second
+ * silence, in bits bits a sample.  Returns 0 on success, -1 on error.
+ */
+static int
+write_sweep(FILE *f, int bits)
+{
+  unsigned char hdr[44], *buf;
+  int bytes = bits / 8;
+  double samplemax = (1L << (bits - 1)) - 1;
+  long i, nframes = 2 * RATE;
+  size_t size = nframes * CHANNELS * bytes;
+  int ret = -1;
+
+  buf = (unsigned char *)calloc(size, 1);
+  if (buf == NULL)
+    return -1;
+  memcpy(hdr, "RIFF", 4);
+  put_lendian(hdr + 4, 36 + size, 4);
+  memcpy(hdr + 8, "WAVEfmt ", 8);
+  put_lendian(hdr + 16, 16, 4);
+  put_lendian(hdr + 20, 1, 2);
+  put_lendian(hdr + 22, CHANNELS, 2);
+  put_lendian(hdr + 24, RATE, 4);
+  put_lendian(hdr + 28, RATE * CHANNELS * bytes, 4);
+  put_lendian(hdr + 32, CHANNELS * bytes, 2);
+  put_lendian(hdr + 34, bits, 2);
+  memcpy(hdr + 36, "data", 4);
+  put_lendian(hdr + 40, size, 4);
+  for (i = 0; i < RATE; i++) {
+    put_lendian(buf + (i * CHANNELS) * bytes,
+		(long)(samplemax - samplemax * i / (RATE - 1)), bytes);
+    put_lendian(buf + (i * CHANNELS + 1) * bytes,
+		(long)(-samplemax - 1 + (samplemax + 1) * i / (RATE - 1)),
+		bytes);
+  }
+  if (fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr)
+      && fwrite(buf, 1, size, f) == size && fflush(f) == 0)
+    ret = 0;
+  free(buf);
+  return ret;
+}
+
+/*
+ * Adjust a sweep of bits bits a sample, and check the output of the
+ * first segment.  Returns the number of frames where it grows, or -1
+ * on error.
+ */
+static int
+check_ramp(int bits, int do_compression)
+{
+  normalize_t *nz;
+  FILE *in = NULL, *out = NULL;
+  unsigned char buf[CHANNELS * 4], hdr[44];
+  int bytes = bits / 8, err, nbad = -1;
+  long left, right, last_left = 0, last_right = 0, i;
+
+  nz = normalize_new(NULL);
+  if (nz == NULL)
+    return -1;
+  normalize_set_compression(nz, do_compression);
+  if ((err = normalize_set_ranges(nz, times, 2)) != NORMALIZE_OK
+      || (err = normalize_set_ramp(nz, RAMP)) != NORMALIZE_OK) {
+    fprintf(stderr, "checkramp: %s\n", normalize_strerror(nz, err));
+    goto error;
+  }
+  in = tmpfile();
+  out = tmpfile();
+  if (in == NULL || out == NULL || write_sweep(in, bits) == -1) {
+    perror("checkramp");
+    goto error;
+  }
+  err = normalize_apply_segments(nz, fileno(in), fileno(out), "sweep",
+				 gains, NULL, NULL);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, "checkramp: %s\n", normalize_strerror(nz, err));
+    goto error;
+  }
+
+  /* the header is copied as it was */
+  rewind(out);
+  if (fread(hdr, 1, sizeof(hdr), out) != sizeof(hdr)) {
+    fprintf(stderr, "checkramp: short output\n");
+    goto error;
+  }
+  nbad = 0;
+  for (i = 0; i < RATE; i++) {
+    if (fread(buf, bytes, CHANNELS, out) != CHANNELS) {
+      fprintf(stderr, "checkramp: short output\n");
+      nbad = -1;
+      goto error;
+    }
+    left = get_lendian(buf, bytes);
+    right = get_lendian(buf + bytes, bytes);
+    if (i > 0 && (left > last_left || right < last_right)) {
+      if (nbad == 0)
+	printf("frame %ld: %ld %ld after %ld %ld\n",
+	       i, left, right, last_left, last_right);
+      nbad++;
+    }
+    last_left = left;
+    last_right = right;
+  }
+
+ error:
+  if (in)
+    fclose(in);
+  if (out)
+    fclose(out);
+  normalize_destroy(nz);
+  return nbad;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int bits, do_compression, nbad, failed = 0;
+
+  for (do_compression = 0; do_compression <= 1; do_compression++) {
+    for (bits = 16; bits <= 24; bits += 8) {
+      nbad = check_ramp(bits, do_compression);
+      printf("%d bits, compression %s: %s\n", bits,
+	     do_compression ? "on" : "off",
+	     nbad == 0 ? "ok" : nbad < 0 ? "error" : "FAILED");
+      if (nbad != 0)
+	failed = 1;
+    }
+  }
+
+  return failed;
+}
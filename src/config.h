@@ -81,6 +81,13 @@
 #define uint8_t unsigned TYPE8
 #define uint16_t unsigned TYPE16
 #define uint32_t unsigned TYPE32
+#define uint64_t unsigned long long
+
+/* Define to 64 to make off_t big enough for files over 2GB.  */
+/* #undef _FILE_OFFSET_BITS */
+
+/* Define to get fseeko() and ftello().  */
+/* #undef _LARGEFILE_SOURCE */
 
 /* The number of bytes in a char.  */
 #define SIZEOF_CHAR 1
@@ -106,6 +113,9 @@
 /* Define if you have the dcgettext function.  */
 /* #undef HAVE_DCGETTEXT */
 
+/* Define if you have the fseeko function.  */
+/* #undef HAVE_FSEEKO */
+
 /* Define if you have the getcwd function.  */
 #define HAVE_GETCWD 1
 
@@ -121,6 +131,9 @@
 /* Define if you have the munmap function.  */
 /* #undef HAVE_MUNMAP */
 
+/* Define if you have the pread function.  */
+#define HAVE_PREAD 1
+
 /* Define if you have the putenv function.  */
 #define HAVE_PUTENV 1
 
@@ -157,6 +170,9 @@
 /* Define if you have the <fcntl.h> header file.  */
 #define HAVE_FCNTL_H 1
 
+/* Define if you have the <immintrin.h> header file.  */
+/* #undef HAVE_IMMINTRIN_H */
+
 /* Define if you have the <limits.h> header file.  */
 #define HAVE_LIMITS_H 1
 
@@ -169,18 +185,33 @@
 /* Define if you have the <nl_types.h> header file.  */
 /* #undef HAVE_NL_TYPES_H */
 
+/* Define if you have the <pthread.h> header file.  */
+/* #undef HAVE_PTHREAD_H */
+
 /* Define if you have the <string.h> header file.  */
 #define HAVE_STRING_H 1
 
+/* Define if you have the <sys/inotify.h> header file.  */
+/* #undef HAVE_SYS_INOTIFY_H */
+
 /* Define if you have the <sys/mman.h> header file.  */
 /* #undef HAVE_SYS_MMAN_H */
 
 /* Define if you have the <sys/param.h> header file.  */
 #define HAVE_SYS_PARAM_H 1
 
+/* Define if you have the <sys/socket.h> header file.  */
+/* #undef HAVE_SYS_SOCKET_H */
+
 /* Define if you have the <sys/stat.h> header file.  */
 #define HAVE_SYS_STAT_H 1
 
+/* Define if you have the <sys/un.h> header file.  */
+/* #undef HAVE_SYS_UN_H */
+
+/* Define if you have the <sys/wait.h> header file.  */
+/* #undef HAVE_SYS_WAIT_H */
+
 /* Define if you have the <unistd.h> header file.  */
 #define HAVE_UNISTD_H 1
 
@@ -190,6 +221,9 @@
 /* Define if you have the m library (-lm).  */
 #define HAVE_LIBM 1
 
+/* Define if you have the pthread library (-lpthread).  */
+/* #undef HAVE_LIBPTHREAD */
+
 /* Name of package */
 #define PACKAGE "normalize"
 
@@ -0,0 +1,841 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Daemon mode: instead of processing the files named on the command
+ * line, listen on a Unix domain socket and process jobs sent by
+ * clients.  Each job is one line of text:
+ *
+ *   COMMAND [PARAM=VALUE | FLAG]... [--] FILE...
+ *
+ * and is answered with one "file" or "error" line per file, and a
+ * final "done" line.  See the man page for the details.
+ *
+ * The jobs are handled by a pool of pre-forked worker processes, each
+ * handling one job at a time with its own libnormalize context.  The
+ * context is made once, before the workers are forked, so the kernels
+ * are checked (or tuned) once and not for every job, and each job sets
+ * every setting a job can change, so a job's settings never leak into
+ * the next one.  Workers live for the lifetime of the daemon, and a
+ * worker that dies is replaced.  A worker serves one connection at a
+ * time, so a connection that goes quiet for IDLE_TIMEOUT seconds is
+ * closed, to free the worker for someone else.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* for sockets */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <ctype.h>
+# include <math.h>
+#endif
+
+#if HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#if HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#if HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+#if HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/time.h>
+# define USE_DAEMON 1
+#else
+# define USE_DAEMON 0
+#endif
+
+#if ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext (s)
+#else
+# define _(s) (s)
+#endif
+
+#include "normalize.h"
+
+#define AMPTODBFS(x) (20 * log10(x))
+#define FRACTODB(x) (20 * log10(x))
+#define DBFSTOAMP(x) pow(10,(x)/20.0)
+#define DBTOFRAC(x) pow(10,(x)/20.0)
+
+#ifndef FALSE
+# define FALSE  (0)
+#endif
+#ifndef TRUE
+# define TRUE   (!FALSE)
+#endif
+
+#ifndef EPSILON
+# define EPSILON 0.00000000001
+#endif
+
+/* seconds a client may leave its connection idle, or stop reading
+   the replies, before we hang up on it */
+#define IDLE_TIMEOUT 10
+
+#if !USE_DAEMON
+
+int
+daemon_main(char *sockpath, int nworkers)
+{
+  fprintf(stderr, _("%s: daemon mode is not supported on this system\n"),
+	  progname);
+  return 1;
+}
+
+#else /* USE_DAEMON */
+
+enum {
+  JOB_ANALYZE,
+  JOB_NORMALIZE,
+  JOB_APPLY_GAIN,
+  JOB_PING,
+  JOB_QUIT,
+};
+
+struct job {
+  int cmd;
+  double target;
+  double threshold;
+  double gain;       /* for JOB_APPLY_GAIN, < 0 if not given */
+  int batch;
+  int mix;
+  int peak;
+  int compression;
+  int float_output;
+  int loudness;      /* one of the NORMALIZE_LOUDNESS_* values */
+  int true_peak;
+  double true_peak_limit; /* as an amplitude, or 0 for none */
+  int nband_edges;   /* 0 for no band levels */
+  double band_edges[NORMALIZE_MAX_BANDS - 1];
+  unsigned int metrics; /* the NORMALIZE_METRIC_* to measure */
+  double max_clip;   /* the fraction of samples a gain may clip, or < 0 */
+  char **files;
+  int nfiles;
+};
+
+static volatile sig_atomic_t stop_requested = FALSE;
+
+static void
+stop_handler(int sig)
+{
+  stop_requested = TRUE;
+}
+
+/*
+ * Read a line of arbitrary length from the stream.  Returns a
+ * malloc'ed string without the newline, or NULL on EOF or error; a
+ * line cut off by an error (such as a timeout) is thrown away.
+ */
+static char *
+read_line(FILE *in)
+{
+  char *buf;
+  int c, len = 0, buflen = 256;
+
+  buf = (char *)xmalloc(buflen);
+  while ((c = getc(in)) != EOF && c != '\n') {
+    if (len + 1 >= buflen) {
+      buflen *= 2;
+      buf = (char *)realloc(buf, buflen);
+      if (buf == NULL) {
+	fprintf(stderr, _("%s: unable to malloc\n"), progname);
+	exit(1);
+      }
+    }
+    buf[len++] = c;
+  }
+  if (c == EOF && (len == 0 || ferror(in))) {
+    free(buf);
+    return NULL;
+  }
+  if (len > 0 && buf[len - 1] == '\r')
+    len--;
+  buf[len] = '\0';
+  return buf;
+}
+
+/*
+ * Split the next whitespace-separated token off of *pp, in place.  A
+ * token may be enclosed in double quotes, in which case it may
+ * contain whitespace, and \" and \\ stand for " and \.  Returns NULL
+ * if there are no more tokens.
+ */
+static char *
+next_token(char **pp)
+{
+  char *p = *pp, *tok, *q;
+
+  while (isspace((unsigned char)*p))
+    p++;
+  if (*p == '\0')
+    return NULL;
+
+  if (*p == '"') {
+    tok = q = ++p;
+    while (*p && *p != '"') {
+      if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+	p++;
+      *q++ = *p++;
+    }
+    if (*p)
+      p++;
+    *q = '\0';
+  } else {
+    tok = p;
+    while (*p && !isspace((unsigned char)*p))
+      p++;
+    if (*p)
+      *p++ = '\0';
+  }
+
+  *pp = p;
+  return tok;
+}
+
+/*
+ * Write s to the stream as a double-quoted string
+ */
+static void
+put_quoted(FILE *out, const char *s)
+{
+  putc('"', out);
+  for ( ; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      putc('\\', out);
+    putc(*s, out);
+  }
+  putc('"', out);
+}
+
+static void
+reply_error(FILE *out, const char *filename, int err, const char *msg)
+{
+  fprintf(out, "error ");
+  if (filename) {
+    fprintf(out, "name=");
+    put_quoted(out, filename);
+    putc(' ', out);
+  }
+  fprintf(out, "code=%d message=", err);
+  put_quoted(out, msg);
+  putc('\n', out);
+}
+
+/*
+ * Parse an amplitude or gain argument: a fraction, or a number of
+ * decibels if followed by "dB".  An amplitude may also be a loudness,
+ * followed by "LUFS", in which case *in_lufs is set.  Returns -1 if it
+ * can't be parsed.
+ */
+static double
+parse_amount(const char *s, int is_amplitude, int *in_lufs)
+{
+  double x;
+  char *p;
+
+  x = strtod(s, &p);
+  if (p == s)
+    return -1.0;
+  while (isspace((unsigned char)*p))
+    p++;
+  if (is_amplitude && strncaseeq(p, "lufs", 4)) {
+    *in_lufs = TRUE;
+    if (x > 0)
+      x = -x;
+    return DBFSTOAMP(x);
+  }
+  if ((p[0] == 'd' || p[0] == 'D') && (p[1] == 'b' || p[1] == 'B')) {
+    if (is_amplitude && x > 0)
+      x = -x;
+    return DBFSTOAMP(x);
+  }
+  if (is_amplitude && x > 1.0)
+    return -1.0;
+  return x;
+}
+
+/*
+ * Parse a job line into *job.  On error, returns -1 and sets *errmsg.
+ */
+static int
+parse_job(char *line, struct job *job, char **errmsg)
+{
+  char *p = line, *tok, *val, *end;
+  size_t linelen = strlen(line);
+  int target_given = FALSE;
+
+  /* the command line options are the defaults */
+  job->target = target;
+  job->threshold = threshold;
+  job->gain = -1.0;
+  job->batch = batch_mode;
+  job->mix = mix_mode;
+  job->peak = use_peak;
+  job->compression = do_compression;
+  job->float_output = float_output;
+  job->loudness = loudness;
+  job->true_peak = do_true_peak;
+  job->true_peak_limit = true_peak_limit;
+  job->nband_edges = nband_edges;
+  memcpy(job->band_edges, band_edges, sizeof(job->band_edges));
+  job->metrics = metrics;
+  job->max_clip = max_clip;
+  job->nfiles = 0;
+
+  tok = next_token(&p);
+  if (tok == NULL) {
+    *errmsg = _("empty request");
+    return -1;
+  }
+  if (strcmp(tok, "analyze") == 0)
+    job->cmd = JOB_ANALYZE;
+  else if (strcmp(tok, "normalize") == 0)
+    job->cmd = JOB_NORMALIZE;
+  else if (strcmp(tok, "apply-gain") == 0)
+    job->cmd = JOB_APPLY_GAIN;
+  else if (strcmp(tok, "ping") == 0)
+    job->cmd = JOB_PING;
+  else if (strcmp(tok, "quit") == 0)
+    job->cmd = JOB_QUIT;
+  else {
+    *errmsg = _("unknown command");
+    return -1;
+  }
+
+  /* parameters, up to the first thing that isn't one */
+  while ((tok = next_token(&p)) != NULL) {
+    if (strcmp(tok, "--") == 0) {
+      tok = next_token(&p);
+      break;
+    }
+    val = strchr(tok, '=');
+    if (val) {
+      *val++ = '\0';
+      if (strcmp(tok, "target") == 0) {
+	int in_lufs = FALSE;
+	job->target = parse_amount(val, TRUE, &in_lufs);
+	if (job->target <= 0) {
+	  *errmsg = _("bad target amplitude");
+	  return -1;
+	}
+	if (in_lufs)
+	  job->loudness = NORMALIZE_LOUDNESS_R128;
+	target_given = TRUE;
+      } else if (strcmp(tok, "gain") == 0) {
+	job->gain = parse_amount(val, FALSE, NULL);
+	if (job->gain < 0) {
+	  *errmsg = _("bad gain");
+	  return -1;
+	}
+      } else if (strcmp(tok, "threshold") == 0) {
+	job->threshold = strtod(val, &end);
+	if (end == val || *end != '\0') {
+	  *errmsg = _("bad threshold");
+	  return -1;
+	}
+      } else if (strcmp(tok, "true-peak-limit") == 0) {
+	/* in dBTP, with or without the units, as on the command line */
+	job->true_peak_limit = strtod(val, &end);
+	while (isspace((unsigned char)*end))
+	  end++;
+	if (strncaseeq(end, "db", 2))
+	  end += strncaseeq(end + 2, "tp", 2) ? 4 : 2;
+	if (end == val || *end != '\0') {
+	  *errmsg = _("bad true-peak-limit");
+	  return -1;
+	}
+	job->true_peak_limit = DBFSTOAMP(job->true_peak_limit);
+	job->true_peak = TRUE;
+      } else if (strcmp(tok, "bands") == 0) {
+	job->nband_edges = parse_bands(val, job->band_edges);
+	if (job->nband_edges == -1) {
+	  *errmsg = _("bad bands");
+	  return -1;
+	}
+      } else if (strcmp(tok, "metrics") == 0) {
+	if (parse_metrics(val, &job->metrics) == -1) {
+	  *errmsg = _("bad metrics");
+	  return -1;
+	}
+	if (job->metrics & NORMALIZE_METRIC_TRUE_PEAK)
+	  job->true_peak = TRUE;
+	if ((job->metrics & NORMALIZE_METRIC_BANDS) && job->nband_edges == 0)
+	  job->nband_edges = parse_bands("octave", job->band_edges);
+      } else if (strcmp(tok, "max-clip") == 0) {
+	job->max_clip = strtod(val, &end);
+	if (end == val || *end != '\0' || job->max_clip < 0
+	    || job->max_clip > 1) {
+	  *errmsg = _("bad clipping budget");
+	  return -1;
+	}
+      } else if (strcmp(tok, "loudness") == 0) {
+	if (strcmp(val, "rms") == 0)
+	  job->loudness = NORMALIZE_LOUDNESS_RMS;
+	else if (strcmp(val, "r128") == 0)
+	  job->loudness = NORMALIZE_LOUDNESS_R128;
+	else {
+	  *errmsg = _("bad loudness method");
+	  return -1;
+	}
+      } else {
+	/* not a parameter, so it's the first file */
+	val[-1] = '=';
+	break;
+      }
+    } else if (strcmp(tok, "batch") == 0) {
+      job->batch = TRUE;
+    } else if (strcmp(tok, "mix") == 0) {
+      job->mix = TRUE;
+    } else if (strcmp(tok, "peak") == 0) {
+      job->peak = TRUE;
+      job->compression = FALSE;
+    } else if (strcmp(tok, "compression") == 0) {
+      job->compression = TRUE;
+    } else if (strcmp(tok, "float") == 0) {
+      job->float_output = TRUE;
+    } else if (strcmp(tok, "true-peak") == 0) {
+      job->true_peak = TRUE;
+    } else {
+      break;
+    }
+  }
+
+  /* a job that asks for R128 when the default is RMS gets R128's
+     default target */
+  if (job->loudness == NORMALIZE_LOUDNESS_R128
+      && loudness != NORMALIZE_LOUDNESS_R128 && !target_given)
+    job->target = DBFSTOAMP(-23.0);
+
+  /* the rest are files; there can't be more than half a line's worth */
+  job->files = (char **)xmalloc((linelen / 2 + 2) * sizeof(char *));
+  for ( ; tok != NULL; tok = next_token(&p))
+    job->files[job->nfiles++] = tok;
+
+  if (job->cmd == JOB_PING || job->cmd == JOB_QUIT)
+    return 0;
+
+  if (job->nfiles == 0) {
+    *errmsg = _("no files given");
+    return -1;
+  }
+  if (job->batch && job->mix) {
+    *errmsg = _("batch and mix are mutually exclusive");
+    return -1;
+  }
+  if (job->peak && (job->batch || job->mix)) {
+    *errmsg = _("batch and mix can't be used with peak");
+    return -1;
+  }
+  if (job->cmd == JOB_APPLY_GAIN && job->gain < 0) {
+    *errmsg = _("apply-gain requires a gain");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Analyze one file.  Returns a NORMALIZE_* code, with errno set on
+ * error.
+ */
+static int
+analyze_file(normalize_t *nz, char *filename, struct signal_info *psi)
+{
+  int fd, err;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NORMALIZE_ERR_IO;
+  err = normalize_analyze_fd(nz, fd, filename, psi);
+  close(fd);
+  return err;
+}
+
+static void
+reply_file(FILE *out, struct job *job, char *filename,
+	   struct signal_info *psi, double gain, const char *status)
+{
+  int i;
+
+  fprintf(out, "file name=");
+  put_quoted(out, filename);
+  if (psi)
+    fprintf(out, " level=%0.4f peak=%0.4f",
+	    AMPTODBFS(psi->level), AMPTODBFS(psi->peak));
+  if (psi && (psi->metrics & NORMALIZE_METRIC_LOUDNESS)
+      && job->loudness != NORMALIZE_LOUDNESS_R128)
+    fprintf(out, " loudness=%0.4f", psi->loudness);
+  if (psi && psi->loudness > -HUGE_VAL)
+    fprintf(out, " range=%0.2f", psi->loudness_range);
+  if (psi && psi->true_peak >= 0)
+    fprintf(out, " true_peak=%0.4f", AMPTODBFS(psi->true_peak));
+  for (i = 0; psi && i < psi->nbands; i++)
+    fprintf(out, "%s%0.2f", i == 0 ? " bands=" : ",",
+	    AMPTODBFS(psi->bands[i]));
+  if (psi && (psi->metrics & NORMALIZE_METRIC_DC))
+    fprintf(out, " dc=%0.6f", psi->dc_offset);
+  if (psi && (psi->metrics & NORMALIZE_METRIC_CREST))
+    fprintf(out, " crest=%0.4f", AMPTODBFS(psi->crest_factor));
+  if (psi && (psi->metrics & NORMALIZE_METRIC_CLIPS))
+    fprintf(out, " clips=%lu", (unsigned long)psi->nclipped);
+  if (psi && (psi->metrics & NORMALIZE_METRIC_SILENCE))
+    fprintf(out, " silence=%0.4f", psi->silence);
+  if (gain > 0)
+    fprintf(out, " gain=%0.4f", FRACTODB(gain));
+  if (gain > 0 && psi && (psi->metrics & NORMALIZE_METRIC_HISTOGRAM)
+      && !job->compression && !job->float_output)
+    fprintf(out, " predicted_clips=%lu",
+	    (unsigned long)normalize_predict_clips(psi, gain));
+  fprintf(out, " status=%s\n", status);
+}
+
+/*
+ * Run the job with the worker's context nz, writing the replies to out
+ */
+static void
+run_job(normalize_t *nz, struct job *job, FILE *out)
+{
+  struct signal_info *sis;
+  struct level_stats stats;
+  char **fnames;
+  double *gains;
+  int i, err, nfiles, nerrors = 0, nadjusted = 0;
+
+  normalize_set_target(nz, job->target);
+  normalize_set_threshold(nz, job->threshold);
+  normalize_set_compression(nz, job->compression);
+  normalize_set_float_output(nz, job->float_output);
+  normalize_set_loudness(nz, job->loudness);
+  normalize_set_true_peak(nz, job->true_peak);
+  normalize_set_true_peak_limit(nz, job->true_peak_limit);
+  normalize_set_bands(nz, job->band_edges, job->nband_edges);
+  /* replies give the level, even for peak jobs */
+  normalize_set_metrics(nz, job->metrics | NORMALIZE_METRIC_LEVEL);
+  normalize_set_max_clip(nz, job->max_clip);
+  if (job->batch)
+    normalize_set_mode(nz, NORMALIZE_MODE_BATCH);
+  else if (job->mix)
+    normalize_set_mode(nz, NORMALIZE_MODE_MIX);
+  else if (job->peak)
+    normalize_set_mode(nz, NORMALIZE_MODE_PEAK);
+  else
+    normalize_set_mode(nz, NORMALIZE_MODE_RMS);
+
+  if (job->cmd == JOB_APPLY_GAIN) {
+    for (i = 0; i < job->nfiles; i++) {
+      err = normalize_adjust_file(nz, job->files[i], job->gain, NULL, NULL);
+      if (err != NORMALIZE_OK) {
+	reply_error(out, job->files[i], errno, normalize_strerror(nz, err));
+	nerrors++;
+      } else {
+	reply_file(out, job, job->files[i], NULL, job->gain, "adjusted");
+	nadjusted++;
+      }
+    }
+    goto done;
+  }
+
+  /* analysis phase: the files that fail are dropped from the job */
+  sis = (struct signal_info *)xmalloc(job->nfiles * sizeof(struct signal_info));
+  fnames = (char **)xmalloc(job->nfiles * sizeof(char *));
+  gains = (double *)xmalloc(job->nfiles * sizeof(double));
+  nfiles = 0;
+  for (i = 0; i < job->nfiles; i++) {
+    err = analyze_file(nz, job->files[i], &sis[nfiles]);
+    if (err != NORMALIZE_OK) {
+      reply_error(out, job->files[i], errno, normalize_strerror(nz, err));
+      nerrors++;
+    } else if (sis[nfiles].level * sis[nfiles].level < EPSILON) {
+      reply_error(out, job->files[i], EINVAL,
+		  job->loudness == NORMALIZE_LOUDNESS_R128
+		  ? _("file has no loudness above the gate")
+		  : _("file has zero power"));
+      nerrors++;
+    } else {
+      fnames[nfiles++] = job->files[i];
+    }
+  }
+  if (nfiles == 0)
+    goto done_free;
+
+  err = normalize_compute_gains(nz, sis, nfiles, gains, &stats);
+  if (err != NORMALIZE_OK) {
+    reply_error(out, NULL, errno, normalize_strerror(nz, err));
+    nerrors++;
+    goto done_free;
+  }
+  if (job->batch || job->mix) {
+    fprintf(out, "average level=%0.4f", AMPTODBFS(stats.level));
+    if (job->batch)
+      fprintf(out, " gain=%0.4f", FRACTODB(gains[0]));
+    putc('\n', out);
+  }
+
+  /* adjustment phase */
+  for (i = 0; i < nfiles; i++) {
+    if (job->cmd == JOB_ANALYZE) {
+      reply_file(out, job, fnames[i], &sis[i], gains[i], "analyzed");
+    } else if (fabs(FRACTODB(gains[i])) < 0.25) {
+      /* too small to be audible; see the comment in main() */
+      reply_file(out, job, fnames[i], &sis[i], gains[i], "unchanged");
+    } else {
+      err = normalize_adjust_file(nz, fnames[i], gains[i], &sis[i], NULL);
+      if (err != NORMALIZE_OK) {
+	reply_error(out, fnames[i], errno, normalize_strerror(nz, err));
+	nerrors++;
+      } else {
+	reply_file(out, job, fnames[i], &sis[i], gains[i], "adjusted");
+	nadjusted++;
+      }
+    }
+  }
+
+ done_free:
+  free(gains);
+  free(fnames);
+  free(sis);
+ done:
+  fprintf(out, "done files=%d adjusted=%d errors=%d\n",
+	  job->nfiles, nadjusted, nerrors);
+}
+
+/*
+ * Handle the requests on one connection, until the client hangs up,
+ * or leaves it idle for IDLE_TIMEOUT seconds
+ */
+static void
+serve_client(normalize_t *nz, int fd)
+{
+  FILE *in, *out;
+  char *line, *errmsg;
+  struct job job;
+  struct timeval tv;
+  int quit = FALSE;
+
+  /* a read or write that times out fails, and we hang up */
+  tv.tv_sec = IDLE_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+      || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+    fprintf(stderr, _("%s: can't set a timeout on a connection: %s\n"),
+	    progname, strerror(errno));
+
+  in = fdopen(fd, "r");
+  out = fdopen(dup(fd), "w");
+  if (in == NULL || out == NULL) {
+    fprintf(stderr, _("%s: failed fdopen: %s\n"), progname, strerror(errno));
+    if (in)
+      fclose(in);
+    else
+      close(fd);
+    if (out)
+      fclose(out);
+    return;
+  }
+
+  while (!quit && !stop_requested && (line = read_line(in)) != NULL) {
+    job.files = NULL;
+    if (parse_job(line, &job, &errmsg) == -1) {
+      reply_error(out, NULL, EINVAL, errmsg);
+      fprintf(out, "done files=0 adjusted=0 errors=1\n");
+    } else if (job.cmd == JOB_PING) {
+      fprintf(out, "ok\n");
+    } else if (job.cmd == JOB_QUIT) {
+      fprintf(out, "ok\n");
+      quit = TRUE;
+    } else {
+      run_job(nz, &job, out);
+    }
+    if (fflush(out) == EOF)
+      quit = TRUE; /* client went away */
+    free(job.files);
+    free(line);
+  }
+
+  fclose(in);
+  fclose(out);
+}
+
+static void
+worker_loop(normalize_t *nz, int listen_fd)
+{
+  int fd;
+
+  signal(SIGPIPE, SIG_IGN);
+  verbose = VERBOSE_QUIET;
+
+  while (!stop_requested) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EINTR)
+	fprintf(stderr, _("%s: accept failed: %s\n"),
+		progname, strerror(errno));
+      continue;
+    }
+    serve_client(nz, fd);
+  }
+
+  close(listen_fd);
+  normalize_destroy(nz);
+  exit(0);
+}
+
+static pid_t
+spawn_worker(normalize_t *nz, int listen_fd)
+{
+  pid_t pid;
+
+  pid = fork();
+  if (pid == -1)
+    fprintf(stderr, _("%s: fork failed: %s\n"), progname, strerror(errno));
+  else if (pid == 0)
+    worker_loop(nz, listen_fd); /* doesn't return */
+  return pid;
+}
+
+/*
+ * Listen on the socket sockpath and process jobs with nworkers
+ * worker processes, until we get SIGTERM or SIGINT.
+ */
+int
+daemon_main(char *sockpath, int nworkers)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct stat st;
+  normalize_t *nz;
+  int listen_fd, i, status;
+  mode_t old_umask;
+  pid_t *pids, pid;
+  time_t *started;
+
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, _("%s: socket name %s is too long\n"), progname, sockpath);
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockpath);
+
+  /* the workers' context; checking the kernels here means it's done
+     once, and each worker gets a copy of the result */
+  nz = normalize_new(NULL);
+  if (nz == NULL) {
+    fprintf(stderr, _("%s: unable to malloc\n"), progname);
+    return 1;
+  }
+  if (kernel_name && normalize_set_kernels(nz, kernel_name) != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error: --kernel=%s: %s\n"),
+	    progname, kernel_name, normalize_strerror(nz, NORMALIZE_ERR_INVAL));
+    normalize_destroy(nz);
+    return 1;
+  }
+  normalize_get_kernels(nz);
+
+  /* remove a stale socket left by a previous daemon, but nothing else */
+  if (stat(sockpath, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(sockpath);
+
+  /* the socket is made for our own user only: connecting takes write
+     permission, and any user who can connect can have the workers
+     rewrite any file we can */
+  old_umask = umask(077);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1
+      || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+      || listen(listen_fd, 16) == -1) {
+    fprintf(stderr, _("%s: can't listen on %s: %s\n"),
+	    progname, sockpath, strerror(errno));
+    umask(old_umask);
+    normalize_destroy(nz);
+    return 1;
+  }
+  umask(old_umask);
+
+  /* no SA_RESTART, so that wait() and accept() notice the signal */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  pids = (pid_t *)xmalloc(nworkers * sizeof(pid_t));
+  started = (time_t *)xmalloc(nworkers * sizeof(time_t));
+  for (i = 0; i < nworkers; i++) {
+    pids[i] = spawn_worker(nz, listen_fd);
+    started[i] = time(NULL);
+  }
+
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr, _("%s: listening on %s with %d workers\n"),
+	    progname, sockpath, nworkers);
+
+  /* restart any worker that dies, until we're told to stop */
+  while (!stop_requested) {
+    pid = wait(&status);
+    if (pid == -1) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    for (i = 0; i < nworkers; i++)
+      if (pids[i] == pid)
+	break;
+    if (i == nworkers || stop_requested)
+      continue;
+    if (verbose >= VERBOSE_INFO)
+      fprintf(stderr, _("%s: worker %d exited, restarting\n"),
+	      progname, (int)pid);
+    /* don't spin if workers are dying as soon as they start */
+    if (time(NULL) - started[i] < 1)
+      sleep(1);
+    pids[i] = spawn_worker(nz, listen_fd);
+    started[i] = time(NULL);
+  }
+
+  /* shut down: workers finish the job they're on, then exit */
+  for (i = 0; i < nworkers; i++)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  while (wait(&status) > 0 || errno == EINTR)
+    ;
+
+  close(listen_fd);
+  unlink(sockpath);
+  normalize_destroy(nz);
+  free(started);
+  free(pids);
+
+  return 0;
+}
+
+#endif /* USE_DAEMON */
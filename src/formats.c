@@ -0,0 +1,454 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _POSIX_C_SOURCE 2
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+#else
+# ifndef HAVE_MEMCPY
+#  define memcpy(d,s,n) bcopy((s),(d),(n))
+# endif
+#endif
+
+#if HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+
+#define N_(s) (s)
+
+#include "formats.h"
+
+#ifndef FALSE
+# define FALSE  (0)
+#endif
+#ifndef TRUE
+# define TRUE   (!FALSE)
+#endif
+
+
+/*
+ * Set errno and the message for a bad file, and return the error code
+ */
+int
+container_error(const char **errmsg, const char *msg)
+{
+  *errmsg = msg;
+  errno = EINVAL;
+  return NORMALIZE_ERR_FORMAT;
+}
+
+static uint16_t
+get_bendian16(const unsigned char *buf)
+{
+  return (buf[0] << 8) | buf[1];
+}
+
+static uint32_t
+get_bendian32(const unsigned char *buf)
+{
+  return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static void
+put_bendian16(unsigned char *buf, uint16_t x)
+{
+  buf[0] = (x >> 8) & 0xFF;
+  buf[1] = x & 0xFF;
+}
+
+static void
+put_bendian32(unsigned char *buf, uint32_t x)
+{
+  buf[0] = (x >> 24) & 0xFF;
+  buf[1] = (x >> 16) & 0xFF;
+  buf[2] = (x >> 8) & 0xFF;
+  buf[3] = x & 0xFF;
+}
+
+/*
+ * Read len bytes from fd.  Returns -1 on error, 1 if fewer than len
+ * bytes were left, and 0 otherwise.
+ */
+static int
+read_fully(int fd, unsigned char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (n == 0)
+      return 1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static off_t
+file_size(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) == -1)
+    return -1;
+  return st.st_size;
+}
+
+static void
+set_rates(struct wavfmt *fmt)
+{
+  fmt->block_align = fmt->channels * (fmt->bits_per_sample / 8);
+  fmt->avg_bytes_per_sec = fmt->samples_per_sec * fmt->block_align;
+}
+
+
+/*
+ * AIFF and AIFF-C.  Samples are big-endian, and 8-bit samples are
+ * signed, except in 'sowt' AIFF-C files, which are little-endian.
+ */
+
+/* the integer part of an 80-bit IEEE extended number, for the rate */
+static uint32_t
+get_extended(const unsigned char *buf)
+{
+  int exponent;
+  uint32_t mantissa;
+
+  exponent = ((buf[0] & 0x7F) << 8 | buf[1]) - 16383;
+  mantissa = get_bendian32(buf + 2);
+  if ((buf[0] & 0x80) || exponent < 0 || exponent > 31)
+    return 0;
+  return mantissa >> (31 - exponent);
+}
+
+static void
+put_extended(unsigned char *buf, uint32_t x)
+{
+  int exponent = 31;
+
+  memset(buf, 0, 10);
+  if (x == 0)
+    return;
+  while (!(x & 0x80000000)) {
+    x <<= 1;
+    exponent--;
+  }
+  put_bendian16(buf, 16383 + exponent);
+  put_bendian32(buf + 2, x);
+}
+
+static int
+aiff_probe(const unsigned char *buf, size_t len)
+{
+  return len >= 12 && memcmp(buf, "FORM", 4) == 0
+    && (memcmp(buf + 8, "AIFF", 4) == 0 || memcmp(buf + 8, "AIFC", 4) == 0);
+}
+
+static int
+aiff_open(int fd, struct container_info *ci, const char **errmsg)
+{
+  unsigned char buf[26];
+  uint32_t size, nframes = 0, ssnd_offset;
+  off_t pos, form_end, ssnd_start = -1;
+  uint64_t ssnd_size = 0;
+  int is_aifc, have_comm = FALSE, bytes, ret;
+
+  if (read_fully(fd, buf, 12) != 0)
+    return container_error(errmsg, N_("not an AIFF file"));
+  is_aifc = memcmp(buf + 8, "AIFC", 4) == 0;
+  form_end = (off_t)8 + get_bendian32(buf + 4);
+  pos = 12;
+
+  ci->fmt.format_tag = WAVE_FORMAT_PCM;
+  ci->fmt.sample_flags = WAVFMT_BIG_ENDIAN | WAVFMT_SIGNED_8;
+  ci->fmt.channel_mask = 0;
+
+  /* the COMM and SSND chunks can come in either order */
+  while (!have_comm || ssnd_start == -1) {
+    if (pos + 8 > form_end)
+      goto truncated;
+    if (lseek(fd, pos, SEEK_SET) == -1)
+      return NORMALIZE_ERR_IO;
+    ret = read_fully(fd, buf, 8);
+    if (ret == -1)
+      return NORMALIZE_ERR_IO;
+    if (ret == 1)
+      goto truncated;
+    size = get_bendian32(buf + 4);
+
+    if (memcmp(buf, "COMM", 4) == 0) {
+      if (size < (is_aifc ? 22 : 18))
+	return container_error(errmsg, N_("bad AIFF COMM chunk"));
+      ret = read_fully(fd, buf, is_aifc ? 22 : 18);
+      if (ret == -1)
+	return NORMALIZE_ERR_IO;
+      if (ret == 1)
+	goto truncated;
+      ci->fmt.channels = get_bendian16(buf);
+      nframes = get_bendian32(buf + 2);
+      ci->fmt.valid_bits = get_bendian16(buf + 6);
+      ci->fmt.samples_per_sec = get_extended(buf + 8);
+      bytes = (ci->fmt.valid_bits + 7) / 8;
+      if (is_aifc && memcmp(buf + 18, "NONE", 4) != 0
+	  && memcmp(buf + 18, "twos", 4) != 0) {
+	if (memcmp(buf + 18, "sowt", 4) == 0) {
+	  ci->fmt.sample_flags = WAVFMT_SIGNED_8;
+	} else if (memcmp(buf + 18, "fl32", 4) == 0
+		   || memcmp(buf + 18, "FL32", 4) == 0) {
+	  ci->fmt.format_tag = WAVE_FORMAT_IEEE_FLOAT;
+	  ci->fmt.valid_bits = 32;
+	  bytes = 4;
+	} else if (memcmp(buf + 18, "fl64", 4) == 0
+		   || memcmp(buf + 18, "FL64", 4) == 0) {
+	  ci->fmt.format_tag = WAVE_FORMAT_IEEE_FLOAT;
+	  ci->fmt.valid_bits = 64;
+	  bytes = 8;
+	} else {
+	  return container_error(errmsg,
+				 N_("unsupported AIFF-C compression type"));
+	}
+      }
+      ci->fmt.bits_per_sample = bytes * 8;
+      set_rates(&ci->fmt);
+      have_comm = TRUE;
+
+    } else if (memcmp(buf, "SSND", 4) == 0) {
+      if (size < 8)
+	return container_error(errmsg, N_("bad AIFF SSND chunk"));
+      ret = read_fully(fd, buf, 8);
+      if (ret == -1)
+	return NORMALIZE_ERR_IO;
+      if (ret == 1)
+	goto truncated;
+      ssnd_offset = get_bendian32(buf);
+      if (ssnd_offset > size - 8)
+	return container_error(errmsg, N_("bad AIFF SSND chunk"));
+      ssnd_start = pos + 16 + ssnd_offset;
+      ssnd_size = size - 8 - ssnd_offset;
+    }
+
+    /* chunks are padded to an even length */
+    pos += 8 + (off_t)size + (size & 1);
+  }
+
+  ci->data_offset = ssnd_start;
+  ci->data_size = (uint64_t)nframes * ci->fmt.block_align;
+  if (ci->data_size > ssnd_size)
+    ci->data_size = ssnd_size;
+  return NORMALIZE_OK;
+
+ truncated:
+  if (!have_comm)
+    return container_error(errmsg, N_("no AIFF COMM chunk found"));
+  return container_error(errmsg, N_("no AIFF SSND chunk found"));
+}
+
+/*
+ * Float output is written as AIFF-C, which is the only kind of AIFF
+ * that can hold float samples.
+ */
+static int
+aiff_write_float_header(FILE *out, const struct wavfmt *fmt, int bits,
+			uint64_t nsamples)
+{
+  /* Pascal strings, with the length byte, padded to an even length */
+  static const char name32[] = "\02532-bit floating point";
+  static const char name64[] = "\02564-bit floating point";
+  unsigned char hdr[92];
+  uint64_t data_size = nsamples * (bits / 8);
+
+  if (data_size > 0xFFFFFFFF - sizeof(hdr)) {
+    errno = EFBIG;
+    return -1;
+  }
+
+  memcpy(hdr, "FORM", 4);
+  put_bendian32(hdr + 4, sizeof(hdr) - 8 + data_size);
+  memcpy(hdr + 8, "AIFCFVER", 8);
+  put_bendian32(hdr + 16, 4);
+  put_bendian32(hdr + 20, 0xA2805140); /* AIFF-C version 1 */
+  memcpy(hdr + 24, "COMM", 4);
+  put_bendian32(hdr + 28, 44);
+  put_bendian16(hdr + 32, fmt->channels);
+  put_bendian32(hdr + 34, nsamples / fmt->channels);
+  put_bendian16(hdr + 38, bits);
+  put_extended(hdr + 40, fmt->samples_per_sec);
+  memcpy(hdr + 50, bits == 32 ? "fl32" : "fl64", 4);
+  memcpy(hdr + 54, bits == 32 ? name32 : name64, 22);
+  memcpy(hdr + 76, "SSND", 4);
+  put_bendian32(hdr + 80, 8 + data_size);
+  put_bendian32(hdr + 84, 0); /* offset */
+  put_bendian32(hdr + 88, 0); /* block size */
+
+  if (fwrite(hdr, 1, sizeof(hdr), out) < sizeof(hdr))
+    return -1;
+  return 0;
+}
+
+const struct container aiff_container = {
+  "AIFF", aiff_probe, aiff_open, aiff_write_float_header, WAVFMT_BIG_ENDIAN
+};
+
+
+/*
+ * Sun/NeXT AU.  Everything is big-endian, and 8-bit linear samples
+ * are signed.
+ */
+
+#define AU_ENCODING_LINEAR_8   2
+#define AU_ENCODING_LINEAR_16  3
+#define AU_ENCODING_LINEAR_24  4
+#define AU_ENCODING_LINEAR_32  5
+#define AU_ENCODING_FLOAT      6
+#define AU_ENCODING_DOUBLE     7
+
+#define AU_SIZE_UNKNOWN 0xFFFFFFFF
+
+static int
+au_probe(const unsigned char *buf, size_t len)
+{
+  return len >= 4 && memcmp(buf, ".snd", 4) == 0;
+}
+
+static int
+au_open(int fd, struct container_info *ci, const char **errmsg)
+{
+  unsigned char buf[24];
+  uint32_t hdr_size, data_size, encoding;
+  off_t len;
+  int ret;
+
+  ret = read_fully(fd, buf, sizeof(buf));
+  if (ret == -1)
+    return NORMALIZE_ERR_IO;
+  if (ret == 1 || memcmp(buf, ".snd", 4) != 0)
+    return container_error(errmsg, N_("not an AU file"));
+  hdr_size = get_bendian32(buf + 4);
+  data_size = get_bendian32(buf + 8);
+  encoding = get_bendian32(buf + 12);
+  if (hdr_size < 24)
+    return container_error(errmsg, N_("bad AU header"));
+
+  ci->fmt.format_tag = WAVE_FORMAT_PCM;
+  ci->fmt.sample_flags = WAVFMT_BIG_ENDIAN | WAVFMT_SIGNED_8;
+  ci->fmt.channel_mask = 0;
+  switch (encoding) {
+  case AU_ENCODING_LINEAR_8:
+  case AU_ENCODING_LINEAR_16:
+  case AU_ENCODING_LINEAR_24:
+  case AU_ENCODING_LINEAR_32:
+    ci->fmt.bits_per_sample = (encoding - 1) * 8;
+    break;
+  case AU_ENCODING_FLOAT:
+    ci->fmt.format_tag = WAVE_FORMAT_IEEE_FLOAT;
+    ci->fmt.bits_per_sample = 32;
+    break;
+  case AU_ENCODING_DOUBLE:
+    ci->fmt.format_tag = WAVE_FORMAT_IEEE_FLOAT;
+    ci->fmt.bits_per_sample = 64;
+    break;
+  default:
+    return container_error(errmsg, N_("unsupported AU encoding"));
+  }
+  ci->fmt.valid_bits = ci->fmt.bits_per_sample;
+  ci->fmt.samples_per_sec = get_bendian32(buf + 16);
+  ci->fmt.channels = get_bendian32(buf + 20);
+  set_rates(&ci->fmt);
+
+  ci->data_offset = hdr_size;
+  ci->data_size = data_size;
+  if (data_size == AU_SIZE_UNKNOWN) {
+    len = file_size(fd);
+    if (len == -1)
+      return NORMALIZE_ERR_IO;
+    ci->data_size = len > hdr_size ? len - hdr_size : 0;
+  }
+  return NORMALIZE_OK;
+}
+
+static int
+au_write_float_header(FILE *out, const struct wavfmt *fmt, int bits,
+		      uint64_t nsamples)
+{
+  unsigned char hdr[24];
+  uint64_t data_size = nsamples * (bits / 8);
+
+  memcpy(hdr, ".snd", 4);
+  put_bendian32(hdr + 4, sizeof(hdr));
+  put_bendian32(hdr + 8, data_size < AU_SIZE_UNKNOWN
+		? data_size : AU_SIZE_UNKNOWN);
+  put_bendian32(hdr + 12, bits == 32 ? AU_ENCODING_FLOAT : AU_ENCODING_DOUBLE);
+  put_bendian32(hdr + 16, fmt->samples_per_sec);
+  put_bendian32(hdr + 20, fmt->channels);
+
+  if (fwrite(hdr, 1, sizeof(hdr), out) < sizeof(hdr))
+    return -1;
+  return 0;
+}
+
+const struct container au_container = {
+  "AU", au_probe, au_open, au_write_float_header, WAVFMT_BIG_ENDIAN
+};
+
+
+/*
+ * Headerless samples, in a format given on the command line.  Float
+ * output is little-endian, with no header either.
+ */
+
+static int
+raw_probe(const unsigned char *buf, size_t len)
+{
+  return FALSE;
+}
+
+static int
+raw_open(int fd, struct container_info *ci, const char **errmsg)
+{
+  off_t len;
+
+  len = file_size(fd);
+  if (len == -1)
+    return NORMALIZE_ERR_IO;
+  ci->data_offset = 0;
+  ci->data_size = len;
+  return NORMALIZE_OK;
+}
+
+static int
+raw_write_float_header(FILE *out, const struct wavfmt *fmt, int bits,
+		       uint64_t nsamples)
+{
+  return 0;
+}
+
+const struct container raw_container = {
+  "raw", raw_probe, raw_open, raw_write_float_header, 0
+};
@@ -0,0 +1,68 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Audio file containers.  A container only knows where the samples
+ * of a file are and what they look like, and how to write a header
+ * for float output; libnormalize.c does everything else.  WAV lives
+ * in libnormalize.c, with the riff code; the others are in formats.c.
+ */
+
+#ifndef _FORMATS_H_
+#define _FORMATS_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "libnormalize.h"
+
+/* where the samples of an audio file are, and what they look like */
+struct container_info {
+  struct wavfmt fmt;
+  off_t data_offset;   /* the offset of the first sample */
+  uint64_t data_size;  /* the size of the samples, in bytes */
+};
+
+struct container {
+  const char *name;
+
+  /* nonzero if buf, the first len bytes of a file, is this format */
+  int (*probe)(const unsigned char *buf, size_t len);
+
+  /* read the header from fd, which is at the start of the file, and
+     fill in *ci; on a format error, return NORMALIZE_ERR_FORMAT with
+     *errmsg set, as container_error() does */
+  int (*open)(int fd, struct container_info *ci, const char **errmsg);
+
+  /* write the header of a file of nsamples float samples, bits bits
+     each, with the rate and channels of fmt; returns -1 on error */
+  int (*write_float_header)(FILE *out, const struct wavfmt *fmt, int bits,
+			    uint64_t nsamples);
+
+  /* the sample_flags of the float samples that follow that header */
+  int float_flags;
+};
+
+extern const struct container aiff_container;
+extern const struct container au_container;
+
+/* headerless samples: ci->fmt must be filled in before open() */
+extern const struct container raw_container;
+
+int container_error(const char **errmsg, const char *msg);
+
+#endif /* _FORMATS_H_ */
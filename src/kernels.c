@@ -0,0 +1,2746 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <string.h>
+#endif
+
+#include "kernels.h"
+
+/*
+ * The SIMD kernels need a compiler that can build code for a CPU
+ * feature in one function, with the rest of the program built for the
+ * baseline, and that can check for the feature at run time.
+ */
+#if HAVE_IMMINTRIN_H && (defined(__x86_64__) || defined(__i386__)) \
+    && (defined(__clang__) || __GNUC__ > 4 \
+	|| (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define KERNELS_X86 1
+# include <immintrin.h>
+#else
+# define KERNELS_X86 0
+#endif
+
+/* and checking for AVX-512 at run time takes GCC 5 */
+#if KERNELS_X86 && (defined(__clang__) || __GNUC__ >= 5)
+# define KERNELS_AVX512 1
+#else
+# define KERNELS_AVX512 0
+#endif
+
+/*
+ * tanh(x) = 1 - 2 / (exp(2x) + 1), for x >= 0.  exp(t) is 2^k exp(r),
+ * with t = k ln 2 + r, |r| <= ln 2 / 2, and exp(r) is its Taylor
+ * series to r^11, whose relative error is under 7e-15 there.  The
+ * error of tanh(x) is at most half that, so scaled to full scale it's
+ * far under an LSB, even for 32 bits.  Past TANH_ONE, tanh(x) is 1.0
+ * in a double.
+ */
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define INV_LN2 1.44269504088896338700e+00
+#define TANH_ONE 20.0
+
+static const double exp_coef[12] = {
+  1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880, 1.0 / 40320, 1.0 / 5040,
+  1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 1.0 / 2, 1.0, 1.0
+};
+
+
+/*
+ * Portable versions
+ */
+
+static __inline__ int32_t
+get_s16(const unsigned char *p)
+{
+  return (int32_t)(int8_t)p[1] * 256 + p[0];
+}
+
+static __inline__ int32_t
+get_s24(const unsigned char *p)
+{
+  return (int32_t)(int8_t)p[2] * 65536 + (p[1] << 8) + p[0];
+}
+
+static __inline__ int32_t
+get_s32(const unsigned char *p)
+{
+  return (int32_t)(int8_t)p[3] * 16777216 + (p[2] << 16) + (p[1] << 8)
+    + p[0];
+}
+
+static __inline__ void
+put_s16(int32_t sample, unsigned char *p)
+{
+  p[0] = (unsigned char)sample;
+  p[1] = (unsigned char)(sample >> 8);
+}
+
+static __inline__ void
+put_s24(int32_t sample, unsigned char *p)
+{
+  p[0] = (unsigned char)sample;
+  p[1] = (unsigned char)(sample >> 8);
+  p[2] = (unsigned char)(sample >> 16);
+}
+
+static __inline__ void
+put_s32(int32_t sample, unsigned char *p)
+{
+  p[0] = (unsigned char)sample;
+  p[1] = (unsigned char)(sample >> 8);
+  p[2] = (unsigned char)(sample >> 16);
+  p[3] = (unsigned char)(sample >> 24);
+}
+
+/*
+ * A loop per sample size, so each is a plain strided copy that the
+ * compiler can do well with.
+ */
+static void
+unpack_c(const unsigned char *in, int bytes_per_sample, int channels,
+	 size_t nframes, int32_t *planes, size_t stride)
+{
+  size_t frame_bytes = (size_t)channels * bytes_per_sample, i;
+  const unsigned char *p;
+  int32_t *out;
+  int c;
+
+  for (c = 0; c < channels; c++) {
+    p = in + c * bytes_per_sample;
+    out = planes + c * stride;
+    switch (bytes_per_sample) {
+    case 1:
+      for (i = 0; i < nframes; i++)
+	out[i] = (int32_t)p[i * frame_bytes] - 128;
+      break;
+    case 2:
+      for (i = 0; i < nframes; i++)
+	out[i] = get_s16(p + i * frame_bytes);
+      break;
+    case 3:
+      for (i = 0; i < nframes; i++)
+	out[i] = get_s24(p + i * frame_bytes);
+      break;
+    case 4:
+      for (i = 0; i < nframes; i++)
+	out[i] = get_s32(p + i * frame_bytes);
+      break;
+    }
+  }
+}
+
+static void
+pack_c(const int32_t *planes, size_t stride, int bytes_per_sample,
+       int channels, size_t nframes, unsigned char *out)
+{
+  size_t frame_bytes = (size_t)channels * bytes_per_sample, i;
+  const int32_t *in;
+  unsigned char *p;
+  int c;
+
+  for (c = 0; c < channels; c++) {
+    in = planes + c * stride;
+    p = out + c * bytes_per_sample;
+    switch (bytes_per_sample) {
+    case 1:
+      for (i = 0; i < nframes; i++)
+	p[i * frame_bytes] = (unsigned char)(in[i] + 128);
+      break;
+    case 2:
+      for (i = 0; i < nframes; i++)
+	put_s16(in[i], p + i * frame_bytes);
+      break;
+    case 3:
+      for (i = 0; i < nframes; i++)
+	put_s24(in[i], p + i * frame_bytes);
+      break;
+    case 4:
+      for (i = 0; i < nframes; i++)
+	put_s32(in[i], p + i * frame_bytes);
+      break;
+    }
+  }
+}
+
+static void
+stats_c(const int32_t *x, size_t n, int64_t *sum, int32_t *pmax,
+	int32_t *pmin)
+{
+  int64_t s = *sum;
+  int32_t max = *pmax, min = *pmin;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    s += (int64_t)x[i] * x[i];
+    max = x[i] > max ? x[i] : max;
+    min = x[i] < min ? x[i] : min;
+  }
+  *sum = s;
+  *pmax = max;
+  *pmin = min;
+}
+
+static void
+peak_c(const int32_t *x, size_t n, int32_t *pmax, int32_t *pmin)
+{
+  int32_t max = *pmax, min = *pmin;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    max = x[i] > max ? x[i] : max;
+    min = x[i] < min ? x[i] : min;
+  }
+  *pmax = max;
+  *pmin = min;
+}
+
+/*
+ * A product truncates to more than max if it's max + 1 or more, and
+ * to less than min if it's min - 1 or less.  Clamping it before it's
+ * truncated gives the same sample, and can't overflow.
+ */
+static __inline__ int32_t
+gain_one(int32_t sample, double gain, double hi, double lo, int32_t max,
+	 int32_t min, unsigned long *pnclippings)
+{
+  double x = sample * gain;
+
+  if (x >= hi) {
+    (*pnclippings)++;
+    return max;
+  }
+  if (x <= lo) {
+    (*pnclippings)++;
+    return min;
+  }
+  return (int32_t)x;
+}
+
+static unsigned long
+gain_c(int32_t *x, size_t n, double gain, int32_t min, int32_t max)
+{
+  double hi = max + 1.0, lo = min - 1.0;
+  unsigned long nclippings = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    x[i] = gain_one(x[i], gain, hi, lo, max, min, &nclippings);
+  return nclippings;
+}
+
+static __inline__ double
+tanh_c(double x)
+{
+  double t = fabs(x), k, r, p;
+  uint64_t bits;
+  int i;
+
+  if (t > TANH_ONE)
+    t = TANH_ONE;
+  t *= 2;
+  k = (int)(t * INV_LN2 + 0.5);  /* floor(), since t >= 0 */
+  r = (t - k * LN2_HI) - k * LN2_LO;
+  p = exp_coef[0];
+  for (i = 1; i < 12; i++)
+    p = p * r + exp_coef[i];
+
+  /* 2^k, built from its bits as the SIMD versions do */
+  bits = (uint64_t)(k + 1023) << 52;
+  memcpy(&k, &bits, sizeof(k));
+  t = 1.0 - 2.0 / (p * k + 1.0);
+  return x < 0 ? -t : t;
+}
+
+static void
+soft_clip_c(double *x, size_t n, double full_scale)
+{
+  double inv = 1.0 / full_scale;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    x[i] = full_scale * tanh_c(x[i] * inv);
+}
+
+static void
+to_float_c(const int32_t *x, size_t n, float scale, float *out)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = x[i] * scale;
+}
+
+/*
+ * The two biquads of the K-weighting filter, in direct form I, on one
+ * channel.  The second biquad's input is the first one's output, so
+ * the state is the last two of each of the input, the first output
+ * and the second.  Each output only waits on the one before it for a
+ * multiply and a subtract, the last things done.  The SIMD versions
+ * do the same arithmetic in the same order, a channel to a lane.
+ */
+static void
+k_weight_one(const double *x, size_t n, const double *coef, double *state,
+	     double *sum)
+{
+  double x1 = state[0], x2 = state[1], y1 = state[2], y2 = state[3];
+  double z1 = state[4], z2 = state[5], acc = *sum, v, y, z;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    v = x[i];
+    y = coef[0] * v + coef[1] * x1 + coef[2] * x2 - coef[4] * y2
+      - coef[3] * y1;
+    z = coef[5] * y + coef[6] * y1 + coef[7] * y2 - coef[9] * z2
+      - coef[8] * z1;
+    acc += z * z;
+    x2 = x1;
+    x1 = v;
+    y2 = y1;
+    y1 = y;
+    z2 = z1;
+    z1 = z;
+  }
+  state[0] = x1;
+  state[1] = x2;
+  state[2] = y1;
+  state[3] = y2;
+  state[4] = z1;
+  state[5] = z2;
+  *sum = acc;
+}
+
+static void
+k_weight_c(const double *x, size_t stride, int channels, size_t n,
+	   const double *coef, double *state, double *sums)
+{
+  int c;
+
+  for (c = 0; c < channels; c++)
+    k_weight_one(x + c * stride, n, coef, state + 6 * c, &sums[c]);
+}
+
+/*
+ * Each phase of the oversampling filter is a sum over its taps, added
+ * up from the oldest sample to the newest.  The SIMD versions do the
+ * same sums for several samples at once, a sample to a lane, so they
+ * come out the same.
+ */
+static float
+true_peak_c(const float *x, size_t n, const float *coef)
+{
+  float peak = 0, y;
+  size_t i;
+  int p, j;
+
+  x -= KERNEL_TRUE_PEAK_TAPS - 1;
+  for (i = 0; i < n; i++) {
+    for (p = 0; p < KERNEL_TRUE_PEAK_PHASES; p++) {
+      y = coef[KERNEL_TRUE_PEAK_TAPS * p] * x[i];
+      for (j = 1; j < KERNEL_TRUE_PEAK_TAPS; j++)
+	y += coef[KERNEL_TRUE_PEAK_TAPS * p + j] * x[i + j];
+      if (y < 0)
+	y = -y;
+      if (y > peak)
+	peak = y;
+    }
+  }
+  return peak;
+}
+
+/*
+ * The spectrum's FFT works in place, on split real and imaginary
+ * arrays, in radix-4 passes, decimating in frequency: a pass takes the
+ * butterflies of points a quarter of the way apart, and twiddles what
+ * comes out, and each pass after that does the same within each
+ * quarter the last one left, until they're down to single points.
+ * If n is an odd power of two, a radix-2 pass over the halves goes
+ * first.  Nothing puts the outputs back in order, since only their
+ * power is wanted; kernels_fft_position() says where each one is.
+ * The SIMD versions do the passes with their points a vector or more
+ * apart a vector at a time, and the last two, on each 16 points, in
+ * registers, adding up the power as they go; the arithmetic is the
+ * same, so they come out the same.
+ */
+
+/* nonzero if n is an odd power of two */
+static int
+fft_odd(size_t n)
+{
+  int odd = 0;
+
+  for (; n > 1; n /= 2)
+    odd = !odd;
+  return odd;
+}
+
+/* the radix-4 pass over n points whose butterflies are q apart, with
+   that pass's twiddles tw */
+static void
+fft_pass_c(float *re, float *im, size_t n, size_t q, const float *tw)
+{
+  const float *w1r = tw, *w1i = tw + q, *w2r = tw + 2 * q;
+  const float *w2i = tw + 3 * q, *w3r = tw + 4 * q, *w3i = tw + 5 * q;
+  float t0r, t0i, t1r, t1i, t2r, t2i, t3r, t3i, yr, yi;
+  float *r0, *r1, *r2, *r3, *i0, *i1, *i2, *i3;
+  size_t g, j;
+
+  for (g = 0; g < n; g += 4 * q) {
+    r0 = re + g; r1 = r0 + q; r2 = r1 + q; r3 = r2 + q;
+    i0 = im + g; i1 = i0 + q; i2 = i1 + q; i3 = i2 + q;
+    for (j = 0; j < q; j++) {
+      t0r = r0[j] + r2[j]; t0i = i0[j] + i2[j];
+      t1r = r0[j] - r2[j]; t1i = i0[j] - i2[j];
+      t2r = r1[j] + r3[j]; t2i = i1[j] + i3[j];
+      t3r = r1[j] - r3[j]; t3i = i1[j] - i3[j];
+      r0[j] = t0r + t2r;
+      i0[j] = t0i + t2i;
+      yr = t1r + t3i;
+      yi = t1i - t3r;
+      r1[j] = yr * w1r[j] - yi * w1i[j];
+      i1[j] = yr * w1i[j] + yi * w1r[j];
+      yr = t0r - t2r;
+      yi = t0i - t2i;
+      r2[j] = yr * w2r[j] - yi * w2i[j];
+      i2[j] = yr * w2i[j] + yi * w2r[j];
+      yr = t1r - t3i;
+      yi = t1i + t3r;
+      r3[j] = yr * w3r[j] - yi * w3i[j];
+      i3[j] = yr * w3i[j] + yi * w3r[j];
+    }
+  }
+}
+
+/* the radix-2 pass over the two halves of n points, with its
+   twiddles tw */
+static void
+fft_radix2_c(float *re, float *im, size_t n, const float *tw)
+{
+  const float *wr = tw, *wi = tw + n / 2;
+  float *r1 = re + n / 2, *i1 = im + n / 2;
+  float yr, yi;
+  size_t j;
+
+  for (j = 0; j < n / 2; j++) {
+    yr = re[j] - r1[j];
+    yi = im[j] - i1[j];
+    re[j] += r1[j];
+    im[j] += i1[j];
+    r1[j] = yr * wr[j] - yi * wi[j];
+    i1[j] = yr * wi[j] + yi * wr[j];
+  }
+}
+
+static void
+fft_c(float *re, float *im, size_t n, const float *tw)
+{
+  size_t span = n;
+
+  if (fft_odd(n)) {
+    fft_radix2_c(re, im, n, tw);
+    tw += n;
+    span /= 2;
+  }
+  for (; span >= 4; span /= 4) {
+    fft_pass_c(re, im, n, span / 4, tw);
+    tw += 6 * (span / 4);
+  }
+}
+
+static void
+spectrum_c(float *re, float *im, size_t n, const float *w, const float *tw,
+	   float *power)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    re[i] *= w[i];
+    im[i] *= w[i];
+  }
+  fft_c(re, im, n, tw);
+  for (i = 0; i < n; i++)
+    power[i] += re[i] * re[i] + im[i] * im[i];
+}
+
+static const struct kernels c_kernels = {
+  "c", KERNEL_ISA_NONE,
+  unpack_c, pack_c, stats_c, peak_c, gain_c, 0, soft_clip_c, k_weight_c,
+  to_float_c, true_peak_c, spectrum_c
+};
+
+
+#if KERNELS_X86
+
+/*
+ * The SIMD versions work on groups of 4, 8 or 16 samples, and leave
+ * whatever is left over to the portable ones.  The converters only
+ * have vector code for the usual layouts, mono and stereo 16 and
+ * 24-bit samples.  The squares are summed exactly, as 64-bit
+ * integers, so the order they're added in doesn't matter.
+ */
+
+/*
+ * SSE2: the 16-bit converters, the sums and the gain.  Everything in
+ * here is SSE2, so the later versions can use these helpers too.
+ */
+
+/* the clip thresholds and limits of a gain, as vectors */
+struct limits_sse {
+  __m128d hi, lo, max, min;
+};
+
+__attribute__((target("sse2")))
+static __inline__ void
+limits_sse2(struct limits_sse *lim, int32_t min, int32_t max)
+{
+  lim->hi = _mm_set1_pd(max + 1.0);
+  lim->lo = _mm_set1_pd(min - 1.0);
+  lim->max = _mm_set1_pd(max);
+  lim->min = _mm_set1_pd(min);
+}
+
+/*
+ * Multiply four 32-bit samples by gain, as gain_one() does, with the
+ * limits in *lim.  Products are clamped before they're converted;
+ * the comparison masks of the ones that clip are all ones, so
+ * subtracting them from the lanes of *pcount counts them.
+ */
+__attribute__((target("sse2")))
+static __inline__ __m128i
+gain_4_sse2(__m128i s, __m128d vgain, const struct limits_sse *lim,
+	    __m128i *pcount)
+{
+  __m128d x0, x1, clip;
+
+  x0 = _mm_mul_pd(_mm_cvtepi32_pd(s), vgain);
+  x1 = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(s, 8)), vgain);
+  clip = _mm_or_pd(_mm_cmpge_pd(x0, lim->hi), _mm_cmple_pd(x0, lim->lo));
+  *pcount = _mm_sub_epi64(*pcount, _mm_castpd_si128(clip));
+  clip = _mm_or_pd(_mm_cmpge_pd(x1, lim->hi), _mm_cmple_pd(x1, lim->lo));
+  *pcount = _mm_sub_epi64(*pcount, _mm_castpd_si128(clip));
+  x0 = _mm_min_pd(_mm_max_pd(x0, lim->min), lim->max);
+  x1 = _mm_min_pd(_mm_max_pd(x1, lim->min), lim->max);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(x0), _mm_cvttpd_epi32(x1));
+}
+
+/* the sum of the two 64-bit lanes of a count or a sum of squares */
+__attribute__((target("sse2")))
+static __inline__ int64_t
+lane_sum_sse2(__m128i v)
+{
+  int64_t lanes[2];
+
+  _mm_storeu_si128((__m128i *)lanes, v);
+  return lanes[0] + lanes[1];
+}
+
+/* fold the lanes of vmax and vmin into *pmax and *pmin */
+__attribute__((target("sse2")))
+static __inline__ void
+extremes_sse2(__m128i vmax, __m128i vmin, int32_t *pmax, int32_t *pmin)
+{
+  int32_t m[4];
+  int j;
+
+  _mm_storeu_si128((__m128i *)m, vmax);
+  for (j = 0; j < 4; j++)
+    if (m[j] > *pmax)
+      *pmax = m[j];
+  _mm_storeu_si128((__m128i *)m, vmin);
+  for (j = 0; j < 4; j++)
+    if (m[j] < *pmin)
+      *pmin = m[j];
+}
+
+/*
+ * 16-bit samples are sign-extended into 32-bit lanes by unpacking
+ * each with itself and shifting down.  A stereo frame is a 32-bit
+ * lane already, with the left sample in its low half.
+ */
+__attribute__((target("sse2")))
+static void
+unpack_sse2(const unsigned char *in, int bytes_per_sample, int channels,
+	    size_t nframes, int32_t *planes, size_t stride)
+{
+  int32_t *l = planes, *r = planes + stride;
+  __m128i s;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8) {
+      s = _mm_loadu_si128((const __m128i *)(in + i * 2));
+      _mm_storeu_si128((__m128i *)(l + i),
+		       _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+      _mm_storeu_si128((__m128i *)(l + i + 4),
+		       _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    }
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 4 <= nframes; i += 4) {
+      s = _mm_loadu_si128((const __m128i *)(in + i * 4));
+      _mm_storeu_si128((__m128i *)(l + i),
+		       _mm_srai_epi32(_mm_slli_epi32(s, 16), 16));
+      _mm_storeu_si128((__m128i *)(r + i), _mm_srai_epi32(s, 16));
+    }
+  }
+  unpack_c(in + i * channels * bytes_per_sample, bytes_per_sample,
+	   channels, nframes - i, planes + i, stride);
+}
+
+/* the samples are in range, so packing them with saturation is exact */
+__attribute__((target("sse2")))
+static void
+pack_sse2(const int32_t *planes, size_t stride, int bytes_per_sample,
+	  int channels, size_t nframes, unsigned char *out)
+{
+  const int32_t *l = planes, *r = planes + stride;
+  const __m128i low = _mm_set1_epi32(0xFFFF);
+  __m128i a, b;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8) {
+      a = _mm_loadu_si128((const __m128i *)(l + i));
+      b = _mm_loadu_si128((const __m128i *)(l + i + 4));
+      _mm_storeu_si128((__m128i *)(out + i * 2), _mm_packs_epi32(a, b));
+    }
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 4 <= nframes; i += 4) {
+      a = _mm_loadu_si128((const __m128i *)(l + i));
+      b = _mm_loadu_si128((const __m128i *)(r + i));
+      _mm_storeu_si128((__m128i *)(out + i * 4),
+		       _mm_or_si128(_mm_and_si128(a, low),
+				    _mm_slli_epi32(b, 16)));
+    }
+  }
+  pack_c(planes + i, stride, bytes_per_sample, channels, nframes - i,
+	 out + i * channels * bytes_per_sample);
+}
+
+/* SSE2 has no 32-bit max, min, absolute value or signed multiply */
+__attribute__((target("sse2")))
+static void
+stats_sse2(const int32_t *x, size_t n, int64_t *sum, int32_t *pmax,
+	   int32_t *pmin)
+{
+  __m128i s, a, sign, gt, vmax, vmin, acc = _mm_setzero_si128();
+  size_t i;
+
+  vmax = _mm_set1_epi32(*pmax);
+  vmin = _mm_set1_epi32(*pmin);
+  for (i = 0; i + 4 <= n; i += 4) {
+    s = _mm_loadu_si128((const __m128i *)(x + i));
+    gt = _mm_cmpgt_epi32(s, vmax);
+    vmax = _mm_or_si128(_mm_and_si128(gt, s), _mm_andnot_si128(gt, vmax));
+    gt = _mm_cmpgt_epi32(vmin, s);
+    vmin = _mm_or_si128(_mm_and_si128(gt, s), _mm_andnot_si128(gt, vmin));
+    sign = _mm_srai_epi32(s, 31);
+    a = _mm_sub_epi32(_mm_xor_si128(s, sign), sign);
+    acc = _mm_add_epi64(acc, _mm_mul_epu32(a, a));
+    a = _mm_srli_epi64(a, 32);
+    acc = _mm_add_epi64(acc, _mm_mul_epu32(a, a));
+  }
+
+  *sum += lane_sum_sse2(acc);
+  extremes_sse2(vmax, vmin, pmax, pmin);
+  stats_c(x + i, n - i, sum, pmax, pmin);
+}
+
+/* two of each extreme, so the compares don't wait on each other */
+__attribute__((target("sse2")))
+static void
+peak_sse2(const int32_t *x, size_t n, int32_t *pmax, int32_t *pmin)
+{
+  __m128i s, t, gt, vmax0, vmax1, vmin0, vmin1;
+  size_t i;
+
+  vmax0 = vmax1 = _mm_set1_epi32(*pmax);
+  vmin0 = vmin1 = _mm_set1_epi32(*pmin);
+  for (i = 0; i + 8 <= n; i += 8) {
+    s = _mm_loadu_si128((const __m128i *)(x + i));
+    t = _mm_loadu_si128((const __m128i *)(x + i + 4));
+    gt = _mm_cmpgt_epi32(s, vmax0);
+    vmax0 = _mm_or_si128(_mm_and_si128(gt, s), _mm_andnot_si128(gt, vmax0));
+    gt = _mm_cmpgt_epi32(t, vmax1);
+    vmax1 = _mm_or_si128(_mm_and_si128(gt, t), _mm_andnot_si128(gt, vmax1));
+    gt = _mm_cmpgt_epi32(vmin0, s);
+    vmin0 = _mm_or_si128(_mm_and_si128(gt, s), _mm_andnot_si128(gt, vmin0));
+    gt = _mm_cmpgt_epi32(vmin1, t);
+    vmin1 = _mm_or_si128(_mm_and_si128(gt, t), _mm_andnot_si128(gt, vmin1));
+  }
+
+  extremes_sse2(vmax0, vmin0, pmax, pmin);
+  extremes_sse2(vmax1, vmin1, pmax, pmin);
+  peak_c(x + i, n - i, pmax, pmin);
+}
+
+__attribute__((target("sse2")))
+static unsigned long
+gain_sse2(int32_t *x, size_t n, double gain, int32_t min, int32_t max)
+{
+  const __m128d vgain = _mm_set1_pd(gain);
+  struct limits_sse lim;
+  __m128i count = _mm_setzero_si128(), s;
+  size_t i;
+
+  limits_sse2(&lim, min, max);
+  for (i = 0; i + 4 <= n; i += 4) {
+    s = _mm_loadu_si128((const __m128i *)(x + i));
+    _mm_storeu_si128((__m128i *)(x + i),
+		     gain_4_sse2(s, vgain, &lim, &count));
+  }
+  return (unsigned long)lane_sum_sse2(count)
+    + gain_c(x + i, n - i, gain, min, max);
+}
+
+/*
+ * k_weight_one() on two channels at once, one to a lane.  The filter
+ * feeds back on itself from sample to sample, so the channels are all
+ * there is to do side by side; an odd one out is left to the portable
+ * version.
+ */
+__attribute__((target("sse2")))
+static void
+k_weight_sse2(const double *x, size_t stride, int channels, size_t n,
+	      const double *coef, double *state, double *sums)
+{
+  __m128d b[10], s[6], acc, v, y, z;
+  const double *x0, *x1;
+  double *st;
+  size_t i;
+  int c, j;
+
+  for (j = 0; j < 10; j++)
+    b[j] = _mm_set1_pd(coef[j]);
+  for (c = 0; c + 2 <= channels; c += 2) {
+    x0 = x + c * stride;
+    x1 = x0 + stride;
+    st = state + 6 * c;
+    for (j = 0; j < 6; j++)
+      s[j] = _mm_setr_pd(st[j], st[6 + j]);
+    acc = _mm_setr_pd(sums[c], sums[c + 1]);
+    for (i = 0; i < n; i++) {
+      v = _mm_setr_pd(x0[i], x1[i]);
+      y = _mm_add_pd(_mm_mul_pd(b[0], v), _mm_mul_pd(b[1], s[0]));
+      y = _mm_add_pd(y, _mm_mul_pd(b[2], s[1]));
+      y = _mm_sub_pd(y, _mm_mul_pd(b[4], s[3]));
+      y = _mm_sub_pd(y, _mm_mul_pd(b[3], s[2]));
+      z = _mm_add_pd(_mm_mul_pd(b[5], y), _mm_mul_pd(b[6], s[2]));
+      z = _mm_add_pd(z, _mm_mul_pd(b[7], s[3]));
+      z = _mm_sub_pd(z, _mm_mul_pd(b[9], s[5]));
+      z = _mm_sub_pd(z, _mm_mul_pd(b[8], s[4]));
+      acc = _mm_add_pd(acc, _mm_mul_pd(z, z));
+      s[1] = s[0];
+      s[0] = v;
+      s[3] = s[2];
+      s[2] = y;
+      s[5] = s[4];
+      s[4] = z;
+    }
+    for (j = 0; j < 6; j++) {
+      _mm_storel_pd(st + j, s[j]);
+      _mm_storeh_pd(st + 6 + j, s[j]);
+    }
+    _mm_storel_pd(sums + c, acc);
+    _mm_storeh_pd(sums + c + 1, acc);
+  }
+  k_weight_c(x + c * stride, stride, channels - c, n, coef, state + 6 * c,
+	     sums + c);
+}
+
+__attribute__((target("sse2")))
+static void
+to_float_sse2(const int32_t *x, size_t n, float scale, float *out)
+{
+  __m128 vscale = _mm_set1_ps(scale);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(
+      _mm_loadu_si128((const __m128i *)(x + i))), vscale));
+  to_float_c(x + i, n - i, scale, out + i);
+}
+
+/* true_peak_c() on four samples at once, one to a lane */
+__attribute__((target("sse2")))
+static float
+true_peak_sse2(const float *x, size_t n, const float *coef)
+{
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 b[KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES];
+  __m128 y0, y1, y2, y3, v, m = _mm_setzero_ps();
+  const __m128 *b1 = b + KERNEL_TRUE_PEAK_TAPS;
+  const __m128 *b2 = b1 + KERNEL_TRUE_PEAK_TAPS;
+  const __m128 *b3 = b2 + KERNEL_TRUE_PEAK_TAPS;
+  float lanes[4], peak;
+  size_t i;
+  int j;
+
+  for (j = 0; j < KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES; j++)
+    b[j] = _mm_set1_ps(coef[j]);
+  x -= KERNEL_TRUE_PEAK_TAPS - 1;
+  for (i = 0; i + 4 <= n; i += 4) {
+    v = _mm_loadu_ps(x + i);
+    y0 = _mm_mul_ps(b[0], v);
+    y1 = _mm_mul_ps(b1[0], v);
+    y2 = _mm_mul_ps(b2[0], v);
+    y3 = _mm_mul_ps(b3[0], v);
+    for (j = 1; j < KERNEL_TRUE_PEAK_TAPS; j++) {
+      v = _mm_loadu_ps(x + i + j);
+      y0 = _mm_add_ps(y0, _mm_mul_ps(b[j], v));
+      y1 = _mm_add_ps(y1, _mm_mul_ps(b1[j], v));
+      y2 = _mm_add_ps(y2, _mm_mul_ps(b2[j], v));
+      y3 = _mm_add_ps(y3, _mm_mul_ps(b3[j], v));
+    }
+    m = _mm_max_ps(m, _mm_max_ps(_mm_andnot_ps(sign, y0),
+				 _mm_andnot_ps(sign, y1)));
+    m = _mm_max_ps(m, _mm_max_ps(_mm_andnot_ps(sign, y2),
+				 _mm_andnot_ps(sign, y3)));
+  }
+  _mm_storeu_ps(lanes, m);
+  peak = true_peak_c(x + i + KERNEL_TRUE_PEAK_TAPS - 1, n - i, coef);
+  for (j = 0; j < 4; j++)
+    if (lanes[j] > peak)
+      peak = lanes[j];
+  return peak;
+}
+
+/* the radix-4 butterfly of fft_pass_c() on a, b, c and d, without
+   its twiddles, a butterfly to a lane */
+__attribute__((target("sse2")))
+static __inline__ void
+fft_4_sse2(__m128 *ar, __m128 *ai, __m128 *br, __m128 *bi, __m128 *cr,
+	   __m128 *ci, __m128 *dr, __m128 *di)
+{
+  __m128 t0r = _mm_add_ps(*ar, *cr), t0i = _mm_add_ps(*ai, *ci);
+  __m128 t1r = _mm_sub_ps(*ar, *cr), t1i = _mm_sub_ps(*ai, *ci);
+  __m128 t2r = _mm_add_ps(*br, *dr), t2i = _mm_add_ps(*bi, *di);
+  __m128 t3r = _mm_sub_ps(*br, *dr), t3i = _mm_sub_ps(*bi, *di);
+
+  *ar = _mm_add_ps(t0r, t2r);
+  *ai = _mm_add_ps(t0i, t2i);
+  *br = _mm_add_ps(t1r, t3i);
+  *bi = _mm_sub_ps(t1i, t3r);
+  *cr = _mm_sub_ps(t0r, t2r);
+  *ci = _mm_sub_ps(t0i, t2i);
+  *dr = _mm_sub_ps(t1r, t3i);
+  *di = _mm_add_ps(t1i, t3r);
+}
+
+/* x times the twiddle w */
+__attribute__((target("sse2")))
+static __inline__ void
+fft_twiddle_sse2(__m128 *xr, __m128 *xi, __m128 wr, __m128 wi)
+{
+  __m128 r = _mm_sub_ps(_mm_mul_ps(*xr, wr), _mm_mul_ps(*xi, wi));
+
+  *xi = _mm_add_ps(_mm_mul_ps(*xr, wi), _mm_mul_ps(*xi, wr));
+  *xr = r;
+}
+
+/* fft_radix2_c(), four points at a time */
+__attribute__((target("sse2")))
+static void
+fft_radix2_sse2(float *re, float *im, size_t n, const float *tw)
+{
+  const float *wr = tw, *wi = tw + n / 2;
+  float *r1 = re + n / 2, *i1 = im + n / 2;
+  __m128 ar, ai, br, bi;
+  size_t j;
+
+  for (j = 0; j < n / 2; j += 4) {
+    ar = _mm_loadu_ps(re + j);
+    ai = _mm_loadu_ps(im + j);
+    br = _mm_loadu_ps(r1 + j);
+    bi = _mm_loadu_ps(i1 + j);
+    _mm_storeu_ps(re + j, _mm_add_ps(ar, br));
+    _mm_storeu_ps(im + j, _mm_add_ps(ai, bi));
+    ar = _mm_sub_ps(ar, br);
+    ai = _mm_sub_ps(ai, bi);
+    fft_twiddle_sse2(&ar, &ai, _mm_loadu_ps(wr + j), _mm_loadu_ps(wi + j));
+    _mm_storeu_ps(r1 + j, ar);
+    _mm_storeu_ps(i1 + j, ai);
+  }
+}
+
+/* fft_pass_c() four points at a time, with q a multiple of 4 */
+__attribute__((target("sse2")))
+static void
+fft_pass_sse2(float *re, float *im, size_t n, size_t q, const float *tw)
+{
+  const float *w1r = tw, *w1i = tw + q, *w2r = tw + 2 * q;
+  const float *w2i = tw + 3 * q, *w3r = tw + 4 * q, *w3i = tw + 5 * q;
+  __m128 ar, ai, br, bi, cr, ci, dr, di;
+  float *r0, *r1, *r2, *r3, *i0, *i1, *i2, *i3;
+  size_t g, j;
+
+  for (g = 0; g < n; g += 4 * q) {
+    r0 = re + g; r1 = r0 + q; r2 = r1 + q; r3 = r2 + q;
+    i0 = im + g; i1 = i0 + q; i2 = i1 + q; i3 = i2 + q;
+    for (j = 0; j < q; j += 4) {
+      ar = _mm_loadu_ps(r0 + j); ai = _mm_loadu_ps(i0 + j);
+      br = _mm_loadu_ps(r1 + j); bi = _mm_loadu_ps(i1 + j);
+      cr = _mm_loadu_ps(r2 + j); ci = _mm_loadu_ps(i2 + j);
+      dr = _mm_loadu_ps(r3 + j); di = _mm_loadu_ps(i3 + j);
+      fft_4_sse2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+      fft_twiddle_sse2(&br, &bi, _mm_loadu_ps(w1r + j), _mm_loadu_ps(w1i + j));
+      fft_twiddle_sse2(&cr, &ci, _mm_loadu_ps(w2r + j), _mm_loadu_ps(w2i + j));
+      fft_twiddle_sse2(&dr, &di, _mm_loadu_ps(w3r + j), _mm_loadu_ps(w3i + j));
+      _mm_storeu_ps(r0 + j, ar); _mm_storeu_ps(i0 + j, ai);
+      _mm_storeu_ps(r1 + j, br); _mm_storeu_ps(i1 + j, bi);
+      _mm_storeu_ps(r2 + j, cr); _mm_storeu_ps(i2 + j, ci);
+      _mm_storeu_ps(r3 + j, dr); _mm_storeu_ps(i3 + j, di);
+    }
+  }
+}
+
+/* add the power of the four points in r and i to p[0 .. 3] */
+__attribute__((target("sse2")))
+static __inline__ void
+power_sse2(float *p, __m128 r, __m128 i)
+{
+  _mm_storeu_ps(p, _mm_add_ps(_mm_loadu_ps(p),
+			      _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i))));
+}
+
+/* the last two passes of fft_c(), on 16 points at a time in
+   registers: the one with its butterflies four apart, then, with the
+   points transposed so each lane has a butterfly, the one with them
+   next to each other, whose twiddles are all 1; and instead of
+   storing what comes out, add its power to power[] */
+__attribute__((target("sse2")))
+static void
+fft_16_sse2(const float *re, const float *im, size_t n, const float *tw,
+	    float *power)
+{
+  const __m128 w1r = _mm_loadu_ps(tw), w1i = _mm_loadu_ps(tw + 4);
+  const __m128 w2r = _mm_loadu_ps(tw + 8), w2i = _mm_loadu_ps(tw + 12);
+  const __m128 w3r = _mm_loadu_ps(tw + 16), w3i = _mm_loadu_ps(tw + 20);
+  __m128 ar, ai, br, bi, cr, ci, dr, di;
+  size_t g;
+
+  for (g = 0; g < n; g += 16) {
+    ar = _mm_loadu_ps(re + g); ai = _mm_loadu_ps(im + g);
+    br = _mm_loadu_ps(re + g + 4); bi = _mm_loadu_ps(im + g + 4);
+    cr = _mm_loadu_ps(re + g + 8); ci = _mm_loadu_ps(im + g + 8);
+    dr = _mm_loadu_ps(re + g + 12); di = _mm_loadu_ps(im + g + 12);
+    fft_4_sse2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+    fft_twiddle_sse2(&br, &bi, w1r, w1i);
+    fft_twiddle_sse2(&cr, &ci, w2r, w2i);
+    fft_twiddle_sse2(&dr, &di, w3r, w3i);
+    _MM_TRANSPOSE4_PS(ar, br, cr, dr);
+    _MM_TRANSPOSE4_PS(ai, bi, ci, di);
+    fft_4_sse2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+    _MM_TRANSPOSE4_PS(ar, br, cr, dr);
+    _MM_TRANSPOSE4_PS(ai, bi, ci, di);
+    power_sse2(power + g, ar, ai);
+    power_sse2(power + g + 4, br, bi);
+    power_sse2(power + g + 8, cr, ci);
+    power_sse2(power + g + 12, dr, di);
+  }
+}
+
+__attribute__((target("sse2")))
+static void
+spectrum_sse2(float *re, float *im, size_t n, const float *w,
+	      const float *tw, float *power)
+{
+  size_t span = n, i;
+  __m128 v;
+
+  for (i = 0; i < n; i += 4) {
+    v = _mm_loadu_ps(w + i);
+    _mm_storeu_ps(re + i, _mm_mul_ps(_mm_loadu_ps(re + i), v));
+    _mm_storeu_ps(im + i, _mm_mul_ps(_mm_loadu_ps(im + i), v));
+  }
+  if (fft_odd(n)) {
+    fft_radix2_sse2(re, im, n, tw);
+    tw += n;
+    span /= 2;
+  }
+  for (; span > 16; span /= 4) {
+    fft_pass_sse2(re, im, n, span / 4, tw);
+    tw += 6 * (span / 4);
+  }
+  fft_16_sse2(re, im, n, tw, power);
+}
+
+static const struct kernels sse2_kernels = {
+  "sse2", KERNEL_ISA_SSE2,
+  unpack_sse2, pack_sse2, stats_sse2, peak_sse2, gain_sse2, 0,
+  soft_clip_c, k_weight_sse2, to_float_sse2, true_peak_sse2, spectrum_sse2
+};
+
+/*
+ * SSSE3: the 24-bit converters.  Four samples come from a 16-byte
+ * load, with the three bytes of each shuffled to the top of a 32-bit
+ * lane and shifted down to sign-extend them; eight come from two
+ * overlapping loads that cover exactly the 24 bytes of the group.
+ * They go back with three stores that cover exactly the same bytes.
+ */
+
+__attribute__((target("ssse3")))
+static __inline__ void
+load_s24_ssse3(const unsigned char *p, __m128i *lo, __m128i *hi)
+{
+  const __m128i unpack_lo = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+					  -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m128i unpack_hi = _mm_setr_epi8(-1, 4, 5, 6, -1, 7, 8, 9,
+					  -1, 10, 11, 12, -1, 13, 14, 15);
+
+  *lo = _mm_srai_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p),
+					unpack_lo), 8);
+  *hi = _mm_srai_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+							(p + 8)),
+					unpack_hi), 8);
+}
+
+__attribute__((target("ssse3")))
+static __inline__ void
+store_s24_ssse3(unsigned char *p, __m128i lo, __m128i hi)
+{
+  const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+				     10, 12, 13, 14, -1, -1, -1, -1);
+  int32_t last;
+
+  /* the first store's four junk bytes are overwritten by the second */
+  hi = _mm_shuffle_epi8(hi, pack);
+  _mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(lo, pack));
+  _mm_storel_epi64((__m128i *)(p + 12), hi);
+  last = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+  memcpy(p + 20, &last, 4);
+}
+
+/* stereo frames are dealt out by gathering each half's left samples
+   into its low 64 bits, and its right ones into its high 64 bits */
+__attribute__((target("ssse3")))
+static void
+unpack_ssse3(const unsigned char *in, int bytes_per_sample, int channels,
+	     size_t nframes, int32_t *planes, size_t stride)
+{
+  int32_t *l = planes, *r = planes + stride;
+  __m128i lo, hi;
+  size_t i = 0;
+
+  if (bytes_per_sample == 3 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8) {
+      load_s24_ssse3(in + i * 3, &lo, &hi);
+      _mm_storeu_si128((__m128i *)(l + i), lo);
+      _mm_storeu_si128((__m128i *)(l + i + 4), hi);
+    }
+  } else if (bytes_per_sample == 3 && channels == 2) {
+    for (; i + 4 <= nframes; i += 4) {
+      load_s24_ssse3(in + i * 6, &lo, &hi);
+      lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+      hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+      _mm_storeu_si128((__m128i *)(l + i), _mm_unpacklo_epi64(lo, hi));
+      _mm_storeu_si128((__m128i *)(r + i), _mm_unpackhi_epi64(lo, hi));
+    }
+  } else {
+    unpack_sse2(in, bytes_per_sample, channels, nframes, planes, stride);
+    return;
+  }
+  unpack_c(in + i * channels * bytes_per_sample, bytes_per_sample,
+	   channels, nframes - i, planes + i, stride);
+}
+
+__attribute__((target("ssse3")))
+static void
+pack_ssse3(const int32_t *planes, size_t stride, int bytes_per_sample,
+	   int channels, size_t nframes, unsigned char *out)
+{
+  const int32_t *l = planes, *r = planes + stride;
+  __m128i a, b;
+  size_t i = 0;
+
+  if (bytes_per_sample == 3 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8)
+      store_s24_ssse3(out + i * 3,
+		      _mm_loadu_si128((const __m128i *)(l + i)),
+		      _mm_loadu_si128((const __m128i *)(l + i + 4)));
+  } else if (bytes_per_sample == 3 && channels == 2) {
+    for (; i + 4 <= nframes; i += 4) {
+      a = _mm_loadu_si128((const __m128i *)(l + i));
+      b = _mm_loadu_si128((const __m128i *)(r + i));
+      store_s24_ssse3(out + i * 6, _mm_unpacklo_epi32(a, b),
+		      _mm_unpackhi_epi32(a, b));
+    }
+  } else {
+    pack_sse2(planes, stride, bytes_per_sample, channels, nframes, out);
+    return;
+  }
+  pack_c(planes + i, stride, bytes_per_sample, channels, nframes - i,
+	 out + i * channels * bytes_per_sample);
+}
+
+static const struct kernels ssse3_kernels = {
+  "ssse3", KERNEL_ISA_SSSE3,
+  unpack_ssse3, pack_ssse3, stats_sse2, peak_sse2, gain_sse2, 0,
+  soft_clip_c, k_weight_sse2, to_float_sse2, true_peak_sse2, spectrum_sse2
+};
+
+/*
+ * AVX2: eight samples at a time, and the 16-bit converters do sixteen.
+ */
+
+__attribute__((target("avx2")))
+static __inline__ __m256i
+load_s24_avx2(const unsigned char *p)
+{
+  __m128i lo, hi;
+
+  load_s24_ssse3(p, &lo, &hi);
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+/* stereo 24-bit frames are dealt out within each load, and then the
+   halves of two loads are put together */
+__attribute__((target("avx2")))
+static void
+unpack_avx2(const unsigned char *in, int bytes_per_sample, int channels,
+	    size_t nframes, int32_t *planes, size_t stride)
+{
+  const __m256i deal = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  int32_t *l = planes, *r = planes + stride;
+  __m256i a, b;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8)
+      _mm256_storeu_si256((__m256i *)(l + i),
+			  _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)
+								(in + i * 2))));
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 8 <= nframes; i += 8) {
+      a = _mm256_loadu_si256((const __m256i *)(in + i * 4));
+      _mm256_storeu_si256((__m256i *)(l + i),
+			  _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16));
+      _mm256_storeu_si256((__m256i *)(r + i), _mm256_srai_epi32(a, 16));
+    }
+  } else if (bytes_per_sample == 3 && channels == 1) {
+    for (; i + 8 <= nframes; i += 8)
+      _mm256_storeu_si256((__m256i *)(l + i), load_s24_avx2(in + i * 3));
+  } else if (bytes_per_sample == 3 && channels == 2) {
+    for (; i + 8 <= nframes; i += 8) {
+      a = _mm256_permutevar8x32_epi32(load_s24_avx2(in + i * 6), deal);
+      b = _mm256_permutevar8x32_epi32(load_s24_avx2(in + i * 6 + 24), deal);
+      _mm256_storeu_si256((__m256i *)(l + i),
+			  _mm256_permute2x128_si256(a, b, 0x20));
+      _mm256_storeu_si256((__m256i *)(r + i),
+			  _mm256_permute2x128_si256(a, b, 0x31));
+    }
+  }
+  unpack_c(in + i * channels * bytes_per_sample, bytes_per_sample,
+	   channels, nframes - i, planes + i, stride);
+}
+
+/* packing with saturation works within each half, so the quarters
+   are put back in order after */
+__attribute__((target("avx2")))
+static void
+pack_avx2(const int32_t *planes, size_t stride, int bytes_per_sample,
+	  int channels, size_t nframes, unsigned char *out)
+{
+  const int32_t *l = planes, *r = planes + stride;
+  const __m256i low = _mm256_set1_epi32(0xFFFF);
+  __m256i a, b;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 16 <= nframes; i += 16) {
+      a = _mm256_loadu_si256((const __m256i *)(l + i));
+      b = _mm256_loadu_si256((const __m256i *)(l + i + 8));
+      _mm256_storeu_si256((__m256i *)(out + i * 2),
+			  _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+						   _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 8 <= nframes; i += 8) {
+      a = _mm256_loadu_si256((const __m256i *)(l + i));
+      b = _mm256_loadu_si256((const __m256i *)(r + i));
+      _mm256_storeu_si256((__m256i *)(out + i * 4),
+			  _mm256_or_si256(_mm256_and_si256(a, low),
+					  _mm256_slli_epi32(b, 16)));
+    }
+  } else {
+    pack_ssse3(planes, stride, bytes_per_sample, channels, nframes, out);
+    return;
+  }
+  pack_c(planes + i, stride, bytes_per_sample, channels, nframes - i,
+	 out + i * channels * bytes_per_sample);
+}
+
+__attribute__((target("avx2")))
+static __inline__ int64_t
+lane_sum_avx2(__m256i v)
+{
+  return lane_sum_sse2(_mm_add_epi64(_mm256_castsi256_si128(v),
+				     _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static void
+stats_avx2(const int32_t *x, size_t n, int64_t *sum, int32_t *pmax,
+	   int32_t *pmin)
+{
+  __m256i s, vmax, vmin, acc = _mm256_setzero_si256();
+  size_t i;
+
+  vmax = _mm256_set1_epi32(*pmax);
+  vmin = _mm256_set1_epi32(*pmin);
+  for (i = 0; i + 8 <= n; i += 8) {
+    s = _mm256_loadu_si256((const __m256i *)(x + i));
+    vmax = _mm256_max_epi32(vmax, s);
+    vmin = _mm256_min_epi32(vmin, s);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(s, s));
+    s = _mm256_srli_epi64(s, 32);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(s, s));
+  }
+
+  *sum += lane_sum_avx2(acc);
+  extremes_sse2(_mm_max_epi32(_mm256_castsi256_si128(vmax),
+			      _mm256_extracti128_si256(vmax, 1)),
+		_mm_min_epi32(_mm256_castsi256_si128(vmin),
+			      _mm256_extracti128_si256(vmin, 1)),
+		pmax, pmin);
+  stats_c(x + i, n - i, sum, pmax, pmin);
+}
+
+__attribute__((target("avx2")))
+static void
+peak_avx2(const int32_t *x, size_t n, int32_t *pmax, int32_t *pmin)
+{
+  __m256i s, t, vmax0, vmax1, vmin0, vmin1;
+  size_t i;
+
+  vmax0 = vmax1 = _mm256_set1_epi32(*pmax);
+  vmin0 = vmin1 = _mm256_set1_epi32(*pmin);
+  for (i = 0; i + 16 <= n; i += 16) {
+    s = _mm256_loadu_si256((const __m256i *)(x + i));
+    t = _mm256_loadu_si256((const __m256i *)(x + i + 8));
+    vmax0 = _mm256_max_epi32(vmax0, s);
+    vmax1 = _mm256_max_epi32(vmax1, t);
+    vmin0 = _mm256_min_epi32(vmin0, s);
+    vmin1 = _mm256_min_epi32(vmin1, t);
+  }
+
+  vmax0 = _mm256_max_epi32(vmax0, vmax1);
+  vmin0 = _mm256_min_epi32(vmin0, vmin1);
+  extremes_sse2(_mm_max_epi32(_mm256_castsi256_si128(vmax0),
+			      _mm256_extracti128_si256(vmax0, 1)),
+		_mm_min_epi32(_mm256_castsi256_si128(vmin0),
+			      _mm256_extracti128_si256(vmin0, 1)),
+		pmax, pmin);
+  peak_c(x + i, n - i, pmax, pmin);
+}
+
+struct limits_avx {
+  __m256d hi, lo, max, min;
+};
+
+/* four 32-bit samples times gain, as gain_4_sse2() does */
+__attribute__((target("avx2")))
+static __inline__ __m128i
+gain_4_avx2(__m128i s, __m256d vgain, const struct limits_avx *lim,
+	    __m256i *pcount)
+{
+  __m256d x, clip;
+
+  x = _mm256_mul_pd(_mm256_cvtepi32_pd(s), vgain);
+  clip = _mm256_or_pd(_mm256_cmp_pd(x, lim->hi, _CMP_GE_OQ),
+		      _mm256_cmp_pd(x, lim->lo, _CMP_LE_OQ));
+  *pcount = _mm256_sub_epi64(*pcount, _mm256_castpd_si256(clip));
+  x = _mm256_min_pd(_mm256_max_pd(x, lim->min), lim->max);
+  return _mm256_cvttpd_epi32(x);
+}
+
+__attribute__((target("avx2")))
+static unsigned long
+gain_avx2(int32_t *x, size_t n, double gain, int32_t min, int32_t max)
+{
+  const __m256d vgain = _mm256_set1_pd(gain);
+  struct limits_avx lim;
+  __m256i count = _mm256_setzero_si256(), s;
+  __m128i r0, r1;
+  size_t i;
+
+  lim.hi = _mm256_set1_pd(max + 1.0);
+  lim.lo = _mm256_set1_pd(min - 1.0);
+  lim.max = _mm256_set1_pd(max);
+  lim.min = _mm256_set1_pd(min);
+  for (i = 0; i + 8 <= n; i += 8) {
+    s = _mm256_loadu_si256((const __m256i *)(x + i));
+    r0 = gain_4_avx2(_mm256_castsi256_si128(s), vgain, &lim, &count);
+    r1 = gain_4_avx2(_mm256_extracti128_si256(s, 1), vgain, &lim, &count);
+    _mm256_storeu_si256((__m256i *)(x + i),
+			_mm256_inserti128_si256(_mm256_castsi128_si256(r0),
+						r1, 1));
+  }
+  return (unsigned long)lane_sum_avx2(count)
+    + gain_c(x + i, n - i, gain, min, max);
+}
+
+/*
+ * tanh_c() on four doubles, step for step, so the results are the
+ * same.  2^k is made by adding k to the exponent bias in the low bits
+ * of a double's mantissa and shifting them up into its exponent.
+ */
+__attribute__((target("avx2")))
+static void
+soft_clip_avx2(double *x, size_t n, double full_scale)
+{
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d bias = _mm256_set1_pd(4503599627370496.0 + 1023);
+  const __m256d vscale = _mm256_set1_pd(full_scale);
+  const __m256d vinv = _mm256_set1_pd(1.0 / full_scale);
+  __m256d v, s, t, k, r, p, e;
+  size_t i;
+  int j;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    v = _mm256_mul_pd(_mm256_loadu_pd(x + i), vinv);
+    s = _mm256_and_pd(v, sign);
+    t = _mm256_andnot_pd(sign, v);
+    t = _mm256_min_pd(t, _mm256_set1_pd(TANH_ONE));
+    t = _mm256_mul_pd(t, two);
+    k = _mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(t,
+				      _mm256_set1_pd(INV_LN2)), half));
+    r = _mm256_sub_pd(_mm256_sub_pd(t, _mm256_mul_pd(k,
+				    _mm256_set1_pd(LN2_HI))),
+		      _mm256_mul_pd(k, _mm256_set1_pd(LN2_LO)));
+    p = _mm256_set1_pd(exp_coef[0]);
+    for (j = 1; j < 12; j++)
+      p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(exp_coef[j]));
+    e = _mm256_castsi256_pd(_mm256_slli_epi64(
+	  _mm256_castpd_si256(_mm256_add_pd(k, bias)), 52));
+    t = _mm256_sub_pd(one, _mm256_div_pd(two,
+		      _mm256_add_pd(_mm256_mul_pd(p, e), one)));
+    _mm256_storeu_pd(x + i, _mm256_mul_pd(vscale, _mm256_or_pd(t, s)));
+  }
+
+  soft_clip_c(x + i, n - i, full_scale);
+}
+
+/* k_weight_sse2() four channels at a time, then two, then one */
+__attribute__((target("avx2")))
+static void
+k_weight_avx2(const double *x, size_t stride, int channels, size_t n,
+	      const double *coef, double *state, double *sums)
+{
+  __m256d b[10], s[6], acc, v, y, z;
+  const double *x0, *x1, *x2, *x3;
+  double *st, lanes[4];
+  size_t i;
+  int c, j, k;
+
+  for (j = 0; j < 10; j++)
+    b[j] = _mm256_set1_pd(coef[j]);
+  for (c = 0; c + 4 <= channels; c += 4) {
+    x0 = x + c * stride;
+    x1 = x0 + stride;
+    x2 = x1 + stride;
+    x3 = x2 + stride;
+    st = state + 6 * c;
+    for (j = 0; j < 6; j++)
+      s[j] = _mm256_setr_pd(st[j], st[6 + j], st[12 + j], st[18 + j]);
+    acc = _mm256_loadu_pd(sums + c);
+    for (i = 0; i < n; i++) {
+      v = _mm256_setr_pd(x0[i], x1[i], x2[i], x3[i]);
+      y = _mm256_add_pd(_mm256_mul_pd(b[0], v), _mm256_mul_pd(b[1], s[0]));
+      y = _mm256_add_pd(y, _mm256_mul_pd(b[2], s[1]));
+      y = _mm256_sub_pd(y, _mm256_mul_pd(b[4], s[3]));
+      y = _mm256_sub_pd(y, _mm256_mul_pd(b[3], s[2]));
+      z = _mm256_add_pd(_mm256_mul_pd(b[5], y), _mm256_mul_pd(b[6], s[2]));
+      z = _mm256_add_pd(z, _mm256_mul_pd(b[7], s[3]));
+      z = _mm256_sub_pd(z, _mm256_mul_pd(b[9], s[5]));
+      z = _mm256_sub_pd(z, _mm256_mul_pd(b[8], s[4]));
+      acc = _mm256_add_pd(acc, _mm256_mul_pd(z, z));
+      s[1] = s[0];
+      s[0] = v;
+      s[3] = s[2];
+      s[2] = y;
+      s[5] = s[4];
+      s[4] = z;
+    }
+    for (j = 0; j < 6; j++) {
+      _mm256_storeu_pd(lanes, s[j]);
+      for (k = 0; k < 4; k++)
+	st[6 * k + j] = lanes[k];
+    }
+    _mm256_storeu_pd(sums + c, acc);
+  }
+  k_weight_sse2(x + c * stride, stride, channels - c, n, coef,
+		state + 6 * c, sums + c);
+}
+
+__attribute__((target("avx2")))
+static void
+to_float_avx2(const int32_t *x, size_t n, float scale, float *out)
+{
+  __m256 vscale = _mm256_set1_ps(scale);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+      _mm256_loadu_si256((const __m256i *)(x + i))), vscale));
+  to_float_c(x + i, n - i, scale, out + i);
+}
+
+/* true_peak_sse2(), eight at a time */
+__attribute__((target("avx2")))
+static float
+true_peak_avx2(const float *x, size_t n, const float *coef)
+{
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 b[KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES];
+  __m256 y0, y1, y2, y3, v, m = _mm256_setzero_ps();
+  const __m256 *b1 = b + KERNEL_TRUE_PEAK_TAPS;
+  const __m256 *b2 = b1 + KERNEL_TRUE_PEAK_TAPS;
+  const __m256 *b3 = b2 + KERNEL_TRUE_PEAK_TAPS;
+  float lanes[8], peak;
+  size_t i;
+  int j;
+
+  for (j = 0; j < KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES; j++)
+    b[j] = _mm256_set1_ps(coef[j]);
+  x -= KERNEL_TRUE_PEAK_TAPS - 1;
+  for (i = 0; i + 8 <= n; i += 8) {
+    v = _mm256_loadu_ps(x + i);
+    y0 = _mm256_mul_ps(b[0], v);
+    y1 = _mm256_mul_ps(b1[0], v);
+    y2 = _mm256_mul_ps(b2[0], v);
+    y3 = _mm256_mul_ps(b3[0], v);
+    for (j = 1; j < KERNEL_TRUE_PEAK_TAPS; j++) {
+      v = _mm256_loadu_ps(x + i + j);
+      y0 = _mm256_add_ps(y0, _mm256_mul_ps(b[j], v));
+      y1 = _mm256_add_ps(y1, _mm256_mul_ps(b1[j], v));
+      y2 = _mm256_add_ps(y2, _mm256_mul_ps(b2[j], v));
+      y3 = _mm256_add_ps(y3, _mm256_mul_ps(b3[j], v));
+    }
+    m = _mm256_max_ps(m, _mm256_max_ps(_mm256_andnot_ps(sign, y0),
+				       _mm256_andnot_ps(sign, y1)));
+    m = _mm256_max_ps(m, _mm256_max_ps(_mm256_andnot_ps(sign, y2),
+				       _mm256_andnot_ps(sign, y3)));
+  }
+  _mm256_storeu_ps(lanes, m);
+  peak = true_peak_sse2(x + i + KERNEL_TRUE_PEAK_TAPS - 1, n - i, coef);
+  for (j = 0; j < 8; j++)
+    if (lanes[j] > peak)
+      peak = lanes[j];
+  return peak;
+}
+
+/* fft_4_sse2(), eight lanes wide */
+__attribute__((target("avx2")))
+static __inline__ void
+fft_4_avx2(__m256 *ar, __m256 *ai, __m256 *br, __m256 *bi, __m256 *cr,
+	   __m256 *ci, __m256 *dr, __m256 *di)
+{
+  __m256 t0r = _mm256_add_ps(*ar, *cr), t0i = _mm256_add_ps(*ai, *ci);
+  __m256 t1r = _mm256_sub_ps(*ar, *cr), t1i = _mm256_sub_ps(*ai, *ci);
+  __m256 t2r = _mm256_add_ps(*br, *dr), t2i = _mm256_add_ps(*bi, *di);
+  __m256 t3r = _mm256_sub_ps(*br, *dr), t3i = _mm256_sub_ps(*bi, *di);
+
+  *ar = _mm256_add_ps(t0r, t2r);
+  *ai = _mm256_add_ps(t0i, t2i);
+  *br = _mm256_add_ps(t1r, t3i);
+  *bi = _mm256_sub_ps(t1i, t3r);
+  *cr = _mm256_sub_ps(t0r, t2r);
+  *ci = _mm256_sub_ps(t0i, t2i);
+  *dr = _mm256_sub_ps(t1r, t3i);
+  *di = _mm256_add_ps(t1i, t3r);
+}
+
+/* and fft_twiddle_sse2() */
+__attribute__((target("avx2")))
+static __inline__ void
+fft_twiddle_avx2(__m256 *xr, __m256 *xi, __m256 wr, __m256 wi)
+{
+  __m256 r = _mm256_sub_ps(_mm256_mul_ps(*xr, wr), _mm256_mul_ps(*xi, wi));
+
+  *xi = _mm256_add_ps(_mm256_mul_ps(*xr, wi), _mm256_mul_ps(*xi, wr));
+  *xr = r;
+}
+
+/* fft_radix2_c(), eight points at a time */
+__attribute__((target("avx2")))
+static void
+fft_radix2_avx2(float *re, float *im, size_t n, const float *tw)
+{
+  const float *wr = tw, *wi = tw + n / 2;
+  float *r1 = re + n / 2, *i1 = im + n / 2;
+  __m256 ar, ai, br, bi;
+  size_t j;
+
+  for (j = 0; j < n / 2; j += 8) {
+    ar = _mm256_loadu_ps(re + j);
+    ai = _mm256_loadu_ps(im + j);
+    br = _mm256_loadu_ps(r1 + j);
+    bi = _mm256_loadu_ps(i1 + j);
+    _mm256_storeu_ps(re + j, _mm256_add_ps(ar, br));
+    _mm256_storeu_ps(im + j, _mm256_add_ps(ai, bi));
+    ar = _mm256_sub_ps(ar, br);
+    ai = _mm256_sub_ps(ai, bi);
+    fft_twiddle_avx2(&ar, &ai,
+		     _mm256_loadu_ps(wr + j), _mm256_loadu_ps(wi + j));
+    _mm256_storeu_ps(r1 + j, ar);
+    _mm256_storeu_ps(i1 + j, ai);
+  }
+}
+
+/* fft_pass_c() eight points at a time, with q a multiple of 8 */
+__attribute__((target("avx2")))
+static void
+fft_pass_avx2(float *re, float *im, size_t n, size_t q, const float *tw)
+{
+  const float *w1r = tw, *w1i = tw + q, *w2r = tw + 2 * q;
+  const float *w2i = tw + 3 * q, *w3r = tw + 4 * q, *w3i = tw + 5 * q;
+  __m256 ar, ai, br, bi, cr, ci, dr, di;
+  float *r0, *r1, *r2, *r3, *i0, *i1, *i2, *i3;
+  size_t g, j;
+
+  for (g = 0; g < n; g += 4 * q) {
+    r0 = re + g; r1 = r0 + q; r2 = r1 + q; r3 = r2 + q;
+    i0 = im + g; i1 = i0 + q; i2 = i1 + q; i3 = i2 + q;
+    for (j = 0; j < q; j += 8) {
+      ar = _mm256_loadu_ps(r0 + j); ai = _mm256_loadu_ps(i0 + j);
+      br = _mm256_loadu_ps(r1 + j); bi = _mm256_loadu_ps(i1 + j);
+      cr = _mm256_loadu_ps(r2 + j); ci = _mm256_loadu_ps(i2 + j);
+      dr = _mm256_loadu_ps(r3 + j); di = _mm256_loadu_ps(i3 + j);
+      fft_4_avx2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+      fft_twiddle_avx2(&br, &bi,
+		       _mm256_loadu_ps(w1r + j), _mm256_loadu_ps(w1i + j));
+      fft_twiddle_avx2(&cr, &ci,
+		       _mm256_loadu_ps(w2r + j), _mm256_loadu_ps(w2i + j));
+      fft_twiddle_avx2(&dr, &di,
+		       _mm256_loadu_ps(w3r + j), _mm256_loadu_ps(w3i + j));
+      _mm256_storeu_ps(r0 + j, ar); _mm256_storeu_ps(i0 + j, ai);
+      _mm256_storeu_ps(r1 + j, br); _mm256_storeu_ps(i1 + j, bi);
+      _mm256_storeu_ps(r2 + j, cr); _mm256_storeu_ps(i2 + j, ci);
+      _mm256_storeu_ps(r3 + j, dr); _mm256_storeu_ps(i3 + j, di);
+    }
+  }
+}
+
+/* four floats from p and four from p + 16, the same points of two
+   groups of 16 */
+__attribute__((target("avx2")))
+static __inline__ __m256
+load_16_avx2(const float *p)
+{
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)),
+			      _mm_loadu_ps(p + 16), 1);
+}
+
+/* power_sse2() on the two halves of r and i, to p[0 .. 3] and
+   p[16 .. 19] */
+__attribute__((target("avx2")))
+static __inline__ void
+power_16_avx2(float *p, __m256 r, __m256 i)
+{
+  __m256 v = _mm256_add_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(i, i));
+
+  v = _mm256_add_ps(load_16_avx2(p), v);
+  _mm_storeu_ps(p, _mm256_castps256_ps128(v));
+  _mm_storeu_ps(p + 16, _mm256_extractf128_ps(v, 1));
+}
+
+/* _MM_TRANSPOSE4_PS() in each half */
+__attribute__((target("avx2")))
+static __inline__ void
+transpose_avx2(__m256 *a, __m256 *b, __m256 *c, __m256 *d)
+{
+  __m256 t0 = _mm256_unpacklo_ps(*a, *b), t1 = _mm256_unpackhi_ps(*a, *b);
+  __m256 t2 = _mm256_unpacklo_ps(*c, *d), t3 = _mm256_unpackhi_ps(*c, *d);
+
+  *a = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  *b = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  *c = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+  *d = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+/* fft_16_sse2(), on two groups of 16 at once, one in each half */
+__attribute__((target("avx2")))
+static void
+fft_16_avx2(const float *re, const float *im, size_t n, const float *tw,
+	    float *power)
+{
+  const __m256 w1r = _mm256_broadcast_ps((const __m128 *)tw);
+  const __m256 w1i = _mm256_broadcast_ps((const __m128 *)(tw + 4));
+  const __m256 w2r = _mm256_broadcast_ps((const __m128 *)(tw + 8));
+  const __m256 w2i = _mm256_broadcast_ps((const __m128 *)(tw + 12));
+  const __m256 w3r = _mm256_broadcast_ps((const __m128 *)(tw + 16));
+  const __m256 w3i = _mm256_broadcast_ps((const __m128 *)(tw + 20));
+  __m256 ar, ai, br, bi, cr, ci, dr, di;
+  size_t g;
+
+  for (g = 0; g < n; g += 32) {
+    ar = load_16_avx2(re + g); ai = load_16_avx2(im + g);
+    br = load_16_avx2(re + g + 4); bi = load_16_avx2(im + g + 4);
+    cr = load_16_avx2(re + g + 8); ci = load_16_avx2(im + g + 8);
+    dr = load_16_avx2(re + g + 12); di = load_16_avx2(im + g + 12);
+    fft_4_avx2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+    fft_twiddle_avx2(&br, &bi, w1r, w1i);
+    fft_twiddle_avx2(&cr, &ci, w2r, w2i);
+    fft_twiddle_avx2(&dr, &di, w3r, w3i);
+    transpose_avx2(&ar, &br, &cr, &dr);
+    transpose_avx2(&ai, &bi, &ci, &di);
+    fft_4_avx2(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+    transpose_avx2(&ar, &br, &cr, &dr);
+    transpose_avx2(&ai, &bi, &ci, &di);
+    power_16_avx2(power + g, ar, ai);
+    power_16_avx2(power + g + 4, br, bi);
+    power_16_avx2(power + g + 8, cr, ci);
+    power_16_avx2(power + g + 12, dr, di);
+  }
+}
+
+__attribute__((target("avx2")))
+static void
+spectrum_avx2(float *re, float *im, size_t n, const float *w,
+	      const float *tw, float *power)
+{
+  size_t span = n, i;
+  __m256 v;
+
+  for (i = 0; i < n; i += 8) {
+    v = _mm256_loadu_ps(w + i);
+    _mm256_storeu_ps(re + i, _mm256_mul_ps(_mm256_loadu_ps(re + i), v));
+    _mm256_storeu_ps(im + i, _mm256_mul_ps(_mm256_loadu_ps(im + i), v));
+  }
+  if (fft_odd(n)) {
+    fft_radix2_avx2(re, im, n, tw);
+    tw += n;
+    span /= 2;
+  }
+  for (; span > 16; span /= 4) {
+    fft_pass_avx2(re, im, n, span / 4, tw);
+    tw += 6 * (span / 4);
+  }
+  fft_16_avx2(re, im, n, tw, power);
+}
+
+static const struct kernels avx2_kernels = {
+  "avx2", KERNEL_ISA_AVX2,
+  unpack_avx2, pack_avx2, stats_avx2, peak_avx2, gain_avx2, 1,
+  soft_clip_avx2, k_weight_avx2, to_float_avx2, true_peak_avx2,
+  spectrum_avx2
+};
+
+#if KERNELS_AVX512
+
+/*
+ * AVX-512: sixteen samples at a time, or eight doubles.  Only the
+ * 16-bit converters are worth widening; the 24-bit ones are bound by
+ * their shuffles, so they're the AVX2 ones.  K-weighting is the AVX2
+ * one too, since only 7.1 files and up would fill eight lanes; the
+ * true peak filter has a lane for every sample, and the FFT a lane
+ * for every point, so they're widened.
+ */
+
+__attribute__((target("avx512f")))
+static void
+unpack_avx512(const unsigned char *in, int bytes_per_sample, int channels,
+	      size_t nframes, int32_t *planes, size_t stride)
+{
+  int32_t *l = planes, *r = planes + stride;
+  __m512i a;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 16 <= nframes; i += 16)
+      _mm512_storeu_si512((void *)(l + i),
+			  _mm512_cvtepi16_epi32(_mm256_loadu_si256(
+			    (const __m256i *)(in + i * 2))));
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 16 <= nframes; i += 16) {
+      a = _mm512_loadu_si512((const void *)(in + i * 4));
+      _mm512_storeu_si512((void *)(l + i),
+			  _mm512_srai_epi32(_mm512_slli_epi32(a, 16), 16));
+      _mm512_storeu_si512((void *)(r + i), _mm512_srai_epi32(a, 16));
+    }
+  } else {
+    unpack_avx2(in, bytes_per_sample, channels, nframes, planes, stride);
+    return;
+  }
+  unpack_c(in + i * channels * bytes_per_sample, bytes_per_sample,
+	   channels, nframes - i, planes + i, stride);
+}
+
+__attribute__((target("avx512f")))
+static void
+pack_avx512(const int32_t *planes, size_t stride, int bytes_per_sample,
+	    int channels, size_t nframes, unsigned char *out)
+{
+  const int32_t *l = planes, *r = planes + stride;
+  const __m512i low = _mm512_set1_epi32(0xFFFF);
+  __m512i a, b;
+  size_t i = 0;
+
+  if (bytes_per_sample == 2 && channels == 1) {
+    for (; i + 16 <= nframes; i += 16)
+      _mm256_storeu_si256((__m256i *)(out + i * 2),
+			  _mm512_cvtsepi32_epi16(_mm512_loadu_si512(
+			    (const void *)(l + i))));
+  } else if (bytes_per_sample == 2 && channels == 2) {
+    for (; i + 16 <= nframes; i += 16) {
+      a = _mm512_loadu_si512((const void *)(l + i));
+      b = _mm512_loadu_si512((const void *)(r + i));
+      _mm512_storeu_si512((void *)(out + i * 4),
+			  _mm512_or_si512(_mm512_and_si512(a, low),
+					  _mm512_slli_epi32(b, 16)));
+    }
+  } else {
+    pack_avx2(planes, stride, bytes_per_sample, channels, nframes, out);
+    return;
+  }
+  pack_c(planes + i, stride, bytes_per_sample, channels, nframes - i,
+	 out + i * channels * bytes_per_sample);
+}
+
+__attribute__((target("avx512f")))
+static void
+stats_avx512(const int32_t *x, size_t n, int64_t *sum, int32_t *pmax,
+	     int32_t *pmin)
+{
+  __m512i s, vmax, vmin, acc = _mm512_setzero_si512();
+  int32_t max, min;
+  size_t i;
+
+  vmax = _mm512_set1_epi32(*pmax);
+  vmin = _mm512_set1_epi32(*pmin);
+  for (i = 0; i + 16 <= n; i += 16) {
+    s = _mm512_loadu_si512((const void *)(x + i));
+    vmax = _mm512_max_epi32(vmax, s);
+    vmin = _mm512_min_epi32(vmin, s);
+    acc = _mm512_add_epi64(acc, _mm512_mul_epi32(s, s));
+    s = _mm512_srli_epi64(s, 32);
+    acc = _mm512_add_epi64(acc, _mm512_mul_epi32(s, s));
+  }
+
+  *sum += _mm512_reduce_add_epi64(acc);
+  max = _mm512_reduce_max_epi32(vmax);
+  min = _mm512_reduce_min_epi32(vmin);
+  if (max > *pmax)
+    *pmax = max;
+  if (min < *pmin)
+    *pmin = min;
+  stats_c(x + i, n - i, sum, pmax, pmin);
+}
+
+__attribute__((target("avx512f")))
+static void
+peak_avx512(const int32_t *x, size_t n, int32_t *pmax, int32_t *pmin)
+{
+  __m512i s, t, vmax0, vmax1, vmin0, vmin1;
+  int32_t max, min;
+  size_t i;
+
+  vmax0 = vmax1 = _mm512_set1_epi32(*pmax);
+  vmin0 = vmin1 = _mm512_set1_epi32(*pmin);
+  for (i = 0; i + 32 <= n; i += 32) {
+    s = _mm512_loadu_si512((const void *)(x + i));
+    t = _mm512_loadu_si512((const void *)(x + i + 16));
+    vmax0 = _mm512_max_epi32(vmax0, s);
+    vmax1 = _mm512_max_epi32(vmax1, t);
+    vmin0 = _mm512_min_epi32(vmin0, s);
+    vmin1 = _mm512_min_epi32(vmin1, t);
+  }
+
+  max = _mm512_reduce_max_epi32(_mm512_max_epi32(vmax0, vmax1));
+  min = _mm512_reduce_min_epi32(_mm512_min_epi32(vmin0, vmin1));
+  if (max > *pmax)
+    *pmax = max;
+  if (min < *pmin)
+    *pmin = min;
+  peak_c(x + i, n - i, pmax, pmin);
+}
+
+struct limits_avx512 {
+  __m512d hi, lo, max, min;
+};
+
+/* eight 32-bit samples times gain, counting clips with a mask */
+__attribute__((target("avx512f")))
+static __inline__ __m256i
+gain_8_avx512(__m256i s, __m512d vgain, const struct limits_avx512 *lim,
+	      __m512i *pcount)
+{
+  __m512d x;
+  __mmask8 clip;
+
+  x = _mm512_mul_pd(_mm512_cvtepi32_pd(s), vgain);
+  clip = _mm512_cmp_pd_mask(x, lim->hi, _CMP_GE_OQ)
+    | _mm512_cmp_pd_mask(x, lim->lo, _CMP_LE_OQ);
+  *pcount = _mm512_mask_add_epi64(*pcount, clip, *pcount,
+				  _mm512_set1_epi64(1));
+  x = _mm512_min_pd(_mm512_max_pd(x, lim->min), lim->max);
+  return _mm512_cvttpd_epi32(x);
+}
+
+__attribute__((target("avx512f")))
+static unsigned long
+gain_avx512(int32_t *x, size_t n, double gain, int32_t min, int32_t max)
+{
+  const __m512d vgain = _mm512_set1_pd(gain);
+  struct limits_avx512 lim;
+  __m512i count = _mm512_setzero_si512(), s, r;
+  size_t i;
+
+  lim.hi = _mm512_set1_pd(max + 1.0);
+  lim.lo = _mm512_set1_pd(min - 1.0);
+  lim.max = _mm512_set1_pd(max);
+  lim.min = _mm512_set1_pd(min);
+  for (i = 0; i + 16 <= n; i += 16) {
+    s = _mm512_loadu_si512((const void *)(x + i));
+    r = _mm512_castsi256_si512(gain_8_avx512(_mm512_castsi512_si256(s),
+					     vgain, &lim, &count));
+    r = _mm512_inserti64x4(r, gain_8_avx512(_mm512_extracti64x4_epi64(s, 1),
+					    vgain, &lim, &count), 1);
+    _mm512_storeu_si512((void *)(x + i), r);
+  }
+  return (unsigned long)_mm512_reduce_add_epi64(count)
+    + gain_c(x + i, n - i, gain, min, max);
+}
+
+/* soft_clip_avx2(), eight at a time */
+__attribute__((target("avx512f")))
+static void
+soft_clip_avx512(double *x, size_t n, double full_scale)
+{
+  const __m512i sign = _mm512_castpd_si512(_mm512_set1_pd(-0.0));
+  const __m512d one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0);
+  const __m512d half = _mm512_set1_pd(0.5);
+  const __m512d bias = _mm512_set1_pd(4503599627370496.0 + 1023);
+  const __m512d vscale = _mm512_set1_pd(full_scale);
+  const __m512d vinv = _mm512_set1_pd(1.0 / full_scale);
+  __m512d t, k, r, p, e;
+  __m512i v, s;
+  size_t i;
+  int j;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    v = _mm512_castpd_si512(_mm512_mul_pd(_mm512_loadu_pd(x + i), vinv));
+    s = _mm512_and_si512(v, sign);
+    t = _mm512_castsi512_pd(_mm512_andnot_si512(sign, v));
+    t = _mm512_min_pd(t, _mm512_set1_pd(TANH_ONE));
+    t = _mm512_mul_pd(t, two);
+    k = _mm512_roundscale_pd(_mm512_add_pd(_mm512_mul_pd(t,
+					   _mm512_set1_pd(INV_LN2)), half),
+			     _MM_FROUND_TO_NEG_INF);
+    r = _mm512_sub_pd(_mm512_sub_pd(t, _mm512_mul_pd(k,
+				    _mm512_set1_pd(LN2_HI))),
+		      _mm512_mul_pd(k, _mm512_set1_pd(LN2_LO)));
+    p = _mm512_set1_pd(exp_coef[0]);
+    for (j = 1; j < 12; j++)
+      p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(exp_coef[j]));
+    e = _mm512_castsi512_pd(_mm512_slli_epi64(
+	  _mm512_castpd_si512(_mm512_add_pd(k, bias)), 52));
+    t = _mm512_sub_pd(one, _mm512_div_pd(two,
+		      _mm512_add_pd(_mm512_mul_pd(p, e), one)));
+    t = _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(t), s));
+    _mm512_storeu_pd(x + i, _mm512_mul_pd(vscale, t));
+  }
+
+  soft_clip_c(x + i, n - i, full_scale);
+}
+
+__attribute__((target("avx512f")))
+static void
+to_float_avx512(const int32_t *x, size_t n, float scale, float *out)
+{
+  __m512 vscale = _mm512_set1_ps(scale);
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(
+      _mm512_loadu_si512((const void *)(x + i))), vscale));
+  to_float_c(x + i, n - i, scale, out + i);
+}
+
+/* true_peak_avx2(), sixteen at a time */
+__attribute__((target("avx512f")))
+static float
+true_peak_avx512(const float *x, size_t n, const float *coef)
+{
+  __m512 b[KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES];
+  __m512 y0, y1, y2, y3, v, m = _mm512_setzero_ps();
+  const __m512 *b1 = b + KERNEL_TRUE_PEAK_TAPS;
+  const __m512 *b2 = b1 + KERNEL_TRUE_PEAK_TAPS;
+  const __m512 *b3 = b2 + KERNEL_TRUE_PEAK_TAPS;
+  float lanes[16], peak;
+  size_t i;
+  int j;
+
+  for (j = 0; j < KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES; j++)
+    b[j] = _mm512_set1_ps(coef[j]);
+  x -= KERNEL_TRUE_PEAK_TAPS - 1;
+  for (i = 0; i + 16 <= n; i += 16) {
+    v = _mm512_loadu_ps(x + i);
+    y0 = _mm512_mul_ps(b[0], v);
+    y1 = _mm512_mul_ps(b1[0], v);
+    y2 = _mm512_mul_ps(b2[0], v);
+    y3 = _mm512_mul_ps(b3[0], v);
+    for (j = 1; j < KERNEL_TRUE_PEAK_TAPS; j++) {
+      v = _mm512_loadu_ps(x + i + j);
+      y0 = _mm512_add_ps(y0, _mm512_mul_ps(b[j], v));
+      y1 = _mm512_add_ps(y1, _mm512_mul_ps(b1[j], v));
+      y2 = _mm512_add_ps(y2, _mm512_mul_ps(b2[j], v));
+      y3 = _mm512_add_ps(y3, _mm512_mul_ps(b3[j], v));
+    }
+    m = _mm512_max_ps(m, _mm512_max_ps(_mm512_abs_ps(y0),
+				       _mm512_abs_ps(y1)));
+    m = _mm512_max_ps(m, _mm512_max_ps(_mm512_abs_ps(y2),
+				       _mm512_abs_ps(y3)));
+  }
+  _mm512_storeu_ps(lanes, m);
+  peak = true_peak_avx2(x + i + KERNEL_TRUE_PEAK_TAPS - 1, n - i, coef);
+  for (j = 0; j < 16; j++)
+    if (lanes[j] > peak)
+      peak = lanes[j];
+  return peak;
+}
+
+/* fft_4_sse2(), sixteen lanes wide */
+__attribute__((target("avx512f")))
+static __inline__ void
+fft_4_avx512(__m512 *ar, __m512 *ai, __m512 *br, __m512 *bi, __m512 *cr,
+	     __m512 *ci, __m512 *dr, __m512 *di)
+{
+  __m512 t0r = _mm512_add_ps(*ar, *cr), t0i = _mm512_add_ps(*ai, *ci);
+  __m512 t1r = _mm512_sub_ps(*ar, *cr), t1i = _mm512_sub_ps(*ai, *ci);
+  __m512 t2r = _mm512_add_ps(*br, *dr), t2i = _mm512_add_ps(*bi, *di);
+  __m512 t3r = _mm512_sub_ps(*br, *dr), t3i = _mm512_sub_ps(*bi, *di);
+
+  *ar = _mm512_add_ps(t0r, t2r);
+  *ai = _mm512_add_ps(t0i, t2i);
+  *br = _mm512_add_ps(t1r, t3i);
+  *bi = _mm512_sub_ps(t1i, t3r);
+  *cr = _mm512_sub_ps(t0r, t2r);
+  *ci = _mm512_sub_ps(t0i, t2i);
+  *dr = _mm512_sub_ps(t1r, t3i);
+  *di = _mm512_add_ps(t1i, t3r);
+}
+
+/* and fft_twiddle_sse2() */
+__attribute__((target("avx512f")))
+static __inline__ void
+fft_twiddle_avx512(__m512 *xr, __m512 *xi, __m512 wr, __m512 wi)
+{
+  __m512 r = _mm512_sub_ps(_mm512_mul_ps(*xr, wr), _mm512_mul_ps(*xi, wi));
+
+  *xi = _mm512_add_ps(_mm512_mul_ps(*xr, wi), _mm512_mul_ps(*xi, wr));
+  *xr = r;
+}
+
+/* fft_radix2_c(), sixteen points at a time */
+__attribute__((target("avx512f")))
+static void
+fft_radix2_avx512(float *re, float *im, size_t n, const float *tw)
+{
+  const float *wr = tw, *wi = tw + n / 2;
+  float *r1 = re + n / 2, *i1 = im + n / 2;
+  __m512 ar, ai, br, bi;
+  size_t j;
+
+  for (j = 0; j < n / 2; j += 16) {
+    ar = _mm512_loadu_ps(re + j);
+    ai = _mm512_loadu_ps(im + j);
+    br = _mm512_loadu_ps(r1 + j);
+    bi = _mm512_loadu_ps(i1 + j);
+    _mm512_storeu_ps(re + j, _mm512_add_ps(ar, br));
+    _mm512_storeu_ps(im + j, _mm512_add_ps(ai, bi));
+    ar = _mm512_sub_ps(ar, br);
+    ai = _mm512_sub_ps(ai, bi);
+    fft_twiddle_avx512(&ar, &ai,
+		       _mm512_loadu_ps(wr + j), _mm512_loadu_ps(wi + j));
+    _mm512_storeu_ps(r1 + j, ar);
+    _mm512_storeu_ps(i1 + j, ai);
+  }
+}
+
+/* fft_pass_c() sixteen points at a time, with q a multiple of 16 */
+__attribute__((target("avx512f")))
+static void
+fft_pass_avx512(float *re, float *im, size_t n, size_t q, const float *tw)
+{
+  const float *w1r = tw, *w1i = tw + q, *w2r = tw + 2 * q;
+  const float *w2i = tw + 3 * q, *w3r = tw + 4 * q, *w3i = tw + 5 * q;
+  __m512 ar, ai, br, bi, cr, ci, dr, di;
+  float *r0, *r1, *r2, *r3, *i0, *i1, *i2, *i3;
+  size_t g, j;
+
+  for (g = 0; g < n; g += 4 * q) {
+    r0 = re + g; r1 = r0 + q; r2 = r1 + q; r3 = r2 + q;
+    i0 = im + g; i1 = i0 + q; i2 = i1 + q; i3 = i2 + q;
+    for (j = 0; j < q; j += 16) {
+      ar = _mm512_loadu_ps(r0 + j); ai = _mm512_loadu_ps(i0 + j);
+      br = _mm512_loadu_ps(r1 + j); bi = _mm512_loadu_ps(i1 + j);
+      cr = _mm512_loadu_ps(r2 + j); ci = _mm512_loadu_ps(i2 + j);
+      dr = _mm512_loadu_ps(r3 + j); di = _mm512_loadu_ps(i3 + j);
+      fft_4_avx512(&ar, &ai, &br, &bi, &cr, &ci, &dr, &di);
+      fft_twiddle_avx512(&br, &bi,
+			 _mm512_loadu_ps(w1r + j), _mm512_loadu_ps(w1i + j));
+      fft_twiddle_avx512(&cr, &ci,
+			 _mm512_loadu_ps(w2r + j), _mm512_loadu_ps(w2i + j));
+      fft_twiddle_avx512(&dr, &di,
+			 _mm512_loadu_ps(w3r + j), _mm512_loadu_ps(w3i + j));
+      _mm512_storeu_ps(r0 + j, ar); _mm512_storeu_ps(i0 + j, ai);
+      _mm512_storeu_ps(r1 + j, br); _mm512_storeu_ps(i1 + j, bi);
+      _mm512_storeu_ps(r2 + j, cr); _mm512_storeu_ps(i2 + j, ci);
+      _mm512_storeu_ps(r3 + j, dr); _mm512_storeu_ps(i3 + j, di);
+    }
+  }
+}
+
+/* the 16-point passes are the AVX2 ones */
+__attribute__((target("avx512f")))
+static void
+spectrum_avx512(float *re, float *im, size_t n, const float *w,
+		const float *tw, float *power)
+{
+  size_t span = n, i;
+  __m512 v;
+
+  for (i = 0; i < n; i += 16) {
+    v = _mm512_loadu_ps(w + i);
+    _mm512_storeu_ps(re + i, _mm512_mul_ps(_mm512_loadu_ps(re + i), v));
+    _mm512_storeu_ps(im + i, _mm512_mul_ps(_mm512_loadu_ps(im + i), v));
+  }
+  if (fft_odd(n)) {
+    fft_radix2_avx512(re, im, n, tw);
+    tw += n;
+    span /= 2;
+  }
+  for (; span > 16; span /= 4) {
+    fft_pass_avx512(re, im, n, span / 4, tw);
+    tw += 6 * (span / 4);
+  }
+  fft_16_avx2(re, im, n, tw, power);
+}
+
+static const struct kernels avx512_kernels = {
+  "avx512", KERNEL_ISA_AVX512,
+  unpack_avx512, pack_avx512, stats_avx512, peak_avx512, gain_avx512, 1,
+  soft_clip_avx512, k_weight_avx2, to_float_avx512, true_peak_avx512,
+  spectrum_avx512
+};
+
+#endif /* KERNELS_AVX512 */
+
+#endif /* KERNELS_X86 */
+
+
+/*
+ * The registry
+ */
+
+const struct kernels *const kernel_sets[] = {
+  &c_kernels,
+#if KERNELS_X86
+  &sse2_kernels,
+  &ssse3_kernels,
+  &avx2_kernels,
+#endif
+#if KERNELS_AVX512
+  &avx512_kernels,
+#endif
+  NULL
+};
+
+/*
+ * Return nonzero if this CPU can run the kernels k
+ */
+int
+kernels_supported(const struct kernels *k)
+{
+#if KERNELS_X86
+  __builtin_cpu_init();
+  switch (k->isa) {
+  case KERNEL_ISA_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case KERNEL_ISA_SSSE3:
+    return __builtin_cpu_supports("ssse3");
+  case KERNEL_ISA_AVX2:
+    return __builtin_cpu_supports("avx2");
+# if KERNELS_AVX512
+  case KERNEL_ISA_AVX512:
+    return __builtin_cpu_supports("avx2")
+      && __builtin_cpu_supports("avx512f");
+# endif
+  }
+#endif
+  return k->isa == KERNEL_ISA_NONE;
+}
+
+/*
+ * Return the kernel set called name, or NULL if there's none
+ */
+const struct kernels *
+kernels_find(const char *name)
+{
+  int i;
+
+  for (i = 0; kernel_sets[i]; i++)
+    if (strcmp(kernel_sets[i]->name, name) == 0)
+      return kernel_sets[i];
+  return NULL;
+}
+
+/*
+ * Return the kernels for the newest instruction set this CPU has.
+ * The newest isn't measured to be the fastest: kernels_tune() does
+ * that.
+ */
+const struct kernels *
+kernels_best(void)
+{
+  const struct kernels *best = &c_kernels;
+  int i;
+
+  for (i = 1; kernel_sets[i]; i++)
+    if (kernels_supported(kernel_sets[i]))
+      best = kernel_sets[i];
+  return best;
+}
+
+
+/*
+ * FFT tables
+ */
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+/*
+ * Fill tw, which has room for KERNEL_FFT_TWIDDLES(n) floats, with the
+ * twiddles of the spectrum kernels for n points: for the radix-2
+ * pass, if there is one, the real and then the imaginary parts of
+ * w^j, w = exp(-2 pi i / n), for j = 0 .. n / 2 - 1; then for each
+ * radix-4 pass in turn, with its butterflies q apart, those of w^j,
+ * w^2j and w^3j, w = exp(-2 pi i / 4q), for j = 0 .. q - 1.
+ */
+void
+kernels_fft_twiddles(float *tw, size_t n)
+{
+  size_t span = n, q, j;
+  int m;
+
+  if (fft_odd(n)) {
+    for (j = 0; j < n / 2; j++) {
+      tw[j] = (float)cos(2 * M_PI * j / n);
+      tw[n / 2 + j] = (float)-sin(2 * M_PI * j / n);
+    }
+    tw += n;
+    span /= 2;
+  }
+  for (; span >= 4; span /= 4) {
+    q = span / 4;
+    for (m = 1; m <= 3; m++) {
+      for (j = 0; j < q; j++) {
+	tw[(2 * m - 2) * q + j] = (float)cos(2 * M_PI * m * j / span);
+	tw[(2 * m - 1) * q + j] = (float)-sin(2 * M_PI * m * j / span);
+      }
+    }
+    tw += 6 * q;
+  }
+}
+
+/*
+ * Return where the spectrum kernels put the power of X[k] of n
+ * points: at k with its digits reversed, the digits being base 4, bar
+ * a first one in base 2 if n is an odd power of two.
+ */
+size_t
+kernels_fft_position(size_t k, size_t n)
+{
+  size_t pos = 0, r = fft_odd(n) ? 2 : 4;
+
+  for (; n > 1; r = 4) {
+    n /= r;
+    pos += k % r * n;
+    k /= r;
+  }
+  return pos;
+}
+
+
+/*
+ * The self-test: every kernel in a set is run on the same test vector
+ * as the portable one, which is the reference.  The integer kernels
+ * have to give exactly the same samples, sums and clip counts; the
+ * soft clip has to be within its bound, and K-weighting, the true
+ * peak and the spectrum within rounding, in case the compiler fuses
+ * their multiplies and adds.
+ */
+
+#define CHECK_SAMPLES 4099  /* not a multiple of any group size */
+#define CHECK_CHANNELS 8    /* the converters are checked up to this */
+#define CHECK_FFT 2048      /* and the spectrum up to this many points */
+
+static const double check_gains[] = { 0.0, 0.5, 1.0, 1.37, 3.5, 1e6 };
+
+/* the K-weighting filter at 48kHz, as BS.1770 gives it */
+static const double check_k_coef[10] = {
+  1.53512485958697, -2.69169618940638, 1.19839281085285,
+  -1.69065929318241, 0.73248077421585,
+  1.0, -2.0, 1.0, -1.99004745483398, 0.99007225036621
+};
+
+/* the buffers the self-test works in */
+struct check_data {
+  double x[CHECK_SAMPLES], y[CHECK_SAMPLES];
+  float f[CHECK_SAMPLES], g[CHECK_SAMPLES];
+  float tp_coef[KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES];
+  float re[2][CHECK_FFT], im[2][CHECK_FFT], power[2][CHECK_FFT];
+  float window[CHECK_FFT], tw[KERNEL_FFT_TWIDDLES(CHECK_FFT)];
+  int32_t a[CHECK_SAMPLES + CHECK_CHANNELS];
+  int32_t b[CHECK_SAMPLES + CHECK_CHANNELS];
+  unsigned char in[CHECK_SAMPLES * 4], out[CHECK_SAMPLES * 4];
+};
+
+/* a small generator of its own, so the vector is always the same */
+static uint32_t
+check_random(uint32_t *state)
+{
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+/* every sample size and layout, and back to the bytes we started with */
+static int
+check_convert(const struct kernels *k, struct check_data *cd)
+{
+  size_t nframes, stride;
+  int bytes_per_sample, channels;
+
+  for (bytes_per_sample = 1; bytes_per_sample <= 4; bytes_per_sample++) {
+    for (channels = 1; channels <= CHECK_CHANNELS; channels++) {
+      nframes = CHECK_SAMPLES / channels;
+      stride = nframes + 1;
+      memset(cd->a, 0, sizeof(cd->a));
+      memset(cd->b, 0, sizeof(cd->b));
+      c_kernels.unpack(cd->in, bytes_per_sample, channels, nframes, cd->a,
+		       stride);
+      k->unpack(cd->in, bytes_per_sample, channels, nframes, cd->b, stride);
+      if (memcmp(cd->a, cd->b, sizeof(cd->a)) != 0)
+	return -1;
+      k->pack(cd->b, stride, bytes_per_sample, channels, nframes, cd->out);
+      if (memcmp(cd->in, cd->out, nframes * channels * bytes_per_sample))
+	return -1;
+    }
+  }
+  return 0;
+}
+
+/* 24-bit samples, starting at each alignment */
+static int
+check_stats(const struct kernels *k, struct check_data *cd)
+{
+  int64_t sum[2];
+  int32_t max[2], min[2];
+  size_t offset;
+
+  c_kernels.unpack(cd->in, 3, 1, CHECK_SAMPLES, cd->a, CHECK_SAMPLES);
+  for (offset = 0; offset < 16; offset++) {
+    sum[0] = sum[1] = 0;
+    max[0] = max[1] = -8388608;
+    min[0] = min[1] = 8388607;
+    c_kernels.stats(cd->a + offset, CHECK_SAMPLES - offset, &sum[0],
+		    &max[0], &min[0]);
+    k->stats(cd->a + offset, CHECK_SAMPLES - offset, &sum[1],
+	     &max[1], &min[1]);
+    if (sum[0] != sum[1] || max[0] != max[1] || min[0] != min[1])
+      return -1;
+  }
+  return 0;
+}
+
+/* the same, with the extremes at each end */
+static int
+check_peak(const struct kernels *k, struct check_data *cd)
+{
+  int32_t max[2], min[2];
+  size_t offset;
+
+  c_kernels.unpack(cd->in, 3, 1, CHECK_SAMPLES, cd->a, CHECK_SAMPLES);
+  for (offset = 0; offset < 40; offset++) {
+    if (offset == 20) {
+      cd->a[CHECK_SAMPLES - 1] = 8388607;
+      cd->a[CHECK_SAMPLES - 2] = -8388608;
+    }
+    max[0] = max[1] = -8388608;
+    min[0] = min[1] = 8388607;
+    c_kernels.peak(cd->a + offset % 20, CHECK_SAMPLES - offset % 20,
+		   &max[0], &min[0]);
+    k->peak(cd->a + offset % 20, CHECK_SAMPLES - offset % 20,
+	    &max[1], &min[1]);
+    if (max[0] != max[1] || min[0] != min[1])
+      return -1;
+  }
+  return 0;
+}
+
+/* samples of each size, with its limits */
+static int
+check_gain(const struct kernels *k, struct check_data *cd)
+{
+  int32_t max, min;
+  size_t i;
+  int bytes_per_sample;
+
+  for (bytes_per_sample = 1; bytes_per_sample <= 4; bytes_per_sample++) {
+    max = (int32_t)((1UL << (bytes_per_sample * 8 - 1)) - 1);
+    min = -max - 1;
+    for (i = 0; i < sizeof(check_gains) / sizeof(check_gains[0]); i++) {
+      c_kernels.unpack(cd->in, bytes_per_sample, 1, CHECK_SAMPLES, cd->a,
+		       CHECK_SAMPLES);
+      memcpy(cd->b, cd->a, CHECK_SAMPLES * sizeof(int32_t));
+      if (c_kernels.gain(cd->a, CHECK_SAMPLES, check_gains[i], min, max)
+	  != k->gain(cd->b, CHECK_SAMPLES, check_gains[i], min, max)
+	  || memcmp(cd->a, cd->b, CHECK_SAMPLES * sizeof(int32_t)) != 0)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+static int
+check_soft_clip(const struct kernels *k, double *x, double *y)
+{
+  uint32_t state = 1;
+  double full_scale;
+  size_t i;
+  int bits;
+
+  for (bits = 24; bits <= 32; bits += 8) {
+    full_scale = ldexp(1.0, bits - 1) - 1;
+    for (i = 0; i < CHECK_SAMPLES; i++) {
+      /* out to four times full scale, both ways */
+      x[i] = y[i] = ((double)check_random(&state) / (1 << 24) - 0.5)
+	* 8 * full_scale;
+    }
+    c_kernels.soft_clip(x, CHECK_SAMPLES, full_scale);
+    k->soft_clip(y, CHECK_SAMPLES, full_scale);
+    for (i = 0; i < CHECK_SAMPLES; i++)
+      if (fabs(x[i] - y[i]) > 0.002)
+	return -1;
+  }
+  return 0;
+}
+
+/* every channel count up to CHECK_CHANNELS, picking up from a state
+   that isn't zero, to within rounding */
+static int
+check_k_weight(const struct kernels *k, double *x)
+{
+  double st[2][6 * CHECK_CHANNELS], sums[2][CHECK_CHANNELS];
+  uint32_t state = 1;
+  size_t i, n;
+  int channels;
+
+  for (i = 0; i < CHECK_SAMPLES; i++)
+    x[i] = (double)check_random(&state) / (1 << 23) - 1.0;
+  for (channels = 1; channels <= CHECK_CHANNELS; channels++) {
+    n = CHECK_SAMPLES / channels;
+    for (i = 0; i < 6 * CHECK_CHANNELS; i++)
+      st[0][i] = st[1][i] = x[i] / 16;
+    for (i = 0; i < CHECK_CHANNELS; i++)
+      sums[0][i] = sums[1][i] = i;
+    c_kernels.k_weight(x, n, channels, n, check_k_coef, st[0], sums[0]);
+    k->k_weight(x, n, channels, n, check_k_coef, st[1], sums[1]);
+    for (i = 0; i < (size_t)channels; i++)
+      if (fabs(sums[0][i] - sums[1][i]) > 1e-9 * sums[0][i])
+	return -1;
+    for (i = 0; i < 6 * (size_t)channels; i++)
+      if (fabs(st[0][i] - st[1][i]) > 1e-9)
+	return -1;
+  }
+  return 0;
+}
+
+/* 32-bit samples, starting at each alignment, exactly */
+static int
+check_to_float(const struct kernels *k, struct check_data *cd)
+{
+  size_t offset;
+
+  c_kernels.unpack(cd->in, 4, 1, CHECK_SAMPLES, cd->a, CHECK_SAMPLES);
+  for (offset = 0; offset < 16; offset++) {
+    c_kernels.to_float(cd->a + offset, CHECK_SAMPLES - offset,
+		       1.0f / 2147483648.0f, cd->f);
+    k->to_float(cd->a + offset, CHECK_SAMPLES - offset,
+		1.0f / 2147483648.0f, cd->g);
+    if (memcmp(cd->f, cd->g, (CHECK_SAMPLES - offset) * sizeof(float)))
+      return -1;
+  }
+  return 0;
+}
+
+/* random taps on random samples, ending at each alignment */
+static int
+check_true_peak(const struct kernels *k, struct check_data *cd)
+{
+  uint32_t state = 1;
+  float peak[2];
+  size_t i, n;
+
+  for (i = 0; i < CHECK_SAMPLES; i++)
+    cd->f[i] = (float)check_random(&state) / (1 << 23) - 1.0f;
+  for (i = 0; i < KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES; i++)
+    cd->tp_coef[i] = (float)check_random(&state) / (1 << 24) - 0.5f;
+  for (n = CHECK_SAMPLES - 32; n < CHECK_SAMPLES - 15; n++) {
+    peak[0] = c_kernels.true_peak(cd->f + 15, n, cd->tp_coef);
+    peak[1] = k->true_peak(cd->f + 15, n, cd->tp_coef);
+    if (fabs(peak[0] - peak[1]) > 1e-6 * peak[0])
+      return -1;
+  }
+  return 0;
+}
+
+/* random points and window, for every size from 16 up, odd powers
+   of two and even, adding to power that isn't zero */
+static int
+check_spectrum(const struct kernels *k, struct check_data *cd)
+{
+  uint32_t state = 1;
+  float max;
+  size_t i, n;
+
+  for (n = 16; n <= CHECK_FFT; n *= 2) {
+    for (i = 0; i < n; i++) {
+      cd->re[0][i] = cd->re[1][i]
+	= (float)check_random(&state) / (1 << 23) - 1.0f;
+      cd->im[0][i] = cd->im[1][i]
+	= (float)check_random(&state) / (1 << 23) - 1.0f;
+      cd->window[i] = (float)check_random(&state) / (1 << 24);
+      cd->power[0][i] = cd->power[1][i] = (float)i;
+    }
+    kernels_fft_twiddles(cd->tw, n);
+    c_kernels.spectrum(cd->re[0], cd->im[0], n, cd->window, cd->tw,
+		       cd->power[0]);
+    k->spectrum(cd->re[1], cd->im[1], n, cd->window, cd->tw, cd->power[1]);
+    max = 0;
+    for (i = 0; i < n; i++)
+      if (cd->power[0][i] > max)
+	max = cd->power[0][i];
+    for (i = 0; i < n; i++)
+      if (fabs(cd->power[0][i] - cd->power[1][i]) > 1e-5 * max)
+	return -1;
+  }
+  return 0;
+}
+
+/*
+ * Check the kernels k against the portable ones.  Returns 0 if they
+ * agree, or -1 if they don't, or there wasn't memory to check.
+ */
+int
+kernels_check(const struct kernels *k)
+{
+  struct check_data *cd;
+  uint32_t state = 1;
+  size_t i;
+  int err = -1;
+
+  if (k == &c_kernels)
+    return 0;
+  cd = (struct check_data *)malloc(sizeof(struct check_data));
+  if (cd == NULL)
+    return -1;
+
+  /* random samples, with runs of full scale ones to clip */
+  for (i = 0; i < sizeof(cd->in); i++)
+    cd->in[i] = (unsigned char)check_random(&state);
+  for (i = 0; i + 6 <= sizeof(cd->in); i += 64)
+    memcpy(cd->in + i, "\xff\xff\x7f\x00\x00\x80", 6);
+
+  if (check_convert(k, cd) == 0 && check_stats(k, cd) == 0
+      && check_peak(k, cd) == 0 && check_gain(k, cd) == 0
+      && check_soft_clip(k, cd->x, cd->y) == 0
+      && check_k_weight(k, cd->x) == 0 && check_to_float(k, cd) == 0
+      && check_true_peak(k, cd) == 0 && check_spectrum(k, cd) == 0)
+    err = 0;
+
+  free(cd);
+  return err;
+}
+
+
+/*
+ * The tuner: time each kernel of every set this CPU can run, on
+ * blocks of typical samples, and put the fastest together.
+ */
+
+#define TUNE_SAMPLES 65536
+#define TUNE_FRAMES 2048  /* stereo frames in a block */
+#define TUNE_CLOCKS (CLOCKS_PER_SEC / 200)  /* time each for 5ms or more */
+
+enum {
+  TUNE_UNPACK, TUNE_PACK, TUNE_STATS, TUNE_PEAK, TUNE_GAIN, TUNE_SOFT_CLIP,
+  TUNE_K_WEIGHT, TUNE_TO_FLOAT, TUNE_TRUE_PEAK, TUNE_SPECTRUM, TUNE_LUT
+};
+
+/* the samples the tuner times kernels on */
+struct tune_data {
+  unsigned char buf[TUNE_SAMPLES * 3];
+  int32_t planes[TUNE_FRAMES * 2];
+  double x[TUNE_SAMPLES / 4];
+  float f[TUNE_SAMPLES / 4];
+  float tp_coef[KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES];
+  float re[TUNE_FRAMES * 2], im[TUNE_FRAMES * 2], power[TUNE_FRAMES * 2];
+  float window[TUNE_FRAMES * 2], tw[KERNEL_FFT_TWIDDLES(TUNE_FRAMES * 2)];
+  int16_t lut[65536];
+};
+
+/* run kernel number what of k over the samples once */
+static void
+tune_run(const struct kernels *k, int what, struct tune_data *td)
+{
+  int32_t *x = td->planes, max = 0, min = 0;
+  int64_t sum = 0;
+  double state[12], sums[2];
+  size_t i, j;
+
+  memset(state, 0, sizeof(state));
+  sums[0] = sums[1] = 0;
+
+  for (i = 0; i < TUNE_SAMPLES; i += TUNE_FRAMES * 2) {
+    switch (what) {
+    case TUNE_UNPACK:
+      /* stereo blocks of 24 and 16-bit samples, ending with 16-bit
+	 ones, so the planes are in range for everything else */
+      k->unpack(td->buf + i * 3, 3, 2, TUNE_FRAMES, x, TUNE_FRAMES);
+      k->unpack(td->buf + i * 2, 2, 2, TUNE_FRAMES, x, TUNE_FRAMES);
+      break;
+    case TUNE_PACK:
+      k->pack(x, TUNE_FRAMES, 3, 2, TUNE_FRAMES, td->buf + i * 3);
+      k->pack(x, TUNE_FRAMES, 2, 2, TUNE_FRAMES, td->buf + i * 2);
+      break;
+    case TUNE_STATS:
+      /* in windows of a 100th of a second, as analysis does */
+      for (j = 0; j + 441 <= TUNE_FRAMES * 2; j += 441)
+	k->stats(x + j, 441, &sum, &max, &min);
+      break;
+    case TUNE_PEAK:
+      k->peak(x, TUNE_FRAMES * 2, &max, &min);
+      break;
+    case TUNE_GAIN:
+      k->gain(x, TUNE_FRAMES * 2, 0.99, -32768, 32767);
+      break;
+    case TUNE_SOFT_CLIP:
+      if (i < TUNE_SAMPLES / 4)
+	k->soft_clip(td->x + i, TUNE_FRAMES * 2, 8388607.0);
+      break;
+    case TUNE_K_WEIGHT:
+      /* stereo, in blocks of the same size */
+      if (i < TUNE_SAMPLES / 4)
+	k->k_weight(td->x + i, TUNE_FRAMES, 2, TUNE_FRAMES, check_k_coef,
+		    state, sums);
+      break;
+    case TUNE_TO_FLOAT:
+      k->to_float(x, TUNE_FRAMES * 2, 1.0f / 32768, td->re);
+      break;
+    case TUNE_TRUE_PEAK:
+      /* a plane, with the samples before it to read back to */
+      if (i < TUNE_SAMPLES / 4)
+	k->true_peak(td->f + i + KERNEL_TRUE_PEAK_TAPS - 1,
+		     TUNE_FRAMES * 2 - KERNEL_TRUE_PEAK_TAPS + 1, td->tp_coef);
+      break;
+    case TUNE_SPECTRUM:
+      /* a plane as both parts, the size band levels use at 48kHz */
+      if (i < TUNE_SAMPLES / 4) {
+	memcpy(td->re, td->f + i, sizeof(td->re));
+	memcpy(td->im, td->f + i, sizeof(td->im));
+	k->spectrum(td->re, td->im, TUNE_FRAMES * 2, td->window, td->tw,
+		    td->power);
+      }
+      break;
+    case TUNE_LUT:
+      /* a lookup table, as gain_block() uses one */
+      for (j = 0; j < TUNE_FRAMES * 2; j++)
+	x[j] = td->lut[x[j] + 32768];
+      break;
+    }
+  }
+}
+
+/* the seconds a run of kernel number what of k takes */
+static double
+tune_time(const struct kernels *k, int what, struct tune_data *td)
+{
+  clock_t start, elapsed;
+  long n = 0;
+
+  tune_run(k, what, td);  /* warm up */
+  start = clock();
+  do {
+    tune_run(k, what, td);
+    n++;
+    elapsed = clock() - start;
+  } while (elapsed < TUNE_CLOCKS);
+  return (double)elapsed / CLOCKS_PER_SEC / n;
+}
+
+/* nonzero if kernel number what is the same code in a and b */
+static int
+tune_same(const struct kernels *a, const struct kernels *b, int what)
+{
+  switch (what) {
+  case TUNE_UNPACK:
+    return a->unpack == b->unpack;
+  case TUNE_PACK:
+    return a->pack == b->pack;
+  case TUNE_STATS:
+    return a->stats == b->stats;
+  case TUNE_PEAK:
+    return a->peak == b->peak;
+  case TUNE_GAIN:
+    return a->gain == b->gain;
+  case TUNE_SOFT_CLIP:
+    return a->soft_clip == b->soft_clip;
+  case TUNE_K_WEIGHT:
+    return a->k_weight == b->k_weight;
+  case TUNE_TO_FLOAT:
+    return a->to_float == b->to_float;
+  case TUNE_TRUE_PEAK:
+    return a->true_peak == b->true_peak;
+  case TUNE_SPECTRUM:
+    return a->spectrum == b->spectrum;
+  }
+  return 0;
+}
+
+/*
+ * Fill in *tuned with the fastest kernel of each kind, from the sets
+ * this CPU can run that pass the self-test, and name it after them in
+ * name, which has room for KERNEL_TUNED_NAME characters.  If there's
+ * no memory to time them in, it's the best set.
+ */
+void
+kernels_tune(struct kernels *tuned, char *name)
+{
+  const struct kernels *k, *winner[TUNE_LUT];
+  struct tune_data *td;
+  double t, best[TUNE_LUT];
+  uint32_t state = 1;
+  long j;
+  int i, what;
+
+  *tuned = *kernels_best();
+  td = (struct tune_data *)malloc(sizeof(struct tune_data));
+  if (td == NULL)
+    return;
+  for (j = 0; j < TUNE_SAMPLES * 3; j++)
+    td->buf[j] = (unsigned char)check_random(&state);
+  for (j = 0; j < TUNE_FRAMES * 2; j++)
+    td->planes[j] = (int32_t)(check_random(&state) & 0xFFFF) - 32768;
+  for (j = 0; j < TUNE_SAMPLES / 4; j++)
+    td->x[j] = ((double)check_random(&state) / (1 << 24) - 0.5) * 4e7;
+  for (j = 0; j < TUNE_SAMPLES / 4; j++)
+    td->f[j] = (float)check_random(&state) / (1 << 23) - 1.0f;
+  for (j = 0; j < KERNEL_TRUE_PEAK_TAPS * KERNEL_TRUE_PEAK_PHASES; j++)
+    td->tp_coef[j] = (float)check_random(&state) / (1 << 24) - 0.5f;
+  kernels_fft_twiddles(td->tw, TUNE_FRAMES * 2);
+  for (j = 0; j < TUNE_FRAMES * 2; j++) {
+    td->window[j] = (float)(0.5 - 0.5 * cos(2 * M_PI * j / (TUNE_FRAMES * 2)));
+    td->power[j] = 0;
+  }
+  for (j = 0; j < 65536; j++)
+    td->lut[j] = (int16_t)((j - 32768) * 0.99);
+
+  *tuned = c_kernels;
+  tuned->name = name;
+  for (what = 0; what < TUNE_LUT; what++) {
+    best[what] = tune_time(&c_kernels, what, td);
+    winner[what] = &c_kernels;
+  }
+  for (i = 1; (k = kernel_sets[i]) != NULL; i++) {
+    if (!kernels_supported(k) || kernels_check(k) != 0)
+      continue;
+    for (what = 0; what < TUNE_LUT; what++) {
+      if (tune_same(k, winner[what], what))
+	continue;
+      t = tune_time(k, what, td);
+      if (t >= best[what])
+	continue;
+      best[what] = t;
+      winner[what] = k;
+      switch (what) {
+      case TUNE_UNPACK:
+	tuned->unpack = k->unpack;
+	break;
+      case TUNE_PACK:
+	tuned->pack = k->pack;
+	break;
+      case TUNE_STATS:
+	tuned->stats = k->stats;
+	break;
+      case TUNE_PEAK:
+	tuned->peak = k->peak;
+	break;
+      case TUNE_GAIN:
+	tuned->gain = k->gain;
+	break;
+      case TUNE_SOFT_CLIP:
+	tuned->soft_clip = k->soft_clip;
+	break;
+      case TUNE_K_WEIGHT:
+	tuned->k_weight = k->k_weight;
+	break;
+      case TUNE_TO_FLOAT:
+	tuned->to_float = k->to_float;
+	break;
+      case TUNE_TRUE_PEAK:
+	tuned->true_peak = k->true_peak;
+	break;
+      case TUNE_SPECTRUM:
+	tuned->spectrum = k->spectrum;
+	break;
+      }
+    }
+  }
+
+  for (what = 0; what < TUNE_LUT; what++)
+    if (winner[what]->isa > tuned->isa)
+      tuned->isa = winner[what]->isa;
+
+  /* and whether the table or the gain kernel is faster; building the
+     table is nothing, over a whole file */
+  tuned->s16_beats_lut
+    = best[TUNE_GAIN] < tune_time(&c_kernels, TUNE_LUT, td);
+  free(td);
+
+  sprintf(name, "tuned:%s,%s,%s,%s,%s,%s,%s,%s,%s,%s%s",
+	  winner[TUNE_UNPACK]->name, winner[TUNE_PACK]->name,
+	  winner[TUNE_STATS]->name, winner[TUNE_PEAK]->name,
+	  winner[TUNE_GAIN]->name,
+	  winner[TUNE_SOFT_CLIP]->name, winner[TUNE_K_WEIGHT]->name,
+	  winner[TUNE_TO_FLOAT]->name, winner[TUNE_TRUE_PEAK]->name,
+	  winner[TUNE_SPECTRUM]->name,
+	  tuned->s16_beats_lut ? "" : ",lut");
+}
@@ -0,0 +1,135 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Sample kernels: the inner loops of analysis and gain.  Samples are
+ * converted from the file's interleaved bytes into planes of 32-bit
+ * integers, one plane per channel, and everything else works on the
+ * planes, so it doesn't matter how the file lays them out.  There's a
+ * portable C version of each kernel, and SIMD versions where the
+ * compiler and the CPU can run them.  All versions give exactly the
+ * same results.
+ */
+
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <sys/types.h>
+
+/* the most samples the stats kernel can take at once, so that the
+   sums of squares of 24-bit samples can't overflow */
+#define KERNEL_MAX_FRAMES 131072
+
+/* the true peak filter: the taps of each of its phases, and how many
+   samples it makes of each one */
+#define KERNEL_TRUE_PEAK_TAPS 12
+#define KERNEL_TRUE_PEAK_PHASES 4
+
+/* the instruction sets kernels can need */
+#define KERNEL_ISA_NONE   0
+#define KERNEL_ISA_SSE2   1
+#define KERNEL_ISA_SSSE3  2
+#define KERNEL_ISA_AVX2   3
+#define KERNEL_ISA_AVX512 4
+
+struct kernels {
+  const char *name;
+  int isa;    /* the KERNEL_ISA_* the CPU needs to run these */
+
+  /* convert nframes frames of interleaved little-endian samples of
+     bytes_per_sample bytes (1 to 4, with 8-bit samples unsigned) to
+     planes of signed samples, channel c's starting at planes + c *
+     stride */
+  void (*unpack)(const unsigned char *in, int bytes_per_sample,
+		 int channels, size_t nframes, int32_t *planes,
+		 size_t stride);
+
+  /* and back; the samples must be in range for bytes_per_sample */
+  void (*pack)(const int32_t *planes, size_t stride, int bytes_per_sample,
+	       int channels, size_t nframes, unsigned char *out);
+
+  /* add the squares of n samples of at most 24 bits to *sum, and
+     update *pmax and *pmin with the extremes */
+  void (*stats)(const int32_t *x, size_t n, int64_t *sum,
+		int32_t *pmax, int32_t *pmin);
+
+  /* just update *pmax and *pmin with the extremes of n samples */
+  void (*peak)(const int32_t *x, size_t n, int32_t *pmax, int32_t *pmin);
+
+  /* multiply n samples by gain, in place, truncating toward zero and
+     clipping to min .. max; returns the number of samples clipped */
+  unsigned long (*gain)(int32_t *x, size_t n, double gain,
+			int32_t min, int32_t max);
+
+  /* nonzero if gain on 16-bit samples is faster than a lookup table,
+     counting the time to build the table, as measured on a typical
+     file */
+  int s16_beats_lut;
+
+  /* replace each of x[0] .. x[n - 1] with full_scale * tanh(x[i] /
+     full_scale), to within a thousandth of an LSB of 32 bits */
+  void (*soft_clip)(double *x, size_t n, double full_scale);
+
+  /* run n samples of each of channels planes of doubles, channel c's
+     starting at x + c * stride, through the two biquads of the
+     K-weighting filter, whose b0, b1, b2, a1 and a2 are coef[0 .. 4]
+     and coef[5 .. 9], with channel c's state at state + 6 * c, and add
+     the squares of what comes out to sums[c]; the channels are
+     filtered side by side, in the lanes of a vector */
+  void (*k_weight)(const double *x, size_t stride, int channels, size_t n,
+		   const double *coef, double *state, double *sums);
+
+  /* convert n samples to floats, out[i] = x[i] * scale, rounding to
+     nearest */
+  void (*to_float)(const int32_t *x, size_t n, float scale, float *out);
+
+  /* oversample x[0] .. x[n - 1] by the polyphase filter whose phase p
+     has the taps coef[KERNEL_TRUE_PEAK_TAPS * p ..], the first of which
+     goes with the oldest sample, and return the largest magnitude that
+     comes out; the filter reads back to x[1 - KERNEL_TRUE_PEAK_TAPS] */
+  float (*true_peak)(const float *x, size_t n, const float *coef);
+
+  /* multiply the n points re[j] + i im[j] by the window w[j], take
+     their discrete Fourier transform X[k], with the twiddles
+     kernels_fft_twiddles() makes for n, and add |X[k]|^2 to power[p],
+     p = kernels_fft_position(k, n); n is a power of two and 16 or
+     more, and re and im are used up */
+  void (*spectrum)(float *re, float *im, size_t n, const float *w,
+		   const float *tw, float *power);
+};
+
+/* room for the name kernels_tune() gives its kernels: "tuned:", the
+   names of the sets it took the unpack, pack, stats, peak, gain,
+   soft_clip, k_weight, to_float, true_peak and spectrum kernels from,
+   and ",lut" if a 16-bit lookup table is faster */
+#define KERNEL_TUNED_NAME 96
+
+/* the floats of twiddles the spectrum kernels need for n points */
+#define KERNEL_FFT_TWIDDLES(n) (2 * (n))
+
+/* the kernel sets built in, the portable one first, then NULL */
+extern const struct kernels *const kernel_sets[];
+
+int kernels_supported(const struct kernels *k);
+const struct kernels *kernels_find(const char *name);
+const struct kernels *kernels_best(void);
+int kernels_check(const struct kernels *k);
+void kernels_tune(struct kernels *tuned, char *name);
+void kernels_fft_twiddles(float *tw, size_t n);
+size_t kernels_fft_position(size_t k, size_t n);
+
+#endif /* _KERNELS_H_ */
@@ -0,0 +1,5429 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _XOPEN_SOURCE 500 /* for pread() */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <math.h>
+#else
+# ifndef HAVE_STRCHR
+#  define strchr index
+#  define strrchr rindex
+# endif
+char *strchr(); char *strrchr();
+# ifndef HAVE_MEMCPY
+#  define memcpy(d,s,n) bcopy((s),(d),(n))
+#  define memmove(d,s,n) bcopy((s),(d),(n))
+# endif
+#endif
+
+#if HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#if HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#if HAVE_BYTESWAP_H
+# include <byteswap.h>
+#else
+# define bswap_16(x) \
+    ((((x) >> 8) & 0xff) | (((x) & 0xff) << 8))
+# define bswap_32(x) \
+    ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) |       \
+     (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
+# define bswap_64(x) \
+    (((uint64_t)bswap_32((x) & 0xffffffff) << 32) | bswap_32((x) >> 32))
+#endif /* HAVE_BYTESWAP_H */
+
+#if ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext (s)
+#else
+# define _(s) (s)
+#endif
+#define N_(s) (s)
+
+#include "riff.h"
+#include "libnormalize.h"
+#include "formats.h"
+#include "kernels.h"
+
+#ifndef HAVE_FSEEKO
+# define fseeko fseek
+#endif
+
+#define USE_TEMPFILE 0
+#define USE_LOOKUPTABLE 1
+
+/* how many lookup tables are kept, for later files to reuse */
+#define LUT_CACHE_SIZE 4
+
+#define FRACTODB(x) (20 * log10(x))
+
+/* float samples are scaled to 24 bits for the sample counts */
+#define FLOAT_FULL_SCALE 8388608.0
+
+/* for copy_bytes(), to copy everything that's left */
+#define COPY_TO_EOF ((uint64_t)-1)
+
+/* the samples in a block, over all its channels */
+#define BLOCK_SAMPLES 8192
+
+/* the blocks a peak-only analysis reads at once */
+#define PEAK_CHUNK_BLOCKS 8
+
+/* the windows the power is smoothed over: a second's worth */
+#define SMOOTH_WINDOWS 100
+
+/* the confidence signal_info.level_max is worked out at, for sampled
+   analysis, and the most of the gaps between the loudest levels
+   sampled it uses.  The bound takes those levels to be spread evenly,
+   which real ones aren't, so this is only a knob, not the confidence
+   the range really has: at 0.95 the range held for 88% of a set of
+   long test recordings, at 0.99 for 97%.  That's why the range is
+   documented as a heuristic, and not as a confidence interval. */
+#define SAMPLED_CONFIDENCE 0.99
+#define SAMPLED_TAIL 32
+
+/* EBU R128 loudness: see struct loudness */
+#define LOUDNESS_GATE (-70)       /* the absolute gate, in LUFS */
+#define LOUDNESS_TOP 30           /* louder blocks go in the top bin */
+#define LOUDNESS_BINS_PER_LU 100
+#define LOUDNESS_BINS \
+  ((LOUDNESS_TOP - LOUDNESS_GATE) * LOUDNESS_BINS_PER_LU)
+#define LOUDNESS_STEPS 30         /* 100ms steps in a short-term block */
+#define LOUDNESS_MIN_RATE 8000    /* the K-weighting shelf is at 1.7kHz */
+
+/* the loudness of a K-weighted mean square */
+#define ENERGYTOLUFS(x) (-0.691 + 10 * log10(x))
+/* and the amplitude that stands for a loudness, as a level */
+#define LUFSTOAMP(x) exp((x) * log(10.0) / 20)
+
+#ifndef FALSE
+# define FALSE  (0)
+#endif
+#ifndef TRUE
+# define TRUE   (!FALSE)
+#endif
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+/* anything less than EPSILON is considered zero */
+#ifndef EPSILON
+# define EPSILON 0.00000000001
+#endif
+
+#if USE_LOOKUPTABLE
+/*
+ * A lookup table of adjusted samples.  Tables are shared by every
+ * context in the process: once built, a table is only read, and it's
+ * good for any file with the same sample size, gain and compression,
+ * whose samples are from lo to hi.  They outlive the contexts that
+ * build them, so they're allocated with malloc(), not the context's
+ * allocator.
+ */
+struct lut_entry {
+  int16_t *lut;         /* indexed from lo to hi */
+  long lo, hi;
+  int bytes_per_sample;
+  double gain;
+  int do_compression;
+  long min_pos_clipped; /* the minimum positive sample that gets clipped */
+  long max_neg_clipped; /* the maximum negative sample that gets clipped */
+  int refs;             /* one for the cache, and one per gain_state */
+  unsigned long last_used;
+};
+
+/*
+ * The tables most recently used, for any context to reuse.  The lock
+ * covers the cache and the entries' refs and last_used; the tables
+ * themselves need none.  Without pthreads there are no threads to
+ * guard against.
+ */
+static struct lut_entry *lut_cache[LUT_CACHE_SIZE];
+static unsigned long lut_clock;
+#if HAVE_PTHREAD_H
+static pthread_mutex_t lut_lock = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_LUTS() pthread_mutex_lock(&lut_lock)
+# define UNLOCK_LUTS() pthread_mutex_unlock(&lut_lock)
+#else
+# define LOCK_LUTS()
+# define UNLOCK_LUTS()
+#endif
+#endif
+
+struct _normalize_t {
+  normalize_allocator_t allocator;
+
+  double target;       /* target amplitude */
+  double threshold;    /* in decibels, or < 0 for 2 * standard deviation */
+  int mode;            /* one of the NORMALIZE_MODE_* values */
+  int loudness;        /* one of the NORMALIZE_LOUDNESS_* values */
+  int do_true_peak;    /* measure true peaks */
+  double true_peak_limit; /* the highest true peak a gain may make, or
+			     <= 0 for no limit */
+  int nband_edges;     /* the bands to measure levels in, or 0 for none */
+  double band_edges[NORMALIZE_MAX_BANDS - 1];
+  unsigned int metrics; /* the NORMALIZE_METRIC_* asked for */
+  double max_clip;     /* the fraction of samples a gain may clip, or < 0
+			  for any */
+  double sampling;     /* the fraction of a file to estimate levels from,
+			  or 0 for all of it */
+  double *ranges;      /* the start and end times, in seconds, of the
+			  nranges parts of a file to analyze and adjust,
+			  or NULL for all of it */
+  int nranges;
+  double ramp;         /* seconds to change from one segment's gain to
+			  the next over */
+  double max_gain;     /* the most a lookahead may raise the level by,
+			  or <= 0 for 1 / target */
+  int do_compression;
+  int float_output;    /* write 32-bit float samples, whatever we read */
+  int use_raw_format;  /* files are headerless samples in raw_format */
+  struct wavfmt raw_format;
+
+  normalize_progress_t progress;
+  void *progress_data;
+
+  const char *errmsg;  /* describes the last format or argument error,
+			  untranslated */
+
+  const struct kernels *kernels; /* NULL until the default is chosen */
+  struct kernels tuned;          /* for normalize_set_kernels("tune") */
+  char tuned_name[KERNEL_TUNED_NAME];
+};
+
+static int xmkstemp(char *template);
+static int xrename(const char *oldpath, const char *newpath);
+static int write_float_header(FILE *out, const struct wavfmt *fmt, int bits,
+			      uint64_t nsamples);
+static int apply_fd(normalize_t *nz, int read_fd, int write_fd,
+		    const char *name, double gain, const double *gains,
+		    const struct signal_info *psi, struct gain_info *pgi);
+static int adjust_file(normalize_t *nz, const char *filename, double gain,
+		       const double *gains, const struct signal_info *psi,
+		       struct gain_info *pgi);
+
+
+static void *
+default_alloc(size_t size, void *data)
+{
+  return malloc(size);
+}
+
+static void
+default_free(void *ptr, void *data)
+{
+  free(ptr);
+}
+
+static void *
+nz_alloc(normalize_t *nz, size_t size)
+{
+  void *ptr = nz->allocator.alloc(size, nz->allocator.data);
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+static void
+nz_free(normalize_t *nz, void *ptr)
+{
+  if (ptr)
+    nz->allocator.free(ptr, nz->allocator.data);
+}
+
+/*
+ * Set errno and the message for a bad file, and return the error code
+ */
+static int
+format_error(normalize_t *nz, const char *msg)
+{
+  return container_error(&nz->errmsg, msg);
+}
+
+/*
+ * Create a new context.  If allocator is NULL, malloc() and free()
+ * are used.  Lookup tables for 8- and 16-bit gains are shared by all
+ * contexts, and always use malloc().
+ */
+normalize_t *
+normalize_new(const normalize_allocator_t *allocator)
+{
+  normalize_t *nz;
+
+  if (allocator)
+    nz = (normalize_t *)allocator->alloc(sizeof(normalize_t), allocator->data);
+  else
+    nz = (normalize_t *)malloc(sizeof(normalize_t));
+  if (nz == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (allocator) {
+    nz->allocator = *allocator;
+  } else {
+    nz->allocator.alloc = default_alloc;
+    nz->allocator.free = default_free;
+    nz->allocator.data = NULL;
+  }
+  nz->target = 0.25;
+  nz->threshold = -1.0;
+  nz->mode = NORMALIZE_MODE_RMS;
+  nz->loudness = NORMALIZE_LOUDNESS_RMS;
+  nz->do_true_peak = FALSE;
+  nz->true_peak_limit = 0.0;
+  nz->nband_edges = 0;
+  nz->metrics = 0;
+  nz->max_clip = -1.0;
+  nz->sampling = 0.0;
+  nz->ranges = NULL;
+  nz->nranges = 0;
+  nz->ramp = 0.05;
+  nz->max_gain = 0.0;
+  nz->do_compression = FALSE;
+  nz->float_output = FALSE;
+  nz->use_raw_format = FALSE;
+  nz->progress = NULL;
+  nz->progress_data = NULL;
+  nz->errmsg = NULL;
+  nz->kernels = NULL;
+
+  return nz;
+}
+
+void
+normalize_destroy(normalize_t *nz)
+{
+  nz_free(nz, nz->ranges);
+  nz_free(nz, nz);
+}
+
+/*
+ * The target amplitude, as a fraction of full scale [default 0.25]
+ */
+void
+normalize_set_target(normalize_t *nz, double target)
+{
+  nz->target = target;
+}
+
+/*
+ * When averaging levels, throw out any level more than threshold
+ * decibels from the mean.  A negative threshold [the default] means
+ * twice the standard deviation of the levels.
+ */
+void
+normalize_set_threshold(normalize_t *nz, double threshold)
+{
+  nz->threshold = threshold;
+}
+
+int
+normalize_set_mode(normalize_t *nz, int mode)
+{
+  if (mode < NORMALIZE_MODE_RMS || mode > NORMALIZE_MODE_MIX) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  nz->mode = mode;
+  return NORMALIZE_OK;
+}
+
+/*
+ * How a signal's level is measured: NORMALIZE_LOUDNESS_RMS [the
+ * default], the loudest second of RMS power, or
+ * NORMALIZE_LOUDNESS_R128, its integrated loudness by EBU R128.  With
+ * R128, the level is the loudness as an amplitude, 10^(LUFS / 20), so
+ * gains are worked out just the same, and a target of 10^(-23 / 20) is
+ * -23 LUFS.
+ */
+int
+normalize_set_loudness(normalize_t *nz, int loudness)
+{
+  if (loudness != NORMALIZE_LOUDNESS_RMS
+      && loudness != NORMALIZE_LOUDNESS_R128) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  nz->loudness = loudness;
+  return NORMALIZE_OK;
+}
+
+/*
+ * Measure the true peak of each signal analyzed, into
+ * signal_info.true_peak.  It costs more than the rest of the analysis
+ * put together, without SIMD, so it's off by default.
+ */
+void
+normalize_set_true_peak(normalize_t *nz, int do_true_peak)
+{
+  nz->do_true_peak = do_true_peak;
+}
+
+/*
+ * Keep every gain low enough that the signal's true peak comes out at
+ * limit or under, as a fraction of full scale; 0 [the default] means
+ * no limit.  A limit turns on true peak measurement.
+ */
+void
+normalize_set_true_peak_limit(normalize_t *nz, double limit)
+{
+  nz->true_peak_limit = limit;
+}
+
+/*
+ * Measure the level in each of the bands of the spectrum split at the
+ * nedges frequencies edges, in Hz and going up, into
+ * signal_info.bands; the first band runs from 0 Hz, and the last up to
+ * half the sampling rate.  No edges [the default] means no bands.
+ * Returns NORMALIZE_ERR_INVAL if there are more than
+ * NORMALIZE_MAX_BANDS - 1 edges, or they aren't positive and going up.
+ */
+int
+normalize_set_bands(normalize_t *nz, const double *edges, int nedges)
+{
+  int i;
+
+  if (nedges < 0 || nedges > NORMALIZE_MAX_BANDS - 1) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  for (i = 0; i < nedges; i++) {
+    if (!(edges[i] > 0) || (i > 0 && !(edges[i] > edges[i - 1]))) {
+      errno = EINVAL;
+      return NORMALIZE_ERR_INVAL;
+    }
+  }
+  for (i = 0; i < nedges; i++)
+    nz->band_edges[i] = edges[i];
+  nz->nband_edges = nedges;
+  return NORMALIZE_OK;
+}
+
+/*
+ * Measure the metrics, a set of NORMALIZE_METRIC_* flags, as well as
+ * the level and peak, in the same pass; 0 [the default] means none
+ * but the ones other settings call for.  See normalize_metric_info()
+ * for their names.  In NORMALIZE_MODE_PEAK with no metrics, only the
+ * peak is measured, and reading stops at the first full scale sample;
+ * NORMALIZE_METRIC_LEVEL asks for the level all the same.
+ */
+void
+normalize_set_metrics(normalize_t *nz, unsigned int metrics)
+{
+  nz->metrics = metrics;
+}
+
+/*
+ * Keep every gain low enough that it clips at most fraction of the
+ * samples, worked out from a histogram built as the signal is
+ * analyzed; a negative fraction [the default] means any number.
+ * There's no limit with compression or float output, which don't
+ * clip.
+ */
+void
+normalize_set_max_clip(normalize_t *nz, double fraction)
+{
+  nz->max_clip = fraction;
+}
+
+/*
+ * Estimate the level of a file from about fraction of its 1 second
+ * regions, picked at random all through it, instead of reading all of
+ * it; 0 [the default] or 1 means read it all.  signal_info.level_min
+ * and level_max give a range the level is likely to be in: a
+ * heuristic (see SAMPLED_CONFIDENCE), not a confidence interval.
+ * Only normalize_analyze_fd() samples, and only for the RMS level with
+ * no metrics, which would only be of the regions read; so would the
+ * peak, so max_sample and min_sample are left at full scale.  A file
+ * is read in full if that's less than 2 regions, or more than half of
+ * them.
+ */
+int
+normalize_set_sampling(normalize_t *nz, double fraction)
+{
+  if (!(fraction >= 0 && fraction <= 1)) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  nz->sampling = fraction;
+  return NORMALIZE_OK;
+}
+
+/*
+ * Analyze and adjust only nranges parts of each file, the i'th from
+ * times[2 * i] to times[2 * i + 1] seconds, or to the end of the file
+ * if that's HUGE_VAL; no ranges [the default] means all of it.  The
+ * times are rounded to the nearest sample frame, and the parts are
+ * read straight from there, so nothing else is read or written: an
+ * adjustment leaves the rest of the file as it was on disk.  The parts
+ * are analyzed as if they were one signal.  Returns
+ * NORMALIZE_ERR_INVAL if the ranges are empty, or out of order, or
+ * overlap.  Only normalize_analyze_fd(), normalize_apply_fd() and
+ * normalize_adjust_file() use the ranges, and not with float output.
+ */
+int
+normalize_set_ranges(normalize_t *nz, const double *times, int nranges)
+{
+  double *ranges = NULL;
+  int i;
+
+  if (nranges < 0) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  for (i = 0; i < 2 * nranges; i += 2) {
+    if (!(times[i] >= 0 && times[i + 1] > times[i])
+	|| (i > 0 && times[i] < times[i - 1])) {
+      errno = EINVAL;
+      return NORMALIZE_ERR_INVAL;
+    }
+  }
+  if (nranges > 0) {
+    ranges = (double *)nz_alloc(nz, 2 * nranges * sizeof(double));
+    if (ranges == NULL)
+      return NORMALIZE_ERR_NOMEM;
+    memcpy(ranges, times, 2 * nranges * sizeof(double));
+  }
+  nz_free(nz, nz->ranges);
+  nz->ranges = ranges;
+  nz->nranges = nranges;
+  return NORMALIZE_OK;
+}
+
+/*
+ * Set how long, in seconds, normalize_apply_segments() takes to change
+ * from one segment's gain to the next [default 0.05]; 0 changes it at
+ * once.  Returns NORMALIZE_ERR_INVAL if seconds is negative.
+ */
+int
+normalize_set_ramp(normalize_t *nz, double seconds)
+{
+  if (!(seconds >= 0)) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  nz->ramp = seconds;
+  return NORMALIZE_OK;
+}
+
+/*
+ * The most normalize_apply_lookahead() may raise the level by, as a
+ * factor.  Until it has heard a passage loud enough to go by, its
+ * gain comes from whatever it has heard, and a quiet lead-in would
+ * otherwise be raised to the target, far beyond where it ends up once
+ * the rest arrives.  0 [the default] means 1 / the target, as much as
+ * the target is under full scale.  Nothing else uses it.
+ */
+void
+normalize_set_max_gain(normalize_t *nz, double gain)
+{
+  nz->max_gain = gain;
+}
+
+/*
+ * Get the frames *start to *end - 1 of a file of nframes frames that
+ * range i covers, as normalize_set_ranges() gave it; returns 0 if
+ * there's no range i.  With no ranges, range 0 is the whole file.
+ */
+static int
+get_range(normalize_t *nz, int i, const struct wavfmt *fmt, uint64_t nframes,
+	  uint64_t *start, uint64_t *end)
+{
+  double t;
+
+  if (nz->nranges == 0) {
+    *start = 0;
+    *end = nframes;
+    return i == 0;
+  }
+  if (i >= nz->nranges)
+    return 0;
+
+  t = floor(nz->ranges[2 * i] * fmt->samples_per_sec + 0.5);
+  *start = t < nframes ? (uint64_t)t : nframes;
+  t = floor(nz->ranges[2 * i + 1] * fmt->samples_per_sec + 0.5);
+  *end = t < nframes ? (uint64_t)t : nframes;
+  return 1;
+}
+
+/*
+ * Return gain, lowered if it would take the true peak of the signal
+ * psi over the limit set with normalize_set_true_peak_limit(), or clip
+ * more of it than normalize_set_max_clip() allows
+ */
+double
+normalize_limit_gain(normalize_t *nz, double gain,
+		     const struct signal_info *psi)
+{
+  if (nz->true_peak_limit > 0 && psi->true_peak * gain > nz->true_peak_limit)
+    gain = nz->true_peak_limit / psi->true_peak;
+  if (nz->max_clip >= 0 && !nz->do_compression && !nz->float_output
+      && gain > psi->clip_gain)
+    gain = psi->clip_gain;
+  return gain;
+}
+
+/*
+ * The gain of step i of signal_info.gain_clips, over the first gain
+ * that clips, in dB
+ */
+static double
+clip_step_db(int i)
+{
+  if (i < NORMALIZE_CLIP_FINE_STEPS)
+    return i / 32.0;
+  return (NORMALIZE_CLIP_FINE_STEPS - 1) / 32.0
+    + (i - NORMALIZE_CLIP_FINE_STEPS + 1) / 2.0;
+}
+
+/*
+ * Return the number of samples of the signal psi that gain would clip,
+ * if its histogram was measured, or else 0.  Gains between the steps
+ * of signal_info.gain_clips are rounded up, so this is never too low.
+ * The last step takes every sample but 0 past full scale, so any gain
+ * over it clips as many as it does.
+ */
+uint64_t
+normalize_predict_clips(const struct signal_info *psi, double gain)
+{
+  double db;
+  int i;
+
+  if (!(psi->metrics & NORMALIZE_METRIC_HISTOGRAM)
+      || gain < psi->first_clip_gain)
+    return 0;
+  db = 20 * log10(gain / psi->first_clip_gain) - 1e-9;
+  if (db <= clip_step_db(NORMALIZE_CLIP_FINE_STEPS - 1))
+    i = (int)ceil(32 * db);
+  else
+    i = NORMALIZE_CLIP_FINE_STEPS - 1
+      + (int)ceil(2 * (db - clip_step_db(NORMALIZE_CLIP_FINE_STEPS - 1)));
+  if (i < 0)
+    i = 0;
+  if (i >= NORMALIZE_CLIP_STEPS)
+    i = NORMALIZE_CLIP_STEPS - 1;
+  return psi->gain_clips[i];
+}
+
+/*
+ * Do tanh compression instead of clipping, when positive gain would
+ * clip.
+ */
+void
+normalize_set_compression(normalize_t *nz, int do_compression)
+{
+  nz->do_compression = do_compression;
+}
+
+/*
+ * Write IEEE float samples when applying gain to a file or a stream,
+ * even if the input is integer PCM.  Float samples can't clip, so no
+ * compression is needed however high the gain.  The output gets a
+ * new, minimal WAV header, so any other chunks are dropped.  This has
+ * no effect on normalize_apply_buffer(), which works in place.
+ */
+void
+normalize_set_float_output(normalize_t *nz, int float_output)
+{
+  nz->float_output = float_output;
+}
+
+/*
+ * Take files given to normalize_analyze_fd(), normalize_apply_fd(),
+ * and normalize_adjust_file() to be headerless samples in the format
+ * fmt, instead of looking for a header.  If fmt is NULL, headers are
+ * looked for again.
+ */
+void
+normalize_set_raw_format(normalize_t *nz, const struct wavfmt *fmt)
+{
+  nz->use_raw_format = fmt != NULL;
+  if (fmt)
+    nz->raw_format = *fmt;
+}
+
+/*
+ * Return the kernels to use: the ones chosen with
+ * normalize_set_kernels(), or for the newest instruction set this CPU
+ * has, if they pass the self-test.
+ */
+static const struct kernels *
+nz_kernels(normalize_t *nz)
+{
+  if (nz->kernels == NULL) {
+    nz->kernels = kernels_best();
+    if (kernels_check(nz->kernels) != 0)
+      nz->kernels = kernel_sets[0];
+  }
+  return nz->kernels;
+}
+
+/*
+ * Choose the sample kernels: name is one of the names given by
+ * normalize_kernel_info(), or "tune" to time them all on this CPU and
+ * take the fastest of each kind, or NULL or "auto" [the default] for
+ * the newest instruction set this CPU has.  Kernels are checked
+ * against the portable ones before they're used.
+ */
+int
+normalize_set_kernels(normalize_t *nz, const char *name)
+{
+  const struct kernels *k;
+
+  nz->errmsg = NULL;
+  if (name == NULL || strcmp(name, "auto") == 0) {
+    nz->kernels = NULL;
+    return NORMALIZE_OK;
+  }
+  if (strcmp(name, "tune") == 0) {
+    kernels_tune(&nz->tuned, nz->tuned_name);
+    nz->kernels = &nz->tuned;
+    return NORMALIZE_OK;
+  }
+
+  k = kernels_find(name);
+  if (k == NULL)
+    nz->errmsg = N_("no kernels by that name");
+  else if (!kernels_supported(k))
+    nz->errmsg = N_("kernels not supported by this CPU");
+  else if (kernels_check(k) != 0)
+    nz->errmsg = N_("kernels failed their self-test");
+  if (nz->errmsg) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  nz->kernels = k;
+  return NORMALIZE_OK;
+}
+
+/*
+ * Return the name of the kernels in use
+ */
+const char *
+normalize_get_kernels(normalize_t *nz)
+{
+  return nz_kernels(nz)->name;
+}
+
+/*
+ * Return the name of the i'th set of kernels built in, and set
+ * *status to one of the NORMALIZE_KERNEL_* values, or return NULL if
+ * there are fewer than i + 1 sets.
+ */
+const char *
+normalize_kernel_info(int i, int *status)
+{
+  int n;
+
+  for (n = 0; n < i; n++)
+    if (kernel_sets[n] == NULL)
+      return NULL;
+  if (kernel_sets[i] == NULL)
+    return NULL;
+  if (!kernels_supported(kernel_sets[i]))
+    *status = NORMALIZE_KERNEL_UNSUPPORTED;
+  else if (kernels_check(kernel_sets[i]) != 0)
+    *status = NORMALIZE_KERNEL_FAILED;
+  else
+    *status = NORMALIZE_KERNEL_OK;
+  return kernel_sets[i]->name;
+}
+
+void
+normalize_set_progress(normalize_t *nz, normalize_progress_t callback,
+		       void *data)
+{
+  nz->progress = callback;
+  nz->progress_data = data;
+}
+
+/*
+ * Return a message describing the error code err, as returned by the
+ * last call on nz.
+ */
+const char *
+normalize_strerror(normalize_t *nz, int err)
+{
+  switch (err) {
+  case NORMALIZE_OK:
+    return _("Success");
+  case NORMALIZE_ERR_NOMEM:
+    return strerror(ENOMEM);
+  case NORMALIZE_ERR_FORMAT:
+    if (nz && nz->errmsg)
+      return _(nz->errmsg);
+    return _("not a WAV file that can be handled");
+  case NORMALIZE_ERR_INVAL:
+    if (nz && nz->errmsg)
+      return _(nz->errmsg);
+    return strerror(EINVAL);
+  case NORMALIZE_ERR_IGNORED:
+    return _("all files ignored, try using -t 100");
+  }
+  return strerror(errno);
+}
+
+
+/*
+ * Float samples are always little-endian IEEE, and may not be aligned
+ */
+static __inline__ float
+get_float32(unsigned char *pdata)
+{
+  uint32_t u;
+  float f;
+
+  memcpy(&u, pdata, 4);
+#ifdef WORDS_BIGENDIAN
+  u = bswap_32(u);
+#endif
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+static __inline__ void
+put_float32(float f, unsigned char *pdata)
+{
+  uint32_t u;
+
+  memcpy(&u, &f, 4);
+#ifdef WORDS_BIGENDIAN
+  u = bswap_32(u);
+#endif
+  memcpy(pdata, &u, 4);
+}
+
+static __inline__ double
+get_float64(unsigned char *pdata)
+{
+  uint64_t u;
+  double d;
+
+  memcpy(&u, pdata, 8);
+#ifdef WORDS_BIGENDIAN
+  u = bswap_64(u);
+#endif
+  memcpy(&d, &u, 8);
+  return d;
+}
+
+static __inline__ void
+put_float64(double d, unsigned char *pdata)
+{
+  uint64_t u;
+
+  memcpy(&u, &d, 8);
+#ifdef WORDS_BIGENDIAN
+  u = bswap_64(u);
+#endif
+  memcpy(pdata, &u, 8);
+}
+
+/*
+ * Convert n samples in buf between the layout given by
+ * fmt->sample_flags and WAV's, in place, so the rest of the code
+ * only ever sees WAV samples.  Doing it twice gets back where we
+ * started.  Each loop is a plain byte shuffle, which compilers turn
+ * into vector shuffles on their own.
+ */
+static void
+flip_samples(const struct wavfmt *fmt, unsigned char *buf, size_t n)
+{
+  int bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+  unsigned char t;
+  size_t i;
+
+  if (bytes_per_sample == 1) {
+    if (fmt->sample_flags & WAVFMT_SIGNED_8)
+      for (i = 0; i < n; i++)
+	buf[i] ^= 0x80;
+    return;
+  }
+  if (!(fmt->sample_flags & WAVFMT_BIG_ENDIAN))
+    return;
+
+  switch (bytes_per_sample) {
+  case 2:
+    for (i = 0; i < n * 2; i += 2) {
+      t = buf[i];
+      buf[i] = buf[i + 1];
+      buf[i + 1] = t;
+    }
+    break;
+  case 3:
+    for (i = 0; i < n * 3; i += 3) {
+      t = buf[i];
+      buf[i] = buf[i + 2];
+      buf[i + 2] = t;
+    }
+    break;
+  case 4:
+    for (i = 0; i < n * 4; i += 4) {
+      t = buf[i];
+      buf[i] = buf[i + 3];
+      buf[i + 3] = t;
+      t = buf[i + 1];
+      buf[i + 1] = buf[i + 2];
+      buf[i + 2] = t;
+    }
+    break;
+  case 8:
+    for (i = 0; i < n * 8; i += 8) {
+      t = buf[i];     buf[i]     = buf[i + 7]; buf[i + 7] = t;
+      t = buf[i + 1]; buf[i + 1] = buf[i + 6]; buf[i + 6] = t;
+      t = buf[i + 2]; buf[i + 2] = buf[i + 5]; buf[i + 5] = t;
+      t = buf[i + 3]; buf[i + 3] = buf[i + 4]; buf[i + 4] = t;
+    }
+    break;
+  }
+}
+
+/* the highest sample rate taken from a header; anything over this is
+   a corrupt header, and sizing buffers by it could exhaust memory */
+#define MAX_SAMPLE_RATE 768000
+
+/*
+ * Make sure we can handle this type of wav
+ */
+static int
+check_format(normalize_t *nz, const struct wavfmt *fmt)
+{
+  if (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT) {
+    if (fmt->bits_per_sample != 32 && fmt->bits_per_sample != 64)
+      return format_error(nz, N_("float samples must be 32 or 64 bits"));
+  } else if (fmt->format_tag != WAVE_FORMAT_PCM) {
+    return format_error(nz, N_("this is a non-PCM WAV file"));
+  } else if (fmt->bits_per_sample > 32) {
+    return format_error(nz,
+			N_("more than 32 bits per sample not implemented"));
+  }
+  if (fmt->bits_per_sample == 0 || fmt->channels == 0
+      || fmt->samples_per_sec < 100)
+    return format_error(nz, N_("bad WAV format header"));
+  if (fmt->samples_per_sec > MAX_SAMPLE_RATE)
+    return format_error(nz, N_("sample rate is too high"));
+  return NORMALIZE_OK;
+}
+
+/* the KSDATAFORMAT_SUBTYPE_* GUIDs all end with this */
+static const unsigned char ksdataformat_tail[14] = {
+  0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+  0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
+/*
+ * Fill in *fmt from the first len bytes of a fmt chunk, which are
+ * little-endian.  For WAVE_FORMAT_EXTENSIBLE, the format tag comes
+ * from the subformat GUID.
+ */
+static int
+parse_format(const char **errmsg, const unsigned char *buf, size_t len,
+	     struct wavfmt *fmt)
+{
+  if (len < 16)
+    return container_error(errmsg, N_("bad WAV format header"));
+  fmt->format_tag        = buf[0] | (buf[1] << 8);
+  fmt->channels          = buf[2] | (buf[3] << 8);
+  fmt->samples_per_sec   = buf[4] | (buf[5] << 8) | (buf[6] << 16)
+    | ((uint32_t)buf[7] << 24);
+  fmt->avg_bytes_per_sec = buf[8] | (buf[9] << 8) | (buf[10] << 16)
+    | ((uint32_t)buf[11] << 24);
+  fmt->block_align       = buf[12] | (buf[13] << 8);
+  fmt->bits_per_sample   = buf[14] | (buf[15] << 8);
+  fmt->valid_bits = fmt->bits_per_sample;
+  fmt->channel_mask = 0;
+  fmt->sample_flags = 0;
+
+  if (fmt->format_tag == WAVE_FORMAT_EXTENSIBLE) {
+    /* cbSize, valid bits, channel mask, and the subformat GUID */
+    if (len < 40 || (buf[16] | (buf[17] << 8)) < 22)
+      return container_error(errmsg, N_("bad WAV format header"));
+    fmt->valid_bits = buf[18] | (buf[19] << 8);
+    fmt->channel_mask = buf[20] | (buf[21] << 8) | (buf[22] << 16)
+      | ((uint32_t)buf[23] << 24);
+    if (memcmp(buf + 26, ksdataformat_tail, 14) != 0)
+      return container_error(errmsg,
+			     N_("unknown WAVE_FORMAT_EXTENSIBLE subformat"));
+    fmt->format_tag = buf[24] | (buf[25] << 8);
+    if (fmt->valid_bits == 0)
+      fmt->valid_bits = fmt->bits_per_sample;
+    if (fmt->valid_bits > fmt->bits_per_sample)
+      return container_error(errmsg, N_("bad WAV format header"));
+  }
+
+  return NORMALIZE_OK;
+}
+
+/*
+ * The error code for a riff_chunk_read() that returned NULL: riff
+ * sets errno to EINVAL for a chunk it can't make sense of.
+ */
+static int
+riff_error(const char **errmsg)
+{
+  if (errno == ENOMEM)
+    return NORMALIZE_ERR_NOMEM;
+  if (errno == EINVAL || errno == 0)
+    return container_error(errmsg, N_("error reading riff chunk"));
+  return NORMALIZE_ERR_IO;
+}
+
+/*
+ * Read the WAV headers, and find the data chunk.  Returns NULL and
+ * sets *perr, and *errmsg for a format error, on error.
+ */
+static riff_chunk_t *
+get_wav_data(const char **errmsg, riff_t *riff, struct wavfmt *fmt,
+	     int *perr)
+{
+  riff_chunk_t *chnk;
+  unsigned char buf[40];
+  size_t len;
+
+  errno = 0;
+  chnk = riff_chunk_read(riff);
+  if (chnk == NULL) {
+    *perr = riff_error(errmsg);
+    goto error2;
+  }
+  if (!riff_fourcc_equals(chnk->id, "RIFF")) {
+    *perr = container_error(errmsg, N_("not a RIFF WAV file"));
+    goto error3;
+  }
+  riff_list_descend(riff, chnk);
+  riff_chunk_unref(chnk);
+
+  /* read format header */
+  errno = 0;
+  chnk = riff_chunk_read(riff);
+  if (chnk == NULL) {
+    *perr = riff_error(errmsg);
+    goto error2;
+  }
+  if (!riff_fourcc_equals(chnk->id, "fmt ")) {
+    *perr = container_error(errmsg, N_("no format chunk found"));
+    goto error3;
+  }
+  len = chnk->size < sizeof(buf) ? chnk->size : sizeof(buf);
+  if (riff_chunk_get_stream(chnk) == NULL) {
+    *perr = NORMALIZE_ERR_IO;
+    goto error3;
+  }
+  len = fread(buf, 1, len, riff_chunk_get_stream(chnk));
+  riff_chunk_unref(chnk);
+
+  *perr = parse_format(errmsg, buf, len, fmt);
+  if (*perr != NORMALIZE_OK)
+    goto error2;
+
+  /* read until data chunk */
+  chnk = NULL;
+  do {
+
+    if (chnk) {
+      riff_chunk_unref(chnk);
+      chnk = NULL;
+    }
+
+    errno = 0;
+    chnk = riff_chunk_read(riff);
+    if (chnk == NULL) {
+      if (errno == 0)
+	*perr = container_error(errmsg, N_("no data chunk found"));
+      else
+	*perr = riff_error(errmsg);
+      goto error2;
+    }
+
+  } while (!riff_fourcc_equals(chnk->id, "data"));
+
+  *perr = NORMALIZE_OK;
+  return chnk;
+
+  /* error handling stuff */
+ error3:
+  riff_chunk_unref(chnk);
+ error2:
+  return NULL;
+}
+
+
+/*
+ * Read the WAV header from a stream opened with riff_stream_open(),
+ * up to the start of the data chunk, and fill in *fmt.  If the
+ * stream isn't RIFF, it's all data: *fmt is left alone.  The other
+ * containers need to seek, so a stream that starts like one of them
+ * is refused, rather than read as samples, unless a raw format was set.
+ */
+static int
+get_stream_wav_data(normalize_t *nz, riff_stream_t *rs, int is_riff,
+		    struct wavfmt *fmt)
+{
+  unsigned char buf[40];
+  int have_fmt = FALSE, err;
+
+  if (!is_riff && !nz->use_raw_format
+      && (aiff_container.probe(rs->peek, rs->npeek)
+	  || au_container.probe(rs->peek, rs->npeek)))
+    return format_error(nz,
+			N_("AIFF and AU files can't be read from a stream"));
+  if (!is_riff)
+    return check_format(nz, fmt);
+  if (!riff_fourcc_equals(rs->type, "WAVE"))
+    return format_error(nz, N_("not a RIFF WAV file"));
+
+  for (;;) {
+    if (riff_stream_next(rs) == -1) {
+      if (errno)
+	return NORMALIZE_ERR_IO;
+      return format_error(nz, N_("no data chunk found"));
+    }
+
+    if (riff_fourcc_equals(rs->id, "data")) {
+      if (!have_fmt)
+	return format_error(nz, N_("no format chunk found"));
+      break;
+    }
+
+    if (riff_fourcc_equals(rs->id, "fmt ")) {
+      if (rs->size == RIFF_SIZE_UNKNOWN)
+	return format_error(nz, N_("bad WAV format header"));
+      err = parse_format(&nz->errmsg, buf,
+			 riff_stream_read(rs, buf, sizeof(buf)), fmt);
+      if (err != NORMALIZE_OK)
+	return err;
+      have_fmt = TRUE;
+    }
+  }
+
+  return check_format(nz, fmt);
+}
+
+static int
+wav_probe(const unsigned char *buf, size_t len)
+{
+  return len >= 4 && (memcmp(buf, "RIFF", 4) == 0
+		      || memcmp(buf, "RF64", 4) == 0
+		      || memcmp(buf, "BW64", 4) == 0
+		      || memcmp(buf, "riff", 4) == 0);
+}
+
+static int
+wav_open(int fd, struct container_info *ci, const char **errmsg)
+{
+  riff_t *riff;
+  riff_chunk_t *chnk;
+  int err;
+
+  riff = riff_new(fd, RIFF_RDONLY);
+  if (riff == NULL)
+    return errno == ENOMEM ? NORMALIZE_ERR_NOMEM : NORMALIZE_ERR_IO;
+  /* the library prints nothing: riff's errors come back in errno */
+  riff_set_msg_stream(riff, NULL);
+  chnk = get_wav_data(errmsg, riff, &ci->fmt, &err);
+  if (chnk) {
+    ci->data_offset = chnk->offset + chnk->hdr_size;
+    ci->data_size = chnk->size;
+    riff_chunk_unref(chnk);
+  }
+  riff_unref(riff);
+  return err;
+}
+
+static const struct container wav_container = {
+  "WAV", wav_probe, wav_open, write_float_header, 0
+};
+
+/* the containers we look for in a file's first bytes */
+static const struct container *const containers[] = {
+  &wav_container, &aiff_container, &au_container, NULL
+};
+
+/*
+ * Work out what kind of file is open on fd, and where its samples
+ * are.  Anything we don't recognize is read as WAV, for the error
+ * message, unless a raw format was set.  Leaves fd at an unknown
+ * offset.
+ */
+static int
+open_container(normalize_t *nz, int fd, struct container_info *ci,
+	       const struct container **ptype)
+{
+  const struct container *type;
+  unsigned char buf[12];
+  ssize_t len;
+  int i, err;
+
+  memset(&ci->fmt, 0, sizeof(struct wavfmt));
+  if (nz->use_raw_format) {
+    type = &raw_container;
+    ci->fmt = nz->raw_format;
+  } else {
+    if (lseek(fd, 0, SEEK_SET) == -1)
+      return NORMALIZE_ERR_IO;
+    len = read(fd, buf, sizeof(buf));
+    if (len == -1)
+      return NORMALIZE_ERR_IO;
+    type = &wav_container;
+    for (i = 0; containers[i]; i++) {
+      if (containers[i]->probe(buf, len)) {
+	type = containers[i];
+	break;
+      }
+    }
+  }
+
+  if (lseek(fd, 0, SEEK_SET) == -1)
+    return NORMALIZE_ERR_IO;
+  err = type->open(fd, ci, &nz->errmsg);
+  if (err != NORMALIZE_OK)
+    return err;
+  *ptype = type;
+  return check_format(nz, &ci->fmt);
+}
+
+/*
+ * A block of samples, converted from the file's interleaved bytes to
+ * planes, one per channel: 32-bit integers for integer samples, or
+ * doubles for float samples, which hold 32 and 64-bit floats exactly.
+ * Analysis and gain only ever see blocks, so they don't need to know
+ * how the samples were laid out, and their loops run over contiguous,
+ * aligned arrays.
+ */
+struct block {
+  int channels;
+  int bytes_per_sample;
+  int is_float;
+  size_t size;       /* the frames each plane has room for */
+  size_t nframes;    /* the frames in the block */
+  int32_t *s;        /* channel c's integer samples are at s + c * size */
+  double *x;         /* and its float samples at x + c * size */
+  int32_t max, min;  /* once analyzed, bounds on its integer samples */
+  void *mem;
+};
+
+/*
+ * Set up a block for samples in format fmt
+ */
+static int
+block_init(normalize_t *nz, struct block *blk, const struct wavfmt *fmt)
+{
+  size_t sample_size;
+  unsigned char *p;
+
+  blk->channels = fmt->channels;
+  blk->bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+  blk->is_float = (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT);
+  blk->nframes = 0;
+  blk->s = NULL;
+  blk->x = NULL;
+
+  /* a multiple of 16 frames, so every plane starts on a 64-byte
+     boundary if the first one does */
+  blk->size = BLOCK_SAMPLES / blk->channels / 16 * 16;
+  if (blk->size == 0)
+    blk->size = 16;
+  sample_size = blk->is_float ? sizeof(double) : sizeof(int32_t);
+  blk->mem = nz_alloc(nz, blk->size * blk->channels * sample_size + 63);
+  if (blk->mem == NULL)
+    return NORMALIZE_ERR_NOMEM;
+  p = (unsigned char *)blk->mem;
+  p += (64 - (size_t)p % 64) % 64;
+  if (blk->is_float)
+    blk->x = (double *)p;
+  else
+    blk->s = (int32_t *)p;
+  return NORMALIZE_OK;
+}
+
+static void
+block_free(normalize_t *nz, struct block *blk)
+{
+  nz_free(nz, blk->mem);
+  blk->mem = NULL;
+  blk->s = NULL;
+  blk->x = NULL;
+}
+
+/*
+ * Fill the block with nframes frames of interleaved WAV samples from
+ * data.  nframes must be at most blk->size.
+ */
+static void
+block_read(struct block *blk, const struct kernels *k, unsigned char *data,
+	   size_t nframes)
+{
+  size_t frame_bytes = blk->channels * blk->bytes_per_sample, i;
+  double *x;
+  int c;
+
+  blk->nframes = nframes;
+  if (!blk->is_float) {
+    k->unpack(data, blk->bytes_per_sample, blk->channels, nframes,
+	      blk->s, blk->size);
+    return;
+  }
+  for (c = 0; c < blk->channels; c++) {
+    x = blk->x + c * blk->size;
+    if (blk->bytes_per_sample == 4) {
+      for (i = 0; i < nframes; i++)
+	x[i] = get_float32(data + i * frame_bytes + c * 4);
+    } else {
+      for (i = 0; i < nframes; i++)
+	x[i] = get_float64(data + i * frame_bytes + c * 8);
+    }
+  }
+}
+
+/*
+ * Write the block back to data, in the layout it came in
+ */
+static void
+block_write(struct block *blk, const struct kernels *k, unsigned char *data)
+{
+  size_t frame_bytes = blk->channels * blk->bytes_per_sample, i;
+  double *x;
+  int c;
+
+  if (!blk->is_float) {
+    k->pack(blk->s, blk->size, blk->bytes_per_sample, blk->channels,
+	    blk->nframes, data);
+    return;
+  }
+  for (c = 0; c < blk->channels; c++) {
+    x = blk->x + c * blk->size;
+    if (blk->bytes_per_sample == 4) {
+      for (i = 0; i < blk->nframes; i++)
+	put_float32((float)x[i], data + i * frame_bytes + c * 4);
+    } else {
+      for (i = 0; i < blk->nframes; i++)
+	put_float64(x[i], data + i * frame_bytes + c * 8);
+    }
+  }
+}
+
+/*
+ * Write the integer samples of the block to out as interleaved 32-bit
+ * float samples, times scale
+ */
+static void
+block_write_float(struct block *blk, double scale, unsigned char *out)
+{
+  size_t frame_bytes = blk->channels * 4, i;
+  int32_t *s;
+  int c;
+
+  for (c = 0; c < blk->channels; c++) {
+    s = blk->s + c * blk->size;
+    for (i = 0; i < blk->nframes; i++)
+      put_float32((float)(s[i] * scale), out + i * frame_bytes + c * 4);
+  }
+}
+
+typedef struct {
+  double *buf;
+  int buflen;  /* elements allocated to buffer */
+  int start;   /* index of first element in buffer */
+  int n;       /* num of elements in buffer */
+} datasmooth_t;
+
+/*
+ * Takes a full smoothing window, and returns the value of the center
+ * element, smoothed.  Currently, just does a mean filter, but we could
+ * do a median or gaussian filter here instead.
+ */
+static __inline__ double
+get_smoothed_data(datasmooth_t *s)
+{
+  int i;
+  /*int center = (s->n + 1) / 2;*/
+  double smoothed;
+
+  smoothed = 0;
+  for (i = 0; i < s->n; i++)
+    smoothed += s->buf[i];
+  smoothed = smoothed / s->n;
+
+  return smoothed;
+}
+
+/*
+ * EBU R128 loudness, as ITU-R BS.1770 measures it.  Each channel is
+ * K-weighted, by a high shelf and a high pass, and the mean squares
+ * of the channels are summed, the surround ones counting for more and
+ * the LFE not at all, over 400ms blocks that start every 100ms.  The
+ * integrated loudness is the mean over the blocks above an absolute
+ * gate of -70 LUFS and a relative gate 10 LU under the mean of those.
+ * The loudness range, from EBU Tech 3342, is the spread from the 10th
+ * to the 95th percentile of 3 second blocks, gated at -70 LUFS and 20
+ * LU under their mean.
+ *
+ * Blocks are kept in a histogram of 0.01 LU bins, each with the count
+ * of its blocks and their summed energy, so a file of any length takes
+ * the same memory, and only a relative gate that falls inside a bin is
+ * off, by less than a bin.
+ */
+struct loudness_hist {
+  unsigned long count[LOUDNESS_BINS];
+  double energy[LOUDNESS_BINS];
+};
+
+struct loudness {
+  int channels;
+  double coef[10];         /* the two biquads, as kernels.h has them */
+  double *weights;         /* of each channel */
+  double *state;           /* the filters', 6 doubles a channel */
+  double *sums;            /* each channel's, over the current step */
+  double *x;               /* the block's integer samples, as doubles */
+  double scale;            /* turns integer samples into those */
+  unsigned long step;      /* frames in 100ms */
+  unsigned long step_done; /* frames of the current step done */
+  double steps[LOUDNESS_STEPS]; /* the weighted sums of the last steps */
+  unsigned long nsteps;
+  struct loudness_hist *momentary;  /* 400ms blocks */
+  struct loudness_hist *short_term; /* 3s blocks */
+};
+
+/*
+ * The K-weighting filter at a sample rate: BS.1770 gives it at 48kHz,
+ * and these are the analog filters its coefficients come from, put
+ * through the bilinear transform.
+ */
+static void
+loudness_coef(double rate, double *coef)
+{
+  double k, q, vh, vb, a0;
+
+  /* the high shelf, +4dB above 1.7kHz */
+  k = tan(M_PI * 1681.974450955533 / rate);
+  q = 0.7071752369554196;
+  vh = pow(10.0, 3.999843853973347 / 20);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1 + k / q + k * k;
+  coef[0] = (vh + vb * k / q + k * k) / a0;
+  coef[1] = 2 * (k * k - vh) / a0;
+  coef[2] = (vh - vb * k / q + k * k) / a0;
+  coef[3] = 2 * (k * k - 1) / a0;
+  coef[4] = (1 - k / q + k * k) / a0;
+
+  /* the high pass at 38Hz */
+  k = tan(M_PI * 38.13547087602444 / rate);
+  q = 0.5003270373238773;
+  a0 = 1 + k / q + k * k;
+  coef[5] = 1.0;
+  coef[6] = -2.0;
+  coef[7] = 1.0;
+  coef[8] = 2 * (k * k - 1) / a0;
+  coef[9] = (1 - k / q + k * k) / a0;
+}
+
+/*
+ * BS.1770's channel weights: 1.41 for the surround channels, nothing
+ * for the LFE, and 1.0 for the rest.  Without a channel mask, six and
+ * eight channels are taken to be 5.1 and 7.1, in WAV's order.
+ */
+static void
+loudness_weights(const struct wavfmt *fmt, double *weights)
+{
+  uint32_t mask = fmt->channel_mask, bit;
+  int c = 0, i;
+
+  if (mask == 0 && fmt->channels == 6)
+    mask = 0x3F;  /* FL FR FC LFE BL BR */
+  else if (mask == 0 && fmt->channels == 8)
+    mask = 0x63F; /* and SL SR */
+  for (i = 0; i < 32 && c < fmt->channels; i++) {
+    bit = (uint32_t)1 << i;
+    if (!(mask & bit))
+      continue;
+    if (bit == 0x8)
+      weights[c++] = 0.0;  /* LFE */
+    else if (bit & 0x630)
+      weights[c++] = 1.41; /* back and side, left and right */
+    else
+      weights[c++] = 1.0;
+  }
+  for (; c < fmt->channels; c++)
+    weights[c] = 1.0;
+}
+
+static void loudness_free(normalize_t *nz, void *state);
+
+/*
+ * Set up to measure the loudness of samples in format fmt, fed to it
+ * in blocks of up to block_size frames
+ */
+static int
+loudness_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	      size_t block_size)
+{
+  struct loudness *lm = (struct loudness *)state;
+  int bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+
+  memset(lm, 0, sizeof(struct loudness));
+  if (fmt->samples_per_sec < LOUDNESS_MIN_RATE)
+    return format_error(nz, N_("sample rate too low to measure loudness"));
+
+  lm->channels = fmt->channels;
+  loudness_coef(fmt->samples_per_sec, lm->coef);
+  lm->scale = 1.0 / ldexp(1.0, bytes_per_sample * 8 - 1);
+  lm->step = (fmt->samples_per_sec + 5) / 10;
+
+  lm->weights = (double *)nz_alloc(nz, lm->channels * sizeof(double));
+  lm->state = (double *)nz_alloc(nz, 6 * lm->channels * sizeof(double));
+  lm->sums = (double *)nz_alloc(nz, lm->channels * sizeof(double));
+  lm->momentary = (struct loudness_hist *)
+    nz_alloc(nz, sizeof(struct loudness_hist));
+  lm->short_term = (struct loudness_hist *)
+    nz_alloc(nz, sizeof(struct loudness_hist));
+  if (fmt->format_tag != WAVE_FORMAT_IEEE_FLOAT)
+    lm->x = (double *)nz_alloc(nz, block_size * lm->channels
+			       * sizeof(double));
+  if (!lm->weights || !lm->state || !lm->sums || !lm->momentary
+      || !lm->short_term
+      || (!lm->x && fmt->format_tag != WAVE_FORMAT_IEEE_FLOAT)) {
+    loudness_free(nz, lm);
+    return NORMALIZE_ERR_NOMEM;
+  }
+  loudness_weights(fmt, lm->weights);
+  memset(lm->state, 0, 6 * lm->channels * sizeof(double));
+  memset(lm->sums, 0, lm->channels * sizeof(double));
+  memset(lm->momentary, 0, sizeof(struct loudness_hist));
+  memset(lm->short_term, 0, sizeof(struct loudness_hist));
+  return NORMALIZE_OK;
+}
+
+static void
+loudness_free(normalize_t *nz, void *state)
+{
+  struct loudness *lm = (struct loudness *)state;
+
+  nz_free(nz, lm->weights);
+  nz_free(nz, lm->state);
+  nz_free(nz, lm->sums);
+  nz_free(nz, lm->x);
+  nz_free(nz, lm->momentary);
+  nz_free(nz, lm->short_term);
+  memset(lm, 0, sizeof(struct loudness));
+}
+
+/*
+ * Put a block's mean square in the histogram, if it's above the
+ * absolute gate
+ */
+static void
+hist_add(struct loudness_hist *h, double energy)
+{
+  double lufs;
+  int bin;
+
+  if (energy <= 0)
+    return;
+  lufs = ENERGYTOLUFS(energy);
+  if (lufs < LOUDNESS_GATE)
+    return;
+  bin = (int)((lufs - LOUDNESS_GATE) * LOUDNESS_BINS_PER_LU);
+  if (bin >= LOUDNESS_BINS)
+    bin = LOUDNESS_BINS - 1;
+  h->count[bin]++;
+  h->energy[bin] += energy;
+}
+
+/*
+ * Return the first bin of h above the relative gate, gate LU under
+ * the loudness of the mean of all its blocks, or -1 if it's empty
+ */
+static int
+hist_gate(const struct loudness_hist *h, double gate)
+{
+  double energy = 0, lufs;
+  unsigned long count = 0;
+  int bin;
+
+  for (bin = 0; bin < LOUDNESS_BINS; bin++) {
+    count += h->count[bin];
+    energy += h->energy[bin];
+  }
+  if (count == 0)
+    return -1;
+
+  /* the bins whose middles are at or over the gate */
+  lufs = ENERGYTOLUFS(energy / count) - gate;
+  bin = (int)ceil((lufs - LOUDNESS_GATE) * LOUDNESS_BINS_PER_LU - 0.5);
+  return bin < 0 ? 0 : bin;
+}
+
+/* the loudness of the middle of a bin */
+static double
+hist_lufs(int bin)
+{
+  return LOUDNESS_GATE + (bin + 0.5) / LOUDNESS_BINS_PER_LU;
+}
+
+/*
+ * End a 100ms step: the 400ms block and the 3s block that end with it
+ * go in the histograms
+ */
+static void
+loudness_step(struct loudness *lm)
+{
+  double energy = 0;
+  int c, i;
+
+  for (c = 0; c < lm->channels; c++) {
+    energy += lm->weights[c] * lm->sums[c];
+    lm->sums[c] = 0;
+  }
+  lm->steps[lm->nsteps % LOUDNESS_STEPS] = energy;
+  lm->nsteps++;
+  lm->step_done = 0;
+
+  /* a filter that has died away, over silence, goes to zero rather
+     than into slow denormals */
+  for (i = 0; i < 6 * lm->channels; i++)
+    if (fabs(lm->state[i]) < 1e-30)
+      lm->state[i] = 0;
+
+  if (lm->nsteps >= 4) {
+    energy = 0;
+    for (i = 1; i <= 4; i++)
+      energy += lm->steps[(lm->nsteps - i) % LOUDNESS_STEPS];
+    hist_add(lm->momentary, energy / (4.0 * lm->step));
+  }
+  if (lm->nsteps >= LOUDNESS_STEPS) {
+    energy = 0;
+    for (i = 0; i < LOUDNESS_STEPS; i++)
+      energy += lm->steps[i];
+    hist_add(lm->short_term, energy / ((double)LOUDNESS_STEPS * lm->step));
+  }
+}
+
+/*
+ * Feed the samples in blk to the loudness meter: they're K-weighted
+ * by the kernel, a step at a time
+ */
+static void
+loudness_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct loudness *lm = (struct loudness *)state;
+  const double *x = blk->x;
+  const int32_t *s;
+  double *d;
+  size_t done, n, i;
+  int c;
+
+  if (!blk->is_float) {
+    for (c = 0; c < blk->channels; c++) {
+      s = blk->s + c * blk->size;
+      d = lm->x + c * blk->size;
+      for (i = 0; i < blk->nframes; i++)
+	d[i] = s[i] * lm->scale;
+    }
+    x = lm->x;
+  }
+
+  for (done = 0; done < blk->nframes; done += n) {
+    n = lm->step - lm->step_done;
+    if (n > blk->nframes - done)
+      n = blk->nframes - done;
+    k->k_weight(x + done, blk->size, blk->channels, n, lm->coef, lm->state,
+		lm->sums);
+    lm->step_done += n;
+    if (lm->step_done == lm->step)
+      loudness_step(lm);
+  }
+}
+
+/*
+ * Fill in the integrated loudness of psi, in LUFS, or -HUGE_VAL if no
+ * block was above the gates, and the loudness range, in LU
+ */
+static void
+loudness_finish(void *state, const struct kernels *k,
+		struct signal_info *psi)
+{
+  struct loudness *lm = (struct loudness *)state;
+  double *plufs = &psi->loudness, *prange = &psi->loudness_range;
+  const struct loudness_hist *h;
+  unsigned long count, n, lo_rank, hi_rank;
+  double energy;
+  int first, bin, lo;
+
+  *plufs = -HUGE_VAL;
+  h = lm->momentary;
+  first = hist_gate(h, 10.0);
+  if (first >= 0) {
+    count = 0;
+    energy = 0;
+    for (bin = first; bin < LOUDNESS_BINS; bin++) {
+      count += h->count[bin];
+      energy += h->energy[bin];
+    }
+    if (count)
+      *plufs = ENERGYTOLUFS(energy / count);
+  }
+
+  /* the range runs between the blocks of these ranks, counting up */
+  *prange = 0.0;
+  h = lm->short_term;
+  first = hist_gate(h, 20.0);
+  if (first < 0)
+    return;
+  count = 0;
+  for (bin = first; bin < LOUDNESS_BINS; bin++)
+    count += h->count[bin];
+  if (count == 0)
+    return;
+  lo_rank = (unsigned long)(0.10 * (count - 1));
+  hi_rank = (unsigned long)(0.95 * (count - 1));
+  n = 0;
+  lo = -1;
+  for (bin = first; bin < LOUDNESS_BINS; bin++) {
+    n += h->count[bin];
+    if (lo < 0 && n > lo_rank)
+      lo = bin;
+    if (n > hi_rank) {
+      *prange = hist_lufs(bin) - hist_lufs(lo);
+      return;
+    }
+  }
+}
+
+/*
+ * True peak, as BS.1770 measures it: each channel is oversampled four
+ * times by a polyphase FIR filter, and the true peak is the largest
+ * sample that comes out.  It's never taken to be under the sample
+ * peak, though the filter can miss it by a little.  The kernel reads
+ * back KERNEL_TRUE_PEAK_TAPS - 1 samples from the start of a block, so
+ * each channel's plane keeps that many from the last block in front.
+ */
+
+#define TRUE_PEAK_HISTORY (KERNEL_TRUE_PEAK_TAPS - 1)
+
+/* the phases of the filter, from BS.1770-4 annex 2, each with its
+   oldest tap first */
+static const float true_peak_coef[KERNEL_TRUE_PEAK_PHASES
+				  * KERNEL_TRUE_PEAK_TAPS] = {
+  0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f,
+  -0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f,
+  0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f,
+
+  -0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f,
+  -0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f,
+  0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f,
+
+  -0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f,
+  -0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f,
+  0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f,
+
+  -0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f,
+  -0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f,
+  0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f
+};
+
+struct true_peak {
+  int channels;
+  float scale;         /* takes integer samples to fractions of full scale */
+  size_t stride;       /* TRUE_PEAK_HISTORY plus the block size */
+  float *x;            /* channel c's plane is at x + c * stride */
+  float peak;
+};
+
+/*
+ * Set up to measure the true peak of samples in format fmt, fed to it
+ * in blocks of up to block_size frames
+ */
+static int
+true_peak_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	       size_t block_size)
+{
+  struct true_peak *tp = (struct true_peak *)state;
+  int bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+
+  tp->channels = fmt->channels;
+  tp->scale = (float)(1.0 / ldexp(1.0, bytes_per_sample * 8 - 1));
+  tp->stride = TRUE_PEAK_HISTORY + block_size;
+  tp->peak = 0;
+  tp->x = (float *)nz_alloc(nz, tp->channels * tp->stride * sizeof(float));
+  if (tp->x == NULL)
+    return NORMALIZE_ERR_NOMEM;
+  memset(tp->x, 0, tp->channels * tp->stride * sizeof(float));
+  return NORMALIZE_OK;
+}
+
+/*
+ * Feed the samples in blk to the true peak meter
+ */
+static void
+true_peak_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct true_peak *tp = (struct true_peak *)state;
+  const double *x;
+  float *d, peak;
+  size_t i;
+  int c;
+
+  for (c = 0; c < tp->channels; c++) {
+    d = tp->x + c * tp->stride;
+    if (blk->is_float) {
+      x = blk->x + c * blk->size;
+      for (i = 0; i < blk->nframes; i++)
+	d[TRUE_PEAK_HISTORY + i] = (float)x[i];
+    } else {
+      k->to_float(blk->s + c * blk->size, blk->nframes, tp->scale,
+		  d + TRUE_PEAK_HISTORY);
+    }
+    peak = k->true_peak(d + TRUE_PEAK_HISTORY, blk->nframes,
+			true_peak_coef);
+    if (peak > tp->peak)
+      tp->peak = peak;
+    /* the last samples are the history for the next block */
+    memmove(d, d + blk->nframes, TRUE_PEAK_HISTORY * sizeof(float));
+  }
+}
+
+/*
+ * Fill in the true peak of psi, as a fraction of full scale, once the
+ * filter has run out past the last samples
+ */
+static void
+true_peak_finish(void *state, const struct kernels *k,
+		 struct signal_info *psi)
+{
+  struct true_peak *tp = (struct true_peak *)state;
+  float *d, peak;
+  int c;
+
+  for (c = 0; c < tp->channels; c++) {
+    d = tp->x + c * tp->stride;
+    memset(d + TRUE_PEAK_HISTORY, 0, TRUE_PEAK_HISTORY * sizeof(float));
+    peak = k->true_peak(d + TRUE_PEAK_HISTORY, TRUE_PEAK_HISTORY,
+			true_peak_coef);
+    if (peak > tp->peak)
+      tp->peak = peak;
+  }
+  psi->true_peak = tp->peak;
+  if (psi->true_peak < fabs(psi->peak))
+    psi->true_peak = fabs(psi->peak);
+}
+
+static void
+true_peak_free(normalize_t *nz, void *state)
+{
+  struct true_peak *tp = (struct true_peak *)state;
+
+  nz_free(nz, tp->x);
+  tp->x = NULL;
+}
+
+/*
+ * Band levels: each channel is cut into frames of n samples, n being
+ * the first power of two over a twelfth of a second, which are Hann
+ * windowed, with no overlap, and transformed.  The power in a band is
+ * the power in its bins, summed over the file.  Two planes go through
+ * each FFT, one as the real part and one as the imaginary: the power
+ * of the transform at k and -k together is that of the two planes,
+ * and the levels are averaged over the channels, so the planes never
+ * need to be pulled apart.  With an odd number of channels, the last
+ * one waits for the next frame's to pair it with.  The spectrum kernel
+ * sums the power where its FFT leaves each bin, in floats, which are
+ * added to doubles every so often; they're only sorted into bands at
+ * the end.
+ */
+
+#define BANDS_MIN_FRAME 16     /* the spectrum kernels' smallest size */
+#define BANDS_MAX_FRAME 65536  /* big enough for MAX_SAMPLE_RATE */
+#define BANDS_FLUSH 64         /* transforms summed in floats at a time */
+
+struct bands {
+  int channels;
+  double rate;
+  int nedges;
+  double edges[NORMALIZE_MAX_BANDS - 1];
+  size_t n;            /* the frame size, and the FFT's */
+  size_t fill;         /* the samples of each channel in the frame */
+  float scale;         /* takes integer samples to fractions of full scale */
+  float *frame;        /* channel c's samples at frame + c * n */
+  float *spare;        /* a plane waiting for its pair, if pending */
+  int pending;
+  float *window;
+  float *tw;           /* the FFT's twiddles */
+  float *fpower;       /* the power where the FFT leaves each bin, */
+  int nsummed;         /*   summed over this many transforms, */
+  double *power;       /*   and over the ones before */
+  double wsum;         /* the sum of the window's squares */
+  double weight;       /* the sum of wsum over every plane transformed */
+};
+
+static void bands_free(normalize_t *nz, void *state);
+
+/*
+ * Set up to measure the band levels of samples in format fmt
+ */
+static int
+bands_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	   size_t block_size)
+{
+  struct bands *b = (struct bands *)state;
+  int bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+  size_t i;
+
+  memset(b, 0, sizeof(struct bands));
+  b->channels = fmt->channels;
+  b->rate = fmt->samples_per_sec;
+  b->nedges = nz->nband_edges;
+  memcpy(b->edges, nz->band_edges, sizeof(b->edges));
+  for (b->n = BANDS_MIN_FRAME; b->n < b->rate / 12 && b->n < BANDS_MAX_FRAME;
+       b->n *= 2)
+    ;
+  b->scale = (float)(1.0 / ldexp(1.0, bytes_per_sample * 8 - 1));
+  b->frame = (float *)nz_alloc(nz, b->channels * b->n * sizeof(float));
+  b->spare = (float *)nz_alloc(nz, b->n * sizeof(float));
+  b->window = (float *)nz_alloc(nz, b->n * sizeof(float));
+  b->tw = (float *)nz_alloc(nz, KERNEL_FFT_TWIDDLES(b->n) * sizeof(float));
+  b->fpower = (float *)nz_alloc(nz, b->n * sizeof(float));
+  b->power = (double *)nz_alloc(nz, b->n * sizeof(double));
+  if (!b->frame || !b->spare || !b->window || !b->tw || !b->fpower
+      || !b->power) {
+    bands_free(nz, b);
+    return NORMALIZE_ERR_NOMEM;
+  }
+
+  for (i = 0; i < b->n; i++) {
+    b->window[i] = (float)(0.5 - 0.5 * cos(2 * M_PI * i / b->n));
+    b->wsum += b->window[i] * (double)b->window[i];
+    b->fpower[i] = 0;
+    b->power[i] = 0;
+  }
+  kernels_fft_twiddles(b->tw, b->n);
+  return NORMALIZE_OK;
+}
+
+/*
+ * Transform the planes re and im together, adding up the power
+ */
+static void
+bands_transform(struct bands *b, const struct kernels *k, float *re,
+		float *im)
+{
+  size_t i;
+
+  k->spectrum(re, im, b->n, b->window, b->tw, b->fpower);
+  if (++b->nsummed == BANDS_FLUSH) {
+    for (i = 0; i < b->n; i++) {
+      b->power[i] += b->fpower[i];
+      b->fpower[i] = 0;
+    }
+    b->nsummed = 0;
+  }
+}
+
+/*
+ * Transform the frame, whose first fill samples in each channel are
+ * real and the rest zeros
+ */
+static void
+bands_frame(struct bands *b, const struct kernels *k, size_t fill)
+{
+  float *last;
+  size_t i;
+  int c;
+
+  for (c = 0; c + 1 < b->channels; c += 2)
+    bands_transform(b, k, b->frame + c * b->n, b->frame + (c + 1) * b->n);
+  if (c < b->channels) {
+    last = b->frame + c * b->n;
+    if (b->pending)
+      bands_transform(b, k, b->spare, last);
+    else
+      memcpy(b->spare, last, b->n * sizeof(float));
+    b->pending = !b->pending;
+  }
+
+  if (fill == b->n) {
+    b->weight += b->channels * b->wsum;
+  } else {
+    for (i = 0; i < fill; i++)
+      b->weight += b->channels * (b->window[i] * (double)b->window[i]);
+  }
+}
+
+/*
+ * Feed the samples in blk to the band meter
+ */
+static void
+bands_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct bands *b = (struct bands *)state;
+  const double *x;
+  float *d;
+  size_t done, n, i;
+  int c;
+
+  for (done = 0; done < blk->nframes; done += n) {
+    n = b->n - b->fill;
+    if (n > blk->nframes - done)
+      n = blk->nframes - done;
+    for (c = 0; c < b->channels; c++) {
+      d = b->frame + c * b->n + b->fill;
+      if (blk->is_float) {
+	x = blk->x + c * blk->size + done;
+	for (i = 0; i < n; i++)
+	  d[i] = (float)x[i];
+      } else {
+	k->to_float(blk->s + c * blk->size + done, n, b->scale, d);
+      }
+    }
+    b->fill += n;
+    if (b->fill == b->n) {
+      bands_frame(b, k, b->n);
+      b->fill = 0;
+    }
+  }
+}
+
+/*
+ * Fill in the band levels of psi, once the last frame and plane are
+ * transformed
+ */
+static void
+bands_finish(void *state, const struct kernels *k, struct signal_info *psi)
+{
+  struct bands *b = (struct bands *)state;
+  double f, sums[NORMALIZE_MAX_BANDS];
+  size_t i;
+  int c, band;
+
+  if (b->fill > 0) {
+    for (c = 0; c < b->channels; c++)
+      memset(b->frame + c * b->n + b->fill, 0,
+	     (b->n - b->fill) * sizeof(float));
+    bands_frame(b, k, b->fill);
+  }
+  if (b->pending) {
+    memset(b->frame, 0, b->n * sizeof(float));
+    bands_transform(b, k, b->spare, b->frame);
+  }
+  for (i = 0; i < b->n; i++)
+    b->power[i] += b->fpower[i];
+
+  for (band = 0; band <= b->nedges; band++)
+    sums[band] = 0;
+  for (i = 0; i < b->n; i++) {
+    /* bins n - i and i are -f and f */
+    f = (i <= b->n / 2 ? i : b->n - i) * b->rate / b->n;
+    for (band = 0; band < b->nedges && f >= b->edges[band]; band++)
+      ;
+    sums[band] += b->power[kernels_fft_position(i, b->n)];
+  }
+  psi->nbands = b->nedges + 1;
+  for (band = 0; band <= b->nedges; band++)
+    psi->bands[band] = b->weight > 0 ? sqrt(sums[band] / b->n / b->weight)
+      : 0.0;
+}
+
+static void
+bands_free(normalize_t *nz, void *state)
+{
+  struct bands *b = (struct bands *)state;
+
+  nz_free(nz, b->frame);
+  nz_free(nz, b->spare);
+  nz_free(nz, b->window);
+  nz_free(nz, b->tw);
+  nz_free(nz, b->fpower);
+  nz_free(nz, b->power);
+  b->frame = b->spare = b->window = b->tw = b->fpower = NULL;
+  b->power = NULL;
+}
+
+/*
+ * The full scale sample of format fmt, as the window sums see it:
+ * float samples are scaled to FLOAT_FULL_SCALE
+ */
+static double
+full_scale(const struct wavfmt *fmt)
+{
+  if (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT)
+    return FLOAT_FULL_SCALE;
+  return ldexp(1.0, ((fmt->bits_per_sample - 1) / 8 + 1) * 8 - 1);
+}
+
+/*
+ * DC offset: the mean of each channel.  Integer samples are summed
+ * exactly.
+ */
+
+struct dc {
+  int channels;
+  double scale;        /* takes integer samples to fractions of full scale */
+  int64_t *isums;
+  double *sums;
+  uint64_t nframes;
+};
+
+static int
+dc_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	size_t block_size)
+{
+  struct dc *dc = (struct dc *)state;
+
+  dc->channels = fmt->channels;
+  dc->scale = fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT ? 1.0
+    : 1.0 / full_scale(fmt);
+  dc->isums = (int64_t *)nz_alloc(nz, dc->channels * sizeof(int64_t));
+  dc->sums = (double *)nz_alloc(nz, dc->channels * sizeof(double));
+  if (!dc->isums || !dc->sums) {
+    nz_free(nz, dc->isums);
+    nz_free(nz, dc->sums);
+    return NORMALIZE_ERR_NOMEM;
+  }
+  memset(dc->isums, 0, dc->channels * sizeof(int64_t));
+  memset(dc->sums, 0, dc->channels * sizeof(double));
+  return NORMALIZE_OK;
+}
+
+static void
+dc_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct dc *dc = (struct dc *)state;
+  const int32_t *s;
+  const double *x;
+  int64_t isum[4];
+  double sum;
+  size_t i, n = blk->nframes;
+  int c;
+
+  for (c = 0; c < dc->channels; c++) {
+    if (blk->is_float) {
+      x = blk->x + c * blk->size;
+      sum = 0;
+      for (i = 0; i < n; i++)
+	sum += x[i];
+      dc->sums[c] += sum;
+    } else {
+      /* four sums, so the additions don't wait on each other */
+      s = blk->s + c * blk->size;
+      isum[0] = isum[1] = isum[2] = isum[3] = 0;
+      for (i = 0; i + 4 <= n; i += 4) {
+	isum[0] += s[i];
+	isum[1] += s[i + 1];
+	isum[2] += s[i + 2];
+	isum[3] += s[i + 3];
+      }
+      for ( ; i < n; i++)
+	isum[0] += s[i];
+      dc->isums[c] += isum[0] + isum[1] + isum[2] + isum[3];
+    }
+  }
+  dc->nframes += blk->nframes;
+}
+
+static void
+dc_finish(void *state, const struct kernels *k, struct signal_info *psi)
+{
+  struct dc *dc = (struct dc *)state;
+  double mean;
+  int c;
+
+  psi->dc_offset = 0.0;
+  if (dc->nframes == 0)
+    return;
+  for (c = 0; c < dc->channels; c++) {
+    mean = (dc->sums[c] + (double)dc->isums[c]) * dc->scale / dc->nframes;
+    if (fabs(mean) > fabs(psi->dc_offset))
+      psi->dc_offset = mean;
+  }
+}
+
+static void
+dc_free(normalize_t *nz, void *state)
+{
+  struct dc *dc = (struct dc *)state;
+
+  nz_free(nz, dc->isums);
+  nz_free(nz, dc->sums);
+  dc->isums = NULL;
+  dc->sums = NULL;
+}
+
+/*
+ * Crest factor: the peak over the RMS level of the whole signal, which
+ * comes from the sums the level is measured from
+ */
+
+struct crest {
+  int channels;
+  double full_scale;
+  double sum;
+  uint64_t nsamples;
+};
+
+static int
+crest_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	   size_t block_size)
+{
+  struct crest *cr = (struct crest *)state;
+
+  cr->channels = fmt->channels;
+  cr->full_scale = full_scale(fmt);
+  return NORMALIZE_OK;
+}
+
+static void
+crest_window(void *state, const double *sums, unsigned int nframes)
+{
+  struct crest *cr = (struct crest *)state;
+  int c;
+
+  for (c = 0; c < cr->channels; c++)
+    cr->sum += sums[c];
+  cr->nsamples += (uint64_t)nframes * cr->channels;
+}
+
+static void
+crest_finish(void *state, const struct kernels *k, struct signal_info *psi)
+{
+  struct crest *cr = (struct crest *)state;
+  double rms;
+
+  rms = cr->nsamples ? sqrt(cr->sum / cr->nsamples) / cr->full_scale : 0.0;
+  psi->crest_factor = rms > 0 ? psi->peak / rms : 0.0;
+}
+
+/*
+ * Clipping: the samples at full scale, either way
+ */
+
+struct clips {
+  int32_t max, min;
+  uint64_t n;
+};
+
+static int
+clips_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	   size_t block_size)
+{
+  struct clips *cl = (struct clips *)state;
+
+  cl->max = (int32_t)(full_scale(fmt) - 1);
+  cl->min = -cl->max - 1;
+  return NORMALIZE_OK;
+}
+
+static void
+clips_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct clips *cl = (struct clips *)state;
+  const int32_t *s;
+  const double *x;
+  size_t i, n = 0;
+  int c;
+
+  /* most blocks never get to full scale */
+  if (!blk->is_float && blk->max < cl->max && blk->min > cl->min)
+    return;
+  for (c = 0; c < blk->channels; c++) {
+    if (blk->is_float) {
+      x = blk->x + c * blk->size;
+      for (i = 0; i < blk->nframes; i++)
+	n += x[i] >= 1.0 || x[i] <= -1.0;
+    } else {
+      s = blk->s + c * blk->size;
+      for (i = 0; i < blk->nframes; i++)
+	n += (s[i] == cl->max) | (s[i] == cl->min);
+    }
+  }
+  cl->n += n;
+}
+
+static void
+clips_finish(void *state, const struct kernels *k, struct signal_info *psi)
+{
+  psi->nclipped = ((struct clips *)state)->n;
+}
+
+/*
+ * Silence: the windows whose power is under NORMALIZE_SILENCE_DBFS in
+ * every channel
+ */
+
+struct silence {
+  int channels;
+  double floor;        /* the power of a window at NORMALIZE_SILENCE_DBFS */
+  unsigned long nwindows, nsilent;
+};
+
+static int
+silence_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	     size_t block_size)
+{
+  struct silence *si = (struct silence *)state;
+
+  si->channels = fmt->channels;
+  si->floor = full_scale(fmt) * full_scale(fmt)
+    * pow(10.0, NORMALIZE_SILENCE_DBFS / 10);
+  return NORMALIZE_OK;
+}
+
+static void
+silence_window(void *state, const double *sums, unsigned int nframes)
+{
+  struct silence *si = (struct silence *)state;
+  int c;
+
+  si->nwindows++;
+  for (c = 0; c < si->channels; c++)
+    if (sums[c] >= si->floor * nframes)
+      return;
+  si->nsilent++;
+}
+
+static void
+silence_finish(void *state, const struct kernels *k, struct signal_info *psi)
+{
+  struct silence *si = (struct silence *)state;
+
+  psi->silence = si->nwindows ? (double)si->nsilent / si->nwindows : 0.0;
+}
+
+/*
+ * Histogram: how many samples there are of each value, from which the
+ * clipping of any gain can be worked out without another pass.
+ * Samples of up to 16 bits get a bin for each value, so the counts are
+ * exact.  Wider ones get bins a 256th of an octave wide, numbered by
+ * the exponent and top mantissa bits of the sample's magnitude as a
+ * float, and a bin counts as clipped as soon as its largest value is.
+ * Float samples don't clip, so they aren't counted.
+ */
+
+#define HIST_EXACT_BINS 65536
+#define HIST_SUB_BITS 8
+#define HIST_LOG_BINS ((32 << HIST_SUB_BITS) + 1)
+
+struct histogram {
+  int exact;           /* a bin for each value of up to 16 bits */
+  int32_t max, min;    /* full scale */
+  double max_clip;     /* the budget, or < 0 for none */
+  uint64_t *bins;      /* NULL for float samples */
+  int32_t top, bottom; /* bounds on the samples counted so far */
+  uint64_t nsamples;
+};
+
+/* the log bin of a sample: 0 for 0, and from 1 up for the rest */
+static __inline__ unsigned int
+hist_log_bin(int32_t s)
+{
+  uint32_t m = s < 0 ? -(uint32_t)s : (uint32_t)s;
+  float f = (float)m;
+  uint32_t bits;
+
+  if (m == 0)
+    return 0;
+  memcpy(&bits, &f, sizeof(bits));
+  return (bits >> (23 - HIST_SUB_BITS)) - (127 << HIST_SUB_BITS) + 1;
+}
+
+/* the largest magnitude that can land in log bin b */
+static double
+hist_log_top(unsigned int b)
+{
+  unsigned int e = (b - 1) >> HIST_SUB_BITS;
+  unsigned int sub = (b - 1) & ((1 << HIST_SUB_BITS) - 1);
+
+  return ceil(ldexp((1 << HIST_SUB_BITS) + sub + 1.0,
+		    (int)e - HIST_SUB_BITS)) - 1;
+}
+
+static int
+histogram_init(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	       size_t block_size)
+{
+  struct histogram *h = (struct histogram *)state;
+  size_t nbins;
+
+  h->max = (int32_t)(full_scale(fmt) - 1);
+  h->min = -h->max - 1;
+  h->max_clip = nz->max_clip;
+  if (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT)
+    return NORMALIZE_OK;
+  h->exact = (fmt->bits_per_sample <= 16);
+  nbins = h->exact ? HIST_EXACT_BINS : HIST_LOG_BINS;
+  h->bins = (uint64_t *)nz_alloc(nz, nbins * sizeof(uint64_t));
+  if (h->bins == NULL)
+    return NORMALIZE_ERR_NOMEM;
+  memset(h->bins, 0, nbins * sizeof(uint64_t));
+  return NORMALIZE_OK;
+}
+
+static void
+histogram_block(void *state, const struct kernels *k, const struct block *blk)
+{
+  struct histogram *h = (struct histogram *)state;
+  uint64_t *bins = h->bins;
+  const int32_t *s;
+  size_t i;
+  int c;
+
+  if (bins == NULL)
+    return;
+  if (blk->max > h->top)
+    h->top = blk->max;
+  if (blk->min < h->bottom)
+    h->bottom = blk->min;
+  for (c = 0; c < blk->channels; c++) {
+    s = blk->s + c * blk->size;
+    if (h->exact) {
+      bins += HIST_EXACT_BINS / 2;
+      for (i = 0; i < blk->nframes; i++)
+	bins[s[i]]++;
+      bins -= HIST_EXACT_BINS / 2;
+    } else {
+      for (i = 0; i < blk->nframes; i++)
+	bins[hist_log_bin(s[i])]++;
+    }
+  }
+  h->nsamples += (uint64_t)blk->nframes * blk->channels;
+}
+
+/*
+ * Return the largest gain that clips at most nclips of the samples in
+ * h, or HUGE_VAL if no gain clips more.  A sample clips if gain takes
+ * it to max + 1 or min - 1, as the gain kernels see it, so the gain
+ * that clips the sample after the last one allowed is made a hair
+ * smaller.  Only the bins from the largest sample down to that one
+ * are looked at.
+ */
+static double
+histogram_clip_gain(const struct histogram *h, uint64_t nclips)
+{
+  double hi = h->max + 1.0, lo = h->min - 1.0, top;
+  const uint64_t *bins = h->bins + HIST_EXACT_BINS / 2;
+  uint64_t n = 0;
+  int32_t pos = h->top, neg = h->bottom;
+  unsigned int b;
+
+  if (h->bins == NULL)
+    return HUGE_VAL;
+  if (h->exact) {
+    /* go down through the positive and negative samples together,
+       in the order rising gain clips them */
+    while (pos > 0 || neg < 0) {
+      if (neg >= 0 || (pos > 0 && hi * neg >= lo * pos)) {
+	n += bins[pos];
+	if (n > nclips)
+	  return hi / pos * (1 - 1e-12);
+	pos--;
+      } else {
+	n += bins[neg];
+	if (n > nclips)
+	  return lo / neg * (1 - 1e-12);
+	neg++;
+      }
+    }
+    return HUGE_VAL;
+  }
+  b = hist_log_bin(h->top > -(int64_t)h->bottom ? h->top : h->bottom);
+  for ( ; b > 0; b--) {
+    n += h->bins[b];
+    if (n > nclips) {
+      top = hist_log_top(b);
+      return hi / top * (1 - 1e-12);
+    }
+  }
+  return HUGE_VAL;
+}
+
+static void
+histogram_finish(void *state, const struct kernels *k,
+		 struct signal_info *psi)
+{
+  struct histogram *h = (struct histogram *)state;
+  const uint64_t *bins = h->bins + HIST_EXACT_BINS / 2;
+  double hi = h->max + 1.0, lo = h->min - 1.0, gain;
+  int32_t pos = h->max, neg = h->min;
+  unsigned int b = HIST_LOG_BINS - 1;
+  uint64_t n = 0;
+  int i;
+
+  psi->nsamples = h->nsamples;
+  psi->first_clip_gain = HUGE_VAL;
+  psi->clip_gain = HUGE_VAL;
+  memset(psi->gain_clips, 0, sizeof(psi->gain_clips));
+  if (h->bins == NULL)
+    return;
+  if (h->max_clip >= 0)
+    psi->clip_gain = histogram_clip_gain(h, (uint64_t)(h->max_clip
+						       * h->nsamples));
+
+  /* the gain just over the one that clips nothing clips something; the
+     samples each step clips are those the last one did and more, so
+     one walk down the bins does them all */
+  psi->first_clip_gain = histogram_clip_gain(h, 0) / (1 - 1e-12);
+  if (psi->first_clip_gain == HUGE_VAL)
+    return;
+  for (i = 0; i < NORMALIZE_CLIP_STEPS; i++) {
+    gain = psi->first_clip_gain * pow(10.0, clip_step_db(i) / 20);
+    if (h->exact) {
+      for ( ; pos > 0 && pos * gain >= hi; pos--)
+	n += bins[pos];
+      for ( ; neg < 0 && neg * gain <= lo; neg++)
+	n += bins[neg];
+    } else {
+      for ( ; b > 0 && hist_log_top(b) * gain >= hi; b--)
+	n += h->bins[b];
+    }
+    psi->gain_clips[i] = n;
+  }
+}
+
+static void
+histogram_free(normalize_t *nz, void *state)
+{
+  struct histogram *h = (struct histogram *)state;
+
+  nz_free(nz, h->bins);
+  h->bins = NULL;
+}
+
+/*
+ * The metrics, each measured in the same pass as the level and peak:
+ * the analyzer converts each block once and hands it to every metric
+ * being measured, and at the end of each 1/100 second window, hands
+ * them each channel's sum of squares over it.  A metric costs only
+ * what it does with them.
+ */
+
+struct metric {
+  const char *name;
+  unsigned int flag;   /* its NORMALIZE_METRIC_* */
+  size_t size;         /* of its state, which starts out zeros */
+
+  /* set up the state for samples in format fmt, in blocks of up to
+     block_size frames; on error, leave nothing to free */
+  int (*init)(normalize_t *nz, void *state, const struct wavfmt *fmt,
+	      size_t block_size);
+  /* take a block of samples, once the core has its extremes, or NULL */
+  void (*block)(void *state, const struct kernels *k,
+		const struct block *blk);
+  /* take the sums of squares of a window of nframes frames, or NULL */
+  void (*window)(void *state, const double *sums, unsigned int nframes);
+  /* fill in psi, which has the level and peak */
+  void (*finish)(void *state, const struct kernels *k,
+		 struct signal_info *psi);
+  /* free what init allocated, or NULL */
+  void (*free)(normalize_t *nz, void *state);
+};
+
+static const struct metric metric_table[] = {
+  { "loudness", NORMALIZE_METRIC_LOUDNESS, sizeof(struct loudness),
+    loudness_init, loudness_block, NULL, loudness_finish, loudness_free },
+  { "true-peak", NORMALIZE_METRIC_TRUE_PEAK, sizeof(struct true_peak),
+    true_peak_init, true_peak_block, NULL, true_peak_finish,
+    true_peak_free },
+  { "bands", NORMALIZE_METRIC_BANDS, sizeof(struct bands),
+    bands_init, bands_block, NULL, bands_finish, bands_free },
+  { "dc", NORMALIZE_METRIC_DC, sizeof(struct dc),
+    dc_init, dc_block, NULL, dc_finish, dc_free },
+  { "crest", NORMALIZE_METRIC_CREST, sizeof(struct crest),
+    crest_init, NULL, crest_window, crest_finish, NULL },
+  { "clips", NORMALIZE_METRIC_CLIPS, sizeof(struct clips),
+    clips_init, clips_block, NULL, clips_finish, NULL },
+  { "silence", NORMALIZE_METRIC_SILENCE, sizeof(struct silence),
+    silence_init, NULL, silence_window, silence_finish, NULL },
+  { "histogram", NORMALIZE_METRIC_HISTOGRAM, sizeof(struct histogram),
+    histogram_init, histogram_block, NULL, histogram_finish, histogram_free }
+};
+
+#define NMETRICS (sizeof(metric_table) / sizeof(metric_table[0]))
+
+/*
+ * Return the name of the i'th metric, and set *metric to its
+ * NORMALIZE_METRIC_* flag, or return NULL if there are fewer than
+ * i + 1.
+ */
+const char *
+normalize_metric_info(int i, unsigned int *metric)
+{
+  if (i < 0 || (size_t)i >= NMETRICS)
+    return NULL;
+  *metric = metric_table[i].flag;
+  return metric_table[i].name;
+}
+
+/*
+ * The state of a level computation: samples are fed to it one
+ * window (1/100 of a second) at a time, or in bigger chunks if it's
+ * only after the peak.
+ */
+struct analyzer {
+  struct signal_info *psi;
+  int channels;
+  int bytes_per_sample;
+  int is_float;
+  const struct kernels *kernels;
+  unsigned int windowsz;   /* in samples per channel */
+  long samplemax, samplemin;
+  double *sums;
+  int64_t *isums;          /* exact sums, for samples of 24 bits or less */
+  datasmooth_t *powsmooth;
+  double maxpow;
+  unsigned char *data_buf; /* holds one chunk */
+  unsigned int chunksz;    /* the frames read at once: a window, or
+			      PEAK_CHUNK_BLOCKS blocks when peak_only */
+  struct block blk;
+  int level_is_loudness;   /* the level is the R128 loudness */
+  int peak_only;           /* just find the peak (see analyzer_peak()) */
+  void *state[NMETRICS];   /* each metric's, if it's being measured */
+};
+
+static void analyzer_free(normalize_t *nz, struct analyzer *an);
+
+/*
+ * Set up to compute the levels of a signal in format psi->fmt
+ */
+static int
+analyzer_init(normalize_t *nz, struct analyzer *an, struct signal_info *psi)
+{
+  struct wavfmt *fmt = &psi->fmt;
+  const struct metric *m;
+  unsigned int metrics;
+  void *state;
+  size_t i;
+  int c, err;
+
+  memset(an, 0, sizeof(struct analyzer));
+  err = check_format(nz, fmt);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  an->psi = psi;
+  an->channels = fmt->channels;
+  an->windowsz = (unsigned int)(fmt->samples_per_sec / 100);
+  an->bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+  an->is_float = (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT);
+  an->kernels = nz_kernels(nz);
+  if (an->is_float) {
+    an->samplemax = (long)FLOAT_FULL_SCALE;
+    an->samplemin = -an->samplemax;
+  } else {
+    an->samplemax = (long)((1UL << (an->bytes_per_sample * 8 - 1)) - 1);
+    an->samplemin = -an->samplemax - 1;
+  }
+  an->maxpow = 0.0;
+
+  /* initialize peaks to effectively -inf and +inf */
+  psi->max_sample = an->samplemin;
+  psi->min_sample = an->samplemax;
+  psi->loudness = -HUGE_VAL;
+  psi->loudness_range = 0.0;
+  psi->true_peak = -1.0;
+  psi->nbands = 0;
+  psi->dc_offset = 0.0;
+  psi->crest_factor = 0.0;
+  psi->nclipped = 0;
+  psi->silence = 0.0;
+  psi->nsamples = 0;
+  psi->first_clip_gain = HUGE_VAL;
+  psi->clip_gain = HUGE_VAL;
+  memset(psi->gain_clips, 0, sizeof(psi->gain_clips));
+  psi->sampled = 1.0;
+
+  metrics = nz->metrics;
+  if (nz->loudness == NORMALIZE_LOUDNESS_R128)
+    metrics |= NORMALIZE_METRIC_LOUDNESS;
+  if (nz->do_true_peak || nz->true_peak_limit > 0)
+    metrics |= NORMALIZE_METRIC_TRUE_PEAK;
+  if (nz->max_clip >= 0)
+    metrics |= NORMALIZE_METRIC_HISTOGRAM;
+  if (nz->nband_edges > 0)
+    metrics |= NORMALIZE_METRIC_BANDS;
+  else
+    metrics &= ~NORMALIZE_METRIC_BANDS;
+  psi->metrics = metrics;
+  an->level_is_loudness = (nz->loudness == NORMALIZE_LOUDNESS_R128);
+  an->peak_only = (nz->mode == NORMALIZE_MODE_PEAK && metrics == 0);
+
+  an->sums = (double *)nz_alloc(nz, an->channels * sizeof(double));
+  an->isums = (int64_t *)nz_alloc(nz, an->channels * sizeof(int64_t));
+  an->powsmooth = (datasmooth_t *)nz_alloc(nz, an->channels
+					   * sizeof(datasmooth_t));
+  if (!an->sums || !an->isums || !an->powsmooth
+      || block_init(nz, &an->blk, fmt) != NORMALIZE_OK)
+    goto error;
+  an->chunksz = an->windowsz;
+  if (an->peak_only)
+    an->chunksz = (unsigned int)an->blk.size * PEAK_CHUNK_BLOCKS;
+  an->data_buf = (unsigned char *)nz_alloc(nz, an->chunksz * an->channels
+					   * an->bytes_per_sample);
+  if (an->data_buf == NULL)
+    goto error;
+  memset(an->powsmooth, 0, an->channels * sizeof(datasmooth_t));
+  for (i = 0; i < NMETRICS; i++) {
+    m = &metric_table[i];
+    if (!(metrics & m->flag))
+      continue;
+    state = nz_alloc(nz, m->size);
+    if (state == NULL)
+      goto error;
+    memset(state, 0, m->size);
+    err = m->init(nz, state, fmt, an->blk.size);
+    if (err != NORMALIZE_OK) {
+      nz_free(nz, state);
+      analyzer_free(nz, an);
+      return err;
+    }
+    an->state[i] = state;
+  }
+
+  /* set up smoothing window buffer */
+  for (c = 0; c < an->channels; c++) {
+    an->sums[c] = 0;
+    an->powsmooth[c].buflen = SMOOTH_WINDOWS;
+    an->powsmooth[c].buf = (double *)nz_alloc(nz, an->powsmooth[c].buflen
+					      * sizeof(double));
+    if (an->powsmooth[c].buf == NULL)
+      goto error;
+    an->powsmooth[c].start = an->powsmooth[c].n = 0;
+  }
+
+  return NORMALIZE_OK;
+
+ error:
+  analyzer_free(nz, an);
+  return NORMALIZE_ERR_NOMEM;
+}
+
+/*
+ * Scale a float sample to the 24-bit range used for max_sample and
+ * min_sample, without overflowing a long.
+ */
+static long
+float_to_sample(double x)
+{
+  x *= FLOAT_FULL_SCALE;
+  if (x > 2147483647.0)
+    return 2147483647L;
+  if (x < -2147483647.0)
+    return -2147483647L;
+  return (long)floor(x + 0.5);
+}
+
+/*
+ * Add the squares of the n samples of a plane to *sum, in order, and
+ * update *pmax and *pmin.  For 32-bit and float samples, which the
+ * stats kernel can't sum exactly.
+ */
+static void
+plane_stats_s32(const int32_t *s, size_t n, double *sum, int32_t *pmax,
+		int32_t *pmin)
+{
+  int32_t max = *pmax, min = *pmin;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    *sum += s[i] * (double)s[i];
+    max = s[i] > max ? s[i] : max;
+    min = s[i] < min ? s[i] : min;
+  }
+  *pmax = max;
+  *pmin = min;
+}
+
+static void
+plane_stats_float(const double *x, size_t n, double *sum, double *pmax,
+		  double *pmin)
+{
+  double max = *pmax, min = *pmin;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    *sum += x[i] * x[i];
+    max = x[i] > max ? x[i] : max;
+    min = x[i] < min ? x[i] : min;
+  }
+  *pmax = max;
+  *pmin = min;
+}
+
+/*
+ * Feed nframes samples per channel, interleaved, to a peak_only
+ * analyzer.  Only the extremes are wanted, so it doesn't matter which
+ * channel a sample is in: the integer samples are unpacked a block's
+ * worth at a time as one plane, and the peak kernel finds its
+ * extremes.  There are no windows, and no sums.
+ */
+static void
+analyzer_peak(struct analyzer *an, unsigned char *data, unsigned int nframes)
+{
+  struct signal_info *psi = an->psi;
+  size_t n = (size_t)nframes * an->channels, room, done, len, i;
+  int32_t max, min;
+  double x, fmax, fmin;
+
+  if (an->is_float) {
+    fmax = psi->max_sample / FLOAT_FULL_SCALE;
+    fmin = psi->min_sample / FLOAT_FULL_SCALE;
+    for (i = 0; i < n; i++) {
+      if (an->bytes_per_sample == 4)
+	x = get_float32(data + i * 4);
+      else
+	x = get_float64(data + i * 8);
+      fmax = x > fmax ? x : fmax;
+      fmin = x < fmin ? x : fmin;
+    }
+    psi->max_sample = float_to_sample(fmax);
+    psi->min_sample = float_to_sample(fmin);
+    return;
+  }
+
+  max = psi->max_sample;
+  min = psi->min_sample;
+  room = an->blk.size * an->channels;
+  for (done = 0; done < n; done += len) {
+    len = n - done < room ? n - done : room;
+    an->kernels->unpack(data + done * an->bytes_per_sample,
+			an->bytes_per_sample, 1, len, an->blk.s, len);
+    an->kernels->peak(an->blk.s, len, &max, &min);
+  }
+  psi->max_sample = max;
+  psi->min_sample = min;
+}
+
+/*
+ * Nonzero if a peak_only analyzer has seen a full scale sample, so the
+ * peak can't get any bigger.  The other extreme isn't known then, so
+ * both are set to full scale, which still bounds the samples.
+ */
+static int
+analyzer_peak_done(struct analyzer *an)
+{
+  struct signal_info *psi = an->psi;
+
+  if (!an->peak_only || an->is_float
+      || (psi->max_sample < an->samplemax && psi->min_sample > an->samplemin))
+    return FALSE;
+  psi->max_sample = an->samplemax;
+  psi->min_sample = an->samplemin;
+  return TRUE;
+}
+
+/*
+ * Feed one window of nframes samples per channel, interleaved, to the
+ * analyzer.  It's converted a block at a time, and each channel's
+ * plane is summed on its own.  Samples of 24 bits or less are summed
+ * exactly, by the stats kernel; bigger ones and floats are summed in
+ * order, so the result doesn't depend on the block size.
+ */
+static void
+analyzer_window(struct analyzer *an, unsigned char *data,
+		unsigned int nframes)
+{
+  struct signal_info *psi = an->psi;
+  struct block *blk = &an->blk;
+  size_t frame_bytes = an->channels * an->bytes_per_sample, done, n, i;
+  int32_t max = 0, min = 0;
+  double pow, fmax = 0, fmin = 0;
+  int c, end;
+
+  if (an->peak_only) {
+    analyzer_peak(an, data, nframes);
+    return;
+  }
+
+  for (c = 0; c < an->channels; c++) {
+    an->sums[c] = 0;
+    an->isums[c] = 0;
+  }
+  if (an->is_float) {
+    fmax = psi->max_sample / FLOAT_FULL_SCALE;
+    fmin = psi->min_sample / FLOAT_FULL_SCALE;
+  } else {
+    max = psi->max_sample;
+    min = psi->min_sample;
+  }
+
+  for (done = 0; done < nframes; done += n) {
+    n = nframes - done < blk->size ? nframes - done : blk->size;
+    block_read(blk, an->kernels, data + done * frame_bytes, n);
+    blk->max = blk->min = 0;
+    for (c = 0; c < an->channels; c++) {
+      if (an->is_float) {
+	plane_stats_float(blk->x + c * blk->size, n, &an->sums[c],
+			  &fmax, &fmin);
+      } else if (an->bytes_per_sample == 4) {
+	plane_stats_s32(blk->s + c * blk->size, n, &an->sums[c],
+			&blk->max, &blk->min);
+      } else {
+	an->kernels->stats(blk->s + c * blk->size, n, &an->isums[c],
+			   &blk->max, &blk->min);
+	/* a window that long could overflow the exact sum */
+	if (nframes >= KERNEL_MAX_FRAMES) {
+	  an->sums[c] += (double)an->isums[c];
+	  an->isums[c] = 0;
+	}
+      }
+    }
+    if (blk->max > max)
+      max = blk->max;
+    if (blk->min < min)
+      min = blk->min;
+    for (i = 0; i < NMETRICS; i++)
+      if (an->state[i] && metric_table[i].block)
+	metric_table[i].block(an->state[i], an->kernels, blk);
+  }
+
+  for (c = 0; c < an->channels; c++) {
+    if (an->is_float)
+      an->sums[c] *= FLOAT_FULL_SCALE * FLOAT_FULL_SCALE;
+    else
+      an->sums[c] += (double)an->isums[c];
+  }
+  if (an->is_float) {
+    psi->max_sample = float_to_sample(fmax);
+    psi->min_sample = float_to_sample(fmin);
+  } else {
+    psi->max_sample = max;
+    psi->min_sample = min;
+  }
+  for (i = 0; i < NMETRICS; i++)
+    if (an->state[i] && metric_table[i].window)
+      metric_table[i].window(an->state[i], an->sums, nframes);
+
+  /* compute power for each channel */
+  for (c = 0; c < an->channels; c++) {
+    datasmooth_t *s = &an->powsmooth[c];
+
+    pow = an->sums[c] / (double)nframes;
+
+    end = (s->start + s->n) % s->buflen;
+    s->buf[end] = pow;
+    if (s->n == s->buflen) {
+      s->start = (s->start + 1) % s->buflen;
+      pow = get_smoothed_data(s);
+      if (pow > an->maxpow)
+	an->maxpow = pow;
+    } else {
+      s->n++;
+    }
+  }
+}
+
+/*
+ * Fill in the signal_info struct, and free the analyzer.  Returns the
+ * maximum power, scaled to the range 0.0 -- 1.0.
+ */
+static double
+analyzer_finish(normalize_t *nz, struct analyzer *an)
+{
+  struct signal_info *psi = an->psi;
+  double pow, maxpow;
+  size_t i;
+  int c;
+
+  maxpow = an->maxpow;
+  if (maxpow < EPSILON) {
+    /*
+     * Either this whole file has zero power, or was too short to ever
+     * fill the smoothing buffer.  In the latter case, we need to just
+     * get maxpow from whatever data we did collect.
+     */
+    for (c = 0; c < an->channels; c++) {
+      pow = get_smoothed_data(&an->powsmooth[c]);
+      if (pow > maxpow)
+	maxpow = pow;
+    }
+  }
+
+  /* scale the pow value to be in the range 0.0 -- 1.0 */
+  maxpow = maxpow / (an->samplemin * (double)an->samplemin);
+
+  /* fill in the signal_info struct */
+  psi->level = sqrt(maxpow);
+  if (-psi->min_sample > psi->max_sample)
+    psi->peak = psi->min_sample / (double)an->samplemin;
+  else
+    psi->peak = psi->max_sample / (double)an->samplemax;
+  if (an->peak_only)
+    psi->level = psi->peak;
+
+  for (i = 0; i < NMETRICS; i++)
+    if (an->state[i])
+      metric_table[i].finish(an->state[i], an->kernels, psi);
+
+  /* with R128, the level is the loudness as an amplitude */
+  if (an->level_is_loudness)
+    psi->level = psi->loudness > -HUGE_VAL ? LUFSTOAMP(psi->loudness)
+      : 0.0;
+  psi->level_min = psi->level_max = psi->level;
+
+  analyzer_free(nz, an);
+
+  return maxpow;
+}
+
+/*
+ * Return the state of the metric, a NORMALIZE_METRIC_* flag, or NULL
+ * if it isn't being measured
+ */
+static void *
+analyzer_metric(struct analyzer *an, unsigned int metric)
+{
+  size_t i;
+
+  for (i = 0; i < NMETRICS; i++)
+    if (metric_table[i].flag == metric)
+      return an->state[i];
+  return NULL;
+}
+
+static void
+analyzer_free(normalize_t *nz, struct analyzer *an)
+{
+  size_t i;
+  int c;
+
+  if (an->powsmooth)
+    for (c = 0; c < an->channels; c++)
+      nz_free(nz, an->powsmooth[c].buf);
+  nz_free(nz, an->powsmooth);
+  nz_free(nz, an->data_buf);
+  nz_free(nz, an->sums);
+  nz_free(nz, an->isums);
+  block_free(nz, &an->blk);
+  for (i = 0; i < NMETRICS; i++) {
+    if (an->state[i] == NULL)
+      continue;
+    if (metric_table[i].free)
+      metric_table[i].free(nz, an->state[i]);
+    nz_free(nz, an->state[i]);
+    an->state[i] = NULL;
+  }
+  an->powsmooth = NULL;
+  an->data_buf = NULL;
+  an->sums = NULL;
+  an->isums = NULL;
+}
+
+
+/*
+ * Read len bytes from offset in fd, without moving its offset if we
+ * have pread().  Returns the number of bytes read, which is only short
+ * at the end of the file, or -1 on error.
+ */
+static ssize_t
+read_at(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+  ssize_t n;
+
+#if !HAVE_PREAD
+  if (lseek(fd, offset, SEEK_SET) == -1)
+    return -1;
+#endif
+  while (done < len) {
+#if HAVE_PREAD
+    n = pread(fd, buf + done, len - done, offset + (off_t)done);
+#else
+    n = read(fd, buf + done, len - done);
+#endif
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return (ssize_t)done;
+}
+
+/*
+ * The number of 1 second regions of a file to estimate its level from,
+ * for normalize_set_sampling(), or 0 to read all of it.  The file has
+ * *pnregions regions, each SMOOTH_WINDOWS windows long; they start a
+ * window in, since that's where the first second a full analysis
+ * smooths the power over starts (see analyzer_window()).
+ */
+static uint64_t
+sampled_regions(normalize_t *nz, struct analyzer *an, int fd,
+		const struct container_info *ci, uint64_t nsamples,
+		uint64_t *pnregions)
+{
+  struct stat stbuf;
+  uint64_t nwindows, nsampled;
+  size_t frame_bytes = an->channels * an->bytes_per_sample;
+
+  if (nz->sampling <= 0 || nz->sampling >= 1 || nz->nranges > 0
+      || nz->mode == NORMALIZE_MODE_PEAK
+      || (an->psi->metrics & ~NORMALIZE_METRIC_LEVEL) != 0)
+    return 0;
+
+  /* a streamed header can claim more data than the file has */
+  if (fstat(fd, &stbuf) == 0 && stbuf.st_size > ci->data_offset
+      && (uint64_t)(stbuf.st_size - ci->data_offset) / frame_bytes < nsamples)
+    nsamples = (uint64_t)(stbuf.st_size - ci->data_offset) / frame_bytes;
+
+  nwindows = nsamples / an->windowsz;
+  *pnregions = nwindows > 0 ? (nwindows - 1) / SMOOTH_WINDOWS : 0;
+  nsampled = (uint64_t)ceil(nz->sampling * *pnregions);
+  if (nsampled < 2 || nsampled > *pnregions / 2)
+    return 0;
+  return nsampled;
+}
+
+static int
+compare_levels(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Estimate the level of the file open on fd from nsampled of its
+ * nregions regions, as sampled_regions() lays them out, and finish
+ * the analyzer.  The regions are split into nsampled runs, and one
+ * region is picked from each at random, the same ones every time.
+ *
+ * Each region's power, smoothed over exactly its windows, is one a
+ * full analysis would take the maximum of, so the largest, X, is a
+ * level the file's can only be over.  How far over is worked out as
+ * Robson and Whitlock bound the end point of a distribution from its
+ * largest samples, taking the levels, in decibels, to be spread evenly
+ * just under the loudest a file gets.  The gaps between the k + 1
+ * loudest levels read then average m = (X - X[k]) / k, the end point
+ * is at most (C^(-1/k) - 1) k m over X at confidence 1 - C, and the
+ * loudest of all nregions is about (1 - nsampled / nregions) m over X.
+ */
+static int
+analyze_sampled(normalize_t *nz, struct analyzer *an, int fd,
+		const struct container_info *ci, uint64_t nregions,
+		uint64_t nsampled, const char *name)
+{
+  struct signal_info *psi = an->psi;
+  size_t window_bytes, region_bytes;
+  uint64_t i, k, first, len, region;
+  uint32_t seed = 1;
+  double power, smoothed, scale, m, *levels;
+  float progress, last_progress = 0.0;
+  unsigned char *buf;
+  long samplemax, samplemin;
+  int c, w, is_float;
+
+  window_bytes = an->windowsz * an->channels * an->bytes_per_sample;
+  region_bytes = SMOOTH_WINDOWS * window_bytes;
+  buf = (unsigned char *)nz_alloc(nz, region_bytes);
+  levels = (double *)nz_alloc(nz, nsampled * sizeof(double));
+  if (buf == NULL || levels == NULL) {
+    nz_free(nz, buf);
+    nz_free(nz, levels);
+    return NORMALIZE_ERR_NOMEM;
+  }
+
+  scale = an->samplemin * (double)an->samplemin;
+  an->maxpow = 0;
+  for (i = 0; i < nsampled; i++) {
+    first = i * nregions / nsampled;
+    len = (i + 1) * nregions / nsampled - first;
+    seed = seed * 1103515245 + 12345;
+    region = first + (seed >> 16) % len;
+    if (read_at(fd, buf, region_bytes, ci->data_offset
+		+ (off_t)(1 + region * SMOOTH_WINDOWS) * window_bytes)
+	!= (ssize_t)region_bytes) {
+      nz_free(nz, buf);
+      nz_free(nz, levels);
+      return NORMALIZE_ERR_IO;
+    }
+    flip_samples(&psi->fmt, buf, region_bytes / an->bytes_per_sample);
+
+    /* smooth over just this region */
+    for (c = 0; c < an->channels; c++)
+      an->powsmooth[c].start = an->powsmooth[c].n = 0;
+    for (w = 0; w < SMOOTH_WINDOWS; w++)
+      analyzer_window(an, buf + w * window_bytes, an->windowsz);
+    power = 0;
+    for (c = 0; c < an->channels; c++) {
+      smoothed = get_smoothed_data(&an->powsmooth[c]);
+      if (smoothed > power)
+	power = smoothed;
+    }
+    if (power > an->maxpow)
+      an->maxpow = power;
+    levels[i] = power > 0 ? 10 * log10(power / scale) : -HUGE_VAL;
+
+    if (nz->progress) {
+      progress = (i + 1) / (float)nsampled;
+      if (progress >= last_progress + 0.01) {
+	nz->progress(name, progress, nz->progress_data);
+	last_progress = progress;
+      }
+    }
+  }
+  nz_free(nz, buf);
+
+  /* the gaps between the top quarter of the levels, or so */
+  qsort(levels, nsampled, sizeof(double), compare_levels);
+  k = nsampled / 4;
+  if (k < 1)
+    k = 1;
+  if (k > SAMPLED_TAIL)
+    k = SAMPLED_TAIL;
+  m = (levels[0] - levels[k]) / k;
+  nz_free(nz, levels);
+
+  samplemax = an->samplemax;
+  samplemin = an->samplemin;
+  is_float = an->is_float;
+  analyzer_finish(nz, an);
+
+  psi->sampled = nsampled / (double)nregions;
+  psi->level_min = psi->level;
+  if (psi->level > 0 && m < HUGE_VAL) {
+    psi->level *= pow(10, (1 - psi->sampled) * m / 20);
+    psi->level_max = psi->level_min
+      * pow(10, (pow(1 - SAMPLED_CONFIDENCE, -1.0 / k) - 1) * k * m / 20);
+  } else {
+    psi->level_max = HUGE_VAL;
+  }
+
+  /* the level and the extremes of integer samples are at most full
+     scale; the extremes of the rest of the file aren't known */
+  if (!is_float) {
+    if (psi->level > 1.0)
+      psi->level = 1.0;
+    if (psi->level_max > 1.0)
+      psi->level_max = 1.0;
+    psi->max_sample = samplemax;
+    psi->min_sample = samplemin;
+  }
+
+  return NORMALIZE_OK;
+}
+
+/*
+ * Where a read of the ranges of a file has got to
+ */
+struct range_reader {
+  const struct container_info *ci;
+  size_t frame_bytes;
+  uint64_t nframes;  /* in the file */
+  int next;          /* the range after the one being read */
+  int last;          /* the range after the last one to read */
+  uint64_t pos, end; /* the next frame to read, and the end of its range */
+};
+
+/*
+ * Start reading ranges first to last - 1 of the file described by ci,
+ * and return the number of frames in them
+ */
+static uint64_t
+range_reader_init(normalize_t *nz, struct range_reader *rr,
+		  const struct container_info *ci, size_t frame_bytes,
+		  int first, int last)
+{
+  uint64_t start, end, total = 0;
+  int i;
+
+  rr->ci = ci;
+  rr->frame_bytes = frame_bytes;
+  rr->nframes = ci->data_size / frame_bytes;
+  rr->next = first;
+  rr->last = last;
+  rr->pos = rr->end = 0;
+  for (i = first;
+       i < last && get_range(nz, i, &ci->fmt, rr->nframes, &start, &end); i++)
+    if (end > start)
+      total += end - start;
+  return total;
+}
+
+/*
+ * Read up to n frames of the ranges into buf, seeking to the start of
+ * each range as it's reached, and return the number read; that's
+ * fewer than n only at the end of the ranges, or if in ends too soon.
+ */
+static size_t
+range_read(normalize_t *nz, struct range_reader *rr, FILE *in,
+	   unsigned char *buf, size_t n)
+{
+  size_t done = 0, want, got;
+  uint64_t start, end;
+
+  while (done < n) {
+    if (rr->pos == rr->end) {
+      if (rr->next >= rr->last
+	  || !get_range(nz, rr->next, &rr->ci->fmt, rr->nframes, &start, &end))
+	break;
+      rr->next++;
+      if (end <= start)
+	continue;
+      if (fseeko(in, rr->ci->data_offset + (off_t)(start * rr->frame_bytes),
+		 SEEK_SET) == -1)
+	break;
+      rr->pos = start;
+      rr->end = end;
+    }
+    want = n - done;
+    if (rr->end - rr->pos < want)
+      want = rr->end - rr->pos;
+    got = fread(buf + done * rr->frame_bytes, rr->frame_bytes, want, in);
+    done += got;
+    rr->pos += got;
+    if (got < want)
+      break;
+  }
+  return done;
+}
+
+/*
+ * Feed the analyzer the nsamples frames rr reads from in, a chunk at a
+ * time, until they run out or the peak can't get any bigger.  Progress
+ * is reported as through total frames, done of which went before.
+ */
+static void
+analyze_frames(normalize_t *nz, struct analyzer *an, struct range_reader *rr,
+	       FILE *in, uint64_t nsamples, const char *name, uint64_t done,
+	       uint64_t total, float *last_progress)
+{
+  int last_window;
+  uint64_t win_start, win_end;
+  float progress;
+  size_t nread;
+
+  /*
+   * win_start, win_end, and chunksz are in units of samples.
+   *
+   * The actual window extends from win_start to win_end - 1, inclusive.
+   */
+  win_start = 0;
+  win_end = 0;
+  last_window = FALSE;
+
+  do {
+
+    /* set up the window end */
+    win_end = win_start + an->chunksz;
+    if (win_end >= nsamples) {
+      win_end = nsamples;
+      last_window = TRUE;
+    }
+
+    /* read a chunksz sized chunk */
+    nread = range_read(nz, rr, in, an->data_buf, win_end - win_start);
+    flip_samples(&an->psi->fmt, an->data_buf, nread * an->channels);
+    analyzer_window(an, an->data_buf, win_end - win_start);
+
+    /* the peak can't get any bigger, so the rest needn't be read */
+    if (analyzer_peak_done(an)) {
+      if (nz->progress && done + nsamples == total)
+	nz->progress(name, 1.0, nz->progress_data);
+      break;
+    }
+
+    /* update progress meter */
+    if (nz->progress) {
+      if (total - an->chunksz == 0)
+	progress = 0;
+      else
+	progress = (done + win_end - an->chunksz)
+	  / (float)(total - an->chunksz);
+      if (progress >= *last_progress + 0.01) {
+	nz->progress(name, progress, nz->progress_data);
+	*last_progress += 0.01;
+      }
+    }
+
+    /* slide the window ahead */
+    win_start += an->chunksz;
+
+  } while (!last_window);
+}
+
+/*
+ * Compute the levels of the audio file open on fd, and fill in psi,
+ * including psi->fmt.  name is passed to the progress callback.  Only
+ * the ranges set with normalize_set_ranges() are read.
+ */
+int
+normalize_analyze_fd(normalize_t *nz, int fd, const char *name,
+		     struct signal_info *psi)
+{
+  const struct container *type;
+  struct container_info ci;
+  struct analyzer an;
+  struct range_reader rr;
+  uint64_t nsamples, nregions, nsampled;
+  int err;
+  float last_progress = 0.0;
+  FILE *in;
+
+  nz->errmsg = NULL;
+
+  /* format info will be passed back */
+  err = open_container(nz, fd, &ci, &type);
+  if (err != NORMALIZE_OK)
+    goto error1;
+  psi->fmt = ci.fmt;
+
+  err = analyzer_init(nz, &an, psi);
+  if (err != NORMALIZE_OK)
+    goto error1;
+  nsamples = range_reader_init(nz, &rr, &ci, an.bytes_per_sample * an.channels,
+			       0, nz->nranges > 0 ? nz->nranges : 1);
+
+  /* initialize progress meter */
+  if (nz->progress) {
+    nz->progress(name, 0.0, nz->progress_data);
+    last_progress = 0.0;
+  }
+
+  /* estimate the level from a sample of it, if we've been asked to */
+  nsampled = sampled_regions(nz, &an, fd, &ci, nsamples, &nregions);
+  if (nsampled > 0) {
+    err = analyze_sampled(nz, &an, fd, &ci, nregions, nsampled, name);
+    if (err != NORMALIZE_OK)
+      goto error2;
+    return NORMALIZE_OK;
+  }
+
+  /* fdopen a duplicate of fd, so the stream can be closed without
+     closing the caller's descriptor */
+  in = fdopen(dup(fd), "r");
+  if (in == NULL) {
+    err = NORMALIZE_ERR_IO;
+    goto error2;
+  }
+
+  analyze_frames(nz, &an, &rr, in, nsamples, name, 0, nsamples,
+		 &last_progress);
+
+  fclose(in);
+  analyzer_finish(nz, &an);
+
+  return NORMALIZE_OK;
+
+  /* error handling stuff */
+ error2:
+  analyzer_free(nz, &an);
+ error1:
+  return err;
+}
+
+
+/*
+ * Compute the levels of each of the ranges set with
+ * normalize_set_ranges() of the audio file open on fd, as segments of
+ * it, into sis[0] to sis[nranges - 1], reading through the file once.
+ * name is passed to the progress callback.
+ */
+int
+normalize_analyze_segments(normalize_t *nz, int fd, const char *name,
+			   struct signal_info *sis)
+{
+  const struct container *type;
+  struct container_info ci;
+  struct analyzer an;
+  struct range_reader rr;
+  uint64_t nsamples, done, total;
+  size_t frame_bytes;
+  int i, err;
+  float last_progress = 0.0;
+  FILE *in;
+
+  nz->errmsg = NULL;
+  if (nz->nranges == 0) {
+    nz->errmsg = N_("no segments");
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+
+  err = open_container(nz, fd, &ci, &type);
+  if (err != NORMALIZE_OK)
+    return err;
+  frame_bytes = ci.fmt.channels * ((ci.fmt.bits_per_sample - 1) / 8 + 1);
+  total = range_reader_init(nz, &rr, &ci, frame_bytes, 0, nz->nranges);
+
+  in = fdopen(dup(fd), "r");
+  if (in == NULL)
+    return NORMALIZE_ERR_IO;
+  if (nz->progress)
+    nz->progress(name, 0.0, nz->progress_data);
+
+  /* a fresh analyzer for each segment, as the read reaches it */
+  done = 0;
+  for (i = 0; i < nz->nranges; i++) {
+    sis[i].fmt = ci.fmt;
+    err = analyzer_init(nz, &an, &sis[i]);
+    if (err != NORMALIZE_OK) {
+      fclose(in);
+      return err;
+    }
+    nsamples = range_reader_init(nz, &rr, &ci, frame_bytes, i, i + 1);
+    analyze_frames(nz, &an, &rr, in, nsamples, name, done, total,
+		   &last_progress);
+    analyzer_finish(nz, &an);
+    done += nsamples;
+  }
+
+  fclose(in);
+  if (nz->progress)
+    nz->progress(name, 1.0, nz->progress_data);
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * Compute the levels of the audio read from a stream, until EOF,
+ * without seeking.  If the stream starts with a WAV header, psi->fmt
+ * is filled in from it; otherwise the stream is taken to be raw
+ * samples, whose format must be given in psi->fmt.
+ */
+int
+normalize_analyze_stream(normalize_t *nz, FILE *in, const char *name,
+			 struct signal_info *psi)
+{
+  return normalize_analyze_copy(nz, in, NULL, name, psi);
+}
+
+/*
+ * Like normalize_analyze_stream(), but also write everything read
+ * from in to copy, if it's not NULL.  This lets a stream be analyzed
+ * while it's spooled to a temporary file, so the gain can then be
+ * applied to the copy.
+ */
+int
+normalize_analyze_copy(normalize_t *nz, FILE *in, FILE *copy,
+		       const char *name, struct signal_info *psi)
+{
+  struct analyzer an;
+  riff_stream_t rs;
+  int last_window, is_riff, err;
+  unsigned int filled_sz, nframes, window_bytes;
+
+  nz->errmsg = NULL;
+  is_riff = riff_stream_open(&rs, in, copy);
+  if (is_riff == -1)
+    return NORMALIZE_ERR_IO;
+  err = get_stream_wav_data(nz, &rs, is_riff == 0, &psi->fmt);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  err = analyzer_init(nz, &an, psi);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  /* initialize progress meter: we don't know how much is coming */
+  if (nz->progress)
+    nz->progress(name, 0.0, nz->progress_data);
+
+  /* a copy has to be complete, so this reads to the end even when a
+     peak-only analysis could stop */
+  window_bytes = an.chunksz * an.channels * an.bytes_per_sample;
+  last_window = FALSE;
+  do {
+
+    /* read a chunksz sized chunk */
+    filled_sz = riff_stream_read(&rs, an.data_buf, window_bytes)
+      / an.bytes_per_sample;
+    flip_samples(&psi->fmt, an.data_buf, filled_sz);
+    nframes = an.chunksz;
+
+    /* if we couldn't read a complete chunk, then this is the last chunk */
+    if (filled_sz < an.chunksz * an.channels) {
+      nframes = filled_sz / an.channels;
+      last_window = TRUE;
+    }
+
+    /* an empty last window would add a bogus 0/0 power */
+    if (nframes > 0)
+      analyzer_window(&an, an.data_buf, nframes);
+
+  } while (!last_window);
+
+  /* copy anything after the data chunk */
+  if (copy && is_riff == 0)
+    while (riff_stream_next(&rs) == 0)
+      ;
+
+  if (ferror(in) || (copy && (fflush(copy) == EOF || ferror(copy)))) {
+    analyzer_free(nz, &an);
+    return NORMALIZE_ERR_IO;
+  }
+
+  analyzer_finish(nz, &an);
+
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * Compute the levels of len bytes of raw samples in buf.  The format
+ * of the samples must be given in psi->fmt.  Samples that aren't in
+ * WAV's layout are copied to be converted, since buf is const.
+ */
+int
+normalize_analyze_buffer(normalize_t *nz, const void *buf, size_t len,
+			 struct signal_info *psi)
+{
+  struct analyzer an;
+  unsigned char *p = (unsigned char *)buf;
+  size_t frame_bytes, nframes, n;
+  int err;
+
+  nz->errmsg = NULL;
+  err = analyzer_init(nz, &an, psi);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  /* the analyzer's own window buffer is only needed to convert samples */
+  frame_bytes = an.bytes_per_sample * an.channels;
+  nframes = len / frame_bytes;
+  do {
+    n = nframes < an.chunksz ? nframes : an.chunksz;
+    if (psi->fmt.sample_flags) {
+      memcpy(an.data_buf, p, n * frame_bytes);
+      flip_samples(&psi->fmt, an.data_buf, n * an.channels);
+      analyzer_window(&an, an.data_buf, n);
+    } else {
+      analyzer_window(&an, p, n);
+    }
+    p += n * frame_bytes;
+    nframes -= n;
+  } while (nframes > 0 && !analyzer_peak_done(&an));
+
+  analyzer_finish(nz, &an);
+
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * For batch mode, we take the levels for all the input files, throw
+ * out any that appear to be statistical aberrations, and average the
+ * rest together to get one level and one gain for the whole batch.
+ *
+ * If ignored is not NULL, ignored[i] is set to nonzero for each level
+ * that was thrown out.  Returns NORMALIZE_ERR_IGNORED if every level
+ * was thrown out.
+ */
+int
+normalize_average_levels(normalize_t *nz, const struct signal_info *sis,
+			 int nlevels, struct level_stats *stats, char *ignored)
+{
+  int i, files_to_avg;
+  double sum, level_difference, variance, threshold;
+  char *badlevels;
+
+  if (nlevels <= 0) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+
+  /* badlevels is a boolean array marking the level values to be thrown out */
+  badlevels = ignored;
+  if (badlevels == NULL) {
+    badlevels = (char *)nz_alloc(nz, nlevels * sizeof(char));
+    if (badlevels == NULL)
+      return NORMALIZE_ERR_NOMEM;
+  }
+  memset(badlevels, 0, nlevels * sizeof(char));
+
+  /* get mean level */
+  sum = 0;
+  for (i = 0; i < nlevels; i++)
+    sum += sis[i].level;
+  stats->mean = sum / nlevels;
+
+  /* if no threshold is specified, use 2 * standard dev */
+  threshold = nz->threshold;
+  stats->std_dev = -1.0;
+  if (threshold < 0.0) {
+
+    /*
+     * We want the standard dev of the levels, but we need it in decibels.
+     * Therefore, if u is the mean, the variance is
+     *                  (1/N)summation((20*log10(x/u))^2)
+     *       instead of (1/N)summation((x-u)^2),
+     * which it would be if we needed straight variance "by the numbers".
+     */
+
+    /* get variance */
+    sum = 0;
+    for (i = 0; i < nlevels; i++) {
+      double tmp = FRACTODB(sis[i].level / stats->mean);
+      sum += tmp * tmp;
+    }
+    variance = sum / nlevels;
+
+    /* get standard deviation */
+    if (variance < EPSILON)
+      stats->std_dev = 0.0;
+    else
+      stats->std_dev = sqrt(variance);
+
+    threshold = 2 * stats->std_dev;
+  }
+
+  /*
+   * Throw out level values that seem to be aberrations
+   * (so that one "quiet song" doesn't throw off the average)
+   * We define an aberration as a level that is > 2*stddev dB from the mean.
+   */
+  if (threshold > EPSILON && nlevels > 1) {
+    for (i = 0; i < nlevels; i++) {
+
+      /* Find how different from average the i'th file's level is.
+       * The "level" here is actually the signal's maximum amplitude,
+       * from which we can compute the difference in decibels. */
+      level_difference = fabs(FRACTODB(stats->mean / sis[i].level));
+
+      /* mark as bad any level that is > threshold different than the mean */
+      if (level_difference > threshold)
+	badlevels[i] = TRUE;
+    }
+  }
+
+  /* throw out the levels marked as bad */
+  files_to_avg = 0;
+  sum = 0;
+  for (i = 0; i < nlevels; i++)
+    if (!badlevels[i]) {
+      sum += sis[i].level;
+      files_to_avg++;
+    }
+  stats->nignored = nlevels - files_to_avg;
+
+  if (badlevels != ignored)
+    nz_free(nz, badlevels);
+
+  if (files_to_avg == 0) {
+    stats->level = -1.0;
+    return NORMALIZE_ERR_IGNORED;
+  }
+
+  stats->level = sum / files_to_avg;
+
+  return NORMALIZE_OK;
+}
+
+/*
+ * Compute the gain for each of the n analyzed signals, according to
+ * the context's mode.  In batch and mix mode, the average level is
+ * passed back in stats, which may be NULL otherwise.
+ */
+int
+normalize_compute_gains(normalize_t *nz, const struct signal_info *sis,
+			int n, double *gains, struct level_stats *stats)
+{
+  struct level_stats st;
+  int i, err;
+
+  if (stats == NULL)
+    stats = &st;
+
+  switch (nz->mode) {
+  case NORMALIZE_MODE_PEAK:
+    for (i = 0; i < n; i++)
+      gains[i] = 1.0 / sis[i].peak;
+    break;
+  case NORMALIZE_MODE_BATCH:
+  case NORMALIZE_MODE_MIX:
+    err = normalize_average_levels(nz, sis, n, stats, NULL);
+    if (err != NORMALIZE_OK)
+      return err;
+    for (i = 0; i < n; i++) {
+      /* For mix mode, the target is the average level */
+      if (nz->mode == NORMALIZE_MODE_MIX)
+	gains[i] = stats->level / sis[i].level;
+      else
+	gains[i] = nz->target / stats->level;
+    }
+    break;
+  default:
+    for (i = 0; i < n; i++)
+      gains[i] = nz->target / sis[i].level;
+    break;
+  }
+
+  /* a batch's one gain has to keep every file under the limit */
+  for (i = 0; i < n; i++)
+    gains[i] = normalize_limit_gain(nz, gains[i], &sis[i]);
+  if (nz->mode == NORMALIZE_MODE_BATCH) {
+    for (i = 1; i < n; i++)
+      if (gains[i] < gains[0])
+	gains[0] = gains[i];
+    for (i = 1; i < n; i++)
+      gains[i] = gains[0];
+  }
+
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * Compressing by tanh() costs much more than looking the sample up,
+ * so with compression, 16-bit samples are looked up in a table built
+ * for them.  Building it costs as much as compressing this many
+ * samples directly (65536 tanh() calls, and a little over 30ns each,
+ * measured), so the table is only built once that many samples have
+ * been compressed without it.  That's never more than twice the work
+ * of the better choice, whatever the length of the file.
+ */
+#define LUT_BREAK_EVEN 40000
+
+/* bigger samples are compressed this many at a time */
+#define SOFT_CLIP_BLOCK 256
+
+/*
+ * The state of a gain application: the block the samples are
+ * converted into, a lookup table for small samples, and what we need
+ * to know about clipping.  Float samples need neither of the last
+ * two, and integer samples that are written out as float don't
+ * either.
+ */
+struct gain_state {
+  normalize_t *nz;
+  int bytes_per_sample;
+  long samplemax, samplemin;
+  double gain;
+  int do_compression;
+  int is_float;         /* the samples are float */
+  int to_float;         /* write integer samples as 32-bit float */
+  double knee;          /* compression changes samples under this by
+			   less than an LSB */
+  const struct kernels *kernels;
+  struct block blk;
+#if USE_LOOKUPTABLE
+  long min_pos_clipped; /* the minimum positive sample that gets clipped */
+  long max_neg_clipped; /* the maximum negative sample that gets clipped */
+  struct lut_entry *lut_entry; /* the table we hold a reference to */
+  const int16_t *lut;   /* its table, indexed from lut_lo to lut_hi */
+  long lut_lo, lut_hi;  /* the samples the lut covers, or is to cover */
+  uint64_t lut_due;     /* samples to compress before building the lut */
+#endif
+};
+
+/*
+ * Compress a sample of 16 bits or less, as the lookup table does.
+ */
+static long
+compress_sample(const struct gain_state *gs, long sample)
+{
+  /* Thanks to Ted Wright for this idea and fix */
+  if (sample < 0)
+    return gs->samplemin * tanh(sample * gs->gain / (double)gs->samplemin);
+  return gs->samplemax * tanh(sample * gs->gain / (double)gs->samplemax);
+}
+
+#if USE_LOOKUPTABLE
+/*
+ * Point gs at the lookup table in entry, and take a reference to it.
+ * Called with the lock held.
+ */
+static void
+use_lut(struct gain_state *gs, struct lut_entry *entry)
+{
+  entry->refs++;
+  entry->last_used = ++lut_clock;
+  gs->lut_entry = entry;
+  gs->lut = entry->lut;
+  gs->lut_lo = entry->lo;
+  gs->lut_hi = entry->hi;
+  gs->min_pos_clipped = entry->min_pos_clipped;
+  gs->max_neg_clipped = entry->max_neg_clipped;
+}
+
+/*
+ * Drop a reference to entry, freeing it if it was the last.  Called
+ * with the lock held.
+ */
+static void
+unref_lut(struct lut_entry *entry)
+{
+  if (--entry->refs == 0) {
+    free(entry->lut + entry->lo);
+    free(entry);
+  }
+}
+
+/*
+ * Let go of the lookup table gs is using, if any
+ */
+static void
+release_lut(struct gain_state *gs)
+{
+  if (gs->lut_entry) {
+    LOCK_LUTS();
+    unref_lut(gs->lut_entry);
+    UNLOCK_LUTS();
+  }
+  gs->lut_entry = NULL;
+  gs->lut = NULL;
+}
+
+/*
+ * Find a cached lookup table that will do for gs, and use it.
+ * Returns FALSE if there isn't one.
+ */
+static int
+find_lut(struct gain_state *gs)
+{
+  struct lut_entry *entry;
+  int i, found = FALSE;
+
+  LOCK_LUTS();
+  for (i = 0; i < LUT_CACHE_SIZE && !found; i++) {
+    entry = lut_cache[i];
+    if (entry && entry->bytes_per_sample == gs->bytes_per_sample
+	&& entry->gain == gs->gain
+	&& entry->do_compression == gs->do_compression
+	&& entry->lo <= gs->lut_lo && entry->hi >= gs->lut_hi) {
+      use_lut(gs, entry);
+      found = TRUE;
+    }
+  }
+  UNLOCK_LUTS();
+  return found;
+}
+
+/*
+ * Build the lookup table for samples of 16 bits or less, from lut_lo
+ * to lut_hi, put it in the least recently used slot of the cache, and
+ * use it.  This table is 128k for all 16-bit samples, look out!  It's
+ * built without the lock, so two threads may both build the same one,
+ * which does no harm.
+ */
+static int
+build_lut(struct gain_state *gs)
+{
+  struct lut_entry *entry;
+  int16_t *lut;
+  long i, sample;
+  int slot;
+
+  entry = (struct lut_entry *)malloc(sizeof(struct lut_entry));
+  lut = (int16_t *)malloc((gs->lut_hi - gs->lut_lo + 1) * sizeof(int16_t));
+  if (entry == NULL || lut == NULL) {
+    free(entry);
+    free(lut);
+    errno = ENOMEM;
+    return NORMALIZE_ERR_NOMEM;
+  }
+  lut -= gs->lut_lo; /* so indices don't have to be offset */
+  entry->lut = lut;
+  entry->lo = gs->lut_lo;
+  entry->hi = gs->lut_hi;
+  entry->bytes_per_sample = gs->bytes_per_sample;
+  entry->gain = gs->gain;
+  entry->do_compression = gs->do_compression;
+  entry->min_pos_clipped = gs->samplemax + 1;
+  entry->max_neg_clipped = gs->samplemin - 1;
+  entry->refs = 1; /* the cache's */
+
+  if (gs->gain > 1.0) {
+    if (gs->do_compression) {
+      /* apply gain, and do tanh compression to avoid clipping */
+      for (i = entry->lo; i <= entry->hi; i++)
+	lut[i] = compress_sample(gs, i);
+    } else {
+      /* apply gain, and do clipping */
+      for (i = entry->lo; i <= entry->hi; i++) {
+	sample = i * gs->gain;
+	if (sample > gs->samplemax) {
+	  sample = gs->samplemax;
+	  if (i < entry->min_pos_clipped)
+	    entry->min_pos_clipped = i;
+	} else if (sample < gs->samplemin) {
+	  sample = gs->samplemin;
+	  if (i > entry->max_neg_clipped)
+	    entry->max_neg_clipped = i;
+	}
+	lut[i] = sample; /* negative indices are okay, see above */
+      }
+    }
+  } else {
+    /* just apply gain if it's less than 1 */
+    for (i = entry->lo; i <= entry->hi; i++)
+      lut[i] = i * gs->gain;
+  }
+
+  LOCK_LUTS();
+  slot = 0;
+  for (i = 0; i < LUT_CACHE_SIZE && lut_cache[slot]; i++)
+    if (lut_cache[i] == NULL
+	|| lut_cache[i]->last_used < lut_cache[slot]->last_used)
+      slot = i;
+  if (lut_cache[slot])
+    unref_lut(lut_cache[slot]);
+  lut_cache[slot] = entry;
+  use_lut(gs, entry);
+  UNLOCK_LUTS();
+  return NORMALIZE_OK;
+}
+#endif
+
+/*
+ * Set up to apply gain to samples in format fmt.  If to_float is set,
+ * integer samples will be converted to float with
+ * gain_samples_to_float() instead.
+ */
+static int
+gain_init(normalize_t *nz, struct gain_state *gs, const struct wavfmt *fmt,
+	  double gain, const struct signal_info *psi, int to_float)
+{
+  gs->nz = nz;
+  gs->bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
+  gs->gain = gain;
+  gs->is_float = (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT);
+  gs->to_float = to_float && !gs->is_float;
+  gs->kernels = nz_kernels(nz);
+#if USE_LOOKUPTABLE
+  gs->lut_entry = NULL;
+  gs->lut = NULL;
+  gs->lut_due = 0;
+#endif
+  if (block_init(nz, &gs->blk, fmt) != NORMALIZE_OK)
+    return NORMALIZE_ERR_NOMEM;
+  if (gs->is_float) {
+    gs->samplemax = gs->samplemin = 0;
+    gs->do_compression = FALSE;
+    return NORMALIZE_OK;
+  }
+  gs->samplemax = (long)((1UL << (gs->bytes_per_sample * 8 - 1)) - 1);
+  gs->samplemin = -gs->samplemax - 1;
+  if (gs->to_float) {
+    gs->do_compression = FALSE;
+    return NORMALIZE_OK;
+  }
+
+  /*
+   * Check if we actually need to do compression on this file:
+   * we don't if gain <= 1 or if the peaks wouldn't clip anyway.
+   */
+  gs->do_compression = nz->do_compression && gain > 1.0;
+  if (gs->do_compression && psi) {
+    if (psi->max_sample * gain <= gs->samplemax
+	&& psi->min_sample * gain >= gs->samplemin)
+      gs->do_compression = FALSE;
+  }
+
+  /*
+   * samplemax * tanh(x / samplemax) is more than x - x^3 / (3
+   * samplemax^2), so it's within an LSB of x under this.
+   */
+  gs->knee = pow(3.0 * gs->samplemax * gs->samplemax, 1.0 / 3.0);
+
+#if USE_LOOKUPTABLE
+  /*
+   * 8-bit samples always get a lookup table, it's tiny.  16-bit
+   * samples get one for compression once it pays (see above), or if
+   * the gain kernel we have is slower than a table.  Tables are cached
+   * for the whole process, so files in a batch, which all get the same
+   * gain, share one, as do contexts that want the same one.
+   * Otherwise, a file's table only covers the samples analysis found
+   * in it, if we know them.
+   */
+  gs->lut_lo = gs->samplemin;
+  gs->lut_hi = gs->samplemax;
+  if (psi && nz->mode != NORMALIZE_MODE_BATCH) {
+    if (psi->min_sample > gs->lut_lo)
+      gs->lut_lo = psi->min_sample;
+    if (psi->max_sample < gs->lut_hi)
+      gs->lut_hi = psi->max_sample;
+    if (gs->lut_lo > gs->lut_hi)
+      gs->lut_lo = gs->lut_hi = 0;
+  }
+  if (gs->bytes_per_sample == 1
+      || (gs->bytes_per_sample == 2 && !gs->do_compression
+	  && !gs->kernels->s16_beats_lut)) {
+    if (find_lut(gs) || build_lut(gs) == NORMALIZE_OK)
+      return NORMALIZE_OK;
+    block_free(nz, &gs->blk);
+    return NORMALIZE_ERR_NOMEM;
+  }
+  if (gs->bytes_per_sample == 2 && gs->do_compression && !find_lut(gs)) {
+    /* compressing a partial table's worth costs less */
+    gs->lut_due = (uint64_t)LUT_BREAK_EVEN * (gs->lut_hi - gs->lut_lo + 1)
+      / 65536 + 1;
+  }
+#endif
+
+  return NORMALIZE_OK;
+}
+
+/*
+ * Apply the gain to the n samples of a plane, with tanh compression,
+ * for samples of more than 16 bits.  The compression is done a piece
+ * at a time, by the soft_clip kernel, and skipped for pieces that stay
+ * under the knee.  The result is within an LSB of doing it with libm.
+ */
+static void
+soft_clip_plane(struct gain_state *gs, int32_t *s, size_t n)
+{
+  double x[SOFT_CLIP_BLOCK], peak;
+  size_t i, j, m;
+
+  for (i = 0; i < n; i += m) {
+    m = n - i < SOFT_CLIP_BLOCK ? n - i : SOFT_CLIP_BLOCK;
+    peak = 0;
+    for (j = 0; j < m; j++) {
+      /* the gained sample is truncated before compression, as ever */
+      x[j] = s[i + j] * gs->gain;
+      x[j] = x[j] < 0 ? ceil(x[j]) : floor(x[j]);
+      if (fabs(x[j]) > peak)
+	peak = fabs(x[j]);
+    }
+    if (peak >= gs->knee)
+      gs->kernels->soft_clip(x, m, (double)gs->samplemax);
+    for (j = 0; j < m; j++)
+      s[i + j] = (int32_t)x[j];
+  }
+}
+
+#if USE_LOOKUPTABLE
+/*
+ * Apply the gain to the n samples of a plane with the lookup table,
+ * for the samples it covers.  Returns the number of samples clipped.
+ */
+static unsigned long
+lut_plane(struct gain_state *gs, int32_t *s, size_t n)
+{
+  unsigned long nclippings = 0;
+  long sample;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    sample = s[i];
+    if (sample >= gs->lut_lo && sample <= gs->lut_hi) {
+      if (sample >= gs->min_pos_clipped || sample <= gs->max_neg_clipped)
+	nclippings++;
+      s[i] = gs->lut[sample]; /* negative indices are okay, see above */
+    } else if (gs->do_compression) {
+      /* what the lookup table would give */
+      s[i] = compress_sample(gs, sample);
+    } else {
+      nclippings += gs->kernels->gain(s + i, 1, gs->gain, gs->samplemin,
+				      gs->samplemax);
+    }
+  }
+  return nclippings;
+}
+#endif
+
+/*
+ * Apply the gain to the samples in gs->blk.  Returns the number of
+ * samples clipped.
+ */
+static unsigned long
+gain_block(struct gain_state *gs)
+{
+  struct block *blk = &gs->blk;
+  unsigned long nclippings = 0;
+  size_t n = blk->nframes, i;
+  double gain, *x;
+  int32_t *s;
+  int c;
+
+  for (c = 0; c < blk->channels; c++) {
+    if (gs->is_float) {
+      /* the product of two floats is exact in a double, so rounding
+	 it back to a float gives what multiplying floats would */
+      gain = gs->bytes_per_sample == 4 ? (float)gs->gain : gs->gain;
+      x = blk->x + c * blk->size;
+      for (i = 0; i < n; i++)
+	x[i] *= gain;
+      continue;
+    }
+
+    s = blk->s + c * blk->size;
+#if USE_LOOKUPTABLE
+    if (gs->lut) {
+      nclippings += lut_plane(gs, s, n);
+      continue;
+    }
+#endif
+    if (gs->do_compression && gs->bytes_per_sample > 2) {
+      soft_clip_plane(gs, s, n);
+    } else if (gs->do_compression) {
+      for (i = 0; i < n; i++)
+	s[i] = compress_sample(gs, s[i]);
+    } else {
+      nclippings += gs->kernels->gain(s, n, gs->gain, gs->samplemin,
+				      gs->samplemax);
+    }
+  }
+  return nclippings;
+}
+
+/*
+ * Apply the gain to nsamples integer samples in buf, writing them to
+ * out as 32-bit float, where full scale is 1.0.  out must have room
+ * for nsamples * 4 bytes.
+ */
+static void
+gain_samples_to_float(struct gain_state *gs, unsigned char *buf,
+		      unsigned char *out, size_t nsamples)
+{
+  struct block *blk = &gs->blk;
+  int channels = blk->channels;
+  size_t frame_bytes = channels * gs->bytes_per_sample;
+  size_t nframes = nsamples / channels, done, n;
+  double scale = gs->gain / -(double)gs->samplemin;
+
+  for (done = 0; done < nframes; done += n) {
+    n = nframes - done < blk->size ? nframes - done : blk->size;
+    block_read(blk, gs->kernels, buf + done * frame_bytes, n);
+    block_write_float(blk, scale, out + done * channels * 4);
+  }
+
+  /* a partial frame at the end of a stream: see gain_samples() */
+  if (nsamples % channels) {
+    blk->channels = nsamples % channels;
+    block_read(blk, gs->kernels, buf + nframes * frame_bytes, 1);
+    block_write_float(blk, scale, out + nframes * channels * 4);
+    blk->channels = channels;
+  }
+}
+
+/*
+ * Apply the gain to nsamples samples in buf, in place, a block at a
+ * time.  Returns the number of samples clipped.
+ */
+static unsigned long
+gain_samples(struct gain_state *gs, unsigned char *buf, size_t nsamples)
+{
+  struct block *blk = &gs->blk;
+  int channels = blk->channels;
+  size_t frame_bytes = channels * gs->bytes_per_sample;
+  size_t nframes = nsamples / channels, done, n;
+  unsigned long nclippings = 0;
+
+#if USE_LOOKUPTABLE
+  /* build the lookup table once compressing without it has cost as
+     much; if there's no memory for it, carry on without */
+  if (gs->lut_due) {
+    if (gs->lut_due > nsamples) {
+      gs->lut_due -= nsamples;
+    } else {
+      if (!find_lut(gs))
+	build_lut(gs);
+      gs->lut_due = 0;
+    }
+  }
+#endif
+
+  for (done = 0; done < nframes; done += n) {
+    n = nframes - done < blk->size ? nframes - done : blk->size;
+    block_read(blk, gs->kernels, buf + done * frame_bytes, n);
+    nclippings += gain_block(gs);
+    block_write(blk, gs->kernels, buf + done * frame_bytes);
+  }
+
+  /* a partial frame at the end of a stream is a block of its own, of
+     one frame with fewer channels: the gain is the same for all */
+  if (nsamples % channels) {
+    blk->channels = nsamples % channels;
+    block_read(blk, gs->kernels, buf + nframes * frame_bytes, 1);
+    nclippings += gain_block(gs);
+    block_write(blk, gs->kernels, buf + nframes * frame_bytes);
+    blk->channels = channels;
+  }
+
+  return nclippings;
+}
+
+/*
+ * A change of gain, from g0 to g1, over the len frames from frame from
+ */
+struct ramp {
+  uint64_t from, len;
+  double g0, g1;
+};
+
+/*
+ * Work out the ramps at the start and end of segment i, for
+ * normalize_apply_segments(): up to nz->ramp long, and at most half
+ * the segment.  Where two segments meet, the ramp is in the one with
+ * the higher gain, so neither is ever made louder than its own gain
+ * allows; next to a part of the file with no segment, which is left
+ * as it is, it's in the segment.  There's no ramp at the ends of the
+ * file, or where the gain doesn't change.
+ */
+static void
+get_ramps(normalize_t *nz, int i, const struct wavfmt *fmt, uint64_t nframes,
+	  const double *gains, struct ramp *left, struct ramp *right)
+{
+  uint64_t start, end, next_start, next_end, len;
+
+  get_range(nz, i, fmt, nframes, &start, &end);
+  len = (uint64_t)floor(nz->ramp * fmt->samples_per_sec + 0.5);
+  if (len > (end - start) / 2)
+    len = (end - start) / 2;
+
+  left->len = 0;
+  left->from = start;
+  left->g1 = gains[i];
+  if (i > 0 && get_range(nz, i - 1, fmt, nframes, &next_start, &next_end)
+      && next_end == start) {
+    left->g0 = gains[i - 1];
+    if (left->g1 > left->g0)
+      left->len = len;
+  } else if (start > 0) {
+    left->g0 = 1.0;
+    left->len = len;
+  }
+  if (left->g0 == left->g1)
+    left->len = 0;
+
+  right->len = 0;
+  right->from = end - len;
+  right->g0 = gains[i];
+  if (get_range(nz, i + 1, fmt, nframes, &next_start, &next_end)
+      && next_start == end && next_end > next_start) {
+    right->g1 = gains[i + 1];
+    if (right->g0 > right->g1)
+      right->len = len;
+  } else if (end < nframes) {
+    right->g1 = 1.0;
+    right->len = len;
+  }
+  if (right->g0 == right->g1)
+    right->len = 0;
+}
+
+/*
+ * Apply the ramp r to nframes frames in buf, in place, the first of
+ * them frame pos: each frame gets its own gain.  If compression is on,
+ * every sample goes through tanh() at its frame's gain, as
+ * compress_sample() does, so the ramp bends the same curve the rest of
+ * the segment does; otherwise samples the gain takes past full scale
+ * are clipped.  Returns the number of samples clipped.
+ */
+static unsigned long
+ramp_samples(struct gain_state *gs, const struct ramp *r, uint64_t pos,
+	     unsigned char *buf, size_t nframes)
+{
+  struct block *blk = &gs->blk;
+  size_t frame_bytes = blk->channels * gs->bytes_per_sample;
+  size_t done, n, i, j;
+  unsigned long nclippings = 0;
+  double gain, x;
+  int c;
+
+  for (done = 0; done < nframes; done += n) {
+    n = nframes - done < blk->size ? nframes - done : blk->size;
+    block_read(blk, gs->kernels, buf + done * frame_bytes, n);
+    for (i = 0; i < n; i++) {
+      gain = r->g0 + (r->g1 - r->g0)
+	* ((pos + done + i - r->from) + 0.5) / r->len;
+      for (c = 0; c < blk->channels; c++) {
+	j = c * blk->size + i;
+	if (gs->is_float) {
+	  blk->x[j] *= gain;
+	  continue;
+	}
+	x = blk->s[j] * gain;
+	if (gs->do_compression && x < 0) {
+	  x = gs->samplemin * tanh(x / gs->samplemin);
+	} else if (gs->do_compression) {
+	  x = gs->samplemax * tanh(x / gs->samplemax);
+	} else {
+	  x = x < 0 ? ceil(x) : floor(x);
+	  if (x > gs->samplemax || x < gs->samplemin) {
+	    x = x < 0 ? gs->samplemin : gs->samplemax;
+	    nclippings++;
+	  }
+	}
+	blk->s[j] = (int32_t)x;
+      }
+    }
+    block_write(blk, gs->kernels, buf + done * frame_bytes);
+  }
+  return nclippings;
+}
+
+static void
+gain_free(normalize_t *nz, struct gain_state *gs)
+{
+#if USE_LOOKUPTABLE
+  /* the table stays in the cache, for the next file */
+  release_lut(gs);
+#endif
+  block_free(nz, &gs->blk);
+}
+
+
+static void
+put_lendian16(unsigned char *buf, unsigned int x)
+{
+  buf[0] = x & 0xFF;
+  buf[1] = (x >> 8) & 0xFF;
+}
+
+static void
+put_lendian32(unsigned char *buf, uint32_t x)
+{
+  buf[0] = x & 0xFF;
+  buf[1] = (x >> 8) & 0xFF;
+  buf[2] = (x >> 16) & 0xFF;
+  buf[3] = (x >> 24) & 0xFF;
+}
+
+/*
+ * Write the header of a WAV file of float samples, bits bits each,
+ * with the rate and channels of fmt, to hold nsamples samples.  If
+ * fmt has a channel mask, the header is WAVE_FORMAT_EXTENSIBLE, to
+ * keep it.  If nsamples is RIFF_SIZE_UNKNOWN, or too many for a RIFF
+ * file, the sizes are written as 0xFFFFFFFF, as for a stream.
+ */
+static int
+write_float_header(FILE *out, const struct wavfmt *fmt, int bits,
+		   uint64_t nsamples)
+{
+  unsigned char hdr[80], *p;
+  uint32_t data_size, nframes, fmt_size, hdr_size;
+  int bytes_per_sample = bits / 8;
+
+  fmt_size = fmt->channel_mask ? 40 : 18;
+  hdr_size = 12 + 8 + fmt_size + 12 + 8;
+  if (nsamples == RIFF_SIZE_UNKNOWN
+      || nsamples > (0xFFFFFFFF - hdr_size) / bytes_per_sample) {
+    data_size = nframes = 0xFFFFFFFF;
+    put_lendian32(hdr + 4, 0xFFFFFFFF);
+  } else {
+    data_size = nsamples * bytes_per_sample;
+    nframes = nsamples / fmt->channels;
+    put_lendian32(hdr + 4, hdr_size - 8 + data_size);
+  }
+
+  memcpy(hdr, "RIFF", 4);
+  memcpy(hdr + 8, "WAVEfmt ", 8);
+  put_lendian32(hdr + 16, fmt_size);
+  put_lendian16(hdr + 20, fmt->channel_mask ? WAVE_FORMAT_EXTENSIBLE
+		: WAVE_FORMAT_IEEE_FLOAT);
+  put_lendian16(hdr + 22, fmt->channels);
+  put_lendian32(hdr + 24, fmt->samples_per_sec);
+  put_lendian32(hdr + 28, fmt->samples_per_sec * fmt->channels
+		* bytes_per_sample);
+  put_lendian16(hdr + 32, fmt->channels * bytes_per_sample);
+  put_lendian16(hdr + 34, bits);
+  put_lendian16(hdr + 36, fmt_size - 18); /* extra format bytes */
+  p = hdr + 38;
+  if (fmt->channel_mask) {
+    put_lendian16(p, bits);
+    put_lendian32(p + 2, fmt->channel_mask);
+    put_lendian16(p + 6, WAVE_FORMAT_IEEE_FLOAT);
+    memcpy(p + 8, ksdataformat_tail, 14);
+    p += 22;
+  }
+  /* non-PCM files are supposed to have a fact chunk */
+  memcpy(p, "fact", 4);
+  put_lendian32(p + 4, 4);
+  put_lendian32(p + 8, nframes);
+  memcpy(p + 12, "data", 4);
+  put_lendian32(p + 16, data_size);
+
+  if (fwrite(hdr, 1, hdr_size, out) < hdr_size)
+    return -1;
+  return 0;
+}
+
+/*
+ * Open the stream in, and read its WAV header, if it has one, into
+ * *fmt, which starts out as the raw format.  The header is copied to
+ * out, or if float output is on, a float header is written instead.
+ * *pis_riff is set if the stream has a WAV header.
+ */
+static int
+open_stream_output(normalize_t *nz, riff_stream_t *rs, FILE *in, FILE *out,
+		   struct wavfmt *fmt, int *pis_riff)
+{
+  uint64_t nsamples;
+  int ret, bits;
+
+  ret = riff_stream_open(rs, in, nz->float_output ? NULL : out);
+  if (ret == -1)
+    return NORMALIZE_ERR_IO;
+  *pis_riff = (ret == 0);
+  ret = get_stream_wav_data(nz, rs, *pis_riff, fmt);
+  if (ret != NORMALIZE_OK)
+    return ret;
+
+  if (nz->float_output) {
+    bits = 32;
+    if (fmt->format_tag == WAVE_FORMAT_IEEE_FLOAT)
+      bits = fmt->bits_per_sample;
+    nsamples = RIFF_SIZE_UNKNOWN;
+    if (*pis_riff && rs->size != RIFF_SIZE_UNKNOWN)
+      nsamples = rs->size / ((fmt->bits_per_sample - 1) / 8 + 1);
+    if (write_float_header(out, fmt, bits, nsamples) == -1)
+      return NORMALIZE_ERR_IO;
+  }
+  if (ferror(out))
+    return NORMALIZE_ERR_IO;
+  rs->copy_fp = NULL;
+
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * Copy len bytes from in to out through buf, which holds buf_bytes,
+ * or everything up to EOF if len is COPY_TO_EOF.  Returns -1 on
+ * error, or if in ends too soon.
+ */
+static int
+copy_bytes(FILE *in, FILE *out, unsigned char *buf, size_t buf_bytes,
+	   uint64_t len)
+{
+  size_t n;
+
+  while (len > 0) {
+    n = len < buf_bytes ? len : buf_bytes;
+    n = fread(buf, 1, n, in);
+    if (n == 0)
+      return len == COPY_TO_EOF && !ferror(in) ? 0 : -1;
+    if (fwrite(buf, 1, n, out) < n)
+      return -1;
+    if (len != COPY_TO_EOF)
+      len -= n;
+  }
+  return 0;
+}
+
+
+/*
+ * input is read from read_fd and output is written to write_fd:
+ * name is passed to the progress callback.
+ *
+ * The psi pointer gives the peaks so we know if compression is needed
+ * or not.  It may be specified as NULL if this information is not
+ * available.  If pgi is not NULL, it is filled in with the number of
+ * samples adjusted and clipped.
+ *
+ * Only the samples are changed: the header, and anything after the
+ * samples, are copied as they are.  With float output, the output is
+ * bigger than the input, unless the input is float already, so
+ * write_fd must then be a different file.  Only the samples are
+ * written after the new header.
+ *
+ * With ranges set (see normalize_set_ranges()), only the samples in
+ * them are adjusted, and the rest are copied, unless write_fd is open
+ * on the same file as read_fd: then they're skipped, and only the
+ * samples in the ranges are read and written.
+ */
+int
+normalize_apply_fd(normalize_t *nz, int read_fd, int write_fd,
+		   const char *name, double gain,
+		   const struct signal_info *psi, struct gain_info *pgi)
+{
+  return apply_fd(nz, read_fd, write_fd, name, gain, NULL, psi, pgi);
+}
+
+/*
+ * Apply gains[i] to the samples of segment i, the i'th of the ranges
+ * set with normalize_set_ranges(), as analyzed into sis[i] by
+ * normalize_analyze_segments(); sis may be NULL.  Otherwise this is
+ * normalize_apply_fd().  Where the gain changes, it ramps from one
+ * gain to the other over the time set with normalize_set_ramp():
+ * between segments that meet, the ramp is in the one with the higher
+ * gain, so neither goes past its own, and next to a part of the file
+ * that's left as it is, it's inside the segment, to or from a gain
+ * of 1.
+ */
+int
+normalize_apply_segments(normalize_t *nz, int read_fd, int write_fd,
+			 const char *name, const double *gains,
+			 const struct signal_info *sis, struct gain_info *pgi)
+{
+  if (nz->nranges == 0) {
+    nz->errmsg = N_("no segments");
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  return apply_fd(nz, read_fd, write_fd, name, 1.0, gains, sis, pgi);
+}
+
+/*
+ * Apply the gain, or with gains, the gain for each range, reading
+ * from read_fd and writing to write_fd; psi is then an array too
+ */
+static int
+apply_fd(normalize_t *nz, int read_fd, int write_fd, const char *name,
+	 double gain, const double *gains, const struct signal_info *psi,
+	 struct gain_info *pgi)
+{
+  const struct container *type;
+  struct container_info ci;
+  struct wavfmt outfmt;
+  struct gain_state gs;
+  struct stat rd_stat, wr_stat;
+  struct ramp left, right, *ramp;
+  uint64_t nsamples, nframes, start, end, pos, ranged, samples_done;
+  uint64_t first, last, stop, nclippings;
+  int err, bits = 0, out_bytes, range, in_place = FALSE, compressed;
+  FILE *rd_stream = NULL, *wr_stream = NULL;
+
+  float last_progress = 0, progress;
+
+  unsigned char *data_buf = NULL, *float_buf = NULL, *out_buf;
+  size_t samples_in_buf, samples_recvd, n;
+
+  nz->errmsg = NULL;
+  if (nz->nranges > 0 && nz->float_output) {
+    nz->errmsg = N_("float output can't be limited to ranges");
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  err = open_container(nz, read_fd, &ci, &type);
+  if (err != NORMALIZE_OK)
+    goto error1;
+
+  if (gains)
+    err = gain_init(nz, &gs, &ci.fmt, gains[0], psi, nz->float_output);
+  else
+    err = gain_init(nz, &gs, &ci.fmt, gain, psi, nz->float_output);
+  if (err != NORMALIZE_OK)
+    goto error1;
+  compressed = gs.do_compression;
+
+  /* ignore different channels, apply gain to all samples */
+  nsamples = ci.data_size / gs.bytes_per_sample;
+  nframes = nsamples / ci.fmt.channels;
+
+  /* the samples in the ranges; one reaching the end of the data takes
+     in any odd samples after the last whole frame */
+  ranged = 0;
+  for (range = 0; get_range(nz, range, &ci.fmt, nframes, &start, &end);
+       range++) {
+    end = end == nframes ? nsamples : end * ci.fmt.channels;
+    if (end > start * ci.fmt.channels)
+      ranged += end - start * ci.fmt.channels;
+  }
+
+  /* adjusting ranges of a file in place, the rest needn't be touched */
+  if (nz->nranges > 0 && fstat(read_fd, &rd_stat) == 0
+      && fstat(write_fd, &wr_stat) == 0 && rd_stat.st_dev == wr_stat.st_dev
+      && rd_stat.st_ino == wr_stat.st_ino)
+    in_place = TRUE;
+
+  /* the samples we write, in the container's own layout */
+  outfmt = ci.fmt;
+  out_bytes = gs.bytes_per_sample;
+  if (nz->float_output) {
+    bits = gs.is_float ? ci.fmt.bits_per_sample : 32;
+    outfmt.format_tag = WAVE_FORMAT_IEEE_FLOAT;
+    outfmt.bits_per_sample = bits;
+    outfmt.sample_flags = type->float_flags;
+    out_bytes = bits / 8;
+  }
+
+  /* set up sample buffer to hold a block's worth of samples, so the
+     kernels get whole blocks to work on */
+  samples_in_buf = gs.blk.size * ci.fmt.channels;
+  data_buf = (unsigned char *)nz_alloc(nz, samples_in_buf
+				       * gs.bytes_per_sample);
+  if (data_buf == NULL) {
+    err = NORMALIZE_ERR_NOMEM;
+    goto error2;
+  }
+  if (gs.to_float) {
+    float_buf = (unsigned char *)nz_alloc(nz, samples_in_buf * 4);
+    if (float_buf == NULL) {
+      err = NORMALIZE_ERR_NOMEM;
+      goto error3;
+    }
+  }
+
+  /* open streams for reading and writing (on duplicates of the
+     descriptors, so they can be closed when we're done) */
+  rd_stream = fdopen(dup(read_fd), "rb");
+  wr_stream = fdopen(dup(write_fd), "wb");
+  if (rd_stream == NULL || wr_stream == NULL) {
+    err = NORMALIZE_ERR_IO;
+    goto error4;
+  }
+  /* copy the header, or write a new one for float output */
+  rewind(rd_stream);
+  rewind(wr_stream);
+  if (in_place) {
+    if (fseeko(rd_stream, ci.data_offset, SEEK_SET) == -1
+	|| fseeko(wr_stream, ci.data_offset, SEEK_SET) == -1) {
+      err = NORMALIZE_ERR_IO;
+      goto error4;
+    }
+  } else if (nz->float_output) {
+    if (fseeko(rd_stream, ci.data_offset, SEEK_SET) == -1
+	|| type->write_float_header(wr_stream, &ci.fmt, bits,
+				    nsamples) == -1) {
+      err = NORMALIZE_ERR_IO;
+      goto error4;
+    }
+  } else if (copy_bytes(rd_stream, wr_stream, data_buf,
+			samples_in_buf * gs.bytes_per_sample,
+			ci.data_offset) == -1) {
+    err = NORMALIZE_ERR_IO;
+    goto error4;
+  }
+
+  /* initialize progress meter */
+  if (nz->progress) {
+    nz->progress(name, 0.0, nz->progress_data);
+    last_progress = 0.0;
+  }
+
+  /* read, apply gain, and write, one chunk at time, a range at a time,
+     skipping or copying what's between them */
+  nclippings = samples_done = 0;
+  pos = 0;
+  for (range = 0; get_range(nz, range, &ci.fmt, nframes, &first, &last);
+       range++) {
+    /* each segment has its own gain */
+    if (gains && range > 0) {
+      gain_free(nz, &gs);
+      err = gain_init(nz, &gs, &ci.fmt, gains[range],
+		      psi ? &psi[range] : NULL, FALSE);
+      if (err != NORMALIZE_OK)
+	goto error4;
+      compressed |= gs.do_compression;
+    }
+    start = first * ci.fmt.channels;
+    end = last == nframes ? nsamples : last * ci.fmt.channels;
+    if (end <= start)
+      continue;
+    left.len = right.len = 0;
+    if (gains)
+      get_ramps(nz, range, &ci.fmt, nframes, gains, &left, &right);
+
+    if (start > pos && in_place) {
+      if (fseeko(rd_stream, ci.data_offset
+		 + (off_t)(start * gs.bytes_per_sample), SEEK_SET) == -1
+	  || fseeko(wr_stream, ci.data_offset
+		    + (off_t)(start * gs.bytes_per_sample), SEEK_SET) == -1) {
+	err = NORMALIZE_ERR_IO;
+	goto error4;
+      }
+    } else if (start > pos
+	       && copy_bytes(rd_stream, wr_stream, data_buf,
+			     samples_in_buf * gs.bytes_per_sample,
+			     (start - pos) * gs.bytes_per_sample) == -1) {
+      err = NORMALIZE_ERR_IO;
+      goto error4;
+    }
+    pos = start;
+
+    while (pos < end) {
+      /* the ramps, if any, are done apart from the rest */
+      ramp = NULL;
+      stop = end;
+      if (pos < (first + left.len) * ci.fmt.channels) {
+	ramp = &left;
+	stop = (first + left.len) * ci.fmt.channels;
+      } else if (pos >= (last - right.len) * ci.fmt.channels && right.len) {
+	ramp = &right;
+      } else if (right.len) {
+	stop = (last - right.len) * ci.fmt.channels;
+      }
+      n = samples_in_buf;
+      if (stop - pos < n)
+	n = stop - pos;
+      samples_recvd = fread(data_buf, gs.bytes_per_sample, n, rd_stream);
+      if (samples_recvd == 0)
+	break;
+      flip_samples(&ci.fmt, data_buf, samples_recvd);
+
+      if (ramp) {
+	nclippings += ramp_samples(&gs, ramp, pos / ci.fmt.channels, data_buf,
+				   samples_recvd / ci.fmt.channels);
+	out_buf = data_buf;
+      } else if (gs.to_float) {
+	gain_samples_to_float(&gs, data_buf, float_buf, samples_recvd);
+	out_buf = float_buf;
+      } else {
+	nclippings += gain_samples(&gs, data_buf, samples_recvd);
+	out_buf = data_buf;
+      }
+      flip_samples(&outfmt, out_buf, samples_recvd);
+      if (fwrite(out_buf, out_bytes, samples_recvd, wr_stream)
+	  < samples_recvd) {
+	err = NORMALIZE_ERR_IO;
+	goto error4;
+      }
+
+      samples_done += samples_recvd;
+      pos += samples_recvd;
+
+      /* update progress meter */
+      if (nz->progress) {
+	progress = samples_done / (float)ranged;
+	if (progress >= last_progress + 0.01) {
+	  nz->progress(name, progress, nz->progress_data);
+	  last_progress += 0.01;
+	}
+      }
+    }
+    if (pos < end)
+      break;
+  }
+
+  /* copy the samples after the last range, and whatever follows the
+     samples, unless we wrote a new header or are skipping them */
+  if (!in_place && pos < nsamples && samples_done == ranged
+      && copy_bytes(rd_stream, wr_stream, data_buf,
+		    samples_in_buf * gs.bytes_per_sample,
+		    (nsamples - pos) * gs.bytes_per_sample) == -1) {
+    err = NORMALIZE_ERR_IO;
+    goto error4;
+  }
+  if (!nz->float_output && !in_place && samples_done == ranged
+      && copy_bytes(rd_stream, wr_stream, data_buf,
+		    samples_in_buf * gs.bytes_per_sample, COPY_TO_EOF) == -1) {
+    err = NORMALIZE_ERR_IO;
+    goto error4;
+  }
+
+  /* make sure progress meter is finished */
+  if (nz->progress)
+    nz->progress(name, 1.0, nz->progress_data);
+
+  err = NORMALIZE_OK;
+  if (ferror(rd_stream))
+    err = NORMALIZE_ERR_IO;
+  if (fclose(rd_stream) == EOF)
+    err = NORMALIZE_ERR_IO;
+  if (fclose(wr_stream) == EOF)
+    err = NORMALIZE_ERR_IO;
+
+  if (pgi) {
+    pgi->nsamples = ranged;
+    pgi->nclippings = nclippings;
+    pgi->compressed = compressed;
+  }
+
+  nz_free(nz, float_buf);
+  nz_free(nz, data_buf);
+  gain_free(nz, &gs);
+  return err;
+
+
+  /* error handling stuff */
+ error4:
+  if (rd_stream)
+    fclose(rd_stream);
+  if (wr_stream)
+    fclose(wr_stream);
+  nz_free(nz, float_buf);
+ error3:
+  nz_free(nz, data_buf);
+ error2:
+  gain_free(nz, &gs);
+ error1:
+  return err;
+}
+
+
+/*
+ * Apply the gain to len bytes of raw samples in buf, in place.  The
+ * format of the samples is given by fmt; psi and pgi are as for
+ * normalize_apply_fd().
+ */
+int
+normalize_apply_buffer(normalize_t *nz, void *buf, size_t len,
+		       const struct wavfmt *fmt, double gain,
+		       const struct signal_info *psi, struct gain_info *pgi)
+{
+  struct gain_state gs;
+  unsigned long nclippings;
+  size_t nsamples;
+  int err;
+
+  nz->errmsg = NULL;
+  err = check_format(nz, fmt);
+  if (err != NORMALIZE_OK)
+    return err;
+  err = gain_init(nz, &gs, fmt, gain, psi, FALSE);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  nsamples = len / gs.bytes_per_sample;
+  flip_samples(fmt, (unsigned char *)buf, nsamples);
+  nclippings = gain_samples(&gs, (unsigned char *)buf, nsamples);
+  flip_samples(fmt, (unsigned char *)buf, nsamples);
+
+  if (pgi) {
+    pgi->nsamples = nsamples;
+    pgi->nclippings = nclippings;
+    pgi->compressed = gs.do_compression;
+  }
+
+  gain_free(nz, &gs);
+  return NORMALIZE_OK;
+}
+
+
+/*
+ * Apply the gain to the audio read from in, writing it to out, in
+ * constant memory and without seeking, so in and out may be pipes.
+ *
+ * If the stream starts with a WAV header, the header and any chunks
+ * after the audio data are copied to out unchanged.  Otherwise the
+ * stream is taken to be raw samples in the format rawfmt.  With
+ * float output, a new WAV header is written instead, and only the
+ * audio data follows it.  psi and pgi are as for normalize_apply_fd(),
+ * except that pgi->nsamples is the number of samples actually read.
+ */
+int
+normalize_apply_stream(normalize_t *nz, FILE *in, FILE *out, double gain,
+		       const struct wavfmt *rawfmt,
+		       const struct signal_info *psi, struct gain_info *pgi)
+{
+  riff_stream_t rs;
+  struct wavfmt fmt;
+  struct gain_state gs;
+  unsigned char *data_buf, *float_buf = NULL;
+  size_t buf_bytes, bytes_recvd, samples_recvd;
+  uint64_t nsamples, nclippings;
+  int err, is_riff;
+
+  nz->errmsg = NULL;
+
+  /* copy the wav header */
+  fmt = *rawfmt;
+  err = open_stream_output(nz, &rs, in, out, &fmt, &is_riff);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  err = gain_init(nz, &gs, &fmt, gain, psi, nz->float_output);
+  if (err != NORMALIZE_OK)
+    goto error1;
+
+  /* set up sample buffer to hold a block's worth of samples */
+  buf_bytes = gs.blk.size * fmt.channels * gs.bytes_per_sample;
+  data_buf = (unsigned char *)nz_alloc(nz, buf_bytes);
+  if (data_buf == NULL) {
+    err = NORMALIZE_ERR_NOMEM;
+    goto error1;
+  }
+  if (gs.to_float) {
+    float_buf = (unsigned char *)nz_alloc(nz, buf_bytes / gs.bytes_per_sample
+					  * 4);
+    if (float_buf == NULL) {
+      err = NORMALIZE_ERR_NOMEM;
+      goto error2;
+    }
+  }
+
+  /* read, apply gain, and write, one chunk at time, until the end of
+     the data (a streamed data chunk may not know its own size) */
+  nclippings = nsamples = 0;
+  while ((bytes_recvd = riff_stream_read(&rs, data_buf, buf_bytes)) > 0) {
+
+    /* a partial sample at the end is passed through as it is, unless
+       we wrote a new header */
+    samples_recvd = bytes_recvd / gs.bytes_per_sample;
+    flip_samples(&fmt, data_buf, samples_recvd);
+    if (gs.to_float) {
+      gain_samples_to_float(&gs, data_buf, float_buf, samples_recvd);
+      if (fwrite(float_buf, 4, samples_recvd, out) < samples_recvd) {
+	err = NORMALIZE_ERR_IO;
+	goto error2;
+      }
+    } else {
+      nclippings += gain_samples(&gs, data_buf, samples_recvd);
+      flip_samples(&fmt, data_buf, samples_recvd);
+      if (nz->float_output)
+	bytes_recvd = samples_recvd * gs.bytes_per_sample;
+      if (fwrite(data_buf, 1, bytes_recvd, out) < bytes_recvd) {
+	err = NORMALIZE_ERR_IO;
+	goto error2;
+      }
+    }
+    nsamples += samples_recvd;
+  }
+  if (ferror(in)) {
+    err = NORMALIZE_ERR_IO;
+    goto error2;
+  }
+
+  /* copy anything after the data chunk */
+  if (is_riff && !nz->float_output) {
+    rs.copy_fp = out;
+    while (riff_stream_next(&rs) == 0)
+      ;
+    if (ferror(in)) {
+      err = NORMALIZE_ERR_IO;
+      goto error2;
+    }
+  }
+  if (fflush(out) == EOF || ferror(out)) {
+    err = NORMALIZE_ERR_IO;
+    goto error2;
+  }
+
+  if (pgi) {
+    pgi->nsamples = nsamples;
+    pgi->nclippings = nclippings;
+    pgi->compressed = gs.do_compression;
+  }
+  err = NORMALIZE_OK;
+
+ error2:
+  nz_free(nz, float_buf);
+  nz_free(nz, data_buf);
+ error1:
+  gain_free(nz, &gs);
+  return err;
+}
+
+
+/*
+ * Normalize the audio read from in, writing it to out, in a single
+ * pass with constant memory.  The whole stream can't be analyzed
+ * before any of it is written, so the gain is instead derived from
+ * what has been seen so far plus a lookahead of the given number of
+ * seconds, which is held back in a ring buffer: the output lags the
+ * input by the lookahead, rounded up to whole 1/100 second windows.
+ *
+ * The levels are computed just as for a whole file, with the same
+ * windows and smoothing, and the gain for each window comes from the
+ * loudest smoothed power (or the highest peak) seen up to the end of
+ * the lookahead.  So the gain only ever comes down, and slowly, and
+ * it's already down when a loud passage reaches the output.  If the
+ * loudest passage ends within the lookahead of the start, the result
+ * is just what two passes would have given, unless that's more gain
+ * than normalize_set_max_gain() allows.
+ *
+ * The WAV header, if there is one, is handled as for
+ * normalize_apply_stream().  If pgi is not NULL, it is filled in as
+ * for normalize_apply_stream().
+ */
+int
+normalize_apply_lookahead(normalize_t *nz, FILE *in, FILE *out,
+			  double lookahead, const struct wavfmt *rawfmt,
+			  struct gain_info *pgi)
+{
+  riff_stream_t rs;
+  struct signal_info si;
+  struct analyzer an;
+  const struct true_peak *tp;
+  const struct histogram *hist;
+  struct gain_state gs;
+  unsigned char *ring, *p, *float_buf = NULL;
+  size_t *ring_len;
+  size_t window_bytes, frame_bytes, bytes_recvd;
+  uint64_t nin, nout, nsamples, nclippings;
+  unsigned long nslots;
+  double maxpow, pow, level, gain, cur_gain, clip_gain, max_gain;
+  int c, err, is_riff, compressed, at_eof;
+
+  nz->errmsg = NULL;
+  if (lookahead < 0) {
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+
+  /* loudness is gated over the whole stream, so it can't be done on
+     the way through */
+  if (nz->loudness != NORMALIZE_LOUDNESS_RMS) {
+    nz->errmsg = N_("loudness can't be measured with a lookahead");
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+
+  /* copy the wav header */
+  si.fmt = *rawfmt;
+  err = open_stream_output(nz, &rs, in, out, &si.fmt, &is_riff);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  err = analyzer_init(nz, &an, &si);
+  if (err != NORMALIZE_OK)
+    return err;
+
+  /* the ring holds the lookahead, plus the window being written */
+  nslots = (unsigned long)ceil(lookahead * 100.0 - EPSILON) + 1;
+  frame_bytes = an.channels * an.bytes_per_sample;
+  window_bytes = an.windowsz * frame_bytes;
+  ring = (unsigned char *)nz_alloc(nz, nslots * window_bytes);
+  ring_len = (size_t *)nz_alloc(nz, nslots * sizeof(size_t));
+  if (ring == NULL || ring_len == NULL) {
+    err = NORMALIZE_ERR_NOMEM;
+    goto error1;
+  }
+
+  max_gain = nz->max_gain > 0 ? nz->max_gain : 1.0 / nz->target;
+  cur_gain = 1.0;
+  err = gain_init(nz, &gs, &si.fmt, cur_gain, NULL, nz->float_output);
+  if (err != NORMALIZE_OK)
+    goto error1;
+  if (gs.to_float) {
+    float_buf = (unsigned char *)nz_alloc(nz, window_bytes
+					  / gs.bytes_per_sample * 4);
+    if (float_buf == NULL) {
+      err = NORMALIZE_ERR_NOMEM;
+      goto error2;
+    }
+  }
+
+  maxpow = 0.0;
+  nin = nout = nsamples = nclippings = 0;
+  compressed = at_eof = FALSE;
+  while (nout < nin || !at_eof) {
+
+    /* read the next window into the ring, and add it to the levels */
+    if (!at_eof) {
+      p = ring + (nin % nslots) * window_bytes;
+      bytes_recvd = riff_stream_read(&rs, p, window_bytes);
+      if (bytes_recvd < window_bytes)
+	at_eof = TRUE;
+      if (bytes_recvd > 0) {
+	ring_len[nin % nslots] = bytes_recvd;
+	nin++;
+	flip_samples(&si.fmt, p, bytes_recvd / an.bytes_per_sample);
+	if (bytes_recvd >= frame_bytes) {
+	  analyzer_window(&an, p, bytes_recvd / frame_bytes);
+	  for (c = 0; c < an.channels; c++) {
+	    pow = get_smoothed_data(&an.powsmooth[c]);
+	    if (pow > maxpow)
+	      maxpow = pow;
+	  }
+	}
+      }
+      /* wait until the ring is full before writing anything */
+      if (nin < nslots && !at_eof)
+	continue;
+    }
+    if (nout == nin)
+      break;
+
+    /* work out the gain, as normalize_compute_gains() would */
+    if (nz->mode == NORMALIZE_MODE_PEAK) {
+      if (-si.min_sample > si.max_sample)
+	level = si.min_sample / (double)an.samplemin;
+      else
+	level = si.max_sample / (double)an.samplemax;
+      gain = level > EPSILON ? 1.0 / level : 1.0;
+    } else {
+      level = sqrt(maxpow / (an.samplemin * (double)an.samplemin));
+      gain = level > EPSILON ? nz->target / level : 1.0;
+    }
+
+    /* don't raise a quiet start past where the rest may leave it */
+    if (gain > max_gain)
+      gain = max_gain;
+
+    /* and keep the true peak so far under the limit */
+    tp = (const struct true_peak *)
+      analyzer_metric(&an, NORMALIZE_METRIC_TRUE_PEAK);
+    if (tp && nz->true_peak_limit > 0
+	&& tp->peak * gain > nz->true_peak_limit)
+      gain = nz->true_peak_limit / tp->peak;
+
+    /* and the clipping so far within the budget */
+    hist = (const struct histogram *)
+      analyzer_metric(&an, NORMALIZE_METRIC_HISTOGRAM);
+    if (hist && !nz->do_compression && !nz->float_output) {
+      clip_gain = histogram_clip_gain(hist, (uint64_t)(nz->max_clip
+						       * hist->nsamples));
+      if (gain > clip_gain)
+	gain = clip_gain;
+    }
+
+    /* rebuilding the lookup table for every tiny change would be a
+       waste: 0.1% is well under anything audible */
+    if (fabs(gain / cur_gain - 1.0) > 0.001) {
+      gain_free(nz, &gs);
+      cur_gain = gain;
+      err = gain_init(nz, &gs, &si.fmt, cur_gain, NULL, nz->float_output);
+      if (err != NORMALIZE_OK)
+	goto error1;
+    }
+
+    /* write the oldest window */
+    p = ring + (nout % nslots) * window_bytes;
+    bytes_recvd = ring_len[nout % nslots];
+    if (gs.to_float) {
+      gain_samples_to_float(&gs, p, float_buf,
+			    bytes_recvd / gs.bytes_per_sample);
+      p = float_buf;
+      bytes_recvd = bytes_recvd / gs.bytes_per_sample * 4;
+    } else {
+      nclippings += gain_samples(&gs, p, bytes_recvd / gs.bytes_per_sample);
+      flip_samples(&si.fmt, p, bytes_recvd / gs.bytes_per_sample);
+      if (nz->float_output)
+	bytes_recvd -= bytes_recvd % gs.bytes_per_sample;
+    }
+    if (gs.do_compression)
+      compressed = TRUE;
+    if (fwrite(p, 1, bytes_recvd, out) < bytes_recvd) {
+      err = NORMALIZE_ERR_IO;
+      goto error2;
+    }
+    nsamples += ring_len[nout % nslots] / gs.bytes_per_sample;
+    nout++;
+  }
+  if (ferror(in)) {
+    err = NORMALIZE_ERR_IO;
+    goto error2;
+  }
+
+  /* copy anything after the data chunk */
+  if (is_riff && !nz->float_output) {
+    rs.copy_fp = out;
+    while (riff_stream_next(&rs) == 0)
+      ;
+    if (ferror(in)) {
+      err = NORMALIZE_ERR_IO;
+      goto error2;
+    }
+  }
+  if (fflush(out) == EOF || ferror(out)) {
+    err = NORMALIZE_ERR_IO;
+    goto error2;
+  }
+
+  if (pgi) {
+    pgi->nsamples = nsamples;
+    pgi->nclippings = nclippings;
+    pgi->compressed = compressed;
+  }
+  err = NORMALIZE_OK;
+
+ error2:
+  gain_free(nz, &gs);
+ error1:
+  nz_free(nz, float_buf);
+  nz_free(nz, ring_len);
+  nz_free(nz, ring);
+  analyzer_free(nz, &an);
+  return err;
+}
+
+
+/*
+ * Apply the gain to the named file, in place.  psi and pgi are as for
+ * normalize_apply_fd().  With float output, the file is written to a
+ * temporary file, which then replaces it.
+ */
+int
+normalize_adjust_file(normalize_t *nz, const char *filename, double gain,
+		      const struct signal_info *psi, struct gain_info *pgi)
+{
+  return adjust_file(nz, filename, gain, NULL, psi, pgi);
+}
+
+/*
+ * Apply the gains of the segments to the named file, in place, as
+ * normalize_apply_segments() does
+ */
+int
+normalize_adjust_segments(normalize_t *nz, const char *filename,
+			  const double *gains, const struct signal_info *sis,
+			  struct gain_info *pgi)
+{
+  if (nz->nranges == 0) {
+    nz->errmsg = N_("no segments");
+    errno = EINVAL;
+    return NORMALIZE_ERR_INVAL;
+  }
+  return adjust_file(nz, filename, 1.0, gains, sis, pgi);
+}
+
+static int
+adjust_file(normalize_t *nz, const char *filename, double gain,
+	    const double *gains, const struct signal_info *psi,
+	    struct gain_info *pgi)
+{
+  int fd, fd2, ret, saved_errno;
+  int use_tempfile = USE_TEMPFILE || nz->float_output;
+  struct stat stbuf;
+  char *tmpfile = NULL, *p;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NORMALIZE_ERR_IO;
+
+  if (use_tempfile) {
+    /* Create temporary file name, and open it for writing.  We want
+     * it to be in the same directory (and therefore, in the same
+     * filesystem, for a fast rename). */
+    tmpfile = (char *)nz_alloc(nz, strlen(filename) + 16);
+    if (tmpfile == NULL) {
+      close(fd);
+      return NORMALIZE_ERR_NOMEM;
+    }
+    strcpy(tmpfile, filename);
+    if ((p = strrchr(tmpfile, '/')) == NULL)
+      p = tmpfile;
+    else
+      p++;
+    strcpy(p, "_normXXXXXX");
+    fd2 = xmkstemp(tmpfile);
+    if (fd2 == -1) {
+      saved_errno = errno;
+      close(fd);
+      nz_free(nz, tmpfile);
+      errno = saved_errno;
+      return NORMALIZE_ERR_IO;
+    }
+
+    /* preserve original permissions */
+    fstat(fd, &stbuf);
+    chmod(tmpfile, stbuf.st_mode);
+  } else {
+    fd2 = open(filename, O_WRONLY);
+    if (fd2 == -1) {
+      saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return NORMALIZE_ERR_IO;
+    }
+  }
+
+  ret = apply_fd(nz, fd, fd2, filename, gain, gains, psi, pgi);
+  saved_errno = errno;
+
+  close(fd);
+  close(fd2);
+
+  if (use_tempfile) {
+    /* move the temporary file back to the original file */
+    if (ret == NORMALIZE_OK) {
+      if (xrename(tmpfile, filename) == -1) {
+	saved_errno = errno;
+	ret = NORMALIZE_ERR_IO;
+      }
+    } else {
+      unlink(tmpfile);
+    }
+    nz_free(nz, tmpfile);
+  }
+
+  errno = saved_errno;
+  return ret;
+}
+
+
+/*
+ * This works like the BSD mkstemp, except that we don't unlink the
+ * file, since we end up renaming it to something else.
+ */
+static int
+xmkstemp(char *template)
+{
+  char sfx[7] = "AAAAAA";
+  char *p;
+  int fd, i, done;
+
+  p = template + strlen(template) - 6;
+  if (strcmp(p, "XXXXXX") != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  do {
+    strcpy(p, sfx);
+
+    /* increment the suffix */
+    done = 0; i = 5;
+    while (!done && i >= 0) {
+      sfx[i]++;
+      if (sfx[i] > 'Z') {
+	sfx[i] = 'A';
+	i--;
+      } else {
+	done = 1;
+      }
+    }
+    if (!done) {
+      errno = EEXIST;
+      return -1;
+    }
+
+    /* attempt to open the file */
+    fd = open(template, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+  } while (fd == -1 && errno == EEXIST);
+
+  return fd;
+}
+
+
+/*
+ * Move the file "oldpath" to "newpath", or copy and delete if they
+ * are on different filesystems.
+ */
+static int
+xrename(const char *oldpath, const char *newpath)
+{
+  if (rename(oldpath, newpath) == -1) {
+    if (errno == EXDEV) {
+      /* files are on different filesystems, so we have to copy */
+      FILE *in, *out;
+      char buf[4096];
+      size_t sz;
+
+      in = fopen(oldpath, "rb");
+      if (in == NULL)
+	return -1;
+      out = fopen(newpath, "wb");
+      if (out == NULL) {
+	fclose(in);
+	return -1;
+      }
+
+      while ((sz = fread(buf, 1, 4096, in)) > 0)
+	fwrite(buf, 1, sz, out);
+
+      if (ferror(in) || ferror(out)) {
+	fclose(in);
+	fclose(out);
+	return -1;
+      }
+      if (fclose(in) == EOF) {
+	fclose(out);
+	return -1;
+      }
+      if (fclose(out) == EOF)
+	return -1;
+      if (unlink(oldpath) == -1)
+	return -1;
+    } else {
+      return -1;
+    }
+  }
+
+  return 0;
+}
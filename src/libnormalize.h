@@ -0,0 +1,291 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * libnormalize: the analysis and adjustment code behind normalize,
+ * usable from other programs.
+ *
+ * All settings live in a normalize_t context, and nothing is kept in
+ * global variables, so separate threads can safely use separate
+ * contexts at the same time.  A single context must not be used by
+ * two threads at once.  Nothing is printed and nothing calls exit():
+ * every function that can fail returns one of the NORMALIZE_ERR_*
+ * codes, and leaves errno set to describe the error.
+ */
+
+#ifndef _LIBNORMALIZE_H_
+#define _LIBNORMALIZE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+
+#include <stdio.h>
+#include <sys/types.h>
+/* the fixed-size types come from <stdint.h>, unless a config.h has
+   already defined them as macros, for a system without it */
+#ifndef uint32_t
+# include <stdint.h>
+#endif
+
+
+/* values of wavfmt.format_tag */
+#define WAVE_FORMAT_PCM         1
+#define WAVE_FORMAT_IEEE_FLOAT  3
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE /* only in files, see below */
+
+/* values of wavfmt.sample_flags */
+#define WAVFMT_BIG_ENDIAN       1 /* samples are big-endian */
+#define WAVFMT_SIGNED_8         2 /* 8-bit samples are signed */
+
+/*
+ * For a WAVE_FORMAT_EXTENSIBLE file, format_tag is set from the
+ * subformat GUID, so it's always PCM or float.  sample_flags is 0
+ * for WAV's own layout, little-endian with unsigned 8-bit samples;
+ * other containers, and raw samples, may need some flags set.
+ */
+struct wavfmt {
+  uint16_t format_tag;              /* Format category */
+  uint16_t channels;                /* Number of channels */
+  uint32_t samples_per_sec;         /* Sampling rate */
+  uint32_t avg_bytes_per_sec;       /* For buffer estimation */
+  uint16_t block_align;             /* Data block size */
+
+  uint16_t bits_per_sample;         /* Sample size */
+  uint16_t valid_bits;              /* Bits actually used, or 0 for all */
+  uint32_t channel_mask;            /* Speaker positions, or 0 if unknown */
+  uint16_t sample_flags;            /* WAVFMT_* layout of the samples */
+};
+
+/* the most bands normalize_set_bands() can split the spectrum into */
+#define NORMALIZE_MAX_BANDS 16
+
+/* the metrics analysis can measure besides the level and peak, for
+   normalize_set_metrics(); the loudness, true peak and band levels are
+   also measured when normalize_set_loudness(), normalize_set_true_peak()
+   and normalize_set_bands() call for them */
+#define NORMALIZE_METRIC_LOUDNESS  0x01 /* loudness and loudness_range */
+#define NORMALIZE_METRIC_TRUE_PEAK 0x02 /* true_peak */
+#define NORMALIZE_METRIC_BANDS     0x04 /* bands, if there are edges */
+#define NORMALIZE_METRIC_DC        0x08 /* dc_offset */
+#define NORMALIZE_METRIC_CREST     0x10 /* crest_factor */
+#define NORMALIZE_METRIC_CLIPS     0x20 /* nclipped */
+#define NORMALIZE_METRIC_SILENCE   0x40 /* silence */
+#define NORMALIZE_METRIC_HISTOGRAM 0x80 /* *_clip_gain, gain_clips, nsamples */
+#define NORMALIZE_METRIC_LEVEL     0x100 /* level, in NORMALIZE_MODE_PEAK */
+
+/* the level under which a 1/100 second window counts as silence */
+#define NORMALIZE_SILENCE_DBFS (-60.0)
+
+/* the gains signal_info.gain_clips tells the clipping of: from the
+   first one that clips anything up 48dB, in steps of 1/32dB, and then
+   on up to 188dB, past the gain that takes a 32-bit sample of 1 to
+   full scale, in steps of 1/2dB */
+#define NORMALIZE_CLIP_FINE_STEPS 1537
+#define NORMALIZE_CLIP_STEPS (NORMALIZE_CLIP_FINE_STEPS + 280)
+
+struct signal_info {
+  double level;      /* maximum sustained RMS amplitude, or the loudness
+			as an amplitude (see normalize_set_loudness());
+			just the peak in NORMALIZE_MODE_PEAK, unless
+			NORMALIZE_METRIC_LEVEL or another metric was
+			measured */
+  double level_min;  /* a range the level is likely to be in, by a */
+  double level_max;  /*   heuristic, if it was estimated from a sample
+			  of the signal (see normalize_set_sampling()),
+			  or just the level */
+  double sampled;    /* the fraction of the signal analyzed */
+  double peak;       /* peak amplitude, of the part analyzed */
+  double loudness;   /* R128 integrated loudness in LUFS, or -HUGE_VAL */
+  double loudness_range; /* R128 loudness range in LU */
+  double true_peak;  /* peak amplitude oversampled 4 times, or -1 if it
+			wasn't measured (see normalize_set_true_peak()) */
+  int nbands;        /* the number of band levels, or 0 if they weren't
+			measured (see normalize_set_bands()) */
+  double bands[NORMALIZE_MAX_BANDS]; /* the RMS amplitude in each band,
+					averaged over the channels */
+  double dc_offset;  /* the mean sample of the channel furthest off 0, as
+			a fraction of full scale */
+  double crest_factor; /* the peak over the RMS amplitude of the whole
+			  signal */
+  uint64_t nclipped; /* samples at full scale */
+  double silence;    /* the fraction of 1/100 second windows under
+			NORMALIZE_SILENCE_DBFS in every channel */
+  double first_clip_gain; /* the smallest gain that clips a sample, or
+			     HUGE_VAL */
+  uint64_t gain_clips[NORMALIZE_CLIP_STEPS]; /* the samples each step of
+						gain over that would clip */
+  uint64_t nsamples; /* the samples of all the channels in the histogram */
+  double clip_gain;  /* the largest gain that keeps clipping within
+			the budget (see normalize_set_max_clip()), or
+			HUGE_VAL */
+  unsigned int metrics; /* the NORMALIZE_METRIC_* that were measured */
+  long max_sample;   /* maximum sample value (for float samples, */
+  long min_sample;   /* minimum sample value   scaled so 1.0 is 2^23),
+			or full scale if a peak-only analysis stopped at
+			a full scale sample */
+  struct wavfmt fmt; /* WAV format info */
+};
+
+/* filled in by normalize_average_levels() */
+struct level_stats {
+  double level;      /* the average level, without the thrown out levels */
+  double mean;       /* the mean of all the levels */
+  double std_dev;    /* in decibels, or -1 if a threshold was given */
+  int nignored;      /* the number of levels thrown out */
+};
+
+/* filled in when gain is applied */
+struct gain_info {
+  uint64_t nsamples;        /* samples adjusted */
+  uint64_t nclippings;      /* samples clipped */
+  int compressed;           /* nonzero if compression was done */
+};
+
+typedef struct _normalize_t normalize_t;
+
+/* called with fraction going from 0.0 to 1.0 as a file is processed */
+typedef void (*normalize_progress_t)(const char *name, float fraction,
+				     void *data);
+
+/* a caller-supplied allocator: free may be given NULL */
+typedef struct {
+  void *(*alloc)(size_t size, void *data);
+  void (*free)(void *ptr, void *data);
+  void *data;
+} normalize_allocator_t;
+
+/* return codes */
+#define NORMALIZE_OK             0
+#define NORMALIZE_ERR_NOMEM    (-1) /* allocation failed */
+#define NORMALIZE_ERR_IO       (-2) /* a system call failed, see errno */
+#define NORMALIZE_ERR_FORMAT   (-3) /* not a file we can handle */
+#define NORMALIZE_ERR_INVAL    (-4) /* bad argument */
+#define NORMALIZE_ERR_IGNORED  (-5) /* every level was thrown out */
+
+/* definitions for normalize_set_mode() */
+#define NORMALIZE_MODE_RMS   0 /* normalize each file's RMS level */
+#define NORMALIZE_MODE_PEAK  1 /* bring each file's peak to full scale */
+#define NORMALIZE_MODE_BATCH 2 /* one gain for all files */
+#define NORMALIZE_MODE_MIX   3 /* normalize each file to the average */
+
+/* definitions for normalize_set_loudness() */
+#define NORMALIZE_LOUDNESS_RMS  0 /* the loudest second of RMS power */
+#define NORMALIZE_LOUDNESS_R128 1 /* EBU R128 integrated loudness */
+
+/* the status of a set of kernels, from normalize_kernel_info() */
+#define NORMALIZE_KERNEL_OK          0 /* usable here */
+#define NORMALIZE_KERNEL_UNSUPPORTED 1 /* this CPU can't run them */
+#define NORMALIZE_KERNEL_FAILED      2 /* they failed their self-test */
+
+
+ normalize_t *normalize_new(const normalize_allocator_t *allocator);
+         void normalize_destroy(normalize_t *nz);
+
+         void normalize_set_target(normalize_t *nz, double target);
+         void normalize_set_threshold(normalize_t *nz, double threshold);
+          int normalize_set_mode(normalize_t *nz, int mode);
+          int normalize_set_loudness(normalize_t *nz, int loudness);
+         void normalize_set_true_peak(normalize_t *nz, int do_true_peak);
+         void normalize_set_true_peak_limit(normalize_t *nz, double limit);
+          int normalize_set_bands(normalize_t *nz, const double *edges,
+				  int nedges);
+         void normalize_set_metrics(normalize_t *nz, unsigned int metrics);
+         void normalize_set_max_clip(normalize_t *nz, double fraction);
+          int normalize_set_sampling(normalize_t *nz, double fraction);
+          int normalize_set_ranges(normalize_t *nz, const double *times,
+				   int nranges);
+          int normalize_set_ramp(normalize_t *nz, double seconds);
+         void normalize_set_max_gain(normalize_t *nz, double gain);
+  const char *normalize_metric_info(int i, unsigned int *metric);
+         void normalize_set_compression(normalize_t *nz, int do_compression);
+         void normalize_set_float_output(normalize_t *nz, int float_output);
+         void normalize_set_raw_format(normalize_t *nz,
+				       const struct wavfmt *fmt);
+         void normalize_set_progress(normalize_t *nz,
+				     normalize_progress_t callback,
+				     void *data);
+          int normalize_set_kernels(normalize_t *nz, const char *name);
+  const char *normalize_get_kernels(normalize_t *nz);
+  const char *normalize_kernel_info(int i, int *status);
+
+  const char *normalize_strerror(normalize_t *nz, int err);
+
+          int normalize_analyze_fd(normalize_t *nz, int fd, const char *name,
+				   struct signal_info *psi);
+          int normalize_analyze_stream(normalize_t *nz, FILE *in,
+				       const char *name,
+				       struct signal_info *psi);
+          int normalize_analyze_copy(normalize_t *nz, FILE *in, FILE *copy,
+					     const char *name,
+					     struct signal_info *psi);
+          int normalize_analyze_buffer(normalize_t *nz, const void *buf,
+				       size_t len, struct signal_info *psi);
+          int normalize_analyze_segments(normalize_t *nz, int fd,
+					 const char *name,
+					 struct signal_info *sis);
+
+          int normalize_average_levels(normalize_t *nz,
+				       const struct signal_info *sis, int n,
+				       struct level_stats *stats,
+				       char *ignored);
+          int normalize_compute_gains(normalize_t *nz,
+				      const struct signal_info *sis, int n,
+				      double *gains, struct level_stats *stats);
+       double normalize_limit_gain(normalize_t *nz, double gain,
+				   const struct signal_info *psi);
+     uint64_t normalize_predict_clips(const struct signal_info *psi,
+				      double gain);
+
+          int normalize_apply_fd(normalize_t *nz, int read_fd, int write_fd,
+				 const char *name, double gain,
+				 const struct signal_info *psi,
+				 struct gain_info *pgi);
+          int normalize_apply_buffer(normalize_t *nz, void *buf, size_t len,
+				     const struct wavfmt *fmt, double gain,
+				     const struct signal_info *psi,
+				     struct gain_info *pgi);
+          int normalize_apply_stream(normalize_t *nz, FILE *in, FILE *out,
+					     double gain,
+					     const struct wavfmt *rawfmt,
+					     const struct signal_info *psi,
+					     struct gain_info *pgi);
+          int normalize_apply_lookahead(normalize_t *nz, FILE *in,
+						FILE *out, double lookahead,
+						const struct wavfmt *rawfmt,
+						struct gain_info *pgi);
+          int normalize_adjust_file(normalize_t *nz, const char *filename,
+				    double gain, const struct signal_info *psi,
+				    struct gain_info *pgi);
+          int normalize_apply_segments(normalize_t *nz, int read_fd,
+				       int write_fd, const char *name,
+				       const double *gains,
+				       const struct signal_info *sis,
+				       struct gain_info *pgi);
+          int normalize_adjust_segments(normalize_t *nz,
+					const char *filename,
+					const double *gains,
+					const struct signal_info *sis,
+					struct gain_info *pgi);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _LIBNORMALIZE_H_ */
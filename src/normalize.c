@@ -47,19 +47,6 @@ char *strchr(); char *strrchr();
 #if HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
-#ifdef HAVE_SYS_MMAN_H
-# include <sys/mman.h>
-#endif
-
-#if HAVE_BYTESWAP_H
-# include <byteswap.h>
-#else
-# define bswap_16(x) \
-    ((((x) >> 8) & 0xff) | (((x) & 0xff) << 8))
-# define bswap_32(x) \
-    ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) |       \
-     (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
-#endif /* HAVE_BYTESWAP_H */
 
 #if HAVE_GETHOSTNAME
 extern int gethostname();
@@ -80,10 +67,7 @@ extern int gethostname();
 
 #include "getopt.h"
 
-#include "riff.h"
-
-#define USE_TEMPFILE 0
-#define USE_LOOKUPTABLE 1
+#include "normalize.h"
 
 #define AMPTODBFS(x) (20 * log10(x))
 #define FRACTODB(x) (20 * log10(x))
@@ -112,52 +96,22 @@ extern int gethostname();
 /* warn about clipping if we clip more than this fraction of the samples */
 #define CLIPPING_WARN_THRESH 0.001
 
-struct wavfmt {
-  uint16_t format_tag;              /* Format category */
-  uint16_t channels;                /* Number of channels */
-  uint32_t samples_per_sec;         /* Sampling rate */
-  uint32_t avg_bytes_per_sec;       /* For buffer estimation */
-  uint16_t block_align;             /* Data block size */
-
-  uint16_t bits_per_sample;         /* Sample size */
-};
-
-struct signal_info {
-  double level;      /* maximum sustained RMS amplitude */
-  double peak;       /* peak amplitude */
-  long max_sample;   /* maximum sample value */
-  long min_sample;   /* minimum sample value */
-  struct wavfmt fmt; /* WAV format info */
-};
+struct progress_struct progress_info;
 
-struct progress_struct {
-  time_t file_start;   /* what time we started processing the file */
-  time_t batch_start;  /* what time we started processing the batch */
-  off_t *file_sizes;   /* sizes of each file, in kb */
-  off_t batch_size;    /* sum of all file sizes, in kb */
-  off_t finished_size; /* sum of sizes of all completed files, in kb */
-  int on_file;         /* the index of the file we're working on */
-} progress_info;
-
-void compute_levels(struct signal_info *sis, char **fnames, int nfiles);
-double average_levels(struct signal_info *sis, int nfiles, double threshold);
-double signal_max_power(int fd, char *filename, struct signal_info *psi);
-double signal_max_power_stream(FILE *in, char *filename,
-			       struct signal_info *psi);
-int apply_gain(int read_fd, int write_fd, char *filename, double gain,
-	       struct signal_info *psi);
+void compute_levels(normalize_t *nz, struct signal_info *sis, char **fnames,
+		    int nfiles);
+int filter_stdin(normalize_t *nz, double gain);
+int lookahead_stdin(normalize_t *nz, double lookahead);
+int spool_stdin(normalize_t *nz);
+int list_kernels(void);
 #if 0
 double amp_to_dBFS(double x);
 double frac_to_dB(double x);
 double dBFS_to_amp(double x);
 double dB_to_frac(double x);
 #endif
-#if USE_TEMPFILE
-int xmkstemp(char *template);
-int xrename(const char *oldpath, const char *newpath);
-#endif
 int strncaseeq(const char *s1, const char *s2, size_t n);
-void *xmalloc(size_t size);
+int parse_raw_format(const char *arg, struct wavfmt *fmt);
 
 extern char version[];
 char *progname;
@@ -168,10 +122,11 @@ usage()
 {
   fprintf(stderr, _("\
 Usage: %s [OPTION]... [FILE]...\n\
-Normalize volume of multiple WAV files\n\
+Normalize volume of multiple WAV, AIFF, or AU files\n\
 \n\
   -a, --amplitude=AMP  normalize the RMS volume to the target amplitude\n\
-                         AMP [default 0.25 or -12dBFS]\n\
+                         AMP [default 0.25 or -12dBFS], or the loudness\n\
+                         to AMP if it ends in \"LUFS\" [default -23LUFS]\n\
   -n, --no-adjust      compute and output the volume adjustment, but\n\
                          don't apply it to any of the files\n\
   -g, --gain=ADJ       don't compute the volume adjustment, just apply\n\
@@ -191,6 +146,75 @@ Normalize volume of multiple WAV files\n\
       --peak           adjust using peak levels instead of RMS levels.\n\
                          Each file will be adjusted so that its maximum\n\
                          sample is at full scale.\n\
+      --loudness=METHOD  measure levels by METHOD: \"rms\" [default], or\n\
+                         \"r128\" for EBU R128 integrated loudness, with\n\
+                         gating, in LUFS, and loudness range, in LU\n\
+      --true-peak      measure and show the true peak of each file, with\n\
+                         4x oversampling, in dBTP\n\
+      --true-peak-limit=DBTP\n\
+                       lower the gain of any file whose true peak would\n\
+                         go over DBTP decibels [implies --true-peak]\n\
+      --max-clip=FRACTION\n\
+                       lower the gain of any file it would clip more\n\
+                         than FRACTION of the samples of, as worked\n\
+                         out from a histogram of them [0 for none]\n\
+      --analyze=METHOD read all of each file [\"full\", the default], or\n\
+                         \"sampled:FRACTION\" to estimate the RMS level\n\
+                         from FRACTION of its seconds, picked at random,\n\
+                         reading all of it if that can't tell whether\n\
+                         it needs adjusting\n\
+      --start=TIME     analyze and adjust each file only from TIME on,\n\
+                         in seconds or [HH:]MM:SS.ss, seeking straight\n\
+                         there and leaving the rest of the file as it is\n\
+      --duration=TIME  analyze and adjust only TIME of each file, from\n\
+                         the start or from --start\n\
+      --ranges=FILE    analyze and adjust only the ranges of each file\n\
+                         listed in FILE, a start and end TIME a line,\n\
+                         as one signal\n\
+      --segments=FILE  normalize each segment of each file on its own:\n\
+                         the tracks of FILE, if it's a cue sheet, or\n\
+                         the ranges listed in it, as for --ranges\n\
+      --ramp=SECS      change the gain from one segment's to the next\n\
+                         over SECS seconds, not abruptly [0.05]\n\
+      --bands=EDGES    measure and show the level in each band of the\n\
+                         spectrum split at EDGES, frequencies in Hz\n\
+                         separated by commas, or \"octave\" for octave\n\
+                         bands from 31.5Hz to 16kHz\n\
+      --metrics=LIST   measure and show the metrics in LIST, separated\n\
+                         by commas, in the same pass as the levels: dc\n\
+                         (DC offset), crest (crest factor), clips\n\
+                         (samples at full scale), silence (the part\n\
+                         under -60dBFS), histogram (the clipping the\n\
+                         gain would do), loudness, true-peak, bands, or\n\
+                         all\n\
+      --float          write 32-bit floating point samples, which can't\n\
+                         clip, whatever the input format\n\
+      --raw=ENC,CHANNELS,RATE\n\
+                       read the files, and stdin, as headerless samples\n\
+                         with encoding ENC (u8, s8, s16le, s16be, s24le,\n\
+                         s24be, s32le, s32be, f32le, f32be, f64le, or\n\
+                         f64be), CHANNELS channels, and RATE samples per\n\
+                         second\n\
+      --daemon=SOCKET  run as a server, accepting jobs on the Unix domain\n\
+                         socket SOCKET instead of processing FILEs\n\
+      --workers=N      with --daemon, start N worker processes [default 2]\n\
+      --watch=DIR      watch the directory DIR and its subdirectories, and\n\
+                         normalize audio files as they are written there\n\
+      --debounce=SECS  with --watch, wait until no file has arrived in a\n\
+                         directory for SECS seconds before adjusting it in\n\
+                         batch or mix mode [default 5]\n\
+      --lookahead=SECS normalize stdin to stdout in one pass, deciding\n\
+                         the gain from SECS seconds ahead; the output is\n\
+                         delayed by SECS seconds\n\
+      --max-gain=DB    with --lookahead, raise the level by at most DB\n\
+                         decibels [default: as far as the target is\n\
+                         under full scale]\n\
+      --spool          normalize stdin to stdout in two passes, keeping\n\
+                         the data in a temporary file in between\n\
+      --kernel=NAME    use the sample kernels NAME, \"tune\" to time them\n\
+                         all and use the fastest, or \"auto\" [default]\n\
+      --list-kernels   list the sample kernels, and which ones this CPU\n\
+                         can run\n\
   -v, --verbose        increase verbosity\n\
   -q, --quiet          quiet (decrease verbosity to zero)\n\
   -V, --version        display version information and exit\n\
@@ -199,17 +223,33 @@ Normalize volume of multiple WAV files\n\
 Report bugs to <cvaill@cs.columbia.edu>.\n"), progname);
 }
 
-enum verbose_t {
-  VERBOSE_QUIET    = 0,
-  VERBOSE_PROGRESS = 1,
-  VERBOSE_INFO     = 2,
-  VERBOSE_DEBUG    = 3,
-};
-
 enum {
   OPT_CLIPPING     = 1,
   OPT_PEAK         = 2,
   OPT_FRACTIONS    = 3,
+  OPT_DAEMON       = 4,
+  OPT_WORKERS      = 5,
+  OPT_WATCH        = 6,
+  OPT_DEBOUNCE     = 7,
+  OPT_LOOKAHEAD    = 8,
+  OPT_SPOOL        = 9,
+  OPT_FLOAT        = 10,
+  OPT_RAW          = 11,
+  OPT_KERNEL       = 12,
+  OPT_LIST_KERNELS = 13,
+  OPT_LOUDNESS     = 14,
+  OPT_TRUE_PEAK    = 15,
+  OPT_TP_LIMIT     = 16,
+  OPT_BANDS        = 17,
+  OPT_METRICS      = 18,
+  OPT_MAX_CLIP     = 19,
+  OPT_ANALYZE      = 20,
+  OPT_START        = 21,
+  OPT_DURATION     = 22,
+  OPT_RANGES       = 23,
+  OPT_SEGMENTS     = 24,
+  OPT_RAMP         = 25,
+  OPT_MAX_GAIN     = 26,
 };
 
 /* arguments */
@@ -225,16 +265,49 @@ int mix_mode = FALSE;
 int do_compression = FALSE;
 int use_peak = FALSE;
 int use_fractions = FALSE;
+char *daemon_socket = NULL;
+int daemon_workers = 2;
+char *watch_dir = NULL;
+int watch_debounce = 5;
+double lookahead = -1.0; /* in seconds, or < 0 if not streaming */
+int do_spool = FALSE;
+int float_output = FALSE;
+int use_raw_format = FALSE;
+struct wavfmt raw_format = { WAVE_FORMAT_PCM, 2, 44100, 176400, 4, 16, 16 };
+char *kernel_name = NULL;
+int do_list_kernels = FALSE;
+int loudness = NORMALIZE_LOUDNESS_RMS;
+int do_true_peak = FALSE;
+double true_peak_limit = 0.0;  /* as an amplitude, or 0 for none */
+int nband_edges = 0;           /* 0 for no band levels */
+double band_edges[NORMALIZE_MAX_BANDS - 1];
+unsigned int metrics = 0;      /* the NORMALIZE_METRIC_* to measure */
+double max_clip = -1.0;        /* the fraction of samples a gain may clip,
+				  or < 0 for any */
+double sampling = 0.0;         /* the fraction of a file to estimate its
+				  level from, or 0 to read it all */
+double *ranges = NULL;         /* the start and end times of the parts of
+				  each file to work on, or NULL for all */
+int nranges = 0;
+double ramp = -1.0;            /* the length of the ramps between
+				  segments, or < 0 for the default */
+double max_gain = -1.0;        /* the most --lookahead raises the level
+				  by, in dB, or < 0 for the default */
 
 int
 main(int argc, char *argv[])
 {
-  int fd, fd2, c, i, nfiles;
+  int c, i, nfiles;
+  normalize_t *nz;
   struct signal_info *sis, *psi;
   double level, gain = 1.0, dBdiff;
   char **fnames, *p;
   struct stat st;
   int files_changed = FALSE;
+  int target_given = FALSE, target_in_lufs = FALSE, loudness_given = FALSE;
+  double start_time = -1.0, duration = -1.0;
+  char *ranges_file = NULL, *segments_file = NULL;
+  char **segment_titles = NULL;
 
   struct option longopts[] = {
     {"help", 0, NULL, 'h'},
@@ -251,6 +324,29 @@ main(int argc, char *argv[])
     {"clipping", 0, NULL, OPT_CLIPPING},
     {"peak", 0, NULL, OPT_PEAK},
     {"fractions", 0, NULL, OPT_FRACTIONS},
+    {"daemon", 1, NULL, OPT_DAEMON},
+    {"workers", 1, NULL, OPT_WORKERS},
+    {"watch", 1, NULL, OPT_WATCH},
+    {"debounce", 1, NULL, OPT_DEBOUNCE},
+    {"lookahead", 1, NULL, OPT_LOOKAHEAD},
+    {"spool", 0, NULL, OPT_SPOOL},
+    {"float", 0, NULL, OPT_FLOAT},
+    {"raw", 1, NULL, OPT_RAW},
+    {"kernel", 1, NULL, OPT_KERNEL},
+    {"list-kernels", 0, NULL, OPT_LIST_KERNELS},
+    {"loudness", 1, NULL, OPT_LOUDNESS},
+    {"true-peak", 0, NULL, OPT_TRUE_PEAK},
+    {"true-peak-limit", 1, NULL, OPT_TP_LIMIT},
+    {"bands", 1, NULL, OPT_BANDS},
+    {"metrics", 1, NULL, OPT_METRICS},
+    {"max-clip", 1, NULL, OPT_MAX_CLIP},
+    {"analyze", 1, NULL, OPT_ANALYZE},
+    {"start", 1, NULL, OPT_START},
+    {"duration", 1, NULL, OPT_DURATION},
+    {"ranges", 1, NULL, OPT_RANGES},
+    {"segments", 1, NULL, OPT_SEGMENTS},
+    {"ramp", 1, NULL, OPT_RAMP},
+    {"max-gain", 1, NULL, OPT_MAX_GAIN},
     {NULL, 0, NULL, 0}
   };
 
@@ -278,13 +374,16 @@ main(int argc, char *argv[])
     switch(c) {
     case 'a':
       target = strtod(optarg, &p);
+      target_given = TRUE;
 
-      /* check if "dB" or "dBFS" is given after number */
+      /* check if "dB", "dBFS" or "LUFS" is given after number */
       while(isspace(*p))
 	p++;
-      if (strncaseeq(p, "db", 2)) {
+      if (strncaseeq(p, "lufs", 4))
+	target_in_lufs = TRUE;
+      if (strncaseeq(p, "db", 2) || target_in_lufs) {
 
-	/* amplitude given as dBFS */
+	/* amplitude given as dBFS, or loudness as LUFS */
 	if (target > 0) {
 	  target = -target;
 	  fprintf(stderr, _("%s: Warning: assuming you meant -%s...\n"),
@@ -349,6 +448,158 @@ main(int argc, char *argv[])
     case OPT_FRACTIONS:
       use_fractions = TRUE;
       break;
+    case OPT_DAEMON:
+      daemon_socket = optarg;
+      break;
+    case OPT_WORKERS:
+      daemon_workers = strtol(optarg, NULL, 10);
+      if (daemon_workers < 1) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_WATCH:
+      watch_dir = optarg;
+      break;
+    case OPT_DEBOUNCE:
+      watch_debounce = strtol(optarg, NULL, 10);
+      if (watch_debounce < 0) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_LOOKAHEAD:
+      lookahead = strtod(optarg, &p);
+      if (p == optarg || *p || lookahead < 0) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_SPOOL:
+      do_spool = TRUE;
+      break;
+    case OPT_FLOAT:
+      float_output = TRUE;
+      break;
+    case OPT_RAW:
+      if (parse_raw_format(optarg, &raw_format) == -1) {
+	fprintf(stderr, _("%s: error: bad raw format \"%s\"\n"),
+		progname, optarg);
+	exit(1);
+      }
+      use_raw_format = TRUE;
+      break;
+    case OPT_KERNEL:
+      kernel_name = optarg;
+      break;
+    case OPT_LIST_KERNELS:
+      do_list_kernels = TRUE;
+      break;
+    case OPT_LOUDNESS:
+      if (strcmp(optarg, "rms") == 0)
+	loudness = NORMALIZE_LOUDNESS_RMS;
+      else if (strcmp(optarg, "r128") == 0)
+	loudness = NORMALIZE_LOUDNESS_R128;
+      else {
+	usage();
+	exit(1);
+      }
+      loudness_given = TRUE;
+      break;
+    case OPT_TRUE_PEAK:
+      do_true_peak = TRUE;
+      break;
+    case OPT_TP_LIMIT:
+      /* in dBTP, with or without the units */
+      true_peak_limit = strtod(optarg, &p);
+      while (isspace(*p))
+	p++;
+      if (strncaseeq(p, "db", 2))
+	p += strncaseeq(p + 2, "tp", 2) ? 4 : 2;
+      if (p == optarg || *p != '\0') {
+	usage();
+	exit(1);
+      }
+      true_peak_limit = DBFSTOAMP(true_peak_limit);
+      do_true_peak = TRUE;
+      break;
+    case OPT_BANDS:
+      nband_edges = parse_bands(optarg, band_edges);
+      if (nband_edges == -1) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_METRICS:
+      if (parse_metrics(optarg, &metrics) == -1) {
+	usage();
+	exit(1);
+      }
+      if (metrics & NORMALIZE_METRIC_TRUE_PEAK)
+	do_true_peak = TRUE;
+      if ((metrics & NORMALIZE_METRIC_BANDS) && nband_edges == 0)
+	nband_edges = parse_bands("octave", band_edges);
+      break;
+    case OPT_MAX_CLIP:
+      max_clip = strtod(optarg, &p);
+      if (p == optarg || *p != '\0' || max_clip < 0 || max_clip > 1) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_ANALYZE:
+      if (strcmp(optarg, "full") == 0) {
+	sampling = 0.0;
+	break;
+      }
+      if (strncmp(optarg, "sampled:", 8) != 0) {
+	usage();
+	exit(1);
+      }
+      sampling = strtod(optarg + 8, &p);
+      if (p == optarg + 8 || *p != '\0' || sampling <= 0 || sampling > 1) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_START:
+      p = parse_time(optarg, &start_time);
+      if (p == NULL || *p != '\0') {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_DURATION:
+      p = parse_time(optarg, &duration);
+      if (p == NULL || *p != '\0' || duration <= 0) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_RANGES:
+      ranges_file = optarg;
+      break;
+    case OPT_SEGMENTS:
+      segments_file = optarg;
+      break;
+    case OPT_RAMP:
+      ramp = strtod(optarg, &p);
+      if (p == optarg || *p != '\0' || ramp < 0) {
+	usage();
+	exit(1);
+      }
+      break;
+    case OPT_MAX_GAIN:
+      max_gain = strtod(optarg, &p);
+      while (isspace((unsigned char)*p))
+	p++;
+      if (strncaseeq(p, "db", 2))
+	p += 2;
+      if (p == optarg || *p != '\0' || max_gain < 0) {
+	usage();
+	exit(1);
+      }
+      break;
     case 'v':
       verbose++;
       break;
@@ -372,17 +623,146 @@ main(int argc, char *argv[])
 	    progname);
     exit(1);
   }
+  /* a target in LUFS means R128, and R128's default target is the
+     broadcast one */
+  if (target_in_lufs) {
+    if (loudness_given && loudness != NORMALIZE_LOUDNESS_R128) {
+      fprintf(stderr,
+	      _("%s: error: a target in LUFS needs --loudness=r128\n"),
+	      progname);
+      exit(1);
+    }
+    loudness = NORMALIZE_LOUDNESS_R128;
+  }
+  if (loudness == NORMALIZE_LOUDNESS_R128 && !target_given)
+    target = DBFSTOAMP(-23.0);
   if (use_peak && (mix_mode || batch_mode)) {
     fprintf(stderr,
 	    _("%s: error: -m and -b can't be used with the --peak option\n"),
 	    progname);
     exit(1);
   }
+  if (lookahead >= 0 || do_spool) {
+    if (lookahead >= 0 && do_spool) {
+      fprintf(stderr,
+	      _("%s: error: the --lookahead and --spool options are mutually exclusive\n"),
+	      progname);
+      exit(1);
+    }
+    if (!do_compute_levels || !do_apply_gain || mix_mode) {
+      fprintf(stderr,
+	      _("%s: error: -g, -n, and -m can't be used with --lookahead or --spool\n"),
+	      progname);
+      exit(1);
+    }
+    if (lookahead >= 0 && loudness != NORMALIZE_LOUDNESS_RMS) {
+      fprintf(stderr,
+	      _("%s: error: --loudness=r128 can't be used with --lookahead\n"),
+	      progname);
+      exit(1);
+    }
+    if (optind != argc - 1 || strcmp(argv[optind], "-") != 0) {
+      fprintf(stderr,
+	      _("%s: error: --lookahead and --spool need - as the only file\n"),
+	      progname);
+      exit(1);
+    }
+  }
+  if (segments_file) {
+    if (ranges_file || start_time >= 0 || duration >= 0) {
+      fprintf(stderr,
+	      _("%s: error: --segments can't be used with --start, --duration or --ranges\n"),
+	      progname);
+      exit(1);
+    }
+    if (!do_compute_levels || lookahead >= 0 || do_spool
+	|| daemon_socket || watch_dir) {
+      fprintf(stderr,
+	      _("%s: error: -g, --lookahead, --spool, --daemon and --watch can't be used with --segments\n"),
+	      progname);
+      exit(1);
+    }
+    nranges = read_segments(segments_file, &ranges, &segment_titles);
+    if (nranges == -1)
+      exit(1);
+  } else if (ranges_file) {
+    if (start_time >= 0 || duration >= 0) {
+      fprintf(stderr,
+	      _("%s: error: --ranges can't be used with --start or --duration\n"),
+	      progname);
+      exit(1);
+    }
+    nranges = read_ranges(ranges_file, &ranges);
+    if (nranges == -1)
+      exit(1);
+  } else if (start_time >= 0 || duration >= 0) {
+    ranges = (double *)xmalloc(2 * sizeof(double));
+    ranges[0] = start_time >= 0 ? start_time : 0.0;
+    ranges[1] = duration >= 0 ? ranges[0] + duration : HUGE_VAL;
+    nranges = 1;
+  }
+  if (nranges > 0) {
+    if (float_output) {
+      fprintf(stderr,
+	      _("%s: error: --float can't be used with --start, --duration, --ranges or --segments\n"),
+	      progname);
+      exit(1);
+    }
+    for (i = optind; i < argc; i++) {
+      if (strcmp(argv[i], "-") == 0) {
+	fprintf(stderr,
+		_("%s: error: --start, --duration, --ranges and --segments can't be used with stdin\n"),
+		progname);
+	exit(1);
+      }
+    }
+  }
+  if (do_list_kernels)
+    return list_kernels();
+  if (daemon_socket) {
+    if (optind < argc) {
+      fprintf(stderr,
+	      _("%s: error: files can't be given with the --daemon option\n"),
+	      progname);
+      exit(1);
+    }
+    /* check --kernel now, rather than in every job */
+    normalize_destroy(new_context());
+    return daemon_main(daemon_socket, daemon_workers);
+  }
+  if (watch_dir) {
+    if (optind < argc) {
+      fprintf(stderr,
+	      _("%s: error: files can't be given with the --watch option\n"),
+	      progname);
+      exit(1);
+    }
+    return watch_main(watch_dir, watch_debounce);
+  }
   if (optind >= argc) {
     usage();
     exit(1);
   }
 
+  nz = new_context();
+
+  /*
+   * With a fixed gain, "-" alone means filter stdin to stdout
+   */
+  if (!do_compute_levels && do_apply_gain
+      && optind == argc - 1 && strcmp(argv[optind], "-") == 0) {
+    i = filter_stdin(nz, gain);
+    normalize_destroy(nz);
+    return i == 0 ? 0 : 1;
+  }
+  if (lookahead >= 0 || do_spool) {
+    if (do_spool)
+      i = spool_stdin(nz);
+    else
+      i = lookahead_stdin(nz, lookahead);
+    normalize_destroy(nz);
+    return i == 0 ? 0 : 1;
+  }
 
   /*
    * get sizes of all files, for progress calculation
@@ -416,6 +796,20 @@ main(int argc, char *argv[])
     return 1;
   }
 
+  /*
+   * With --segments, each file is done on its own, start to finish
+   */
+  if (segments_file) {
+    i = segments_main(nz, fnames, nfiles, segment_titles);
+    normalize_destroy(nz);
+    for (c = 0; segment_titles && c < nranges; c++)
+      free(segment_titles[c]);
+    free(segment_titles);
+    free(progress_info.file_sizes);
+    free(fnames);
+    return i;
+  }
+
   /* allocate space to store levels and peaks */
   sis = (struct signal_info *)xmalloc(nfiles * sizeof(struct signal_info));
 
@@ -424,7 +818,7 @@ main(int argc, char *argv[])
    * Compute the levels
    */
   if (do_compute_levels) {
-    compute_levels(sis, fnames, nfiles);
+    compute_levels(nz, sis, fnames, nfiles);
 
     /* anything that came back with a level of -1 was bad, so remove it */
     for (i = 0; i < nfiles; i++) {
@@ -440,24 +834,40 @@ main(int argc, char *argv[])
     }
 
     if (batch_mode || mix_mode) {
-      level = average_levels(sis, nfiles, threshold);
+      if (average_levels(nz, sis, nfiles, &level) == -1)
+	exit(1);
 
       /* For mix mode, we set the target to the average level */
       if (mix_mode)
 	target = level;
 
-      /* For batch mode, we use one gain for all files */
-      if (batch_mode)
+      /* For batch mode, we use one gain for all files, low enough for
+	 every one of them to stay under any true peak limit */
+      if (batch_mode) {
 	gain = target / level;
+	for (i = 0; i < nfiles; i++)
+	  gain = normalize_limit_gain(nz, gain, &sis[i]);
+      }
 
       if (do_print_only) {
 	if (use_fractions)
 	  printf(_("%-12.6f average level\n"), level);
+	else if (loudness == NORMALIZE_LOUDNESS_R128)
+	  printf(_("%-8.4fLUFS average loudness\n"), AMPTODBFS(level));
 	else
 	  printf(_("%-8.4fdBFS average level\n"), AMPTODBFS(level));
+	for (i = 0; batch_mode && i < nfiles; i++) {
+	  if (shows_clips(&sis[i])) {
+	    printf(_("  clips in %s:"), fnames[i]);
+	    print_clips(stdout, &sis[i], gain);
+	  }
+	}
       } else if (verbose >= VERBOSE_INFO) {
 	if (use_fractions)
 	  fprintf(stderr, _("Average level: %0.4f\n"), level);
+	else if (loudness == NORMALIZE_LOUDNESS_R128)
+	  fprintf(stderr, _("Average loudness: %0.4fLUFS\n"),
+		  AMPTODBFS(level));
 	else
 	  fprintf(stderr, _("Average level: %0.4fdBFS\n"), AMPTODBFS(level));
       }
@@ -506,28 +916,18 @@ main(int argc, char *argv[])
    * Apply the gain
    */
   if (do_apply_gain) {
-#if USE_TEMPFILE
-    struct stat stbuf;
-    char *tmpfile, *p;
-#endif
 
     progress_info.batch_start = time(NULL);
     progress_info.finished_size = 0;
 
     for (i = 0; i < nfiles; i++) {
 
-      fd = open(fnames[i], O_RDONLY);
-      if (fd == -1) {
-	fprintf(stderr, _("%s: error opening %s: %s\n"), progname, fnames[i],
-		strerror(errno));
-	continue;
-      }
-
       if (!batch_mode) {
 	if (use_peak)
 	  gain = 1.0 / sis[i].peak;
 	else
 	  gain = target / sis[i].level;
+	gain = normalize_limit_gain(nz, gain, &sis[i]);
 	dBdiff = FRACTODB(gain);
 
 	/* don't bother applying very small adjustments -- see above */
@@ -543,64 +943,15 @@ main(int argc, char *argv[])
 		  dBdiff, fnames[i]);
       }
 
-#if USE_TEMPFILE
-      /* Create temporary file name, and open it for writing.  We want
-       * it to be in the same directory (and therefore, in the same
-       * filesystem, for a fast rename). */
-      tmpfile = (char *)xmalloc(strlen(fnames[i]) + 16);
-      strcpy(tmpfile, fnames[i]);
-      if ((p = strrchr(tmpfile, '/')) == NULL)
-	p = tmpfile;
-      else
-	p++;
-      strcpy(p, "_normXXXXXX");
-      fd2 = xmkstemp(tmpfile);
-      if (fd2 == -1) {
-	fprintf(stderr, _("%s: error opening temp file: %s\n"), progname,
-		strerror(errno));
-	close(fd);
-	free(tmpfile);
-	continue;
-      }
-
-      /* preserve original permissions */
-      fstat(fd, &stbuf);
-      fchmod(fd2, stbuf.st_mode);
-#else
-      fd2 = open(fnames[i], O_WRONLY);
-      if (fd2 == -1) {
-	fprintf(stderr, _("%s: error opening %s: %s\n"), progname, fnames[i],
-		strerror(errno));
-	close(fd);
-	continue;
-      }
-#endif
-
       progress_info.file_start = time(NULL);
       progress_info.on_file = i;
 
       psi = do_compute_levels ? &sis[i] : NULL;
-      if (apply_gain(fd, fd2, fnames[i], gain, psi) == -1) {
-	fprintf(stderr, _("%s: error applying adjustment to %s: %s\n"),
-		progname, fnames[i], strerror(errno));
-      }
-      files_changed = TRUE;
+      if (adjust_file(nz, fnames[i], gain, psi) == 0)
+	files_changed = TRUE;
 
       progress_info.finished_size += progress_info.file_sizes[i];
 
-      close(fd);
-      close(fd2);
-
-#if USE_TEMPFILE
-      /* move the temporary file back to the original file */
-      if (xrename(tmpfile, fnames[i]) == -1) {
-	fprintf(stderr, _("%s: error moving %s to %s: %s\n"), progname,
-		tmpfile, fnames[i], strerror(errno));
-	exit(1);
-      }
-      free(tmpfile);
-#endif
-
       if (verbose >= VERBOSE_PROGRESS && !batch_mode)
 	fprintf(stderr, "\n");
     }
@@ -622,6 +973,7 @@ main(int argc, char *argv[])
 
   } /* end of if (do_apply_gain) */
 
+  normalize_destroy(nz);
   free(sis);
   free(progress_info.file_sizes);
   free(fnames);
@@ -635,74 +987,364 @@ main(int argc, char *argv[])
 }
 
 /*
- * Compute the RMS levels of the files.
+ * Create a library context set up from the command line options.
  */
-void
-compute_levels(struct signal_info *sis, char **fnames, int nfiles)
+normalize_t *
+new_context(void)
 {
-  double power;
-  int i, fd;
-  char cbuf[32];
-  struct wavfmt fmt = { 1, 2, 44100, 176400, 0, 16 };
+  normalize_t *nz;
 
-  if (verbose >= VERBOSE_PROGRESS) {
-    fprintf(stderr, _("Computing levels...\n"));
+  nz = normalize_new(NULL);
+  if (nz == NULL) {
+    fprintf(stderr, _("%s: unable to malloc\n"), progname);
+    exit(1);
+  }
+  normalize_set_target(nz, target);
+  normalize_set_threshold(nz, threshold);
+  normalize_set_compression(nz, do_compression);
+  normalize_set_float_output(nz, float_output);
+  normalize_set_loudness(nz, loudness);
+  normalize_set_true_peak(nz, do_true_peak);
+  normalize_set_true_peak_limit(nz, true_peak_limit);
+  normalize_set_bands(nz, band_edges, nband_edges);
+  /* a peak-only analysis doesn't measure the level, which is printed */
+  if (use_peak && (do_print_only || verbose >= VERBOSE_INFO))
+    normalize_set_metrics(nz, metrics | NORMALIZE_METRIC_LEVEL);
+  else
+    normalize_set_metrics(nz, metrics);
+  normalize_set_max_clip(nz, max_clip);
+  normalize_set_sampling(nz, sampling);
+  if (normalize_set_ranges(nz, ranges, nranges) != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: unable to malloc\n"), progname);
+    exit(1);
+  }
+  if (ramp >= 0)
+    normalize_set_ramp(nz, ramp);
+  if (max_gain >= 0)
+    normalize_set_max_gain(nz, DBTOFRAC(max_gain));
+  if (use_raw_format)
+    normalize_set_raw_format(nz, &raw_format);
+  if (batch_mode)
+    normalize_set_mode(nz, NORMALIZE_MODE_BATCH);
+  else if (mix_mode)
+    normalize_set_mode(nz, NORMALIZE_MODE_MIX);
+  else if (use_peak)
+    normalize_set_mode(nz, NORMALIZE_MODE_PEAK);
+  if (verbose >= VERBOSE_PROGRESS)
+    normalize_set_progress(nz, progress_callback, NULL);
+  if (kernel_name && normalize_set_kernels(nz, kernel_name) != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error: --kernel=%s: %s\n"),
+	    progname, kernel_name, normalize_strerror(nz, NORMALIZE_ERR_INVAL));
+    exit(1);
+  }
+  if (verbose >= VERBOSE_DEBUG)
+    fprintf(stderr, _("%s: using the %s kernels\n"),
+	    progname, normalize_get_kernels(nz));
 
-    if (do_print_only) {
-      if (batch_mode)
-	fprintf(stderr, _("  level        peak\n"));
-      else
-	fprintf(stderr, _("  level        peak         gain\n"));
+  return nz;
+}
+
+/*
+ * Print the kernels built in, whether they can be used here, and
+ * which will be
+ */
+int
+list_kernels(void)
+{
+  normalize_t *nz;
+  const char *name;
+  int i, status;
+
+  for (i = 0; (name = normalize_kernel_info(i, &status)) != NULL; i++) {
+    switch (status) {
+    case NORMALIZE_KERNEL_OK:
+      printf(_("%-8s available\n"), name);
+      break;
+    case NORMALIZE_KERNEL_UNSUPPORTED:
+      printf(_("%-8s not supported by this CPU\n"), name);
+      break;
+    default:
+      printf(_("%-8s failed its self-test\n"), name);
+      break;
     }
   }
 
-  progress_info.batch_start = time(NULL);
-  progress_info.finished_size = 0;
+  nz = new_context();
+  printf(_("using: %s\n"), normalize_get_kernels(nz));
+  normalize_destroy(nz);
+  return 0;
+}
 
-  for (i = 0; i < nfiles; i++) {
+/*
+ * Warn about clipping, if there was any to speak of
+ */
+void
+report_clipping(struct gain_info *pgi)
+{
+  float clip_loss;
 
-    sis[i].level = 0;
+  if (!pgi->compressed && pgi->nsamples > 0) {
+    clip_loss = (float)pgi->nclippings / (float)pgi->nsamples;
 
-    if (strcmp(fnames[i], "-") == 0) {
-      progress_info.file_start = time(NULL);
-      progress_info.on_file = i;
-      errno = 0;
+    if (verbose >= VERBOSE_INFO) {
+      if (pgi->nclippings) {
+	fprintf(stderr, "\n");
+	fprintf(stderr, _("%s: %lu clippings performed, %.4f%% loss\n"),
+		progname, (unsigned long)pgi->nclippings, clip_loss * 100);
+      }
+    } else if (verbose >= VERBOSE_PROGRESS) {
+      if (clip_loss > CLIPPING_WARN_THRESH)
+	fprintf(stderr,
+        _("%s: Warning: lost %0.2f%% of data due to clipping              \n"),
+		progname, clip_loss * 100);
+    }
+  }
+}
 
-      /* for a stream, format info is passed through sis[i].fmt */
-      memcpy(&sis[i].fmt, &fmt, sizeof(struct wavfmt));
-      power = signal_max_power_stream(stdin, NULL, &sis[i]);
-      fnames[i] = "STDIN";
+/*
+ * Apply the gain to the named file, in place, and report any errors
+ * or clipping.  The psi pointer is passed on to
+ * normalize_adjust_file(), and may be NULL.
+ *
+ * Returns 0 on success, or -1 with errno set if there was an error.
+ */
+int
+adjust_file(normalize_t *nz, char *filename, double gain,
+	    struct signal_info *psi)
+{
+  struct gain_info gi;
+  int err, saved_errno;
+
+  err = normalize_adjust_file(nz, filename, gain, psi, &gi);
+  if (err != NORMALIZE_OK) {
+    saved_errno = errno;
+    fprintf(stderr, _("%s: error applying adjustment to %s: %s\n"),
+	    progname, filename, normalize_strerror(nz, err));
+    errno = saved_errno;
+    return -1;
+  }
 
-    } else {
+  report_clipping(&gi);
 
-      fd = open(fnames[i], O_RDONLY);
-      if (fd == -1) {
-	fprintf(stderr, _("%s: error opening %s: %s\n"), progname, fnames[i],
-		strerror(errno));
-	sis[i].level = -1;
-	goto error_update_progress;
-      }
+  return 0;
+}
 
-      progress_info.file_start = time(NULL);
-      progress_info.on_file = i;
-      errno = 0;
+/*
+ * Apply the gain to stdin, writing the result to stdout.  A WAV
+ * header is passed through unchanged; without one, stdin is taken to
+ * be raw samples in raw_format, as for computing levels.
+ *
+ * Returns 0 on success, or -1 if there was an error.
+ */
+int
+filter_stdin(normalize_t *nz, double gain)
+{
+  struct gain_info gi;
+  int err;
+
+  err = normalize_apply_stream(nz, stdin, stdout, gain, &raw_format, NULL,
+			       &gi);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error applying adjustment to %s: %s\n"),
+	    progname, "STDIN", normalize_strerror(nz, err));
+    return -1;
+  }
 
-      power = signal_max_power(fd, fnames[i], &sis[i]);
-    }
+  report_clipping(&gi);
 
-    if (power < 0) {
-      fprintf(stderr, _("%s: error reading %s: %s\n"), progname, fnames[i],
-	      strerror(errno));
-      sis[i].level = -1;
-      goto error_close_fd;
-    }
-    if (power < EPSILON) {
-      if (verbose >= VERBOSE_PROGRESS) {
+  return 0;
+}
+
+/*
+ * Normalize stdin to stdout in one pass, with the given number of
+ * seconds of lookahead.
+ *
+ * Returns 0 on success, or -1 if there was an error.
+ */
+int
+lookahead_stdin(normalize_t *nz, double lookahead)
+{
+  struct gain_info gi;
+  int err;
+
+  /* the output is held back by whole 1/100 second windows */
+  if (verbose >= VERBOSE_INFO)
+    fprintf(stderr, _("%s: output latency is %0.2f seconds\n"),
+	    progname, (unsigned long)ceil(lookahead * 100.0 - EPSILON) / 100.0);
+
+  err = normalize_apply_lookahead(nz, stdin, stdout, lookahead, &raw_format,
+				  &gi);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error normalizing %s: %s\n"),
+	    progname, "STDIN", normalize_strerror(nz, err));
+    return -1;
+  }
+
+  report_clipping(&gi);
+
+  return 0;
+}
+
+/*
+ * Normalize stdin to stdout in two passes: analyze stdin while
+ * spooling it to a temporary file, then apply the gain to the
+ * temporary file.
+ *
+ * Returns 0 on success, or -1 if there was an error.
+ */
+int
+spool_stdin(normalize_t *nz)
+{
+  struct signal_info si;
+  struct gain_info gi;
+  double gain;
+  FILE *spool;
+  int err;
+
+  spool = tmpfile();
+  if (spool == NULL) {
+    fprintf(stderr, _("%s: error creating temporary file: %s\n"),
+	    progname, strerror(errno));
+    return -1;
+  }
+
+  /* the progress meter can't say anything useful about a pipe */
+  normalize_set_progress(nz, NULL, NULL);
+
+  si.fmt = raw_format;
+  err = normalize_analyze_copy(nz, stdin, spool, "STDIN", &si);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error reading %s: %s\n"),
+	    progname, "STDIN", normalize_strerror(nz, err));
+    goto error1;
+  }
+
+  if (si.level * si.level < EPSILON) {
+    if (verbose >= VERBOSE_PROGRESS)
+      fprintf(stderr, _("File %s has zero power, ignoring...\n"), "STDIN");
+    gain = 1.0;
+  } else {
+    err = normalize_compute_gains(nz, &si, 1, &gain, NULL);
+    if (err != NORMALIZE_OK) {
+      fprintf(stderr, "%s: %s\n", progname, normalize_strerror(nz, err));
+      goto error1;
+    }
+  }
+  if (verbose >= VERBOSE_INFO)
+    fprintf(stderr, _("Applying adjustment of %0.2fdB to %s...\n"),
+	    FRACTODB(gain), "STDIN");
+
+  rewind(spool);
+  err = normalize_apply_stream(nz, spool, stdout, gain, &raw_format, &si,
+			       &gi);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error applying adjustment to %s: %s\n"),
+	    progname, "STDIN", normalize_strerror(nz, err));
+    goto error1;
+  }
+  fclose(spool);
+
+  report_clipping(&gi);
+
+  return 0;
+
+ error1:
+  fclose(spool);
+  return -1;
+}
+
+/*
+ * Compute the RMS levels of the files.
+ */
+void
+compute_levels(normalize_t *nz, struct signal_info *sis, char **fnames,
+	       int nfiles)
+{
+  int i, fd, err;
+  double gain = 1.0;
+
+  if (verbose >= VERBOSE_PROGRESS) {
+    fprintf(stderr, _("Computing levels...\n"));
+
+    if (do_print_only)
+      print_header(!batch_mode);
+  }
+
+  progress_info.batch_start = time(NULL);
+  progress_info.finished_size = 0;
+
+  for (i = 0; i < nfiles; i++) {
+
+    sis[i].level = 0;
+
+    if (strcmp(fnames[i], "-") == 0) {
+      progress_info.file_start = time(NULL);
+      progress_info.on_file = i;
+      errno = 0;
+
+      /* for a raw stream, format info is passed through sis[i].fmt;
+         if there's a WAV header, it's filled in from that instead */
+      memcpy(&sis[i].fmt, &raw_format, sizeof(struct wavfmt));
+      fnames[i] = "STDIN";
+      err = normalize_analyze_stream(nz, stdin, fnames[i], &sis[i]);
+
+    } else {
+
+      fd = open(fnames[i], O_RDONLY);
+      if (fd == -1) {
+	fprintf(stderr, _("%s: error opening %s: %s\n"), progname, fnames[i],
+		strerror(errno));
+	sis[i].level = -1;
+	goto error_update_progress;
+      }
+
+      progress_info.file_start = time(NULL);
+      progress_info.on_file = i;
+      errno = 0;
+
+      err = analyze_fd(nz, fd, fnames[i], &sis[i]);
+    }
+
+    if (err != NORMALIZE_OK) {
+      if (verbose >= VERBOSE_PROGRESS)
 	fprintf(stderr,
 		"\r                                     "
 		"                                     \r");
+      fprintf(stderr, _("%s: error reading %s: %s\n"), progname, fnames[i],
+	      normalize_strerror(nz, err));
+      sis[i].level = -1;
+      goto error_close_fd;
+    }
+#if DEBUG
+    if (verbose >= VERBOSE_DEBUG) {
+      fprintf(stderr,
+	      "fmt chunk for %s:\n"
+	      "  format_tag:        %u\n"
+	      "  channels:          %u\n"
+	      "  samples_per_sec:   %u\n"
+	      "  avg_bytes_per_sec: %u\n"
+	      "  block_align:       %u\n"
+	      "  bits_per_sample:   %u\n"
+	      "  valid_bits:        %u\n"
+	      "  channel_mask:      0x%08lX\n",
+	      fnames[i], sis[i].fmt.format_tag, sis[i].fmt.channels,
+	      sis[i].fmt.samples_per_sec, sis[i].fmt.avg_bytes_per_sec,
+	      sis[i].fmt.block_align, sis[i].fmt.bits_per_sample,
+	      sis[i].fmt.valid_bits, (unsigned long)sis[i].fmt.channel_mask);
+    }
+#endif
+    /* the level is the square root of the power */
+    if (sis[i].level * sis[i].level < EPSILON) {
+      if (verbose >= VERBOSE_PROGRESS) {
 	fprintf(stderr,
-		_("File %s has zero power, ignoring...\n"), fnames[i]);
+		"\r                                     "
+		"                                     \r");
+	if (loudness == NORMALIZE_LOUDNESS_R128)
+	  fprintf(stderr, _("File %s has no loudness above the gate, ignoring...\n"),
+		  fnames[i]);
+	else
+	  fprintf(stderr,
+		  _("File %s has zero power, ignoring...\n"), fnames[i]);
       }
       sis[i].level = -1;
       goto error_close_fd;
@@ -716,24 +1358,9 @@ compute_levels(struct signal_info *sis, char **fnames, int nfiles)
 		"\r                                     "
 		"                                     \r");
 
-      if (use_fractions)
-	sprintf(cbuf, "%0.6f", sis[i].level);
-      else
-	sprintf(cbuf, "%0.4fdBFS", AMPTODBFS(sis[i].level));
-      printf("%-12s ", cbuf);
-      if (use_fractions)
-	sprintf(cbuf, "%0.6f", sis[i].peak);
-      else
-	sprintf(cbuf, "%0.4fdBFS", AMPTODBFS(sis[i].peak));
-      printf("%-12s ", cbuf);
-      if (!batch_mode) {
-	if (use_fractions)
-	  sprintf(cbuf, "%0.6f", target / sis[i].level);
-	else
-	  sprintf(cbuf, "%0.4fdB", AMPTODBFS(target / sis[i].level));
-	printf("%-10s ", cbuf);
-      }
-      printf("%s\n", fnames[i]);
+      if (!batch_mode)
+	gain = normalize_limit_gain(nz, target / sis[i].level, &sis[i]);
+      print_levels(&sis[i], gain, !batch_mode, fnames[i]);
 
     } else if (verbose >= VERBOSE_INFO) {
       fprintf(stderr,
@@ -742,9 +1369,31 @@ compute_levels(struct signal_info *sis, char **fnames, int nfiles)
       if (use_fractions)
 	fprintf(stderr, _("Level for %s: %0.4f (%0.4f peak)\n"),
 		fnames[i], sis[i].level, sis[i].peak);
+      else if (loudness == NORMALIZE_LOUDNESS_R128)
+	fprintf(stderr, _("Loudness of %s: %0.4fLUFS (range %0.2fLU, %0.4fdBFS peak)\n"),
+		fnames[i], sis[i].loudness, sis[i].loudness_range,
+		AMPTODBFS(sis[i].peak));
       else
 	fprintf(stderr, _("Level for %s: %0.4fdBFS (%0.4fdBFS peak)\n"),
 		fnames[i], AMPTODBFS(sis[i].level), AMPTODBFS(sis[i].peak));
+      if (do_true_peak && use_fractions)
+	fprintf(stderr, _("True peak of %s: %0.4f\n"), fnames[i],
+		sis[i].true_peak);
+      else if (do_true_peak)
+	fprintf(stderr, _("True peak of %s: %0.4fdBTP\n"), fnames[i],
+		AMPTODBFS(sis[i].true_peak));
+      if (sis[i].nbands > 0) {
+	fprintf(stderr, _("Bands for %s:"), fnames[i]);
+	print_bands(stderr, &sis[i]);
+      }
+      if (shows_metrics(&sis[i])) {
+	fprintf(stderr, _("Metrics for %s:"), fnames[i]);
+	print_metrics(stderr, &sis[i]);
+      }
+      if (sis[i].sampled < 1) {
+	fprintf(stderr, _("Sample of %s:"), fnames[i]);
+	print_sampled(stderr, &sis[i]);
+      }
     }
 
   error_close_fd:
@@ -762,121 +1411,161 @@ compute_levels(struct signal_info *sis, char **fnames, int nfiles)
 }
 
 /*
- * For batch mode, we take the levels for all the input files, throw
- * out any that appear to be statistical aberrations, and average the
- * rest together to get one level and one gain for the whole batch.
+ * Print the heading of the columns print_levels() prints
  */
-double
-average_levels(struct signal_info *sis, int nlevels, double threshold)
+void
+print_header(int show_gain)
 {
-  int i, files_to_avg;
-  double sum, level_difference, std_dev, variance;
-  double level, mean_level;
-  char *badlevels;
-
-  /* badlevels is a boolean array marking the level values to be thrown out */
-  badlevels = (char *)xmalloc(nlevels * sizeof(char));
-  memset(badlevels, 0, nlevels * sizeof(char));
-
-  /* get mean level */
-  sum = 0;
-  for (i = 0; i < nlevels; i++)
-    sum += sis[i].level;
-  mean_level = sum / nlevels;
-
-  /* if no threshold is specified, use 2 * standard dev */
-  if (threshold < 0.0) {
-
-    /*
-     * We want the standard dev of the levels, but we need it in decibels.
-     * Therefore, if u is the mean, the variance is
-     *                  (1/N)summation((20*log10(x/u))^2)
-     *       instead of (1/N)summation((x-u)^2),
-     * which it would be if we needed straight variance "by the numbers".
-     */
-
-    /* get variance */
-    sum = 0;
-    for (i = 0; i < nlevels; i++) {
-      double tmp = FRACTODB(sis[i].level / mean_level);
-      sum += tmp * tmp;
-    }
-    variance = sum / nlevels;
+  if (loudness == NORMALIZE_LOUDNESS_R128)
+    fputs(_("  loudness   range    peak"), stderr);
+  else
+    fputs(_("  level        peak"), stderr);
+  if (do_true_peak)
+    fputs(_("         true peak"), stderr);
+  if (show_gain && do_true_peak)
+    fputs(_("    gain"), stderr);
+  else if (show_gain)
+    fputs(_("         gain"), stderr);
+  fputc('\n', stderr);
+}
+
+/*
+ * Print the levels of psi, the gain if show_gain is set, and name on
+ * a line of stdout, and the bands, metrics, clipping and sample on
+ * lines of their own under it
+ */
+void
+print_levels(const struct signal_info *psi, double gain, int show_gain,
+	     const char *name)
+{
+  char cbuf[32];
 
-    /* get standard deviation */
-    if (variance < EPSILON)
-      std_dev = 0.0;
+  if (use_fractions)
+    sprintf(cbuf, "%0.6f", psi->level);
+  else if (loudness == NORMALIZE_LOUDNESS_R128)
+    sprintf(cbuf, "%0.4fLUFS", psi->loudness);
+  else
+    sprintf(cbuf, "%0.4fdBFS", AMPTODBFS(psi->level));
+  printf("%-12s ", cbuf);
+  if (loudness == NORMALIZE_LOUDNESS_R128) {
+    sprintf(cbuf, "%0.2fLU", psi->loudness_range);
+    printf("%-8s ", cbuf);
+  }
+  if (use_fractions)
+    sprintf(cbuf, "%0.6f", psi->peak);
+  else
+    sprintf(cbuf, "%0.4fdBFS", AMPTODBFS(psi->peak));
+  printf("%-12s ", cbuf);
+  if (do_true_peak) {
+    if (use_fractions)
+      sprintf(cbuf, "%0.6f", psi->true_peak);
+    else
+      sprintf(cbuf, "%0.4fdBTP", AMPTODBFS(psi->true_peak));
+    printf("%-12s ", cbuf);
+  }
+  if (show_gain) {
+    if (use_fractions)
+      sprintf(cbuf, "%0.6f", gain);
     else
-      std_dev = sqrt(variance);
-    if (verbose >= VERBOSE_INFO)
-      fprintf(stderr, _("Standard deviation is %0.2f dB\n"), std_dev);
+      sprintf(cbuf, "%0.4fdB", AMPTODBFS(gain));
+    printf("%-10s ", cbuf);
+  }
+  printf("%s\n", name);
+  if (psi->nbands > 0) {
+    fputs("  bands:", stdout);
+    print_bands(stdout, psi);
+  }
+  if (shows_metrics(psi)) {
+    fputs("  metrics:", stdout);
+    print_metrics(stdout, psi);
+  }
+  if (show_gain && shows_clips(psi)) {
+    fputs("  clips:", stdout);
+    print_clips(stdout, psi, gain);
+  }
+  if (psi->sampled < 1) {
+    fputs("  sampled:", stdout);
+    print_sampled(stdout, psi);
+  }
+}
+
+/*
+ * For batch mode, average the levels of the files with
+ * normalize_average_levels(), and report the levels that were thrown
+ * out.
+ *
+ * Returns 0 and sets *plevel on success, or -1 if every level was
+ * thrown out.
+ */
+int
+average_levels(normalize_t *nz, struct signal_info *sis, int nlevels,
+	       double *plevel)
+{
+  struct level_stats stats;
+  char *ignored;
+  double level_difference;
+  int i, err;
 
-    threshold = 2 * std_dev;
+  if (nlevels == 0) {
+    fprintf(stderr, _("%s: no files!\n"), progname);
+    return -1;
   }
 
-  /*
-   * Throw out level values that seem to be aberrations
-   * (so that one "quiet song" doesn't throw off the average)
-   * We define an aberration as a level that is > 2*stddev dB from the mean.
-   */
-  if (threshold > EPSILON && nlevels > 1) {
-    for (i = 0; i < nlevels; i++) {
+  ignored = (char *)xmalloc(nlevels * sizeof(char));
+  err = normalize_average_levels(nz, sis, nlevels, &stats, ignored);
+  if (err == NORMALIZE_ERR_NOMEM) {
+    fprintf(stderr, _("%s: unable to malloc\n"), progname);
+    exit(1);
+  }
 
-      /* Find how different from average the i'th file's level is.
-       * The "level" here is actually the signal's maximum amplitude,
-       * from which we can compute the difference in decibels. */
-      level_difference = fabs(FRACTODB(mean_level / sis[i].level));
+  if (verbose >= VERBOSE_INFO) {
+    if (stats.std_dev >= 0)
+      fprintf(stderr, _("Standard deviation is %0.2f dB\n"), stats.std_dev);
 
-      /* mark as bad any level that is > threshold different than the mean */
-      if (level_difference > threshold) {
-	if (verbose >= VERBOSE_INFO) {
-	  if (use_fractions) {
-	    fprintf(stderr,
+    for (i = 0; i < nlevels; i++) {
+      if (!ignored[i])
+	continue;
+      level_difference = fabs(FRACTODB(stats.mean / sis[i].level));
+      if (use_fractions) {
+	fprintf(stderr,
 		_("Throwing out level of %0.4f (different by %0.2fdB)\n"),
-		    sis[i].level, level_difference);
-	  } else {
-	    fprintf(stderr,
+		sis[i].level, level_difference);
+      } else {
+	fprintf(stderr,
 		_("Throwing out level of %0.4fdBFS (different by %0.2fdB)\n"),
-		    AMPTODBFS(sis[i].level), level_difference);
-	  }
-	}
-	badlevels[i] = TRUE;
+		AMPTODBFS(sis[i].level), level_difference);
       }
     }
   }
+  free(ignored);
 
-  /* throw out the levels marked as bad */
-  files_to_avg = 0;
-  sum = 0;
-  for (i = 0; i < nlevels; i++)
-    if (!badlevels[i]) {
-      sum += sis[i].level;
-      files_to_avg++;
-    }
-
-  if (files_to_avg == 0) {
+  if (err != NORMALIZE_OK) {
     fprintf(stderr, _("%s: all files ignored, try using -t 100\n"), progname);
-    exit(1);
+    return -1;
   }
 
-  free(badlevels);
-
-  level = sum / files_to_avg;
-
-  return level;
+  *plevel = stats.level;
+  return 0;
 }
 
 #define LINE_LENGTH 79
 void
-progress_callback(char *prefix, float fraction_completed)
+progress_callback(const char *name, float fraction_completed, void *data)
 {
   char buf[LINE_LENGTH + 32]; /* need +1, but +32 in case of huge ETA's */
+  char prefix[18];
   time_t now, time_spent;
   unsigned int file_eta_hr, file_eta_min, file_eta_sec;
   off_t kb_done;
   float batch_fraction;
   unsigned int batch_eta_hr, batch_eta_min, batch_eta_sec;
 
+  /* the prefix is the first 17 characters of the file's base name */
+  if (strrchr(name, '/') != NULL)
+    name = strrchr(name, '/') + 1;
+  strncpy(prefix, name, 17);
+  prefix[17] = 0;
+
   if (fraction_completed <= 0.0) {
     if (progress_info.batch_size == 0) {
       fprintf(stderr,
@@ -938,980 +1627,430 @@ progress_callback(char *prefix, float fraction_completed)
 }
 
 
-static __inline__ long
-get_sample(unsigned char *pdata, int bytes_per_sample)
+#if 0
+/*
+ * decibel conversion routines
+ */
+__inline__ double
+amp_to_dBFS(double x)
 {
-  long sample;
-
-  switch(bytes_per_sample) {
-  case 1:
-    sample = *pdata - 128;
-    break;
-  case 2:
-#ifdef WORDS_BIGENDIAN
-    sample = *((int8_t *)pdata + 1) << 8;
-    sample |= *((int8_t *)pdata) & 0xFF;
-#else
-    sample = *((int16_t *)pdata);
-#endif
-    break;
-  case 3:
-    sample = *((int8_t *)pdata + 2) << 16;
-    sample |= (*((int8_t *)pdata + 1) << 8) & 0xFF00;
-    sample |= *((int8_t *)pdata) & 0xFF;
-    break;
-  case 4:
-    sample = *((int32_t *)pdata);
-#ifdef WORDS_BIGENDIAN
-    sample = bswap_32(sample);
-#endif
-    break;
-  default:
-    /* shouldn't happen */
-    fprintf(stderr,
-	    _("%s: I don't know what to do with %d bytes per sample\n"),
-	    progname, bytes_per_sample);
-    sample = 0;
-  }
-
-  return sample;
+  return 20 * log10(x);
 }
 
-
-static __inline__ void
-put_sample(long sample, unsigned char *pdata, int bytes_per_sample)
+__inline__ double
+frac_to_dB(double x)
 {
-  switch(bytes_per_sample) {
-  case 1:
-    *pdata = sample + 128;
-    break;
-  case 2:
-#ifdef WORDS_BIGENDIAN
-    sample = bswap_16(sample);
-#endif
-    *((int16_t *)pdata) = (int16_t)sample;
-    break;
-  case 3:
-    *pdata = (unsigned char)sample;
-    *(pdata + 1) = (unsigned char)(sample >> 8);
-    *(pdata + 2) = (unsigned char)(sample >> 16);
-    break;
-  case 4:
-#ifdef WORDS_BIGENDIAN
-    sample = bswap_32(sample);
-#endif
-    *((int32_t *)pdata) = (int32_t)sample;
-    break;
-  default:
-    /* shouldn't happen */
-    fprintf(stderr,
-	    _("%s: I don't know what to do with %d bytes per sample\n"),
-	    progname, bytes_per_sample);
-  }
+  return 20 * log10(x);
 }
 
-
-static riff_chunk_t *
-get_wav_data(riff_t *riff, struct wavfmt *fmt)
+__inline__ double
+dBFS_to_amp(double x)
 {
-  riff_chunk_t *chnk;
+  return pow(10, x / 20.0);
+}
 
-  chnk = riff_chunk_read(riff);
-  if (chnk == NULL) {
-    fprintf(stderr, _("%s: error reading riff chunk\n"), progname);
-    goto error2;
-  }
-  if (!riff_fourcc_equals(chnk->id, "RIFF")) {
-    fprintf(stderr, _("%s: not a RIFF WAV file\n"), progname);
-    goto error3;
-  }
-  riff_list_descend(riff, chnk);
-  riff_chunk_unref(chnk);
-
-  /* read format header */
-  chnk = riff_chunk_read(riff);
-  if (chnk == NULL) {
-    fprintf(stderr, _("%s: error reading riff chunk\n"), progname);
-    goto error2;
-  }
-  if (!riff_fourcc_equals(chnk->id, "fmt ")) {
-    fprintf(stderr, _("%s: no format chunk found\n"), progname);
-    goto error3;
-  }
-  fread(fmt, sizeof(struct wavfmt), 1, riff_chunk_get_stream(chnk));
-  riff_chunk_unref(chnk);
-#ifdef WORDS_BIGENDIAN
-  fmt->format_tag        = bswap_16(fmt->format_tag);
-  fmt->channels          = bswap_16(fmt->channels);
-  fmt->samples_per_sec   = bswap_32(fmt->samples_per_sec);
-  fmt->avg_bytes_per_sec = bswap_32(fmt->avg_bytes_per_sec);
-  fmt->block_align       = bswap_16(fmt->block_align);
-  fmt->bits_per_sample   = bswap_16(fmt->bits_per_sample);
+__inline__ double
+dB_to_frac(double x)
+{
+  return pow(10, x / 20.0);
+}
 #endif
 
-  /*
-   * Make sure we can handle this type of wav
-   */
-  if (fmt->format_tag != 1) {
-    fprintf(stderr, _("%s: this is a non-PCM WAV file\n"), progname);
-    errno = EINVAL;
-    goto error3;
-  }
-  if (fmt->bits_per_sample > 32) {
-    fprintf(stderr, _("%s: more than 32 bits per sample not implemented\n"),
-	    progname);
-    errno = EINVAL;
-    goto error3;
+/*
+ * Return nonzero if the two strings are equal, ignoring case, up to
+ * the first n characters
+ */
+int
+strncaseeq(const char *s1, const char *s2, size_t n)
+{
+  for ( ; n > 0; n--) {
+    if (tolower(*s1++) != tolower(*s2++))
+      return 0;
   }
 
-  /* read until data chunk */
-  chnk = NULL;
-  do {
-
-    if (chnk) {
-      riff_chunk_unref(chnk);
-      chnk = NULL;
-    }
-
-    errno = 0;
-    chnk = riff_chunk_read(riff);
-    if (chnk == NULL) {
-      fprintf(stderr, _("%s: no data chunk found\n"), progname);
-      if (errno == 0)
-	errno = EINVAL;
-      goto error2;
-    }
-
-  } while (!riff_fourcc_equals(chnk->id, "data"));
-
-  return chnk;
-
-  /* error handling stuff */
- error3:
-  riff_chunk_unref(chnk);
- error2:
-  return NULL;
+  return 1;
 }
 
-typedef struct {
-  double *buf;
-  int buflen;  /* elements allocated to buffer */
-  int start;   /* index of first element in buffer */
-  int n;       /* num of elements in buffer */
-} datasmooth_t;
-
 /*
- * Takes a full smoothing window, and returns the value of the center
- * element, smoothed.  Currently, just does a mean filter, but we could
- * do a median or gaussian filter here instead.
+ * Parse a raw sample format, as given to --raw: an encoding, the
+ * number of channels, and the sample rate, separated by commas.
+ * Returns 0 on success, or -1 if arg can't be parsed.
  */
-static __inline__ double
-get_smoothed_data(datasmooth_t *s)
+int
+parse_raw_format(const char *arg, struct wavfmt *fmt)
 {
+  static const struct {
+    const char *name;
+    int format_tag, bits, flags;
+  } encodings[] = {
+    { "u8",    WAVE_FORMAT_PCM,        8,  0 },
+    { "s8",    WAVE_FORMAT_PCM,        8,  WAVFMT_SIGNED_8 },
+    { "s16le", WAVE_FORMAT_PCM,        16, 0 },
+    { "s16be", WAVE_FORMAT_PCM,        16, WAVFMT_BIG_ENDIAN },
+    { "s24le", WAVE_FORMAT_PCM,        24, 0 },
+    { "s24be", WAVE_FORMAT_PCM,        24, WAVFMT_BIG_ENDIAN },
+    { "s32le", WAVE_FORMAT_PCM,        32, 0 },
+    { "s32be", WAVE_FORMAT_PCM,        32, WAVFMT_BIG_ENDIAN },
+    { "f32le", WAVE_FORMAT_IEEE_FLOAT, 32, 0 },
+    { "f32be", WAVE_FORMAT_IEEE_FLOAT, 32, WAVFMT_BIG_ENDIAN },
+    { "f64le", WAVE_FORMAT_IEEE_FLOAT, 64, 0 },
+    { "f64be", WAVE_FORMAT_IEEE_FLOAT, 64, WAVFMT_BIG_ENDIAN },
+    { NULL, 0, 0, 0 }
+  };
+  const char *p;
+  char *q;
+  long channels, rate;
   int i;
-  /*int center = (s->n + 1) / 2;*/
-  double smoothed;
 
-  smoothed = 0;
-  for (i = 0; i < s->n; i++)
-    smoothed += s->buf[i];
-  smoothed = smoothed / s->n;
+  p = strchr(arg, ',');
+  if (p == NULL)
+    return -1;
+  for (i = 0; encodings[i].name; i++)
+    if (strlen(encodings[i].name) == p - arg
+	&& strncaseeq(arg, encodings[i].name, p - arg))
+      break;
+  if (encodings[i].name == NULL)
+    return -1;
 
-  return smoothed;
-}
+  channels = strtol(p + 1, &q, 10);
+  if (q == p + 1 || *q != ',' || channels < 1 || channels > 0xFFFF)
+    return -1;
+  p = q + 1;
+  rate = strtol(p, &q, 10);
+  if (q == p || *q || rate < 100)
+    return -1;
+
+  memset(fmt, 0, sizeof(struct wavfmt));
+  fmt->format_tag = encodings[i].format_tag;
+  fmt->channels = channels;
+  fmt->samples_per_sec = rate;
+  fmt->bits_per_sample = fmt->valid_bits = encodings[i].bits;
+  fmt->block_align = channels * (encodings[i].bits / 8);
+  fmt->avg_bytes_per_sec = rate * fmt->block_align;
+  fmt->sample_flags = encodings[i].flags;
 
+  return 0;
+}
 
 /*
- * Get the maximum power level of the wav file
- * (and the peak sample, if ppeak is not NULL)
+ * Parse the bands given to --bands: "octave", or the frequencies that
+ * split them, in Hz, going up and separated by commas.  Returns the
+ * number of frequencies, put in edges, which has room for
+ * NORMALIZE_MAX_BANDS - 1 of them, or -1 if arg can't be parsed.
  */
-double
-signal_max_power(int fd, char *filename, struct signal_info *psi)
+int
+parse_bands(const char *arg, double *edges)
 {
-  riff_t *riff;
-  riff_chunk_t *chnk;
-  struct wavfmt *fmt;
-  unsigned int nsamples;
-
-  int bytes_per_sample;
-  int last_window;
-  unsigned int windowsz;
-  unsigned int win_start, old_start, win_end, old_end;
-
-  int i, c;
-  long sample, samplemax, samplemin;
-  double *sums;
-  double pow, maxpow;
-  datasmooth_t *powsmooth;
-
-  float progress, last_progress = 0.0;
-  char prefix_buf[18];
-
-  FILE *in;
-  unsigned char *data_buf = NULL;
-  int filled_sz;
-
-
-  riff = riff_new(fd, RIFF_RDONLY);
-  if (riff == NULL) {
-    fprintf(stderr, _("%s: error making riff object\n"), progname);
-    goto error1;
+  const char *p = arg;
+  char *q;
+  int n;
+
+  /* halfway, in octaves, between the centres from 31.5Hz to 16kHz */
+  if (strcmp(arg, "octave") == 0) {
+    for (n = 0; n < 9; n++)
+      edges[n] = 1000.0 * pow(2.0, n - 4.5);
+    return 9;
   }
 
-  /* WAV format info will be passed back */
-  fmt = &psi->fmt;
-
-  chnk = get_wav_data(riff, fmt);
-  if (chnk == NULL) {
-    fprintf(stderr, _("%s: error getting wav data\n"), progname);
-    goto error2;
-  }
-#if DEBUG
-  if (verbose >= VERBOSE_DEBUG) {
-    fprintf(stderr,
-	    "fmt chunk for %s:\n"
-	    "  format_tag:        %u\n"
-	    "  channels:          %u\n"
-	    "  samples_per_sec:   %u\n"
-	    "  avg_bytes_per_sec: %u\n"
-	    "  block_align:       %u\n"
-	    "  bits_per_sample:   %u\n",
-	    filename, fmt->format_tag, fmt->channels, fmt->samples_per_sec,
-	    fmt->avg_bytes_per_sec, fmt->block_align, fmt->bits_per_sample);
-  }
-#endif
-  windowsz = (unsigned int)(fmt->samples_per_sec / 100);
-
-  bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
-  samplemax = (1 << (bytes_per_sample * 8 - 1)) - 1;
-  samplemin = -samplemax - 1;
-  nsamples = chnk->size / bytes_per_sample / fmt->channels;
-  /* initialize peaks to effectively -inf and +inf */
-  psi->max_sample = samplemin;
-  psi->min_sample = samplemax;
-#if DEBUG
-  if (verbose >= VERBOSE_DEBUG) {
-    fprintf(stderr,
-	    "bytes_per_sample: %d nsamples: %d\n"
-	    "samplemax: %ld samplemin: %ld\n",
-	    bytes_per_sample, nsamples, samplemax, samplemin);
+  for (n = 0; n < NORMALIZE_MAX_BANDS - 1; n++) {
+    edges[n] = strtod(p, &q);
+    if (q == p || !(edges[n] > 0) || (n > 0 && !(edges[n] > edges[n - 1])))
+      return -1;
+    if (*q == '\0')
+      return n + 1;
+    if (*q != ',')
+      return -1;
+    p = q + 1;
   }
-#endif
-
-  sums = (double *)xmalloc(fmt->channels * sizeof(double));
-  for (c = 0; c < fmt->channels; c++)
-    sums[c] = 0;
-
-  data_buf = (unsigned char *)xmalloc(windowsz
-				      * fmt->channels * bytes_per_sample);
+  return -1;
+}
 
-  /* set up smoothing window buffer */
-  powsmooth = (datasmooth_t *)xmalloc(fmt->channels * sizeof(datasmooth_t));
-  for (c = 0; c < fmt->channels; c++) {
-    powsmooth[c].buflen = 100; /* use a 100-element (1 second) window */
-    powsmooth[c].buf = (double *)xmalloc(powsmooth[c].buflen * sizeof(double));
-    powsmooth[c].start = powsmooth[c].n = 0;
-  }
+/*
+ * Parse a time: seconds, or minutes and seconds, or hours, minutes and
+ * seconds, separated by colons, with only the seconds fractional.
+ * Sets *pt to the time in seconds, and returns a pointer to the
+ * character after it, or NULL if arg doesn't start with a time.
+ */
+char *
+parse_time(const char *arg, double *pt)
+{
+  const char *p = arg;
+  char *q;
+  double x, t = 0;
+  int i;
 
-  /* initialize progress meter */
-  if (verbose >= VERBOSE_PROGRESS) {
-    if (strrchr(filename, '/') != NULL) {
-      filename = strrchr(filename, '/');
-      filename++;
+  for (i = 0; i < 3; i++) {
+    if (!isdigit(*p) && *p != '.')
+      return NULL;
+    x = strtod(p, &q);
+    if (q == p || (i > 0 && x >= 60))
+      return NULL;
+    t = t * 60 + x;
+    if (*q != ':') {
+      *pt = t;
+      return q;
     }
-    strncpy(prefix_buf, filename, 17);
-    prefix_buf[17] = 0;
-    progress_callback(prefix_buf, 0.0);
-    last_progress = 0.0;
+    if (x != floor(x))
+      return NULL;
+    p = q + 1;
   }
+  return NULL;
+}
 
-  in = fdopen(fd, "r");
-  if (in == NULL) {
-    fprintf(stderr, _("%s: failed fdopen: %s\n"),
-	    progname, strerror(errno));
-    goto error7;
+/*
+ * Read the ranges given to --ranges from the file filename: one a
+ * line, as a start and an end time, separated by spaces, or just a
+ * start time for one that runs up to the next one's start, or to the
+ * end, in order and not overlapping.  Blank lines, and anything after
+ * a #, are ignored.  Returns the number of ranges, whose times are put
+ * in an array allocated for *ptimes, or -1 after printing an error.
+ */
+int
+read_ranges(const char *filename, double **ptimes)
+{
+  FILE *f;
+  char line[1024], *p;
+  double *times = NULL, start, end;
+  int n = 0, room = 0, lineno = 0;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, _("%s: error opening %s: %s\n"),
+	    progname, filename, strerror(errno));
+    return -1;
   }
-  fseek(in, chnk->offset + 8, SEEK_SET);
-
-
-  /*
-   * win_start, win_end, old_start, windowsz, interval, and i are in
-   * units of samples.  c is in units of channels.
-   *
-   * The actual window extends from win_start to win_end - 1, inclusive.
-   */
-  old_start = win_start = 0;
-  win_end = 0;
-  last_window = FALSE;
-  maxpow = 0.0;
-
-  do {
-
-    /* set up the window end */
-    old_end = win_end;
-    win_end = win_start + windowsz;
-    if (win_end >= nsamples) {
-      win_end = nsamples;
-      last_window = TRUE;
-    }
-
-    /* read a windowsz sized chunk */
-    filled_sz = fread(data_buf, bytes_per_sample,
-		      windowsz * fmt->channels, in);
-    for (c = 0; c < fmt->channels; c++) {
-      sums[c] = 0;
-      for (i = 0; i < (win_end - win_start); i++) {
-	sample = get_sample(data_buf + (i * fmt->channels * bytes_per_sample)
-			    + (c * bytes_per_sample), bytes_per_sample);
-	sums[c] += sample * (double)sample;
-	/* track peak */
-	if (sample > psi->max_sample)
-	  psi->max_sample = sample;
-	if (sample < psi->min_sample)
-	  psi->min_sample = sample;
-      }
-    }
-
-    /* compute power for each channel */
-    for (c = 0; c < fmt->channels; c++) {
-      int end;
-      pow = sums[c] / (double)(win_end - win_start);
-
-      end = (powsmooth[c].start + powsmooth[c].n) % powsmooth[c].buflen;
-      powsmooth[c].buf[end] = pow;
-      if (powsmooth[c].n == powsmooth[c].buflen) {
-	powsmooth[c].start = (powsmooth[c].start + 1) % powsmooth[c].buflen;
-	pow = get_smoothed_data(&powsmooth[c]);
-	if (pow > maxpow)
-	  maxpow = pow;
-      } else {
-	powsmooth[c].n++;
-      }
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if ((p = strchr(line, '#')) != NULL)
+      *p = '\0';
+    for (p = line; isspace(*p); p++)
+      ;
+    if (*p == '\0')
+      continue;
+
+    end = HUGE_VAL;
+    p = parse_time(p, &start);
+    if (p && n > 0 && times[2 * n - 1] == HUGE_VAL && start > times[2 * n - 2])
+      times[2 * n - 1] = start;
+    if (p && isspace(*p)) {
+      while (isspace(*p))
+	p++;
+      if (*p != '\0')
+	p = parse_time(p, &end);
     }
-
-    /* update progress meter */
-    if (verbose >= VERBOSE_PROGRESS) {
-      if (nsamples - windowsz == 0)
-	progress = 0;
-      else
-	progress = (win_end - windowsz) / (float)(nsamples - windowsz);
-      /*progress = win_end / ((nsamples - windowsz) / (float)windowsz);*/
-      if (progress >= last_progress + 0.01) {
-	/*printf(_("progress: %f       \n"), progress);*/
-	progress_callback(prefix_buf, progress);
-	last_progress += 0.01;
-      }
+    while (p && isspace(*p))
+      p++;
+    if (p == NULL || *p != '\0' || !(end > start)
+	|| (n > 0 && start < times[2 * n - 1])) {
+      fprintf(stderr, _("%s: %s, line %d: bad range, or out of order\n"),
+	      progname, filename, lineno);
+      goto error;
     }
 
-    /* slide the window ahead */
-    old_start = win_start;
-    win_start += windowsz;
-
-  } while (!last_window);
-
-  if (maxpow < EPSILON) {
-    /*
-     * Either this whole file has zero power, or was too short to ever
-     * fill the smoothing buffer.  In the latter case, we need to just
-     * get maxpow from whatever data we did collect.
-     */
-    for (c = 0; c < fmt->channels; c++) {
-      pow = get_smoothed_data(&powsmooth[c]);
-      if (pow > maxpow)
-	maxpow = pow;
+    if (n == room) {
+      room = room ? 2 * room : 16;
+      times = (double *)xrealloc(times, 2 * room * sizeof(double));
     }
+    times[2 * n] = start;
+    times[2 * n + 1] = end;
+    n++;
+  }
+  if (ferror(f)) {
+    fprintf(stderr, _("%s: error reading %s: %s\n"),
+	    progname, filename, strerror(errno));
+    goto error;
+  }
+  if (n == 0) {
+    fprintf(stderr, _("%s: %s: no ranges\n"), progname, filename);
+    goto error;
   }
+  fclose(f);
+  *ptimes = times;
+  return n;
 
-  for (c = 0; c < fmt->channels; c++)
-    free(powsmooth[c].buf);
-  free(powsmooth);
-  free(data_buf);
-  free(sums);
-  riff_chunk_unref(chnk);
-  riff_unref(riff);
-
-  /* scale the pow value to be in the range 0.0 -- 1.0 */
-  maxpow = maxpow / (samplemin * (double)samplemin);
-
-  /* fill in the signal_info struct */
-  psi->level = sqrt(maxpow);
-  if (-psi->min_sample > psi->max_sample)
-    psi->peak = psi->min_sample / (double)samplemin;
-  else
-    psi->peak = psi->max_sample / (double)samplemax;
-
-  return maxpow;
-
-  /* error handling stuff */
- error7:
-  for (c = 0; c < fmt->channels; c++)
-    free(powsmooth[c].buf);
-  /*error6:*/
-  free(powsmooth);
-  /*error5:*/
-  free(data_buf);
-  /*error4:*/
-  free(sums);
-  /*error3:*/
-  riff_chunk_unref(chnk);
- error2:
-  riff_unref(riff);
- error1:
-  return -1.0;
+ error:
+  fclose(f);
+  free(times);
+  return -1;
 }
 
-
 /*
- * Get the maximum power level of the data read from a stream
- * (and the peak sample, if ppeak is not NULL)
+ * Print the band levels of psi on the rest of a line of out, each
+ * after the frequency its band starts at
  */
-double
-signal_max_power_stream(FILE *in, char *filename, struct signal_info *psi)
-
+void
+print_bands(FILE *out, const struct signal_info *psi)
 {
-  struct wavfmt *fmt;
-  int bytes_per_sample;
-  int last_window;
-  unsigned int windowsz;
-  unsigned int win_start, old_start, win_end, old_end;
-
-  int i, c;
-  long sample, samplemax, samplemin;
-  double *sums;
-  double pow, maxpow;
-  datasmooth_t *powsmooth;
-
-  char prefix_buf[18];
-
-  unsigned char *data_buf = NULL;
-  int filled_sz;
-
-  if (filename == NULL || strcmp(filename, "-") == 0)
-    filename = "STDIN";
-
-  /* WAV format info must be passed to us in psi->fmt */
-  fmt = &psi->fmt;
-
-  windowsz = (unsigned int)(fmt->samples_per_sec / 100);
-
-  bytes_per_sample = (fmt->bits_per_sample - 1) / 8 + 1;
-  samplemax = (1 << (bytes_per_sample * 8 - 1)) - 1;
-  samplemin = -samplemax - 1;
-  /* initialize peaks to effectively -inf and +inf */
-  psi->max_sample = samplemin;
-  psi->min_sample = samplemax;
-
-  sums = (double *)xmalloc(fmt->channels * sizeof(double));
-  for (c = 0; c < fmt->channels; c++)
-    sums[c] = 0;
-
-  data_buf = (unsigned char *)xmalloc(windowsz
-				      * fmt->channels * bytes_per_sample);
-
-  /* set up smoothing window buffer */
-  powsmooth = (datasmooth_t *)xmalloc(fmt->channels * sizeof(datasmooth_t));
-  for (c = 0; c < fmt->channels; c++) {
-    powsmooth[c].buflen = 100; /* use a 100-element (1 second) window */
-    powsmooth[c].buf = (double *)xmalloc(powsmooth[c].buflen * sizeof(double));
-    powsmooth[c].start = powsmooth[c].n = 0;
-  }
-
-  /* initialize progress meter */
-  if (verbose >= VERBOSE_PROGRESS) {
-    if (strrchr(filename, '/') != NULL) {
-      filename = strrchr(filename, '/');
-      filename++;
-    }
-    strncpy(prefix_buf, filename, 17);
-    prefix_buf[17] = 0;
-    progress_callback(prefix_buf, 0.0);
-  }
-
-
-  /*
-   * win_start, win_end, old_start, windowsz, interval, and i are in
-   * units of samples.  c is in units of channels.
-   *
-   * The actual window extends from win_start to win_end - 1, inclusive.
-   */
-  old_start = win_start = 0;
-  win_end = 0;
-  last_window = FALSE;
-  maxpow = 0.0;
-
-  do {
-
-    /* set up the window end */
-    old_end = win_end;
-    win_end = win_start + windowsz;
-
-    /* read a windowsz sized chunk */
-    filled_sz = fread(data_buf, bytes_per_sample,
-		      windowsz * fmt->channels, in);
-
-    /* if we couldn't read a complete chunk, then this is the last chunk */
-    if (filled_sz < windowsz * fmt->channels) {
-      win_end = win_start + (filled_sz / fmt->channels);
-      last_window = TRUE;
-    }
-
-    for (c = 0; c < fmt->channels; c++) {
-      sums[c] = 0;
-      for (i = 0; i < (win_end - win_start); i++) {
-	sample = get_sample(data_buf + (i * fmt->channels * bytes_per_sample)
-			    + (c * bytes_per_sample), bytes_per_sample);
-	sums[c] += sample * (double)sample;
-	/* track peak */
-	if (sample > psi->max_sample)
-	  psi->max_sample = sample;
-	if (sample < psi->min_sample)
-	  psi->min_sample = sample;
-      }
-    }
-
-    /* compute power for each channel */
-    for (c = 0; c < fmt->channels; c++) {
-      int end;
-      pow = sums[c] / (double)(win_end - win_start);
-
-      end = (powsmooth[c].start + powsmooth[c].n) % powsmooth[c].buflen;
-      powsmooth[c].buf[end] = pow;
-      if (powsmooth[c].n == powsmooth[c].buflen) {
-	powsmooth[c].start = (powsmooth[c].start + 1) % powsmooth[c].buflen;
-	pow = get_smoothed_data(&powsmooth[c]);
-	if (pow > maxpow)
-	  maxpow = pow;
-      } else {
-	powsmooth[c].n++;
-      }
-    }
+  int i;
 
-    /* slide the window ahead */
-    old_start = win_start;
-    win_start += windowsz;
-
-  } while (!last_window);
-
-  if (maxpow < EPSILON) {
-    /*
-     * Either this whole file has zero power, or was too short to ever
-     * fill the smoothing buffer.  In the latter case, we need to just
-     * get maxpow from whatever data we did collect.
-     */
-    for (c = 0; c < fmt->channels; c++) {
-      pow = get_smoothed_data(&powsmooth[c]);
-      if (pow > maxpow)
-	maxpow = pow;
-    }
+  for (i = 0; i < psi->nbands; i++) {
+    fprintf(out, " %0.0fHz ", i == 0 ? 0.0 : band_edges[i - 1]);
+    if (use_fractions)
+      fprintf(out, "%0.6f", psi->bands[i]);
+    else
+      fprintf(out, "%0.2fdBFS", AMPTODBFS(psi->bands[i]));
   }
-
-  for (c = 0; c < fmt->channels; c++)
-    free(powsmooth[c].buf);
-  free(powsmooth);
-  free(data_buf);
-  free(sums);
-
-  /* scale the pow value to be in the range 0.0 -- 1.0 */
-  maxpow = maxpow / (samplemin * (double)samplemin);
-
-  /* fill in the signal_info struct */
-  psi->level = sqrt(maxpow);
-  if (-psi->min_sample > psi->max_sample)
-    psi->peak = psi->min_sample / (double)samplemin;
-  else
-    psi->peak = psi->max_sample / (double)samplemax;
-
-  return maxpow;
+  fputc('\n', out);
 }
 
-
 /*
- * input is read from read_fd and output is written to write_fd:
- * filename is used only for messages.
- *
- * The psi pointer gives the peaks so we know if compression is needed
- * or not.  It may be specified as NULL if this information is not
- * available.
+ * Parse the metrics given to --metrics: their names, separated by
+ * commas, or "all".  Sets *pmetrics to their NORMALIZE_METRIC_*
+ * flags, or returns -1 if arg can't be parsed.
  */
 int
-apply_gain(int read_fd, int write_fd, char *filename, double gain,
-	   struct signal_info *psi)
+parse_metrics(const char *arg, unsigned int *pmetrics)
 {
-  riff_t *riff;
-  riff_chunk_t *chnk;
-  struct wavfmt fmt;
-  unsigned int nsamples, samples_done, nclippings;
-  int bytes_per_sample, i;
-  long sample, samplemax, samplemin;
-  float clip_loss;
-  FILE *rd_stream, *wr_stream;
-
-  float last_progress = 0, progress;
-  char prefix_buf[18];
-
-  unsigned char *data_buf = NULL;
-  int samples_in_buf, samples_recvd;
-  int do_compression_this_file;
-#if USE_LOOKUPTABLE
-  int min_pos_clipped; /* the minimum positive sample that gets clipped */
-  int max_neg_clipped; /* the maximum negative sample that gets clipped */
-  int16_t *lut = NULL;
-#endif
-
-  riff = riff_new(read_fd, RIFF_RDONLY);
-  if (riff == NULL) {
-    fprintf(stderr, _("%s: error making riff object\n"), progname);
-    goto error1;
-  }
-
-  chnk = get_wav_data(riff, &fmt);
-  if (chnk == NULL) {
-    fprintf(stderr, _("%s: error getting wav data\n"), progname);
-    goto error2;
-  }
-
-  bytes_per_sample = (fmt.bits_per_sample - 1) / 8 + 1;
-  samplemax = (1 << (bytes_per_sample * 8 - 1)) - 1;
-  samplemin = -samplemax - 1;
-
-  /* ignore different channels, apply gain to all samples */
-  nsamples = chnk->size / bytes_per_sample;
-
-  /* set up sample buffer to hold 1/100 of a second worth of samples */
-  /* (make sure it can hold at least the wav header, though) */
-  samples_in_buf = (fmt.samples_per_sec / 100) * fmt.channels;
-  if (chnk->offset + 8 > samples_in_buf * bytes_per_sample)
-    data_buf = (unsigned char *)xmalloc(chnk->offset + 8);
-  else
-    data_buf = (unsigned char *)xmalloc(samples_in_buf * bytes_per_sample);
-
-  /* open streams for reading and writing */
-  rd_stream = fdopen(read_fd, "rb");
-  wr_stream = fdopen(write_fd, "wb");
-  if (rd_stream == NULL || wr_stream == NULL) {
-    fprintf(stderr, _("%s: failed fdopen: %s\n"), progname, strerror(errno));
-    goto error4;
-  }
-  /* copy the wav header */
-  rewind(rd_stream);
-  rewind(wr_stream);
-  if (fread(data_buf, chnk->offset + 8, 1, rd_stream) < 1) {
-    fprintf(stderr, _("%s: read failed: %s\n"), progname, strerror(errno));
-    goto error4;
-  }
-  if (fwrite(data_buf, chnk->offset + 8, 1, wr_stream) < 1) {
-    fprintf(stderr, _("%s: write failed: %s\n"), progname, strerror(errno));
-    goto error4;
-  }
-
-  /*
-   * Check if we actually need to do compression on this file:
-   * we don't if gain <= 1 or if the peaks wouldn't clip anyway.
-   */
-  do_compression_this_file = do_compression && gain > 1.0;
-  if (do_compression_this_file && psi) {
-    if (psi->max_sample * gain <= samplemax
-	&& psi->min_sample * gain >= samplemin)
-      do_compression_this_file = FALSE;
-  }
+  const char *p = arg, *name;
+  unsigned int metric, all = 0, found = 0;
+  size_t len;
+  int i;
 
-#if USE_LOOKUPTABLE
-  /*
-   * If samples are 16 bits or less, build a lookup table for fast
-   * adjustment.  This table is 128k, look out!
-   */
-  if (bytes_per_sample <= 2) {
-    lut = (int16_t *)xmalloc((samplemax - samplemin + 1) * sizeof(int16_t));
-    lut -= samplemin; /* so indices don't have to be offset */
-    min_pos_clipped = samplemax + 1;
-    max_neg_clipped = samplemin - 1;
-    if (gain > 1.0) {
-      if (do_compression_this_file) {
-	/* apply gain, and do tanh compression to avoid clipping */
-	/* Thanks to Ted Wright for this idea and fix */
-	for (i = samplemin; i < 0; i++)
-	  lut[i] = samplemin * tanh(i * gain / (double)samplemin);
-	for (i = 0; i <= samplemax; i++)
-	  lut[i] = samplemax * tanh(i * gain / (double)samplemax);
-      } else {
-	/* apply gain, and do clipping */
-	for (i = samplemin; i <= samplemax; i++) {
-	  sample = i * gain;
-	  if (sample > samplemax) {
-	    sample = samplemax;
-	    if (i < min_pos_clipped)
-	      min_pos_clipped = i;
-	  } else if (sample < samplemin) {
-	    sample = samplemin;
-	    if (i > max_neg_clipped)
-	      max_neg_clipped = i;
-	  }
-	  lut[i] = sample; /* negative indices are okay, see above */
-	}
-      }
+  for (i = 0; normalize_metric_info(i, &metric) != NULL; i++)
+    all |= metric;
+  for (;;) {
+    len = strcspn(p, ",");
+    if (len == 3 && strncmp(p, "all", 3) == 0) {
+      found |= all;
     } else {
-      /* just apply gain if it's less than 1 */
-      for (i = samplemin; i <= samplemax; i++)
-	lut[i] = i * gain;
-    }
-  }
-#endif
-
-  /* initialize progress meter */
-  if (verbose >= VERBOSE_PROGRESS) {
-    if (strrchr(filename, '/') != NULL) {
-      filename = strrchr(filename, '/');
-      filename++;
-    }
-    strncpy(prefix_buf, filename, 17);
-    prefix_buf[17] = 0;
-    progress_callback(prefix_buf, 0.0);
-    last_progress = 0.0;
-  }
-
-  /* read, apply gain, and write, one chunk at time */
-  nclippings = samples_done = 0;
-  while ((samples_recvd = fread(data_buf, bytes_per_sample,
-				samples_in_buf, rd_stream)) > 0) {
-
-    for (i = 0; i < samples_recvd; i++) {
-      sample = get_sample(data_buf + (i * bytes_per_sample), bytes_per_sample);
-
-      if (lut) {
-
-	/* use the lookup table if we built one */
-	if (sample >= min_pos_clipped || sample <= max_neg_clipped)
-	  nclippings++;
-	sample = lut[sample];
-
-      } else {
-
-	/* apply the gain to the sample */
-	sample *= gain;
-
-	if (gain > 1.0) {
-	  if (do_compression_this_file) {
-	    /* do tanh compression instead of clipping */
-	    sample = samplemax * tanh(sample / (double)samplemax);
-	  } else {
-	    /* perform clipping */
-	    if (sample > samplemax) {
-	      sample = samplemax;
-	      nclippings++;
-	    } else if (sample < samplemin) {
-	      sample = samplemin;
-	      nclippings++;
-	    }
-	  }
-	}
-      }
-
-      put_sample(sample, data_buf + (i * bytes_per_sample), bytes_per_sample);
-    }
-
-    if (fwrite(data_buf, bytes_per_sample,
-	       samples_recvd, wr_stream) == 0) {
-      fprintf(stderr, _("%s: failed fwrite: %s\n"), progname, strerror(errno));
-    }
-
-    samples_done += samples_recvd;
-
-    /* update progress meter */
-    if (verbose >= VERBOSE_PROGRESS) {
-      progress = samples_done / (float)nsamples;
-      if (progress >= last_progress + 0.01) {
-	progress_callback(prefix_buf, progress);
-	last_progress += 0.01;
-      }
-    }
-  }
-
-  /* make sure progress meter is finished */
-  if (verbose >= VERBOSE_PROGRESS)
-    progress_callback(prefix_buf, 1.0);
-
-  if (fflush(rd_stream) == -1) {
-    fprintf(stderr, _("%s: failed fflush: %s\n"), progname, strerror(errno));
-  }
-  if (fflush(wr_stream) == -1) {
-    fprintf(stderr, _("%s: failed fflush: %s\n"), progname, strerror(errno));
-  }
-
-  if (!do_compression_this_file) {
-    clip_loss = (float)nclippings / (float)nsamples;
-
-    if (verbose >= VERBOSE_INFO) {
-      if (nclippings) {
-	fprintf(stderr, "\n");
-	fprintf(stderr, _("%s: %d clippings performed, %.4f%% loss\n"),
-		progname, nclippings, clip_loss * 100);
-      }
-    } else if (verbose >= VERBOSE_PROGRESS) {
-      if (clip_loss > CLIPPING_WARN_THRESH)
-	fprintf(stderr,
-        _("%s: Warning: lost %0.2f%% of data due to clipping              \n"),
-		progname, clip_loss * 100);
+      for (i = 0; (name = normalize_metric_info(i, &metric)) != NULL; i++)
+	if (strlen(name) == len && strncmp(p, name, len) == 0)
+	  break;
+      if (name == NULL)
+	return -1;
+      found |= metric;
     }
+    if (p[len] == '\0')
+      break;
+    p += len + 1;
   }
-
-  if (lut) {
-    /* readjust the pointer to the beginning of the array */
-    lut += samplemin;
-    free(lut);
-  }
-  free(data_buf);
-  riff_chunk_unref(chnk);
-  riff_unref(riff);
+  *pmetrics = found;
   return 0;
-
-
-  /* error handling stuff */
- error4:
-  free(data_buf);
-  /*error3:*/
-  riff_chunk_unref(chnk);
- error2:
-  riff_unref(riff);
- error1:
-  return -1;
 }
 
-#if 0
 /*
- * decibel conversion routines
+ * Return nonzero if print_metrics() has anything to show for psi: the
+ * loudness, when it isn't the level, and the metrics with nowhere
+ * else to go
  */
-__inline__ double
-amp_to_dBFS(double x)
+int
+shows_metrics(const struct signal_info *psi)
 {
-  return 20 * log10(x);
-}
+  unsigned int shown = NORMALIZE_METRIC_DC | NORMALIZE_METRIC_CREST
+    | NORMALIZE_METRIC_CLIPS | NORMALIZE_METRIC_SILENCE;
 
-__inline__ double
-frac_to_dB(double x)
-{
-  return 20 * log10(x);
+  if (loudness != NORMALIZE_LOUDNESS_R128)
+    shown |= NORMALIZE_METRIC_LOUDNESS;
+  return (psi->metrics & shown) != 0;
 }
 
-__inline__ double
-dBFS_to_amp(double x)
+/*
+ * Print those metrics of psi on the rest of a line of out
+ */
+void
+print_metrics(FILE *out, const struct signal_info *psi)
 {
-  return pow(10, x / 20.0);
+  if ((psi->metrics & NORMALIZE_METRIC_LOUDNESS)
+      && loudness != NORMALIZE_LOUDNESS_R128)
+    fprintf(out, " loudness=%0.4fLUFS range=%0.2fLU", psi->loudness,
+	    psi->loudness_range);
+  if ((psi->metrics & NORMALIZE_METRIC_DC) && use_fractions)
+    fprintf(out, " dc=%+0.6f", psi->dc_offset);
+  else if (psi->metrics & NORMALIZE_METRIC_DC)
+    fprintf(out, " dc=%+0.4f%%", 100 * psi->dc_offset);
+  if ((psi->metrics & NORMALIZE_METRIC_CREST) && use_fractions)
+    fprintf(out, " crest=%0.4f", psi->crest_factor);
+  else if (psi->metrics & NORMALIZE_METRIC_CREST)
+    fprintf(out, " crest=%0.2fdB", AMPTODBFS(psi->crest_factor));
+  if (psi->metrics & NORMALIZE_METRIC_CLIPS)
+    fprintf(out, " clips=%lu", (unsigned long)psi->nclipped);
+  if ((psi->metrics & NORMALIZE_METRIC_SILENCE) && use_fractions)
+    fprintf(out, " silence=%0.4f", psi->silence);
+  else if (psi->metrics & NORMALIZE_METRIC_SILENCE)
+    fprintf(out, " silence=%0.2f%%", 100 * psi->silence);
+  fputc('\n', out);
 }
 
-__inline__ double
-dB_to_frac(double x)
+/*
+ * Return nonzero if print_clips() has anything to show for psi: its
+ * histogram was measured, and gain would clip rather than compress
+ */
+int
+shows_clips(const struct signal_info *psi)
 {
-  return pow(10, x / 20.0);
+  return (psi->metrics & NORMALIZE_METRIC_HISTOGRAM) && psi->nsamples > 0
+    && !do_compression && !float_output;
 }
-#endif
 
-#if USE_TEMPFILE
 /*
- * This works like the BSD mkstemp, except that we don't unlink the
- * file, since we end up renaming it to something else.
+ * Print the clipping gain would do to psi, as predicted from its
+ * histogram, on the rest of a line of out
  */
-int
-xmkstemp(char *template)
+void
+print_clips(FILE *out, const struct signal_info *psi, double gain)
 {
-  static char sfx[7] = "AAAAAA";
-  char *p;
-  int fd, i, done;
+  uint64_t n = normalize_predict_clips(psi, gain);
+  double frac = (double)n / psi->nsamples;
 
-  p = template + strlen(template) - 6;
-  if (strcmp(p, "XXXXXX") != 0) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  do {
-    strcpy(p, sfx);
-
-    /* increment the suffix */
-    done = 0; i = 5;
-    while (!done && i >= 0) {
-      sfx[i]++;
-      if (sfx[i] > 'Z') {
-	sfx[i] = 'A';
-	i--;
-      } else {
-	done = 1;
-      }
-    }
-    if (!done) {
-      errno = EEXIST;
-      return -1;
-    }
-
-    /* attempt to open the file */
-    fd = open(template, O_RDWR | O_CREAT | O_EXCL, 0600);
-
-  } while (fd == -1 && errno == EEXIST);
-
-  return fd;
+  if (use_fractions)
+    fprintf(out, " %lu (%0.6f) at %0.6f\n", (unsigned long)n, frac, gain);
+  else
+    fprintf(out, " %lu (%0.4f%%) at %0.4fdB\n", (unsigned long)n,
+	    frac * 100, AMPTODBFS(gain));
 }
 
-
 /*
- * Move the file "oldpath" to "newpath", or copy and delete if they
- * are on different filesystems.
+ * Print how much of psi was sampled, and the range its level is in, on
+ * the rest of a line of out
  */
-int
-xrename(const char *oldpath, const char *newpath)
+void
+print_sampled(FILE *out, const struct signal_info *psi)
 {
-  if (rename(oldpath, newpath) == -1) {
-    if (errno == EXDEV) {
-      /* files are on different filesystems, so we have to copy */
-      FILE *in, *out;
-      char buf[4096];
-      size_t sz;
-
-      in = fopen(oldpath, "rb");
-      if (in == NULL)
-	return -1;
-      out = fopen(newpath, "wb");
-      if (out == NULL) {
-	fclose(in);
-	return -1;
-      }
-
-      while ((sz = fread(buf, 1, 4096, in)) > 0)
-	fwrite(buf, 1, sz, out);
-
-      if (ferror(in) || ferror(out)) {
-	fclose(in);
-	fclose(out);
-	return -1;
-      }
-      if (fclose(in) == EOF) {
-	fclose(out);
-	return -1;
-      }
-      if (fclose(out) == EOF)
-	return -1;
-      if (unlink(oldpath) == -1)
-	return -1;
-    } else {
-      return -1;
-    }
-  }
-
-  return 0;
+  if (use_fractions)
+    fprintf(out, _(" %0.6f read, level %0.6f to %0.6f\n"), psi->sampled,
+	    psi->level_min, psi->level_max);
+  else
+    fprintf(out, _(" %0.2f%% read, level %0.4fdBFS to %0.4fdBFS\n"),
+	    psi->sampled * 100, AMPTODBFS(psi->level_min),
+	    AMPTODBFS(psi->level_max));
 }
-#endif
 
 /*
- * Return nonzero if the two strings are equal, ignoring case, up to
- * the first n characters
+ * Analyze the file open on fd into psi, with normalize_analyze_fd().
+ * If its level was estimated from a sample of it (see --analyze), and
+ * that can't tell whether the file needs adjusting, it's read in full
+ * after all: that's if the sample is silent, or if the gain, as main()
+ * would work it out, is within 0.25dB for some levels in the range the
+ * sample gives and not for others.  In batch and mix mode, the gain
+ * depends on the other files, so only a silent sample is read again.
  */
 int
-strncaseeq(const char *s1, const char *s2, size_t n)
+analyze_fd(normalize_t *nz, int fd, const char *name, struct signal_info *psi)
 {
-  for ( ; n > 0; n--) {
-    if (tolower(*s1++) != tolower(*s2++))
-      return 0;
+  double lo, hi;
+  int err, unsure = FALSE;
+
+  err = normalize_analyze_fd(nz, fd, name, psi);
+  if (err != NORMALIZE_OK || psi->sampled >= 1)
+    return err;
+
+  if (psi->level * psi->level < EPSILON) {
+    unsure = TRUE;
+  } else if (!batch_mode && !mix_mode) {
+    lo = FRACTODB(normalize_limit_gain(nz, target / psi->level_max, psi));
+    hi = FRACTODB(normalize_limit_gain(nz, target / psi->level_min, psi));
+    unsure = !(lo > -0.25 && hi < 0.25) && !(hi <= -0.25 || lo >= 0.25);
   }
-
-  return 1;
+  if (!unsure)
+    return err;
+
+  if (verbose >= VERBOSE_DEBUG)
+    fprintf(stderr, _("%s: sample of %s is inconclusive, reading it all\n"),
+	    progname, name);
+  normalize_set_sampling(nz, 0.0);
+  err = normalize_analyze_fd(nz, fd, name, psi);
+  normalize_set_sampling(nz, sampling);
+  return err;
 }
 
 void *
@@ -1924,3 +2063,14 @@ xmalloc(size_t size)
   }
   return ptr;
 }
+
+void *
+xrealloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, _("%s: unable to malloc\n"), progname);
+    exit(1);
+  }
+  return ptr;
+}
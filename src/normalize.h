@@ -0,0 +1,109 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _NORMALIZE_H_
+#define _NORMALIZE_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "libnormalize.h"
+
+struct progress_struct {
+  time_t file_start;   /* what time we started processing the file */
+  time_t batch_start;  /* what time we started processing the batch */
+  off_t *file_sizes;   /* sizes of each file, in kb */
+  off_t batch_size;    /* sum of all file sizes, in kb */
+  off_t finished_size; /* sum of sizes of all completed files, in kb */
+  int on_file;         /* the index of the file we're working on */
+};
+
+enum verbose_t {
+  VERBOSE_QUIET    = 0,
+  VERBOSE_PROGRESS = 1,
+  VERBOSE_INFO     = 2,
+  VERBOSE_DEBUG    = 3,
+};
+
+/* arguments, defined in normalize.c */
+extern int verbose;
+extern int do_print_only;
+extern double target;
+extern double threshold;
+extern int batch_mode;
+extern int mix_mode;
+extern int do_compression;
+extern int use_peak;
+extern int use_fractions;
+extern int float_output;
+extern int use_raw_format;
+extern struct wavfmt raw_format;
+extern char *kernel_name;
+extern int loudness;
+extern int do_true_peak;
+extern double true_peak_limit;
+extern int nband_edges;
+extern double band_edges[NORMALIZE_MAX_BANDS - 1];
+extern unsigned int metrics;
+extern double max_clip;
+extern double sampling;
+extern double *ranges;
+extern int nranges;
+
+extern char *progname;
+extern struct progress_struct progress_info;
+
+/* normalize.c */
+normalize_t *new_context(void);
+int average_levels(normalize_t *nz, struct signal_info *sis, int nfiles,
+		   double *plevel);
+int adjust_file(normalize_t *nz, char *filename, double gain,
+		struct signal_info *psi);
+void progress_callback(const char *name, float fraction_completed,
+		       void *data);
+void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+int strncaseeq(const char *s1, const char *s2, size_t n);
+char *parse_time(const char *arg, double *pt);
+int read_ranges(const char *filename, double **ptimes);
+int parse_bands(const char *arg, double *edges);
+void print_bands(FILE *out, const struct signal_info *psi);
+int parse_metrics(const char *arg, unsigned int *pmetrics);
+int shows_metrics(const struct signal_info *psi);
+void print_metrics(FILE *out, const struct signal_info *psi);
+int shows_clips(const struct signal_info *psi);
+void print_clips(FILE *out, const struct signal_info *psi, double gain);
+void print_sampled(FILE *out, const struct signal_info *psi);
+void print_header(int show_gain);
+void print_levels(const struct signal_info *psi, double gain, int show_gain,
+		  const char *name);
+void report_clipping(struct gain_info *pgi);
+int analyze_fd(normalize_t *nz, int fd, const char *name,
+	       struct signal_info *psi);
+
+/* daemon.c */
+int daemon_main(char *sockpath, int nworkers);
+
+/* watch.c */
+int watch_main(char *dirname, int debounce);
+
+/* segments.c */
+int read_segments(const char *filename, double **ptimes, char ***ptitles);
+int segments_main(normalize_t *nz, char **fnames, int nfiles, char **titles);
+
+#endif /* _NORMALIZE_H_ */
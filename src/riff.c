@@ -49,30 +49,82 @@ char *strerror();
 
 #include "riff.h"
 
+#ifndef HAVE_FSEEKO
+# define fseeko fseek
+#endif
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
 /* we use a stack to keep track of the nestedness of list chunks */
 struct _riff_chunk_stack_t {
-  long start_off;
-  long end_off;
+  off_t start_off;
+  off_t end_off;
   struct _riff_chunk_stack_t *next;
 };
 
 typedef struct _riff_chunk_stack_t *riff_chunk_stack_t;
 
+/* an entry in the table of chunk sizes in an RF64 ds64 chunk */
+struct _ds64_entry_t {
+  fourcc_t id;
+  uint64_t size;
+};
+
 struct _riff_t {
   int ref;
   FILE *fp; /* needed for stream writing */
-  long file_off; /* current file offset */
+  off_t file_off; /* current file offset */
   int mode;
+  int format; /* one of the RIFF_FORMAT_* values */
 
   riff_chunk_stack_t stack;
 
+  /* for RF64, the real sizes of chunks that say 0xFFFFFFFF */
+  uint64_t ds64_data_size;
+  struct _ds64_entry_t *ds64_table;
+  unsigned int ds64_table_len;
+
   /* stream to which messages are written */
   FILE *msg_stream;
 };
 
+/*
+ * Wave64 identifies chunks by GUID.  The GUIDs for the chunks we know
+ * about are a fourcc followed by one of these.
+ */
+static const unsigned char _w64_riff_guid_tail[12] = {
+  0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
+};
+static const unsigned char _w64_guid_tail[12] = {
+  0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+
+/*
+ * converts a 4- or 8-byte little-endian array to an integer
+ */
+static uint32_t
+_buffer_to_int_lendian(const unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint64_t
+_buffer_to_int64_lendian(const unsigned char *buf)
+{
+  return _buffer_to_int_lendian(buf)
+    | ((uint64_t)_buffer_to_int_lendian(buf + 4) << 32);
+}
+
+/*
+ * Is this the start of a Wave64 file?
+ */
+static int
+_is_w64(const unsigned char *buf)
+{
+  return memcmp(buf, "riff", 4) == 0
+    && memcmp(buf + 4, _w64_riff_guid_tail, 12) == 0;
+}
+
 /*
  * converts the integer x to a 4-byte little-endian array
  */
@@ -99,13 +151,13 @@ _stack_print(riff_chunk_stack_t stack)
 #endif
 
 static int
-_stack_push(riff_chunk_stack_t *stack, long start, long end)
+_stack_push(riff_chunk_stack_t *stack, off_t start, off_t end)
 {
   riff_chunk_stack_t newelt;
 
   newelt = (riff_chunk_stack_t)malloc(sizeof(struct _riff_chunk_stack_t));
   if(newelt == NULL) {
-    fprintf(stderr, "riff: unable to malloc!\n");
+    errno = ENOMEM;
     return -1;
   }
   newelt->start_off = start;
@@ -133,7 +185,7 @@ riff_new(int fd, int mode)
   riff_t *riff;
   char *fmode;
   int dup_fd;
-  long file_len;
+  off_t file_len;
   struct stat st;
 
   riff = (riff_t *)malloc(sizeof(riff_t));
@@ -143,6 +195,10 @@ riff_new(int fd, int mode)
   }
 
   riff->mode = mode;
+  riff->format = RIFF_FORMAT_RIFF;
+  riff->ds64_data_size = 0;
+  riff->ds64_table = NULL;
+  riff->ds64_table_len = 0;
   riff->msg_stream = stderr;
   riff->file_off = lseek(fd, 0, SEEK_CUR);
 
@@ -153,8 +209,6 @@ riff_new(int fd, int mode)
   case RIFF_WRONLY: fmode = "wb";  break;
   case RIFF_RDWR:   fmode = "r+b"; break;
   default:
-    if(riff->msg_stream)
-      fprintf(riff->msg_stream, "riff: bad riff mode %d\n", riff->mode);
     free(riff);
     errno = EINVAL;
     return NULL;
@@ -200,6 +254,16 @@ riff_new(int fd, int mode)
   return riff;
 }
 
+/*
+ * Set the stream to which warnings and errors are written, or NULL
+ * to write none.  Until this is called, they go to stderr.
+ */
+void
+riff_set_msg_stream(riff_t *riff, FILE *stream)
+{
+  riff->msg_stream = stream;
+}
+
 void
 riff_unref(riff_t *riff)
 {
@@ -214,9 +278,82 @@ riff_destroy(riff_t *riff)
   while(riff->stack != NULL)
     _stack_pop(&riff->stack);
   fclose(riff->fp);
+  if(riff->ds64_table)
+    free(riff->ds64_table);
   free(riff);
 }
 
+/*
+ * Which kind of RIFF file this is, once the top-level chunk has been
+ * read.  RF64 and Wave64 files look just like RIFF files otherwise:
+ * their top-level chunk has the id "RIFF", and the ds64 chunk of an
+ * RF64 file is read for you and never returned.
+ */
+int
+riff_format(riff_t *riff)
+{
+  return riff->format;
+}
+
+/*
+ * Read the body of an RF64 ds64 chunk, which the file pointer is at
+ */
+static int
+_read_ds64(riff_t *riff, uint64_t size)
+{
+  unsigned char buf[28];
+  unsigned int i, n;
+
+  if(size < 28 || fread(buf, 1, 28, riff->fp) < 28) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* buf holds the RIFF size, the data size, and the sample count */
+  riff->ds64_data_size = _buffer_to_int64_lendian(buf + 8);
+  n = _buffer_to_int_lendian(buf + 24);
+  if(n > (size - 28) / 12)
+    n = (size - 28) / 12;
+
+  if(riff->ds64_table)
+    free(riff->ds64_table);
+  riff->ds64_table = NULL;
+  riff->ds64_table_len = 0;
+  if(n == 0)
+    return 0;
+  riff->ds64_table = (struct _ds64_entry_t *)
+    malloc(n * sizeof(struct _ds64_entry_t));
+  if(riff->ds64_table == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for(i = 0; i < n; i++) {
+    if(fread(buf, 1, 12, riff->fp) < 12) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(&riff->ds64_table[i].id, buf, 4);
+    riff->ds64_table[i].size = _buffer_to_int64_lendian(buf + 4);
+    riff->ds64_table_len++;
+  }
+  return 0;
+}
+
+/*
+ * The real size of an RF64 chunk whose size field says 0xFFFFFFFF
+ */
+static uint64_t
+_ds64_size(riff_t *riff, fourcc_t id, uint64_t size)
+{
+  unsigned int i;
+
+  if(riff_fourcc_equals(id, "data"))
+    return riff->ds64_data_size;
+  for(i = 0; i < riff->ds64_table_len; i++)
+    if(riff->ds64_table[i].id == id)
+      return riff->ds64_table[i].size;
+  return size;
+}
+
 
 /*
  * Get the next chunk in the file
@@ -225,17 +362,20 @@ riff_chunk_t *
 riff_chunk_read(riff_t *riff)
 {
   riff_chunk_t *new_chnk;
-  long remaining;
+  off_t remaining;
+  unsigned char buf[24];
   fourcc_t chnk_id;
-  unsigned int chnk_size;
+  uint64_t chnk_size;
+  int top_level, hdr_size, pad;
 
+ next_chunk:
   remaining = riff->stack->end_off - riff->file_off;
   if(remaining < 8) {
     if(remaining > 0)
       if(riff->msg_stream)
 	fprintf(riff->msg_stream,
-		"riff: trailing junk at offset 0x%08lX ignored\n",
-		riff->file_off);
+		"riff: trailing junk at offset 0x%08llX ignored\n",
+		(unsigned long long)riff->file_off);
     errno = 0; /* no error, there's just no more chunks */
     return NULL;
   }
@@ -245,6 +385,7 @@ riff_chunk_read(riff_t *riff)
   if(new_chnk == NULL) {
     if(riff->msg_stream)
       fprintf(riff->msg_stream, "riff: unable to malloc!\n");
+    errno = ENOMEM;
     return NULL;
   }
   new_chnk->ref = 1;
@@ -253,7 +394,7 @@ riff_chunk_read(riff_t *riff)
   new_chnk->fp = NULL;
   new_chnk->data = NULL;
 
-  if(fseek(riff->fp, new_chnk->offset, SEEK_SET) == -1) {
+  if(fseeko(riff->fp, new_chnk->offset, SEEK_SET) == -1) {
     riff_chunk_destroy(new_chnk);
     if(riff->msg_stream)
       fprintf(riff->msg_stream, "riff: unable to fseek: %s\n",
@@ -262,41 +403,94 @@ riff_chunk_read(riff_t *riff)
   }
 
   /* read ID and size */
-  fread(&chnk_id, 4, 1, riff->fp);
-  fread(&chnk_size, 4, 1, riff->fp);
+  fread(buf, 1, 8, riff->fp);
+
+  /* the top-level chunk tells us what kind of file this is */
+  top_level = (riff->stack->next == NULL);
+  if(top_level) {
+    riff->format = RIFF_FORMAT_RIFF;
+    if(memcmp(buf, "RF64", 4) == 0 || memcmp(buf, "BW64", 4) == 0)
+      riff->format = RIFF_FORMAT_RF64;
+    else if(remaining >= 24 && memcmp(buf, "riff", 4) == 0) {
+      fread(buf + 8, 1, 16, riff->fp);
+      if(_is_w64(buf))
+	riff->format = RIFF_FORMAT_W64;
+      else
+	fseeko(riff->fp, new_chnk->offset + 8, SEEK_SET);
+    }
+  }
 
-#ifdef WORDS_BIGENDIAN
-  /* reverse bytes on big endian machines */
-  chnk_size = bswap_32(chnk_size);
-#endif
+  if(riff->format == RIFF_FORMAT_W64) {
+    /* a GUID and a 64-bit size, which counts the header too */
+    hdr_size = 24;
+    pad = 7;
+    if(remaining < 24) {
+      if(riff->msg_stream)
+	fprintf(riff->msg_stream,
+		"riff: trailing junk at offset 0x%08llX ignored\n",
+		(unsigned long long)riff->file_off);
+      riff_chunk_destroy(new_chnk);
+      errno = 0;
+      return NULL;
+    }
+    if(!top_level)
+      fread(buf + 8, 1, 16, riff->fp);
+    memcpy(&chnk_id, buf, 4);
+    if(top_level)
+      chnk_id = RIFFID_RIFF;
+    else if(memcmp(buf + 4, _w64_guid_tail, 12) != 0)
+      chnk_id = 0; /* not one we know */
+    chnk_size = _buffer_to_int64_lendian(buf + 16);
+    chnk_size = chnk_size < 24 ? 0 : chnk_size - 24;
+  } else {
+    hdr_size = 8;
+    pad = 1;
+    memcpy(&chnk_id, buf, 4);
+    chnk_size = _buffer_to_int_lendian(buf + 4);
+    if(riff->format == RIFF_FORMAT_RF64 && chnk_size == 0xFFFFFFFF) {
+      if(top_level) {
+	chnk_id = RIFFID_RIFF;
+	chnk_size = remaining - 8; /* the real size comes in ds64 */
+      } else {
+	chnk_size = _ds64_size(riff, chnk_id, chnk_size);
+      }
+    } else if(top_level && riff->format == RIFF_FORMAT_RF64) {
+      chnk_id = RIFFID_RIFF;
+    }
+  }
 
   new_chnk->id = chnk_id;
   new_chnk->size = chnk_size;
+  new_chnk->hdr_size = hdr_size;
 
   /* if it's a RIFF or LIST, read the type */
   if(chnk_id == RIFFID_RIFF || chnk_id == RIFFID_LIST) {
 
-    if(remaining < 12) {
+    if(remaining < hdr_size + (riff->format == RIFF_FORMAT_W64 ? 16 : 4)) {
       if(riff->msg_stream)
 	fprintf(riff->msg_stream,
-		"riff: bad RIFF or LIST chunk at offset 0x%08lX\n",
-		riff->file_off);
+		"riff: bad RIFF or LIST chunk at offset 0x%08llX\n",
+		(unsigned long long)riff->file_off);
       riff_chunk_destroy(new_chnk);
       errno = EINVAL;
       return NULL;
     }
 
+    /* for Wave64 it's a GUID, but the fourcc is all we look at */
     fread(&new_chnk->type, 4, 1, riff->fp);
+    if(riff->format == RIFF_FORMAT_W64
+       && riff_fourcc_equals(new_chnk->type, "wave"))
+      memcpy(&new_chnk->type, "WAVE", 4);
 
   } else { /* it's not a RIFF or LIST */
 
     /* if we're at the top level (which we can tell by the stack),
        this should be a RIFF chunk */
-    if(riff->stack->next == NULL) {
+    if(top_level) {
       if(riff->msg_stream)
 	fprintf(riff->msg_stream,
-		"riff: bad top-level chunk id at offset 0x%08lX\n",
-		riff->file_off);
+		"riff: bad top-level chunk id at offset 0x%08llX\n",
+		(unsigned long long)riff->file_off);
       riff_chunk_destroy(new_chnk);
       errno = EINVAL;
       return NULL;
@@ -304,17 +498,32 @@ riff_chunk_read(riff_t *riff)
   }
 
   /* check size against size of containing chunk */
-  if(remaining - 8 < chnk_size) {
+  if((uint64_t)(remaining - hdr_size) < chnk_size) {
     if(riff->msg_stream)
-      fprintf(riff->msg_stream, "riff: chunk at offset 0x%08lX has bad size\n",
-	      riff->file_off);
-    chnk_size = remaining - 8;
+      fprintf(riff->msg_stream,
+	      "riff: chunk at offset 0x%08llX has bad size\n",
+	      (unsigned long long)riff->file_off);
+    chnk_size = remaining - hdr_size;
   }
 
-  /* seek to beginning of next chunk */
-  if(chnk_size & 1)
-    chnk_size++;
-  riff->file_off += chnk_size + 8;
+  /* the ds64 chunk of an RF64 file is ours */
+  if(riff->format == RIFF_FORMAT_RF64 && riff->stack->next
+     && riff->stack->next->next == NULL
+     && riff_fourcc_equals(chnk_id, "ds64")) {
+    if(_read_ds64(riff, chnk_size) == -1) {
+      if(riff->msg_stream)
+	fprintf(riff->msg_stream, "riff: bad ds64 chunk at offset 0x%08llX\n",
+		(unsigned long long)riff->file_off);
+      riff_chunk_destroy(new_chnk);
+      return NULL;
+    }
+    riff_chunk_destroy(new_chnk);
+    riff->file_off += hdr_size + ((chnk_size + pad) & ~(uint64_t)pad);
+    goto next_chunk;
+  }
+
+  /* seek to beginning of next chunk (chunks are padded) */
+  riff->file_off += hdr_size + ((chnk_size + pad) & ~(uint64_t)pad);
 
   return new_chnk;
 }
@@ -357,7 +566,7 @@ riff_chunk_get_stream(riff_chunk_t *chnk)
   }
 
   /* seek to beginning of chunk data (skip id & size) */
-  if(fseek(chnk->fp, chnk->offset + 8, SEEK_SET) == -1) {
+  if(fseeko(chnk->fp, chnk->offset + chnk->hdr_size, SEEK_SET) == -1) {
     fclose(chnk->fp);
     chnk->fp = NULL;
     if(riff->msg_stream)
@@ -391,7 +600,7 @@ riff_chunk_write(riff_t *riff, fourcc_t id, unsigned int size, void *data)
 {
   unsigned char buf[8];
 
-  if(fseek(riff->fp, riff->file_off, SEEK_SET) == -1)
+  if(fseeko(riff->fp, riff->file_off, SEEK_SET) == -1)
     return -1;
   memcpy(buf, &id, 4);
   _int_to_buffer_lendian(buf + 4, size);
@@ -439,7 +648,7 @@ riff_list_open(riff_t *riff, fourcc_t type)
   memcpy(buf, &id, 4);       /* chunk id */
   ;                          /* chunk length (already zeroed) */
   memcpy(buf + 8, &type, 4); /* list type */
-  if(fseek(riff->fp, riff->file_off, SEEK_SET) == -1) {
+  if(fseeko(riff->fp, riff->file_off, SEEK_SET) == -1) {
     _stack_pop(&riff->stack);
     return -1;
   }
@@ -458,7 +667,7 @@ riff_list_close(riff_t *riff)
   unsigned char buf[4];
   unsigned int len;
 
-  if(fseek(riff->fp, riff->stack->start_off + 4, SEEK_SET) == -1) {
+  if(fseeko(riff->fp, riff->stack->start_off + 4, SEEK_SET) == -1) {
     if(riff->msg_stream)
       fprintf(riff->msg_stream, "riff: unable to seek\n");
     return -1;
@@ -480,11 +689,14 @@ riff_list_close(riff_t *riff)
 int
 riff_list_descend(riff_t *riff, riff_chunk_t *chnk)
 {
-  if(_stack_push(&riff->stack, chnk->offset, chnk->offset + 8 + chnk->size)
-     == -1) {
+  off_t end_off = chnk->offset + chnk->hdr_size + chnk->size;
+
+  if(_stack_push(&riff->stack, chnk->offset, end_off) == -1) {
     return -1;
   }
-  riff->file_off = chnk->offset + 12;
+  /* skip the list type: a fourcc, or a GUID for Wave64 */
+  riff->file_off = chnk->offset + chnk->hdr_size
+    + (riff->format == RIFF_FORMAT_W64 ? 16 : 4);
   return 0;
 }
 
@@ -510,3 +722,196 @@ riff_fourcc_equals(fourcc_t fcc, char *s)
   fourcc_t other = *((fourcc_t *)s);
   return (fcc == other);
 }
+
+
+/*
+ * Forward-only reading, for pipes
+ */
+
+/*
+ * read n bytes (or until EOF) from the stream, copying them to
+ * copy_fp if it's set
+ */
+static size_t
+_stream_read(riff_stream_t *rs, void *buf, size_t n)
+{
+  unsigned char *p = (unsigned char *)buf;
+  size_t got = 0;
+
+  /* bytes read by riff_stream_open() come first */
+  if(rs->peek_off < rs->npeek) {
+    got = MIN(n, rs->npeek - rs->peek_off);
+    memcpy(p, rs->peek + rs->peek_off, got);
+    rs->peek_off += got;
+  }
+  if(got < n)
+    got += fread(p + got, 1, n - got, rs->fp);
+
+  if(rs->copy_fp && got > 0)
+    if(fwrite(p, 1, got, rs->copy_fp) < got)
+      return 0;
+
+  return got;
+}
+
+/*
+ * Start reading a RIFF file from fp.  If copy_fp is not NULL,
+ * everything read from fp is written to it as well (copy_fp may be
+ * changed between calls).  RF64 and Wave64 files are read too, and
+ * look like RIFF files, as for riff_chunk_read().
+ *
+ * Returns 0 if fp starts with a RIFF header, or 1 if it doesn't: then
+ * the stream is treated as a single chunk of unknown size, and
+ * nothing has been copied yet.  Returns -1 on a read error.
+ */
+int
+riff_stream_open(riff_stream_t *rs, FILE *fp, FILE *copy_fp)
+{
+  unsigned char *p = rs->peek;
+  int hdr_len = 12;
+
+  rs->fp = fp;
+  rs->copy_fp = copy_fp;
+  rs->peek_off = 0;
+  rs->npeek = fread(rs->peek, 1, 12, fp);
+  if(ferror(fp))
+    return -1;
+
+  rs->format = -1;
+  rs->ds64_data = RIFF_SIZE_UNKNOWN;
+  if(rs->npeek == 12) {
+    if(memcmp(p, "RIFF", 4) == 0)
+      rs->format = RIFF_FORMAT_RIFF;
+    else if(memcmp(p, "RF64", 4) == 0 || memcmp(p, "BW64", 4) == 0)
+      rs->format = RIFF_FORMAT_RF64;
+    else if(memcmp(p, "riff", 4) == 0
+	    && memcmp(p + 4, _w64_riff_guid_tail, 8) == 0) {
+      /* the rest of the GUID, the size, and the type GUID */
+      rs->npeek += fread(rs->peek + 12, 1, 28, fp);
+      if(ferror(fp))
+	return -1;
+      if(rs->npeek == 40 && _is_w64(p)) {
+	rs->format = RIFF_FORMAT_W64;
+	hdr_len = 40;
+      }
+    }
+  }
+
+  if(rs->format == -1) {
+    /* not RIFF: everything, including what we just read, is data */
+    rs->format = RIFF_FORMAT_RIFF;
+    rs->type = 0;
+    rs->id = 0;
+    rs->size = RIFF_SIZE_UNKNOWN;
+    rs->left = RIFF_SIZE_UNKNOWN;
+    rs->pad = 0;
+    return 1;
+  }
+
+  memcpy(&rs->type, p + hdr_len - (rs->format == RIFF_FORMAT_W64 ? 16 : 4), 4);
+  if(rs->format == RIFF_FORMAT_W64 && riff_fourcc_equals(rs->type, "wave"))
+    memcpy(&rs->type, "WAVE", 4);
+  /* we're positioned before the first chunk inside the RIFF chunk */
+  rs->id = 0;
+  rs->size = 0;
+  rs->left = 0;
+  rs->pad = 0;
+  if(copy_fp && fwrite(rs->peek, 1, hdr_len, copy_fp) < hdr_len)
+    return -1;
+  rs->npeek = 0;
+
+  return 0;
+}
+
+/*
+ * Read through what's left of the current chunk, and read the header
+ * of the next.  A size of RIFF_SIZE_UNKNOWN means the chunk runs to
+ * the end of the stream.  The ds64 chunk of an RF64 file is read
+ * and skipped, like any other chunk, but its data size is kept for
+ * the data chunk.
+ *
+ * Returns 0, or -1 with errno set to 0 if there are no more chunks.
+ */
+int
+riff_stream_next(riff_stream_t *rs)
+{
+  unsigned char buf[512];
+  unsigned char hdr[24];
+  size_t got, hdr_size;
+
+ next_chunk:
+  /* skip the rest of the current chunk, and its padding */
+  while(rs->left > 0) {
+    got = _stream_read(rs, buf, MIN(sizeof(buf), rs->left));
+    if(got == 0)
+      break;
+    if(rs->size != RIFF_SIZE_UNKNOWN)
+      rs->left -= got;
+  }
+  if(rs->pad) {
+    _stream_read(rs, buf, rs->pad);
+    rs->pad = 0;
+  }
+
+  hdr_size = (rs->format == RIFF_FORMAT_W64) ? 24 : 8;
+  got = _stream_read(rs, hdr, hdr_size);
+  if(got < hdr_size) {
+    if(got == 0 && !ferror(rs->fp))
+      errno = 0; /* no error, there's just no more chunks */
+    else if(!ferror(rs->fp))
+      errno = EINVAL;
+    rs->left = 0;
+    rs->pad = 0;
+    return -1;
+  }
+
+  memcpy(&rs->id, hdr, 4);
+  if(rs->format == RIFF_FORMAT_W64) {
+    if(memcmp(hdr + 4, _w64_guid_tail, 12) != 0)
+      rs->id = 0; /* not one we know */
+    rs->size = _buffer_to_int64_lendian(hdr + 16);
+    rs->size = rs->size < 24 ? 0 : rs->size - 24;
+    rs->pad = (8 - (rs->size & 7)) & 7;
+  } else {
+    rs->size = _buffer_to_int_lendian(hdr + 4);
+    if(rs->size == 0xFFFFFFFF) {
+      if(rs->format == RIFF_FORMAT_RF64 && riff_fourcc_equals(rs->id, "data"))
+	rs->size = rs->ds64_data;
+      else
+	rs->size = RIFF_SIZE_UNKNOWN;
+    }
+    rs->pad = (rs->size != RIFF_SIZE_UNKNOWN) && (rs->size & 1);
+  }
+  rs->left = rs->size;
+
+  /* get the data size out of an RF64 ds64 chunk */
+  if(rs->format == RIFF_FORMAT_RF64 && riff_fourcc_equals(rs->id, "ds64")) {
+    if(riff_stream_read(rs, buf, 16) == 16) {
+      rs->ds64_data = _buffer_to_int64_lendian(buf + 8);
+    }
+    goto next_chunk;
+  }
+
+  return 0;
+}
+
+/*
+ * Read up to n bytes of the current chunk into buf.  Returns the
+ * number of bytes read, which is less than n only at the end of the
+ * chunk, at EOF, or on an error.
+ */
+size_t
+riff_stream_read(riff_stream_t *rs, void *buf, size_t n)
+{
+  size_t got;
+
+  if(rs->size != RIFF_SIZE_UNKNOWN)
+    n = MIN(n, rs->left);
+  if(n == 0)
+    return 0;
+  got = _stream_read(rs, buf, n);
+  if(rs->size != RIFF_SIZE_UNKNOWN)
+    rs->left -= got;
+
+  return got;
+}
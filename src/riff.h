@@ -34,12 +34,13 @@ typedef struct _riff_t riff_t;
 
 typedef struct _riff_chunk_t {
   int ref;
-  long offset;
+  off_t offset;
   riff_t *riff_file;
 
   fourcc_t id;
-  unsigned int size;
+  uint64_t size;
   fourcc_t type; /* just for RIFF and LIST chunks */
+  int hdr_size;  /* bytes of id and size before the data */
 
   /* in each chunk, exactly one of the following two pointers should
      be NULL. */
@@ -59,6 +60,34 @@ typedef struct _riff_chunk_t {
 # define RIFFID_JUNK ((fourcc_t)0x4B4E554A) /* "JUNK" in little-endian */
 #endif
 
+/* for reading RIFF files that can't be seeked, like pipes */
+typedef struct _riff_stream_t {
+  FILE *fp;            /* the stream, only ever read forward */
+  FILE *copy_fp;       /* if not NULL, everything read is written here */
+  fourcc_t type;       /* form type of the RIFF chunk, e.g. "WAVE" */
+
+  int format;          /* one of the RIFF_FORMAT_* values */
+  uint64_t ds64_data;  /* RF64 data size, or RIFF_SIZE_UNKNOWN */
+
+  fourcc_t id;         /* the current chunk */
+  uint64_t size;
+  uint64_t left;       /* bytes of the current chunk not read yet */
+  int pad;             /* bytes of padding after the chunk */
+
+  /* bytes read looking for the RIFF header, if there wasn't one */
+  unsigned char peek[40];
+  unsigned int npeek, peek_off;
+} riff_stream_t;
+
+/* the size of a chunk that runs to the end of the stream: streaming
+   encoders write 0xFFFFFFFF when they can't seek back to fill it in */
+#define RIFF_SIZE_UNKNOWN (~(uint64_t)0)
+
+/* definitions for riff_format() */
+#define RIFF_FORMAT_RIFF 0 /* plain RIFF, 32 bit sizes */
+#define RIFF_FORMAT_RF64 1 /* RF64 or BW64, 64 bit sizes in a ds64 chunk */
+#define RIFF_FORMAT_W64  2 /* Sony Wave64, GUIDs and 64 bit sizes */
+
 /* definitions for riff access permissions */
 #define RIFF_RDONLY 1
 #define RIFF_WRONLY 2
@@ -68,6 +97,8 @@ typedef struct _riff_chunk_t {
       riff_t *riff_new(int fd, int mode);
          void riff_unref(riff_t *riff);
          void riff_destroy(riff_t *riff);
+         void riff_set_msg_stream(riff_t *riff, FILE *stream);
+          int riff_format(riff_t *riff);
 
 riff_chunk_t *riff_chunk_read(riff_t *riff);
          void riff_chunk_unref(riff_chunk_t *chnk);
@@ -84,6 +115,10 @@ riff_chunk_t *riff_chunk_read(riff_t *riff);
           int riff_list_ascend(riff_t *riff);
 
           int riff_fourcc_equals(fourcc_t fcc, char *s);
+
+          int riff_stream_open(riff_stream_t *rs, FILE *fp, FILE *copy_fp);
+          int riff_stream_next(riff_stream_t *rs);
+       size_t riff_stream_read(riff_stream_t *rs, void *buf, size_t n);
 #define       riff_string_to_fourcc(s) (*((fourcc_t *)s))
 
 
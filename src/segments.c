@@ -0,0 +1,427 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Segment mode: normalize each segment of a file -- each track of a
+ * cue sheet, or each range of a segment list -- on its own.  The
+ * levels of all the segments are measured in one pass over the file,
+ * and their gains are applied in one more, ramping from one gain to
+ * the next across each boundary so the level never jumps.  Batch and
+ * mix mode work across the segments of a file, the way they work
+ * across files otherwise.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <ctype.h>
+# include <math.h>
+#endif
+
+#if HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#if ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext (s)
+#else
+# define _(s) (s)
+#endif
+
+#include "normalize.h"
+
+#define FRACTODB(x) (20 * log10(x))
+
+#ifndef FALSE
+# define FALSE  (0)
+#endif
+#ifndef TRUE
+# define TRUE   (!FALSE)
+#endif
+
+#ifndef EPSILON
+# define EPSILON 0.00000000001
+#endif
+
+/* cue sheet times are in frames of a CD's sectors, 75 a second */
+#define CUE_FRAMES_PER_SEC 75
+
+/*
+ * Copy the next word of a cue sheet line at *pp, or the string
+ * between the double quotes there, into buf, and move *pp past it.
+ * Returns buf, or NULL if there's nothing left on the line.
+ */
+static char *
+cue_word(char **pp, char *buf)
+{
+  char *p = *pp, *q = buf;
+
+  while (isspace((unsigned char)*p))
+    p++;
+  if (*p == '\0')
+    return NULL;
+  if (*p == '"') {
+    for (p++; *p && *p != '"'; p++)
+      *q++ = *p;
+    if (*p == '"')
+      p++;
+  } else {
+    while (*p && !isspace((unsigned char)*p))
+      *q++ = *p++;
+  }
+  *q = '\0';
+  *pp = p;
+  return buf;
+}
+
+/* nonzero if word is the cue sheet keyword kw, in any case */
+static int
+cue_is(const char *word, const char *kw)
+{
+  return strlen(word) == strlen(kw) && strncaseeq(word, kw, strlen(kw));
+}
+
+/*
+ * Parse an INDEX time, mm:ss:ff, into seconds.  Returns -1 if it
+ * isn't one.
+ */
+static double
+cue_time(const char *s)
+{
+  unsigned int m, sec, f;
+  char c;
+
+  if (sscanf(s, "%u:%u:%u%c", &m, &sec, &f, &c) != 3
+      || sec >= 60 || f >= CUE_FRAMES_PER_SEC)
+    return -1;
+  return m * 60.0 + sec + (double)f / CUE_FRAMES_PER_SEC;
+}
+
+/*
+ * Read the tracks of a cue sheet from f.  Each track runs from its
+ * INDEX 01 to the next one's, and the last to the end of the file.
+ * The sheet may only name one FILE.
+ */
+static int
+read_cue_sheet(FILE *f, const char *filename, double **ptimes,
+	       char ***ptitles)
+{
+  char line[1024], word[1024], *p;
+  double *times = NULL, t;
+  char **titles = NULL;
+  int n = 0, room = 0, lineno = 0, nfiles = 0, in_track = FALSE;
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    p = line;
+    if (cue_word(&p, word) == NULL)
+      continue;
+
+    if (cue_is(word, "FILE")) {
+      if (++nfiles > 1) {
+	fprintf(stderr,
+		_("%s: %s, line %d: only cue sheets of one file can be used\n"),
+		progname, filename, lineno);
+	goto error;
+      }
+
+    } else if (cue_is(word, "TRACK")) {
+      if (in_track && times[2 * n - 2] < 0)
+	goto bad_line;
+      if (n == room) {
+	room = room ? 2 * room : 16;
+	times = (double *)xrealloc(times, 2 * room * sizeof(double));
+	titles = (char **)xrealloc(titles, room * sizeof(char *));
+      }
+      times[2 * n] = -1;
+      times[2 * n + 1] = HUGE_VAL;
+      titles[n] = NULL;
+      n++;
+      in_track = TRUE;
+
+    } else if (cue_is(word, "TITLE") && in_track) {
+      if (cue_word(&p, word) == NULL)
+	goto bad_line;
+      free(titles[n - 1]);
+      titles[n - 1] = (char *)xmalloc(strlen(word) + 1);
+      strcpy(titles[n - 1], word);
+
+    } else if (cue_is(word, "INDEX") && in_track) {
+      /* only index 1, where the track itself starts, matters */
+      if (cue_word(&p, word) == NULL)
+	goto bad_line;
+      if (atoi(word) != 1)
+	continue;
+      if (cue_word(&p, word) == NULL || (t = cue_time(word)) < 0
+	  || (n > 1 && !(t > times[2 * n - 4])))
+	goto bad_line;
+      times[2 * n - 2] = t;
+      if (n > 1)
+	times[2 * n - 3] = t;
+    }
+    /* everything else -- REM, PERFORMER, FLAGS, PREGAP, and so on --
+       doesn't matter here */
+  }
+  if (ferror(f)) {
+    fprintf(stderr, _("%s: error reading %s: %s\n"),
+	    progname, filename, strerror(errno));
+    goto error;
+  }
+  if (n == 0) {
+    fprintf(stderr, _("%s: %s: no tracks\n"), progname, filename);
+    goto error;
+  }
+  if (times[2 * n - 2] < 0) {
+    lineno++;
+    goto bad_line;
+  }
+  *ptimes = times;
+  *ptitles = titles;
+  return n;
+
+ bad_line:
+  fprintf(stderr, _("%s: %s, line %d: bad track, or out of order\n"),
+	  progname, filename, lineno);
+ error:
+  while (n > 0)
+    free(titles[--n]);
+  free(titles);
+  free(times);
+  return -1;
+}
+
+/*
+ * Read the segments given to --segments from the file filename.  If
+ * its first line that isn't blank or a comment starts with a letter,
+ * it's a cue sheet, and the segments are its tracks, with their
+ * titles put in an array allocated for *ptitles; otherwise it's a
+ * list of ranges, as for --ranges, and *ptitles is set to NULL.
+ * Returns the number of segments, whose start and end times are put
+ * in an array allocated for *ptimes, or -1 after printing an error.
+ */
+int
+read_segments(const char *filename, double **ptimes, char ***ptitles)
+{
+  FILE *f;
+  char line[1024], *p;
+  int n, is_cue = FALSE;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, _("%s: error opening %s: %s\n"),
+	    progname, filename, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if (*p == '\0' || *p == '#')
+      continue;
+    is_cue = isalpha((unsigned char)*p);
+    break;
+  }
+
+  *ptitles = NULL;
+  if (is_cue) {
+    rewind(f);
+    n = read_cue_sheet(f, filename, ptimes, ptitles);
+  } else {
+    n = read_ranges(filename, ptimes);
+  }
+  fclose(f);
+  return n;
+}
+
+/*
+ * Name segment i of the file fname, for printing: the file name, the
+ * segment's number and start time, and its title if it has one.
+ * Returns a string allocated with xmalloc().
+ */
+static char *
+segment_name(const char *fname, int i, char **titles)
+{
+  const char *title = titles && titles[i] ? titles[i] : "";
+  double start = ranges[2 * i];
+  int h, m;
+  char *s;
+
+  h = (int)(start / 3600);
+  start -= h * 3600.0;
+  m = (int)(start / 60);
+  start -= m * 60.0;
+  s = (char *)xmalloc(strlen(fname) + strlen(title) + 64);
+  sprintf(s, "%s [%d] %d:%02d:%05.2f%s%s", fname, i + 1, h, m, start,
+	  *title ? " " : "", title);
+  return s;
+}
+
+/*
+ * Normalize the segments of one file.  Returns 0 if it was changed,
+ * 1 if there was an error, or 2 if it didn't need changing.
+ */
+static int
+normalize_segments(normalize_t *nz, const char *fname, char **titles)
+{
+  struct signal_info *sis, *live;
+  struct level_stats stats;
+  struct gain_info gi;
+  double *gains, *live_gains;
+  int *index;
+  int i, fd, err, nlive, changed, ret = 1;
+  char *name;
+
+  sis = (struct signal_info *)xmalloc(nranges * sizeof(struct signal_info));
+  live = (struct signal_info *)xmalloc(nranges * sizeof(struct signal_info));
+  gains = (double *)xmalloc(nranges * sizeof(double));
+  live_gains = (double *)xmalloc(nranges * sizeof(double));
+  index = (int *)xmalloc(nranges * sizeof(int));
+
+  fd = open(fname, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, _("%s: error opening %s: %s\n"), progname, fname,
+	    strerror(errno));
+    goto out;
+  }
+  errno = 0;
+  err = normalize_analyze_segments(nz, fd, fname, sis);
+  close(fd);
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr,
+	    "\r                                     "
+	    "                                     \r");
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error reading %s: %s\n"), progname, fname,
+	    normalize_strerror(nz, err));
+    goto out;
+  }
+
+  /* silent segments are left alone, and don't count toward the
+     average in batch or mix mode */
+  nlive = 0;
+  for (i = 0; i < nranges; i++) {
+    gains[i] = 1.0;
+    if (sis[i].level * sis[i].level < EPSILON) {
+      if (verbose >= VERBOSE_PROGRESS)
+	fprintf(stderr, _("Segment %d of %s has zero power, ignoring...\n"),
+		i + 1, fname);
+      continue;
+    }
+    index[nlive] = i;
+    live[nlive++] = sis[i];
+  }
+  if (nlive == 0) {
+    ret = 2;
+    goto out;
+  }
+  err = normalize_compute_gains(nz, live, nlive, live_gains, &stats);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: %s: %s\n"), progname, fname,
+	    normalize_strerror(nz, err));
+    goto out;
+  }
+
+  /* don't bother with adjustments of less than 0.25dB -- see main() */
+  changed = FALSE;
+  for (i = 0; i < nlive; i++) {
+    if (fabs(FRACTODB(live_gains[i])) >= 0.25) {
+      gains[index[i]] = live_gains[i];
+      changed = TRUE;
+    }
+  }
+
+  if (do_print_only || verbose >= VERBOSE_INFO) {
+    if (verbose >= VERBOSE_PROGRESS)
+      print_header(TRUE);
+    for (i = 0; i < nlive; i++) {
+      name = segment_name(fname, index[i], titles);
+      print_levels(&sis[index[i]], live_gains[i], TRUE, name);
+      free(name);
+    }
+  }
+  if (do_print_only) {
+    ret = 0;
+    goto out;
+  }
+  if (!changed) {
+    if (verbose >= VERBOSE_PROGRESS)
+      fprintf(stderr, _("%s already normalized, not adjusting...\n"), fname);
+    ret = 2;
+    goto out;
+  }
+
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr, _("Adjusting %d segments of %s...\n"), nranges, fname);
+  progress_info.file_start = time(NULL);
+  errno = 0;
+  err = normalize_adjust_segments(nz, fname, gains, sis, &gi);
+  if (verbose >= VERBOSE_PROGRESS)
+    fputc('\n', stderr);
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error adjusting %s: %s\n"), progname, fname,
+	    normalize_strerror(nz, err));
+    goto out;
+  }
+  report_clipping(&gi);
+  ret = 0;
+
+ out:
+  free(index);
+  free(live_gains);
+  free(gains);
+  free(live);
+  free(sis);
+  return ret;
+}
+
+/*
+ * Normalize the segments of each of the nfiles files in fnames,
+ * which the context nz has been given the times of.  titles, if it
+ * isn't NULL, has a title, or NULL, for each segment.  Returns 0 if
+ * any file was changed (or printed, with -n), 1 if there were
+ * errors, or 2 if nothing needed changing.
+ */
+int
+segments_main(normalize_t *nz, char **fnames, int nfiles, char **titles)
+{
+  int i, ret, status = 2;
+
+  progress_info.batch_start = time(NULL);
+  progress_info.finished_size = 0;
+
+  for (i = 0; i < nfiles; i++) {
+    progress_info.file_start = time(NULL);
+    progress_info.on_file = i;
+
+    ret = normalize_segments(nz, fnames[i], titles);
+    if (ret == 1)
+      status = 1;
+    else if (ret == 0 && status == 2)
+      status = 0;
+
+    progress_info.finished_size += progress_info.file_sizes[i];
+  }
+
+  return status;
+}
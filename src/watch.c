@@ -0,0 +1,644 @@
+/* Copyright (C) 1999--2001 Chris Vaill
+   This file is part of normalize.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/*
+ * Watch mode: wait for WAV files to be written into a directory tree,
+ * and normalize each one as soon as the writer closes it.
+ *
+ * Every directory in the tree is a batch group.  In batch or mix
+ * mode, a file is analyzed as soon as it arrives, but it isn't
+ * adjusted until no new file has arrived in its directory for a
+ * while (the debounce time).  Then the group's average level is
+ * recomputed from the stored levels of every file that has arrived so
+ * far, so no file is ever analyzed twice, and the files that are
+ * waiting are adjusted.  Files that were already adjusted are left
+ * alone.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* for poll() */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#if STDC_HEADERS
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <ctype.h>
+# include <math.h>
+#endif
+
+#if HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#if HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# include <poll.h>
+# include <dirent.h>
+# define USE_WATCH 1
+#else
+# define USE_WATCH 0
+#endif
+
+#if ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext (s)
+#else
+# define _(s) (s)
+#endif
+
+#include "normalize.h"
+
+#define AMPTODBFS(x) (20 * log10(x))
+#define FRACTODB(x) (20 * log10(x))
+
+#ifndef FALSE
+# define FALSE  (0)
+#endif
+#ifndef TRUE
+# define TRUE   (!FALSE)
+#endif
+
+#ifndef EPSILON
+# define EPSILON 0.00000000001
+#endif
+
+#if !USE_WATCH
+
+int
+watch_main(char *dirname, int debounce)
+{
+  fprintf(stderr, _("%s: watch mode is not supported on this system\n"),
+	  progname);
+  return 1;
+}
+
+#else /* USE_WATCH */
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+		      | IN_DELETE | IN_CREATE)
+
+struct watched_file {
+  char *name;            /* path of the file */
+  struct signal_info si; /* levels, from before any adjustment */
+  int pending;           /* analyzed, but waiting to be adjusted */
+  /* the file as we left it, so we can ignore our own writes */
+  time_t mtime;
+  off_t size;
+};
+
+struct group {
+  int wd;                /* inotify watch descriptor */
+  char *path;
+  struct watched_file *files;
+  int nfiles;
+  int files_alloc;
+  int npending;
+  time_t deadline;       /* when to adjust the pending files */
+};
+
+static struct group *groups = NULL;
+static int ngroups = 0, groups_alloc = 0;
+
+static normalize_t *nz = NULL;
+
+static volatile sig_atomic_t stop_requested = FALSE;
+
+static void file_arrived(struct group *g, const char *name, int debounce);
+
+static void
+stop_handler(int sig)
+{
+  stop_requested = TRUE;
+}
+
+static char *
+path_join(const char *dir, const char *name)
+{
+  char *path;
+
+  path = (char *)xmalloc(strlen(dir) + strlen(name) + 2);
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/*
+ * Return nonzero if name has the extension of a file we can read
+ */
+static int
+is_audio_name(const char *name)
+{
+  static const char *exts[] = {
+    ".wav", ".aif", ".aiff", ".aifc", ".au", ".snd", NULL
+  };
+  size_t len = strlen(name), extlen;
+  int i;
+
+  if (name[0] == '.')
+    return FALSE;
+  for (i = 0; exts[i]; i++) {
+    extlen = strlen(exts[i]);
+    if (len > extlen && strncaseeq(name + len - extlen, exts[i], extlen))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static struct group *
+find_group(int wd)
+{
+  int i;
+
+  for (i = 0; i < ngroups; i++)
+    if (groups[i].wd == wd)
+      return &groups[i];
+  return NULL;
+}
+
+static struct watched_file *
+find_file(struct group *g, const char *path)
+{
+  int i;
+
+  for (i = 0; i < g->nfiles; i++)
+    if (strcmp(g->files[i].name, path) == 0)
+      return &g->files[i];
+  return NULL;
+}
+
+static void
+remove_file(struct group *g, struct watched_file *wf)
+{
+  if (wf->pending)
+    g->npending--;
+  free(wf->name);
+  g->nfiles--;
+  memmove(wf, wf + 1, (g->files + g->nfiles - wf) * sizeof(*wf));
+}
+
+/*
+ * Start watching the directory path, and (recursively) every
+ * directory in it.  If queue is set, the directory has just been
+ * created or moved in, so the audio files already in it are taken as
+ * having arrived, as a file moved in on its own would be.
+ */
+static void
+add_directory(int ifd, const char *path, int queue, int debounce)
+{
+  struct group *g;
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  char *sub;
+  int wd;
+
+  wd = inotify_add_watch(ifd, path, WATCH_EVENTS);
+  if (wd == -1) {
+    fprintf(stderr, _("%s: can't watch %s: %s\n"),
+	    progname, path, strerror(errno));
+    return;
+  }
+  if (find_group(wd))
+    return; /* already watching it */
+
+  if (ngroups == groups_alloc) {
+    groups_alloc = groups_alloc ? groups_alloc * 2 : 8;
+    groups = (struct group *)realloc(groups,
+				     groups_alloc * sizeof(struct group));
+    if (groups == NULL) {
+      fprintf(stderr, _("%s: unable to malloc\n"), progname);
+      exit(1);
+    }
+  }
+  g = &groups[ngroups++];
+  memset(g, 0, sizeof(struct group));
+  g->wd = wd;
+  g->path = path_join(path, "");
+  g->path[strlen(g->path) - 1] = '\0';
+
+  if (verbose >= VERBOSE_INFO)
+    fprintf(stderr, _("Watching %s\n"), path);
+
+  dir = opendir(path);
+  if (dir == NULL)
+    return;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    sub = path_join(path, ent->d_name);
+    if (stat(sub, &st) == 0 && S_ISDIR(st.st_mode))
+      add_directory(ifd, sub, queue, debounce);
+    else if (queue && is_audio_name(ent->d_name))
+      /* groups may have moved, adding the directories under this one */
+      file_arrived(find_group(wd), ent->d_name, debounce);
+    free(sub);
+  }
+  closedir(dir);
+}
+
+static void
+remove_group(struct group *g)
+{
+  while (g->nfiles > 0)
+    remove_file(g, &g->files[0]);
+  free(g->files);
+  free(g->path);
+  ngroups--;
+  memmove(g, g + 1, (groups + ngroups - g) * sizeof(struct group));
+}
+
+static void
+clear_progress_line(void)
+{
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr,
+	    "\r                                     "
+	    "                                     \r");
+}
+
+/*
+ * Set up the progress meter for a single file
+ */
+static void
+progress_start(const char *path, off_t *kb)
+{
+  struct stat st;
+
+  *kb = 0;
+  if (stat(path, &st) == 0 && st.st_size > 36)
+    *kb = (st.st_size - 36) / 1024;
+  progress_info.file_sizes = kb;
+  progress_info.batch_size = *kb;
+  progress_info.finished_size = 0;
+  progress_info.on_file = 0;
+  progress_info.batch_start = progress_info.file_start = time(NULL);
+}
+
+static void
+adjust_one(struct watched_file *wf, double gain)
+{
+  struct stat st;
+  off_t kb;
+
+  wf->pending = FALSE;
+
+  /* don't bother applying very small adjustments -- see main() */
+  if (fabs(FRACTODB(gain)) < 0.25) {
+    if (verbose >= VERBOSE_PROGRESS)
+      fprintf(stderr, _("%s already normalized, not adjusting...\n"),
+	      wf->name);
+    return;
+  }
+
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr, _("Applying adjustment of %0.2fdB to %s...\n"),
+	    FRACTODB(gain), wf->name);
+  progress_start(wf->name, &kb);
+  adjust_file(nz, wf->name, gain, &wf->si);
+  if (verbose >= VERBOSE_PROGRESS)
+    fputc('\n', stderr);
+
+  /* remember what the file looks like now, so that the close event
+     from our own write isn't taken as a new file */
+  if (stat(wf->name, &st) == 0) {
+    wf->mtime = st.st_mtime;
+    wf->size = st.st_size;
+  }
+  progress_info.file_sizes = NULL;
+}
+
+/*
+ * A file has been closed after writing, or moved into a watched
+ * directory: analyze it, and adjust it unless it has to wait for
+ * the rest of its group.
+ */
+static void
+file_arrived(struct group *g, const char *name, int debounce)
+{
+  struct watched_file *wf;
+  struct stat st;
+  char *path;
+  int fd, err;
+  off_t kb;
+
+  path = path_join(g->path, name);
+  if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+    free(path);
+    return;
+  }
+
+  wf = find_file(g, path);
+  if (wf) {
+    if (wf->mtime == st.st_mtime && wf->size == st.st_size) {
+      /* this is the event from our own adjustment */
+      free(path);
+      return;
+    }
+    /* the file was rewritten, so it's a new file */
+    remove_file(g, wf);
+  }
+
+  if (g->nfiles == g->files_alloc) {
+    g->files_alloc = g->files_alloc ? g->files_alloc * 2 : 16;
+    g->files = (struct watched_file *)
+      realloc(g->files, g->files_alloc * sizeof(struct watched_file));
+    if (g->files == NULL) {
+      fprintf(stderr, _("%s: unable to malloc\n"), progname);
+      exit(1);
+    }
+  }
+  wf = &g->files[g->nfiles];
+  memset(wf, 0, sizeof(struct watched_file));
+  wf->name = path;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, _("%s: error opening %s: %s\n"), progname, path,
+	    strerror(errno));
+    free(path);
+    return;
+  }
+  progress_start(path, &kb);
+  err = analyze_fd(nz, fd, path, &wf->si);
+  close(fd);
+  progress_info.file_sizes = NULL;
+  clear_progress_line();
+
+  if (err != NORMALIZE_OK) {
+    fprintf(stderr, _("%s: error reading %s: %s\n"), progname, path,
+	    normalize_strerror(nz, err));
+    free(path);
+    return;
+  }
+  if (wf->si.level * wf->si.level < EPSILON) {
+    if (verbose >= VERBOSE_PROGRESS && loudness == NORMALIZE_LOUDNESS_R128)
+      fprintf(stderr, _("File %s has no loudness above the gate, ignoring...\n"),
+	      path);
+    else if (verbose >= VERBOSE_PROGRESS)
+      fprintf(stderr, _("File %s has zero power, ignoring...\n"), path);
+    free(path);
+    return;
+  }
+  if (verbose >= VERBOSE_INFO) {
+    if (use_fractions)
+      fprintf(stderr, _("Level for %s: %0.4f (%0.4f peak)\n"),
+	      path, wf->si.level, wf->si.peak);
+    else if (loudness == NORMALIZE_LOUDNESS_R128)
+      fprintf(stderr, _("Loudness of %s: %0.4fLUFS (range %0.2fLU, %0.4fdBFS peak)\n"),
+	      path, wf->si.loudness, wf->si.loudness_range,
+	      AMPTODBFS(wf->si.peak));
+    else
+      fprintf(stderr, _("Level for %s: %0.4fdBFS (%0.4fdBFS peak)\n"),
+	      path, AMPTODBFS(wf->si.level), AMPTODBFS(wf->si.peak));
+    if (do_true_peak && use_fractions)
+      fprintf(stderr, _("True peak of %s: %0.4f\n"), path, wf->si.true_peak);
+    else if (do_true_peak)
+      fprintf(stderr, _("True peak of %s: %0.4fdBTP\n"), path,
+	      AMPTODBFS(wf->si.true_peak));
+    if (wf->si.nbands > 0) {
+      fprintf(stderr, _("Bands for %s:"), path);
+      print_bands(stderr, &wf->si);
+    }
+    if (shows_metrics(&wf->si)) {
+      fprintf(stderr, _("Metrics for %s:"), path);
+      print_metrics(stderr, &wf->si);
+    }
+    if (wf->si.sampled < 1) {
+      fprintf(stderr, _("Sample of %s:"), path);
+      print_sampled(stderr, &wf->si);
+    }
+  }
+
+  g->nfiles++;
+  wf->mtime = st.st_mtime;
+  wf->size = st.st_size;
+
+  if (batch_mode || mix_mode) {
+    /* wait for the rest of the group */
+    wf->pending = TRUE;
+    g->npending++;
+    g->deadline = time(NULL) + debounce;
+  } else {
+    adjust_one(wf, normalize_limit_gain(nz, use_peak ? 1.0 / wf->si.peak
+					: target / wf->si.level, &wf->si));
+  }
+}
+
+/*
+ * The group has been quiet for the debounce time: recompute its
+ * average level, and adjust the files that are waiting.
+ */
+static void
+adjust_group(struct group *g)
+{
+  struct signal_info *sis;
+  double level, group_target, gain;
+  int i;
+
+  sis = (struct signal_info *)xmalloc(g->nfiles * sizeof(struct signal_info));
+  for (i = 0; i < g->nfiles; i++)
+    sis[i] = g->files[i].si;
+  i = average_levels(nz, sis, g->nfiles, &level);
+  free(sis);
+
+  if (i == -1) {
+    /* every level was thrown out; leave the files for next time */
+    g->deadline = 0;
+    return;
+  }
+  if (verbose >= VERBOSE_INFO) {
+    if (use_fractions)
+      fprintf(stderr, _("Average level for %s: %0.4f (%d files)\n"),
+	      g->path, level, g->nfiles);
+    else if (loudness == NORMALIZE_LOUDNESS_R128)
+      fprintf(stderr, _("Average loudness for %s: %0.4fLUFS (%d files)\n"),
+	      g->path, AMPTODBFS(level), g->nfiles);
+    else
+      fprintf(stderr, _("Average level for %s: %0.4fdBFS (%d files)\n"),
+	      g->path, AMPTODBFS(level), g->nfiles);
+  }
+
+  /* a batch's one gain has to keep every file under any true peak
+     limit */
+  group_target = mix_mode ? level : target;
+  gain = group_target / level;
+  for (i = 0; i < g->nfiles; i++)
+    if (batch_mode && g->files[i].pending)
+      gain = normalize_limit_gain(nz, gain, &g->files[i].si);
+  for (i = 0; i < g->nfiles; i++) {
+    if (!g->files[i].pending)
+      continue;
+    if (batch_mode)
+      adjust_one(&g->files[i], gain);
+    else
+      adjust_one(&g->files[i],
+		 normalize_limit_gain(nz, group_target / g->files[i].si.level,
+				      &g->files[i].si));
+  }
+  g->npending = 0;
+  g->deadline = 0;
+}
+
+static void
+handle_event(int ifd, struct inotify_event *ev, int debounce)
+{
+  struct group *g;
+  struct watched_file *wf;
+  char *path;
+
+  if (ev->mask & IN_Q_OVERFLOW) {
+    fprintf(stderr, _("%s: too many events, some files were missed\n"),
+	    progname);
+    return;
+  }
+
+  g = find_group(ev->wd);
+  if (g == NULL)
+    return;
+
+  if (ev->mask & IN_IGNORED) {
+    /* the directory is gone */
+    remove_group(g);
+    return;
+  }
+  if (ev->len == 0)
+    return;
+
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+      path = path_join(g->path, ev->name);
+      add_directory(ifd, path, TRUE, debounce);
+      free(path);
+    }
+    return;
+  }
+
+  if (!is_audio_name(ev->name))
+    return;
+
+  if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+    file_arrived(g, ev->name, debounce);
+  } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    path = path_join(g->path, ev->name);
+    wf = find_file(g, path);
+    if (wf)
+      remove_file(g, wf);
+    free(path);
+  }
+}
+
+/*
+ * Watch the directory tree dirname, until we get SIGTERM or SIGINT.
+ * Files in batch and mix mode groups are adjusted once debounce
+ * seconds have passed without a new file in the group.
+ */
+int
+watch_main(char *dirname, int debounce)
+{
+  struct sigaction sa;
+  struct pollfd pfd;
+  struct inotify_event *ev;
+  char *buf, *p;
+  int ifd, i, timeout;
+  ssize_t len;
+  time_t now, next;
+
+  ifd = inotify_init();
+  if (ifd == -1) {
+    fprintf(stderr, _("%s: inotify_init failed: %s\n"),
+	    progname, strerror(errno));
+    return 1;
+  }
+
+  add_directory(ifd, dirname, FALSE, debounce);
+  if (ngroups == 0) {
+    close(ifd);
+    return 1;
+  }
+
+  nz = new_context();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  if (verbose >= VERBOSE_PROGRESS)
+    fprintf(stderr, _("Watching %s for new files...\n"), dirname);
+
+  /* big enough for a good number of events with maximum-length names */
+  buf = (char *)xmalloc(64 * (sizeof(struct inotify_event) + 256));
+  pfd.fd = ifd;
+  pfd.events = POLLIN;
+
+  while (!stop_requested) {
+
+    /* wake up in time for the first group that's due */
+    now = time(NULL);
+    next = 0;
+    for (i = 0; i < ngroups; i++)
+      if (groups[i].npending && groups[i].deadline
+	  && (next == 0 || groups[i].deadline < next))
+	next = groups[i].deadline;
+    if (next == 0)
+      timeout = -1;
+    else if (next <= now)
+      timeout = 0;
+    else
+      timeout = (next - now) * 1000;
+
+    if (poll(&pfd, 1, timeout) > 0) {
+      len = read(ifd, buf, 64 * (sizeof(struct inotify_event) + 256));
+      for (p = buf; len > 0 && p < buf + len;
+	   p += sizeof(struct inotify_event) + ev->len) {
+	ev = (struct inotify_event *)p;
+	handle_event(ifd, ev, debounce);
+      }
+    }
+
+    now = time(NULL);
+    for (i = 0; i < ngroups; i++)
+      if (groups[i].npending && groups[i].deadline
+	  && groups[i].deadline <= now)
+	adjust_group(&groups[i]);
+  }
+
+  /* don't leave files that have already arrived unadjusted */
+  for (i = 0; i < ngroups; i++)
+    if (groups[i].npending)
+      adjust_group(&groups[i]);
+
+  while (ngroups > 0)
+    remove_group(&groups[0]);
+  free(groups);
+  free(buf);
+  close(ifd);
+  normalize_destroy(nz);
+
+  return 0;
+}
+
+#endif /* USE_WATCH */